@@ -0,0 +1,419 @@
+// Headless benchmarks for the core editor operations.
+//
+// main.c is compiled into this file with its main renamed, stdout is
+// redirected into a scratch file so terminal output can be measured, and
+// malloc/calloc/realloc are wrapped by the linker to count allocations.
+
+#define main atom_main
+#include "../main.c"
+#undef main
+
+#include <time.h>
+#include <fcntl.h>
+
+#define BENCH_TIME_BUDGET_NS 200000000LL
+#define BENCH_MAX_ROWS 256
+#define BENCH_NAME_LEN 64
+
+// ===============================
+// COUNTERS
+// ===============================
+
+typedef struct {
+  unsigned long long allocs;
+} Counters;
+
+Counters Count;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size) {
+  Count.allocs++;
+  return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size) {
+  Count.allocs++;
+  return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+  Count.allocs++;
+  return __real_realloc(ptr, size);
+}
+
+long long now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Bytes the editor has written to the redirected terminal so far
+long long terminal_bytes() {
+  return lseek(STDOUT_FILENO, 0, SEEK_CUR);
+}
+
+// ===============================
+// RESULTS
+// ===============================
+
+typedef struct {
+  char bench[BENCH_NAME_LEN];
+  char input[BENCH_NAME_LEN];
+  long long ops;
+  double ns_per_op;
+  double allocs_per_op;
+  double bytes_per_op;
+} Result;
+
+Result Results[BENCH_MAX_ROWS];
+int ResultCount = 0;
+
+Result Baseline[BENCH_MAX_ROWS];
+int BaselineCount = 0;
+
+FILE *Report;
+
+typedef struct {
+  long long start_ns;
+  unsigned long long start_allocs;
+  long long start_bytes;
+} Sample;
+
+Sample begin_sample() {
+  Sample s;
+  term_flush();
+  s.start_allocs = Count.allocs;
+  s.start_bytes = terminal_bytes();
+  s.start_ns = now_ns();
+  return s;
+}
+
+Result *find_result(Result *rows, int count, const char *bench, const char *input) {
+  for(int i = 0; i < count; i++) {
+    if(strcmp(rows[i].bench, bench) == 0 && strcmp(rows[i].input, input) == 0) return &rows[i];
+  }
+  return NULL;
+}
+
+// extra_bytes counts output that does not go to the terminal (saved files)
+void end_sample(Sample s, const char *bench, const char *input, long long ops, long long extra_bytes) {
+  term_flush();
+  long long elapsed = now_ns() - s.start_ns;
+  unsigned long long allocs = Count.allocs - s.start_allocs;
+  long long bytes = terminal_bytes() - s.start_bytes + extra_bytes;
+  if(ops <= 0 || ResultCount >= BENCH_MAX_ROWS) return;
+
+  Result *r = &Results[ResultCount++];
+  snprintf(r->bench, sizeof(r->bench), "%s", bench);
+  snprintf(r->input, sizeof(r->input), "%s", input);
+  r->ops = ops;
+  r->ns_per_op = (double)elapsed / ops;
+  r->allocs_per_op = (double)allocs / ops;
+  r->bytes_per_op = (double)bytes / ops;
+
+  fprintf(Report, "%-22s %-20s %10lld %14.1f %10.2f %12.1f", r->bench, r->input, r->ops,
+          r->ns_per_op, r->allocs_per_op, r->bytes_per_op);
+
+  Result *base = find_result(Baseline, BaselineCount, bench, input);
+  if(base && base->ns_per_op > 0) {
+    double delta = (r->ns_per_op - base->ns_per_op) / base->ns_per_op * 100.0;
+    fprintf(Report, " %+8.1f%%%s", delta, delta > 10.0 ? "  REGRESSION" : "");
+  }
+  fputc('\n', Report);
+  fflush(Report);
+}
+
+void load_baseline(const char *path) {
+  FILE *f = fopen(path, "r");
+  if(!f) {
+    perror("Error opening baseline");
+    return;
+  }
+
+  char line[512];
+  while(fgets(line, sizeof(line), f) && BaselineCount < BENCH_MAX_ROWS) {
+    if(line[0] == '#') continue;
+    Result *r = &Baseline[BaselineCount];
+    if(sscanf(line, "%63s %63s %lld %lf %lf %lf", r->bench, r->input, &r->ops,
+              &r->ns_per_op, &r->allocs_per_op, &r->bytes_per_op) == 6) {
+      BaselineCount++;
+    }
+  }
+  fclose(f);
+}
+
+void save_results(const char *path) {
+  FILE *f = fopen(path, "w");
+  if(!f) {
+    perror("Error saving results");
+    return;
+  }
+
+  fprintf(f, "# bench\tinput\tops\tns_per_op\tallocs_per_op\tbytes_per_op\n");
+  for(int i = 0; i < ResultCount; i++) {
+    Result *r = &Results[i];
+    fprintf(f, "%s\t%s\t%lld\t%.1f\t%.3f\t%.1f\n", r->bench, r->input, r->ops,
+            r->ns_per_op, r->allocs_per_op, r->bytes_per_op);
+  }
+  fclose(f);
+  fprintf(Report, "\nResults written to %s\n", path);
+}
+
+// ===============================
+// INPUT FILES
+// ===============================
+
+typedef enum {
+  SHAPE_SHORT,
+  SHAPE_LONG,
+  SHAPE_SINGLE,
+} LineShape;
+
+const char *shape_names[] = {
+  [SHAPE_SHORT] = "short",
+  [SHAPE_LONG] = "long",
+  [SHAPE_SINGLE] = "single",
+};
+
+const char *sample_tokens[] = {
+  "int", "count", "=", "0;", "if", "(buffer[i]", "==", "'\\n')", "return",
+  "\"string literal\"", "// comment", "0x1f", "while", "size_t", "NULL,",
+};
+
+#define SAMPLE_TOKEN_COUNT (sizeof(sample_tokens) / sizeof(sample_tokens[0]))
+
+long long parse_size(const char *s) {
+  char *end;
+  long long v = strtoll(s, &end, 10);
+  switch(*end) {
+    case 'k': case 'K': v <<= 10; break;
+    case 'm': case 'M': v <<= 20; break;
+    case 'g': case 'G': v <<= 30; break;
+  }
+  return v;
+}
+
+// Writes roughly size bytes of C-like text made of lines of the given shape
+int generate_file(const char *path, long long size, LineShape shape) {
+  FILE *f = fopen(path, "w");
+  if(!f) {
+    perror("Error creating input");
+    return -1;
+  }
+
+  int line_target = shape == SHAPE_SHORT ? 48 : 4096;
+  long long written = 0;
+  int line_len = 0;
+  unsigned int seed = 1;
+
+  while(written < size) {
+    seed = seed * 1103515245 + 12345;
+    const char *tok = sample_tokens[(seed >> 16) % SAMPLE_TOKEN_COUNT];
+    int len = strlen(tok);
+    fwrite(tok, 1, len, f);
+    written += len;
+    line_len += len;
+
+    if(shape != SHAPE_SINGLE && line_len >= line_target) {
+      fputc('\n', f);
+      line_len = 0;
+    }
+    else {
+      fputc(' ', f);
+      line_len++;
+    }
+    written++;
+  }
+
+  fputc('\n', f);
+  fclose(f);
+  return 0;
+}
+
+// ===============================
+// BENCHMARKS
+// ===============================
+
+void set_bench_cursor(int y, int x) {
+  Buff.cursor.y = y;
+  Buff.cursor.x = x;
+  Buff.cursor.desired_x = x;
+  Win.scroll_y = y;
+}
+
+void bench_open(char *path, const char *input) {
+  long long ops = 0;
+  Sample s = begin_sample();
+  do {
+    open_editor(path);
+    ops++;
+  } while(now_ns() - s.start_ns < BENCH_TIME_BUDGET_NS);
+  end_sample(s, "open_editor", input, ops, 0);
+}
+
+void bench_highlight(const char *input) {
+  int lines = Buff.document_size;
+  if(lines == 0) return;
+
+  long long ops = 0;
+  Sample s = begin_sample();
+  do {
+    Line *line = &Buff.document[ops % lines];
+    syntax_highlight_and_print(line->line, line->size);
+    ops++;
+  } while((ops & 63) != 0 || now_ns() - s.start_ns < BENCH_TIME_BUDGET_NS);
+  end_sample(s, "syntax_highlight", input, ops, 0);
+}
+
+void bench_append_char(char *path, const char *input) {
+  open_editor(path);
+  if(Buff.document_size == 0) return;
+  set_bench_cursor(Buff.document_size / 2, Buff.document[Buff.document_size / 2].size / 2);
+
+  long long ops = 0;
+  Sample s = begin_sample();
+  do {
+    append_char('a' + ops % 26);
+    ops++;
+  } while(now_ns() - s.start_ns < BENCH_TIME_BUDGET_NS);
+  end_sample(s, "append_char", input, ops, 0);
+}
+
+void bench_append_line(char *path, const char *input) {
+  open_editor(path);
+  if(Buff.document_size == 0) return;
+  set_bench_cursor(Buff.document_size / 2, 0);
+
+  long long ops = 0;
+  Sample s = begin_sample();
+  do {
+    append_line();
+    ops++;
+  } while(now_ns() - s.start_ns < BENCH_TIME_BUDGET_NS);
+  end_sample(s, "append_line", input, ops, 0);
+}
+
+void bench_delete_line(char *path, const char *input) {
+  open_editor(path);
+  set_bench_cursor(Buff.document_size / 2, 0);
+
+  long long ops = 0;
+  Sample s = begin_sample();
+  while(Buff.document_size > 1 && now_ns() - s.start_ns < BENCH_TIME_BUDGET_NS) {
+    delete_line();
+    ops++;
+  }
+  end_sample(s, "delete_line", input, ops, 0);
+}
+
+void bench_save(char *path, const char *input, const char *scratch) {
+  char out_path[512];
+  snprintf(out_path, sizeof(out_path), "%s/save.out", scratch);
+
+  open_editor(path);
+  free(Buff.file_name);
+  Buff.file_name = strdup(out_path);
+
+  long long ops = 0;
+  long long file_bytes = 0;
+  struct stat st;
+  Sample s = begin_sample();
+  do {
+    cmd_save_file();
+    if(stat(out_path, &st) == 0) file_bytes += st.st_size;
+    ops++;
+  } while(now_ns() - s.start_ns < BENCH_TIME_BUDGET_NS);
+  end_sample(s, "cmd_save_file", input, ops, file_bytes);
+  unlink(out_path);
+}
+
+void run_input(char *path, const char *input, const char *scratch) {
+  bench_open(path, input);
+  bench_highlight(input);
+  bench_save(path, input, scratch);
+  bench_append_char(path, input);
+  bench_append_line(path, input);
+  bench_delete_line(path, input);
+}
+
+// ===============================
+// MAIN
+// ===============================
+
+void usage(const char *prog) {
+  fprintf(stderr,
+    "Usage: %s [-o results.tsv] [-b baseline.tsv] [-s sizes] [file...]\n"
+    "  -s  comma separated synthetic input sizes, e.g. 1K,1M,64M,2G\n"
+    "  file arguments are benchmarked as real-world inputs\n", prog);
+}
+
+int main(int argc, char **argv) {
+  const char *output = NULL;
+  const char *sizes = "1K,1M,16M";
+  int opt;
+
+  while((opt = getopt(argc, argv, "o:b:s:h")) != -1) {
+    switch(opt) {
+      case 'o': output = optarg; break;
+      case 'b': load_baseline(optarg); break;
+      case 's': sizes = optarg; break;
+      default: usage(argv[0]); return EXIT_FAILURE;
+    }
+  }
+
+  // Reports go to the real stdout, editor output to a scratch file
+  Report = fdopen(dup(STDOUT_FILENO), "w");
+  char scratch[] = "/tmp/atom-bench-XXXXXX";
+  if(!Report || !mkdtemp(scratch)) {
+    perror("Error preparing benchmark");
+    return EXIT_FAILURE;
+  }
+
+  char sink_path[512];
+  snprintf(sink_path, sizeof(sink_path), "%s/terminal.out", scratch);
+  int sink = open(sink_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if(sink < 0) {
+    perror("Error opening terminal sink");
+    return EXIT_FAILURE;
+  }
+  dup2(sink, STDOUT_FILENO);
+  close(sink);
+
+  Win.width = 120;
+  Win.height = 40;
+  Win.scroll_y = 0;
+  init_document();
+  Buff.mode = MODE_VIEW;
+
+  fprintf(Report, "%-22s %-20s %10s %14s %10s %12s\n", "bench", "input", "ops", "ns/op", "allocs/op", "bytes/op");
+
+  char *list = strdup(sizes);
+  for(char *tok = strtok(list, ","); tok; tok = strtok(NULL, ",")) {
+    long long size = parse_size(tok);
+    for(int shape = SHAPE_SHORT; shape <= SHAPE_SINGLE; shape++) {
+      char input[BENCH_NAME_LEN], path[512];
+      snprintf(input, sizeof(input), "%s-%s", tok, shape_names[shape]);
+      snprintf(path, sizeof(path), "%s/%s.c", scratch, input);
+      if(generate_file(path, size, shape) != 0) continue;
+      run_input(path, input, scratch);
+      unlink(path);
+    }
+  }
+  free(list);
+
+  for(int i = optind; i < argc; i++) {
+    const char *base = strrchr(argv[i], '/');
+    run_input(argv[i], base ? base + 1 : argv[i], scratch);
+  }
+
+  free_editor();
+  unlink(sink_path);
+  rmdir(scratch);
+
+  if(output) save_results(output);
+  fclose(Report);
+  return 0;
+}
@@ -0,0 +1,564 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pty.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+
+// End-to-end keystroke harness.
+//
+// Runs atom under a pseudo-terminal, replays a keystroke trace and, for
+// every key, measures the time until the editor goes quiet, the bytes it
+// emitted and the write(2) calls it made (from /proc/<pid>/io). The output
+// is fed through a small VT parser so traces can check the final screen.
+
+#define MAX_ROWS 200
+#define MAX_COLS 400
+#define MAX_SAMPLES 100000
+#define LINE_LEN 4096
+#define DEFAULT_QUIET_MS 20
+
+// ===============================
+// VT PARSER
+// ===============================
+
+typedef enum {
+  VT_GROUND,
+  VT_ESCAPE,
+  VT_CSI,
+} VtState;
+
+typedef struct {
+  int rows;
+  int cols;
+  int cur_row;
+  int cur_col;
+  int wrap_pending;
+  int autowrap;
+  VtState state;
+  char params[64];
+  int params_len;
+  unsigned char utf8_left;
+  char cells[MAX_ROWS][MAX_COLS];
+} Screen;
+
+void vt_init(Screen *s, int rows, int cols) {
+  memset(s, 0, sizeof(*s));
+  s->rows = rows;
+  s->cols = cols;
+  s->autowrap = 1;
+  memset(s->cells, ' ', sizeof(s->cells));
+}
+
+void vt_scroll_up(Screen *s) {
+  memmove(s->cells[0], s->cells[1], (size_t)(s->rows - 1) * MAX_COLS);
+  memset(s->cells[s->rows - 1], ' ', MAX_COLS);
+}
+
+void vt_line_feed(Screen *s) {
+  if(s->cur_row == s->rows - 1) vt_scroll_up(s);
+  else s->cur_row++;
+}
+
+void vt_put(Screen *s, char c) {
+  if(s->wrap_pending) {
+    s->cur_col = 0;
+    vt_line_feed(s);
+    s->wrap_pending = 0;
+  }
+  s->cells[s->cur_row][s->cur_col] = c;
+  if(s->cur_col == s->cols - 1) {
+    if(s->autowrap) s->wrap_pending = 1;
+  }
+  else {
+    s->cur_col++;
+  }
+}
+
+// Returns the n-th numeric parameter, or def when it is missing or zero
+int vt_param(Screen *s, int n, int def) {
+  const char *p = s->params;
+  if(*p == '?') p++;
+  for(int i = 0; i < n; i++) {
+    p = strchr(p, ';');
+    if(!p) return def;
+    p++;
+  }
+  int v = atoi(p);
+  return v > 0 ? v : def;
+}
+
+int vt_clamp(int v, int lo, int hi) {
+  if(v < lo) return lo;
+  if(v > hi) return hi;
+  return v;
+}
+
+void vt_erase(Screen *s, int row, int from, int to) {
+  for(int c = from; c < to && c < s->cols; c++) s->cells[row][c] = ' ';
+}
+
+void vt_csi(Screen *s, char final) {
+  int private = s->params[0] == '?';
+  s->wrap_pending = 0;
+
+  switch(final) {
+    case 'H':
+    case 'f':
+      s->cur_row = vt_clamp(vt_param(s, 0, 1) - 1, 0, s->rows - 1);
+      s->cur_col = vt_clamp(vt_param(s, 1, 1) - 1, 0, s->cols - 1);
+      break;
+    case 'A': s->cur_row = vt_clamp(s->cur_row - vt_param(s, 0, 1), 0, s->rows - 1); break;
+    case 'B': s->cur_row = vt_clamp(s->cur_row + vt_param(s, 0, 1), 0, s->rows - 1); break;
+    case 'C': s->cur_col = vt_clamp(s->cur_col + vt_param(s, 0, 1), 0, s->cols - 1); break;
+    case 'D': s->cur_col = vt_clamp(s->cur_col - vt_param(s, 0, 1), 0, s->cols - 1); break;
+    case 'G': s->cur_col = vt_clamp(vt_param(s, 0, 1) - 1, 0, s->cols - 1); break;
+    case 'd': s->cur_row = vt_clamp(vt_param(s, 0, 1) - 1, 0, s->rows - 1); break;
+    case 'J': {
+      int mode = atoi(s->params);
+      if(mode == 2 || mode == 3) {
+        for(int r = 0; r < s->rows; r++) vt_erase(s, r, 0, s->cols);
+      }
+      else if(mode == 0) {
+        vt_erase(s, s->cur_row, s->cur_col, s->cols);
+        for(int r = s->cur_row + 1; r < s->rows; r++) vt_erase(s, r, 0, s->cols);
+      }
+      break;
+    }
+    case 'K': {
+      int mode = atoi(s->params);
+      if(mode == 0) vt_erase(s, s->cur_row, s->cur_col, s->cols);
+      else if(mode == 1) vt_erase(s, s->cur_row, 0, s->cur_col + 1);
+      else vt_erase(s, s->cur_row, 0, s->cols);
+      break;
+    }
+    case 'h':
+    case 'l':
+      if(private && vt_param(s, 0, 0) == 7) s->autowrap = final == 'h';
+      break;
+  }
+}
+
+void vt_feed(Screen *s, const char *data, size_t len) {
+  for(size_t i = 0; i < len; i++) {
+    unsigned char c = data[i];
+
+    switch(s->state) {
+      case VT_GROUND:
+        if(s->utf8_left > 0) {
+          s->utf8_left--;
+          continue;
+        }
+        if(c == 27) s->state = VT_ESCAPE;
+        else if(c == '\r') { s->cur_col = 0; s->wrap_pending = 0; }
+        else if(c == '\n') { vt_line_feed(s); s->wrap_pending = 0; }
+        else if(c == '\b') { if(s->cur_col > 0) s->cur_col--; s->wrap_pending = 0; }
+        else if(c == '\t') s->cur_col = vt_clamp((s->cur_col / 8 + 1) * 8, 0, s->cols - 1);
+        else if(c >= 0xC0) {
+          // Non-ASCII characters occupy one cell shown as '?'
+          s->utf8_left = c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : 1;
+          vt_put(s, '?');
+        }
+        else if(c >= 32 && c < 127) vt_put(s, c);
+        break;
+      case VT_ESCAPE:
+        if(c == '[') {
+          s->state = VT_CSI;
+          s->params_len = 0;
+          s->params[0] = '\0';
+        }
+        else {
+          s->state = VT_GROUND;
+        }
+        break;
+      case VT_CSI:
+        if(c >= 0x40 && c <= 0x7E) {
+          vt_csi(s, c);
+          s->state = VT_GROUND;
+        }
+        else if(s->params_len < (int)sizeof(s->params) - 1) {
+          s->params[s->params_len++] = c;
+          s->params[s->params_len] = '\0';
+        }
+        break;
+    }
+  }
+}
+
+// Row text without trailing blanks
+void vt_row_text(Screen *s, int row, char *out) {
+  int end = s->cols;
+  while(end > 0 && s->cells[row][end - 1] == ' ') end--;
+  memcpy(out, s->cells[row], end);
+  out[end] = '\0';
+}
+
+void vt_dump(Screen *s, FILE *f) {
+  char row[MAX_COLS + 1];
+  for(int r = 0; r < s->rows; r++) {
+    vt_row_text(s, r, row);
+    fprintf(f, "%3d|%s\n", r + 1, row);
+  }
+  fprintf(f, "cursor %d %d\n", s->cur_row + 1, s->cur_col + 1);
+}
+
+// ===============================
+// EDITOR PROCESS
+// ===============================
+
+typedef struct {
+  pid_t pid;
+  int master;
+  Screen screen;
+  long long bytes;
+  int quiet_ms;
+} Session;
+
+typedef struct {
+  long long latency_ns[MAX_SAMPLES];
+  long long bytes[MAX_SAMPLES];
+  long long writes[MAX_SAMPLES];
+  int count;
+  int failures;
+} Stats;
+
+long long now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Number of write(2) calls the editor has made so far
+long long read_write_syscalls(pid_t pid) {
+  char path[64], line[128];
+  snprintf(path, sizeof(path), "/proc/%d/io", (int)pid);
+  FILE *f = fopen(path, "r");
+  if(!f) return -1;
+
+  long long syscw = -1;
+  while(fgets(line, sizeof(line), f)) {
+    if(sscanf(line, "syscw: %lld", &syscw) == 1) break;
+  }
+  fclose(f);
+  return syscw;
+}
+
+// Reads editor output until it has been silent for quiet_ms.
+// Returns the time of the last byte received, or 0 if nothing arrived.
+long long drain_output(Session *s, long long *bytes) {
+  char buf[65536];
+  long long last = 0;
+  *bytes = 0;
+
+  while(1) {
+    struct pollfd pfd = { .fd = s->master, .events = POLLIN };
+    int r = poll(&pfd, 1, s->quiet_ms);
+    if(r <= 0) break;
+
+    ssize_t n = read(s->master, buf, sizeof(buf));
+    if(n <= 0) break;
+    last = now_ns();
+    *bytes += n;
+    vt_feed(&s->screen, buf, n);
+  }
+
+  s->bytes += *bytes;
+  return last;
+}
+
+// The editor runs inside dir on a relative file name so the status bar
+// reads the same on every run
+int start_session(Session *s, const char *atom, const char *dir, const char *file, int rows, int cols) {
+  struct winsize ws = { .ws_row = rows, .ws_col = cols };
+  vt_init(&s->screen, rows, cols);
+  s->bytes = 0;
+  s->quiet_ms = DEFAULT_QUIET_MS;
+
+  s->pid = forkpty(&s->master, NULL, NULL, &ws);
+  if(s->pid < 0) {
+    perror("forkpty");
+    return -1;
+  }
+  if(s->pid == 0) {
+    setenv("TERM", "xterm-256color", 1);
+    if(chdir(dir) != 0) _exit(127);
+    execl(atom, atom, file, (char *)NULL);
+    perror("exec");
+    _exit(127);
+  }
+
+  long long bytes;
+  drain_output(s, &bytes);
+  return 0;
+}
+
+void stop_session(Session *s) {
+  kill(s->pid, SIGKILL);
+  waitpid(s->pid, NULL, 0);
+  close(s->master);
+}
+
+// Sends one input event and records its latency, bytes and write calls
+void send_event(Session *s, Stats *st, const char *data, size_t len) {
+  long long writes_before = read_write_syscalls(s->pid);
+  long long start = now_ns();
+  if(write(s->master, data, len) != (ssize_t)len) return;
+
+  long long bytes;
+  long long last = drain_output(s, &bytes);
+  long long writes_after = read_write_syscalls(s->pid);
+
+  if(st->count >= MAX_SAMPLES) return;
+  st->latency_ns[st->count] = last > 0 ? last - start : 0;
+  st->bytes[st->count] = bytes;
+  st->writes[st->count] = writes_before >= 0 && writes_after >= 0 ? writes_after - writes_before : 0;
+  st->count++;
+}
+
+// ===============================
+// TRACES
+// ===============================
+
+// Expands \e, \n, \r, \t, \\ and \xNN escapes in place
+size_t unescape(char *s) {
+  char *out = s;
+  for(char *p = s; *p; p++) {
+    if(*p != '\\' || p[1] == '\0') {
+      *out++ = *p;
+      continue;
+    }
+    p++;
+    switch(*p) {
+      case 'e': *out++ = 27; break;
+      case 'n': *out++ = '\n'; break;
+      case 'r': *out++ = '\r'; break;
+      case 't': *out++ = '\t'; break;
+      case 's': *out++ = ' '; break;
+      case 'x': {
+        char hex[3] = { p[1], p[1] ? p[2] : 0, 0 };
+        *out++ = (char)strtol(hex, NULL, 16);
+        p += 2;
+        break;
+      }
+      default: *out++ = *p; break;
+    }
+  }
+  *out = '\0';
+  return out - s;
+}
+
+// Writes a C-like file with the given number of numbered lines
+int generate_file(const char *path, int lines) {
+  FILE *f = fopen(path, "w");
+  if(!f) return -1;
+  for(int i = 1; i <= lines; i++) {
+    fprintf(f, "int value_%d = %d; // line %d\n", i, i * 7, i);
+  }
+  fclose(f);
+  return 0;
+}
+
+int copy_file(const char *from, const char *to) {
+  FILE *in = fopen(from, "r");
+  if(!in) return -1;
+  FILE *out = fopen(to, "w");
+  if(!out) {
+    fclose(in);
+    return -1;
+  }
+  char buf[65536];
+  size_t n;
+  while((n = fread(buf, 1, sizeof(buf), in)) > 0) fwrite(buf, 1, n, out);
+  fclose(in);
+  fclose(out);
+  return 0;
+}
+
+int compare_ll(const void *a, const void *b) {
+  long long x = *(const long long *)a, y = *(const long long *)b;
+  return (x > y) - (x < y);
+}
+
+long long percentile(long long *sorted, int n, double p) {
+  if(n == 0) return 0;
+  int i = (int)(p * (n - 1) + 0.5);
+  return sorted[i];
+}
+
+void report(const char *name, Stats *st) {
+  long long lat[MAX_SAMPLES];
+  long long total_bytes = 0, total_writes = 0, max_bytes = 0, max_writes = 0;
+
+  for(int i = 0; i < st->count; i++) {
+    lat[i] = st->latency_ns[i];
+    total_bytes += st->bytes[i];
+    total_writes += st->writes[i];
+    if(st->bytes[i] > max_bytes) max_bytes = st->bytes[i];
+    if(st->writes[i] > max_writes) max_writes = st->writes[i];
+  }
+  qsort(lat, st->count, sizeof(long long), compare_ll);
+
+  int n = st->count > 0 ? st->count : 1;
+  printf("%-20s %6d %9.3f %9.3f %9.3f %9.3f %10.1f %9lld %10.1f %8lld  %s\n", name, st->count,
+         percentile(lat, st->count, 0.50) / 1e6, percentile(lat, st->count, 0.90) / 1e6,
+         percentile(lat, st->count, 0.99) / 1e6, st->count ? lat[st->count - 1] / 1e6 : 0.0,
+         (double)total_bytes / n, max_bytes, (double)total_writes / n, max_writes,
+         st->failures ? "FAIL" : "ok");
+}
+
+// Trace commands, one per line:
+//   size ROWSxCOLS            terminal size (before open)
+//   open lines=N | PATH       start the editor on a generated file or a copy of PATH
+//   quiet MS                  silence that ends a key's measurement
+//   keys TEXT                 send each byte of TEXT as its own key
+//   repeat N TEXT             send the keys of TEXT N times
+//   paste TEXT                send TEXT in a single write
+//   expect-row ROW TEXT       screen row must read TEXT (trailing blanks ignored)
+//   expect-cursor ROW COL     cursor position on screen
+//   dump                      print the screen
+int run_trace(const char *atom, const char *trace_path, int verbose) {
+  FILE *trace = fopen(trace_path, "r");
+  if(!trace) {
+    perror(trace_path);
+    return 1;
+  }
+
+  static Session session;
+  static Stats stats;
+  memset(&stats, 0, sizeof(stats));
+  int rows = 24, cols = 80, running = 0, lineno = 0;
+  char dir[] = "/tmp/atom-pty-XXXXXX";
+  char scratch[64];
+  char line[LINE_LEN];
+
+  if(!mkdtemp(dir)) {
+    perror("mkdtemp");
+    fclose(trace);
+    return 1;
+  }
+  snprintf(scratch, sizeof(scratch), "%s/trace.c", dir);
+
+  while(fgets(line, sizeof(line), trace)) {
+    lineno++;
+    line[strcspn(line, "\n")] = '\0';
+    if(line[0] == '#' || line[0] == '\0') continue;
+
+    char *arg = strchr(line, ' ');
+    if(arg) *arg++ = '\0';
+    else arg = line + strlen(line);
+
+    if(strcmp(line, "size") == 0) {
+      sscanf(arg, "%dx%d", &rows, &cols);
+      rows = vt_clamp(rows, 4, MAX_ROWS);
+      cols = vt_clamp(cols, 20, MAX_COLS);
+    }
+    else if(strcmp(line, "open") == 0) {
+      int lines;
+      int ok = sscanf(arg, "lines=%d", &lines) == 1 ? generate_file(scratch, lines) : copy_file(arg, scratch);
+      if(ok != 0 || start_session(&session, atom, dir, "trace.c", rows, cols) != 0) {
+        fprintf(stderr, "%s:%d: cannot open %s\n", trace_path, lineno, arg);
+        stats.failures++;
+        break;
+      }
+      running = 1;
+    }
+    else if(!running) {
+      fprintf(stderr, "%s:%d: '%s' before open\n", trace_path, lineno, line);
+      stats.failures++;
+      break;
+    }
+    else if(strcmp(line, "quiet") == 0) {
+      session.quiet_ms = atoi(arg);
+    }
+    else if(strcmp(line, "keys") == 0 || strcmp(line, "repeat") == 0) {
+      int times = 1;
+      if(line[0] == 'r') {
+        times = atoi(arg);
+        char *keys = strchr(arg, ' ');
+        arg = keys ? keys + 1 : arg + strlen(arg);
+      }
+      size_t len = unescape(arg);
+      for(int t = 0; t < times; t++) {
+        for(size_t i = 0; i < len; i++) send_event(&session, &stats, &arg[i], 1);
+      }
+    }
+    else if(strcmp(line, "paste") == 0) {
+      size_t len = unescape(arg);
+      send_event(&session, &stats, arg, len);
+    }
+    else if(strcmp(line, "expect-row") == 0) {
+      int row = atoi(arg);
+      char *text = strchr(arg, ' ');
+      text = text ? text + 1 : arg + strlen(arg);
+      unescape(text);
+      char actual[MAX_COLS + 1] = "";
+      if(row >= 1 && row <= session.screen.rows) vt_row_text(&session.screen, row - 1, actual);
+      if(strcmp(actual, text) != 0) {
+        fprintf(stderr, "%s:%d: row %d is \"%s\", expected \"%s\"\n", trace_path, lineno, row, actual, text);
+        stats.failures++;
+      }
+    }
+    else if(strcmp(line, "expect-cursor") == 0) {
+      int row, col;
+      sscanf(arg, "%d %d", &row, &col);
+      if(session.screen.cur_row + 1 != row || session.screen.cur_col + 1 != col) {
+        fprintf(stderr, "%s:%d: cursor at %d %d, expected %d %d\n", trace_path, lineno,
+                session.screen.cur_row + 1, session.screen.cur_col + 1, row, col);
+        stats.failures++;
+      }
+    }
+    else if(strcmp(line, "dump") == 0) {
+      vt_dump(&session.screen, stderr);
+    }
+    else {
+      fprintf(stderr, "%s:%d: unknown command '%s'\n", trace_path, lineno, line);
+      stats.failures++;
+    }
+  }
+
+  if(running) {
+    if(verbose || stats.failures) vt_dump(&session.screen, stderr);
+    stop_session(&session);
+  }
+  fclose(trace);
+  unlink(scratch);
+  rmdir(dir);
+
+  const char *name = strrchr(trace_path, '/');
+  report(name ? name + 1 : trace_path, &stats);
+  return stats.failures > 0;
+}
+
+int main(int argc, char **argv) {
+  int verbose = 0;
+  int opt;
+
+  while((opt = getopt(argc, argv, "v")) != -1) {
+    if(opt == 'v') verbose = 1;
+  }
+
+  if(argc - optind < 2) {
+    fprintf(stderr, "Usage: %s [-v] path/to/atom trace...\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  char atom[4096];
+  if(!realpath(argv[optind], atom)) {
+    perror(argv[optind]);
+    return EXIT_FAILURE;
+  }
+  printf("%-20s %6s %9s %9s %9s %9s %10s %9s %10s %8s\n", "trace", "keys", "p50 ms", "p90 ms",
+         "p99 ms", "max ms", "bytes/key", "max", "writes/key", "max");
+
+  int failed = 0;
+  for(int i = optind + 1; i < argc; i++) {
+    failed += run_trace(atom, argv[i], verbose);
+  }
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,106 @@
+#ifndef ATOM_H
+#define ATOM_H
+
+#include <stdint.h>
+
+// Types and constants shared by main.c and the modules in include/. Each
+// module still declares the functions it calls from the others; only what
+// has to agree byte for byte between two translation units lives here.
+
+// ===============================
+// CONSTANTS
+// ===============================
+
+#define MAX_PANES 16
+#define KEY_SEQUENCE_TIMEOUT_MS 1000
+
+// ===============================
+// KEYMAPS AND EVENTS
+// ===============================
+
+enum KeymapMode {
+  KEYMAP_VIEW,
+  KEYMAP_INSERT,
+  KEYMAP_BROWSER,
+  KEYMAP_MENU,
+  KEYMAP_MODES
+};
+
+typedef void (*KeyAction)(void);
+typedef void (*KeyFallback)(char c);
+
+typedef struct {
+  const char *keys;
+  KeyAction action;
+} KeyBinding;
+
+typedef void (*EventFdCallback)(int fd, short revents, void *data);
+typedef void (*EventCallback)(void *data);
+
+// ===============================
+// EDITING
+// ===============================
+
+enum JournalOp {
+  JOURNAL_INSERT_CHAR = 1,
+  JOURNAL_DELETE_CHAR,
+  JOURNAL_SPLIT_LINE,
+  JOURNAL_DELETE_LINE,
+  JOURNAL_DELETE_LINES,
+  JOURNAL_SORT_LINES,
+  JOURNAL_REPLACE_LINES,
+};
+
+enum SortFlags {
+  SORT_NUMERIC = 1,
+  SORT_REVERSE = 2,
+  SORT_UNIQUE = 4,
+  SORT_KEEP_ORDER = 8,
+};
+
+typedef struct {
+  uint64_t key;
+  const char *text;
+  int len;
+  int index;
+} SortItem;
+
+// Where a line is between tokens
+enum SyntaxState {
+  SYNTAX_CODE,
+  SYNTAX_STRING,
+  SYNTAX_COMMENT
+};
+
+// Position records of a line cache entry, one per mode
+enum LineCacheKind {
+  LINE_CACHE_EDITOR,
+  LINE_CACHE_PAGER,
+  LINE_CACHE_KINDS
+};
+
+// ===============================
+// SETTINGS AND LAYOUT
+// ===============================
+
+typedef struct {
+  int tab_width;
+  char escape_key_1;
+  char escape_key_2;
+  int escape_timeout_ms;
+  long long mmap_threshold_mb;
+  long long pager_budget_mb;
+  int frame_budget_ms;
+  int worker_threads;
+  long long buffer_budget_mb;
+  int intern_lines;
+} Settings;
+
+typedef struct {
+  int top;
+  int left;
+  int height;
+  int width;
+} LayoutRect;
+
+#endif
@@ -0,0 +1,664 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "atom.h"
+
+// :diff compares the document with the file on disk and marks added,
+// changed and deleted lines in a gutter. Both sides are reduced to one
+// 64 bit hash per line; the file's hashes are computed once on a worker
+// thread and kept until the next save. Differences are found with Myers'
+// linear space algorithm (the middle snake, divide and conquer), also on
+// a worker, so memory stays proportional to the lines compared.
+//
+// Edits only widen a dirty window of document lines. A rerun grows that
+// window to the hunks it touches, maps it back onto the file through the
+// previous result and diffs just that slice, keeping every other hunk and
+// shifting the ones below by the change in line count. Typing in a large
+// file therefore rehashes and rediffs a few lines, not the whole file.
+
+#define DIFF_DELAY_MS 150
+#define DIFF_MAX_COST 200000000LL
+#define DIFF_MIN_D 64
+
+void event_post(EventCallback callback, void *data);
+int event_timer_add(int delay_ms, EventCallback callback, void *data);
+void event_timer_cancel(int id);
+
+const char *document_line_text(int y, int *len);
+int document_line_count();
+void diff_updated(const char *summary);
+
+// ===============================
+// DATA STRUCTURES
+// ===============================
+
+// File lines [base_start, + base_count) became document lines
+// [doc_start, + doc_count)
+typedef struct {
+  int base_start;
+  int base_count;
+  int doc_start;
+  int doc_count;
+} DiffHunk;
+
+typedef struct {
+  DiffHunk *hunks;
+  int count;
+  int capacity;
+} DiffHunks;
+
+// Edited document lines [from, to), which hold delta more lines than
+// before the edits
+typedef struct {
+  int active;
+  int from;
+  int to;
+  int delta;
+} DiffWindow;
+
+typedef struct {
+  int generation;
+
+  // File to hash first, NULL to use base as it is
+  char *path;
+  uint64_t *base;
+  int base_count;
+  int load_failed;
+
+  // Whether to diff at all, and which slice of each side
+  int run;
+  int base_from;
+  int base_to;
+  uint64_t *doc;
+  int doc_from;
+  int doc_count;
+  // The document window in the coordinates of the previous result
+  int old_from;
+  int old_to;
+  int size_delta;
+
+  DiffHunks result;
+} DiffJob;
+
+typedef struct {
+  int active;
+  int generation;
+
+  uint64_t *base;
+  int base_count;
+  int have_base;
+  // Whether the running job reads base
+  int lent;
+
+  // Hunks in the coordinates of the document as the last job saw it
+  DiffHunks hunks;
+  int announce;
+
+  // Edits since the last job started, and the window of the running job
+  DiffWindow dirty;
+  DiffWindow running;
+  int busy;
+  int timer;
+  int reload;
+  char *path;
+} DiffState;
+
+// ===============================
+// GLOBAL
+// ===============================
+
+DiffState Diff = {0};
+
+void diff_schedule();
+void diff_start_job(int reload);
+void diff_job_done(void *data);
+void diff_stop();
+
+// ===============================
+// HELPERS
+// ===============================
+
+uint64_t diff_line_hash(const char *p, int len) {
+  if(len > 0 && p[len - 1] == '\r') len--;
+  uint64_t h = 0x9e3779b97f4a7c15ULL ^ (uint64_t)len;
+  int i = 0;
+  for(; i + 8 <= len; i += 8) {
+    uint64_t w;
+    memcpy(&w, p + i, 8);
+    h = (h ^ w) * 0xff51afd7ed558ccdULL;
+    h ^= h >> 32;
+  }
+  uint64_t tail = 0;
+  for(int k = 0; i < len; i++, k += 8) tail |= (uint64_t)(unsigned char)p[i] << k;
+  h = (h ^ tail) * 0xc4ceb9fe1a85ec53ULL;
+  return h ^ (h >> 29);
+}
+
+void hunks_push(DiffHunks *h, int base_start, int base_count, int doc_start, int doc_count) {
+  // A delete right before an insert is one change
+  if(h->count > 0) {
+    DiffHunk *last = &h->hunks[h->count - 1];
+    if(last->base_start + last->base_count == base_start && last->doc_start + last->doc_count == doc_start) {
+      last->base_count += base_count;
+      last->doc_count += doc_count;
+      return;
+    }
+  }
+  if(h->count == h->capacity) {
+    int capacity = h->capacity ? h->capacity * 2 : 64;
+    DiffHunk *tmp = realloc(h->hunks, capacity * sizeof(DiffHunk));
+    if(!tmp) {
+      perror("Malloc failled");
+      exit(EXIT_FAILURE);
+    }
+    h->hunks = tmp;
+    h->capacity = capacity;
+  }
+  h->hunks[h->count++] = (DiffHunk){ base_start, base_count, doc_start, doc_count };
+}
+
+// Hashes of every line of path, NULL when it cannot be read
+uint64_t *hash_file(const char *path, int *count) {
+  *count = 0;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if(fd < 0) return NULL;
+  struct stat st;
+  if(fstat(fd, &st) != 0) {
+    close(fd);
+    return NULL;
+  }
+
+  size_t size = st.st_size;
+  const char *data = NULL;
+  if(size > 0) {
+    data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(data == MAP_FAILED) {
+      close(fd);
+      return NULL;
+    }
+  }
+  close(fd);
+
+  int capacity = 1024, n = 0;
+  uint64_t *hashes = malloc(capacity * sizeof(uint64_t));
+  if(!hashes) {
+    perror("Malloc failled");
+    exit(EXIT_FAILURE);
+  }
+  const char *p = data, *end = data + size;
+  while(p < end) {
+    const char *nl = memchr(p, '\n', end - p);
+    if(!nl) nl = end;
+    if(n == capacity) {
+      capacity *= 2;
+      uint64_t *tmp = realloc(hashes, capacity * sizeof(uint64_t));
+      if(!tmp) {
+        perror("Malloc failled");
+        exit(EXIT_FAILURE);
+      }
+      hashes = tmp;
+    }
+    hashes[n++] = diff_line_hash(p, nl - p);
+    p = nl + 1;
+  }
+  if(size > 0) munmap((void *)data, size);
+  *count = n;
+  return hashes;
+}
+
+// ===============================
+// MYERS
+// ===============================
+
+typedef struct {
+  const uint64_t *a;
+  const uint64_t *b;
+  int a_offset;
+  int b_offset;
+  int *vf;
+  int *vb;
+  DiffHunks *out;
+} DiffContext;
+
+// Finds the middle snake of a[a0, a1) against b[b0, b1), both non-empty
+// and differing at each end. Returns 0 when the edit distance runs past
+// what is worth the time.
+int middle_snake(DiffContext *c, int a0, int a1, int b0, int b1, int *sx, int *sy, int *ex, int *ey) {
+  const uint64_t *a = c->a + a0, *b = c->b + b0;
+  int n = a1 - a0, m = b1 - b0;
+  int delta = n - m, odd = delta & 1;
+  int max = (n + m + 1) / 2;
+  long long limit = DIFF_MAX_COST / (n + m);
+  if(limit < DIFF_MIN_D) limit = DIFF_MIN_D;
+  // Diagonals -max - 1 .. max + 1
+  int *vf = c->vf + max + 1, *vb = c->vb + max + 1;
+  vf[1] = 0;
+  vb[1] = 0;
+
+  for(int d = 0; d <= max && d <= limit; d++) {
+    for(int k = -d; k <= d; k += 2) {
+      int x = (k == -d || (k != d && vf[k - 1] < vf[k + 1])) ? vf[k + 1] : vf[k - 1] + 1;
+      int y = x - k, x0 = x, y0 = y;
+      while(x < n && y < m && a[x] == b[y]) {
+        x++;
+        y++;
+      }
+      vf[k] = x;
+      int r = delta - k;
+      if(odd && r >= -(d - 1) && r <= d - 1 && x + vb[r] >= n) {
+        *sx = a0 + x0;
+        *sy = b0 + y0;
+        *ex = a0 + x;
+        *ey = b0 + y;
+        return 1;
+      }
+    }
+    // Backwards from the end, x and y counted from the far corner
+    for(int r = -d; r <= d; r += 2) {
+      int x = (r == -d || (r != d && vb[r - 1] < vb[r + 1])) ? vb[r + 1] : vb[r - 1] + 1;
+      int y = x - r, x0 = x, y0 = y;
+      while(x < n && y < m && a[n - 1 - x] == b[m - 1 - y]) {
+        x++;
+        y++;
+      }
+      vb[r] = x;
+      int k = delta - r;
+      if(!odd && k >= -d && k <= d && x + vf[k] >= n) {
+        *sx = a0 + n - x;
+        *sy = b0 + m - y;
+        *ex = a0 + n - x0;
+        *ey = b0 + m - y0;
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+void diff_range(DiffContext *c, int a0, int a1, int b0, int b1) {
+  while(a0 < a1 && b0 < b1 && c->a[a0] == c->b[b0]) {
+    a0++;
+    b0++;
+  }
+  while(a0 < a1 && b0 < b1 && c->a[a1 - 1] == c->b[b1 - 1]) {
+    a1--;
+    b1--;
+  }
+  if(a0 == a1 && b0 == b1) return;
+
+  int sx, sy, ex, ey;
+  if(a0 == a1 || b0 == b1 || !middle_snake(c, a0, a1, b0, b1, &sx, &sy, &ex, &ey)) {
+    hunks_push(c->out, c->a_offset + a0, a1 - a0, c->b_offset + b0, b1 - b0);
+    return;
+  }
+  diff_range(c, a0, sx, b0, sy);
+  diff_range(c, ex, a1, ey, b1);
+}
+
+void *diff_worker(void *arg) {
+  DiffJob *job = arg;
+  if(job->path) {
+    job->base = hash_file(job->path, &job->base_count);
+    job->load_failed = job->base == NULL;
+    if(job->base_to < 0) job->base_to = job->base_count;
+  }
+  if(job->run && !job->load_failed) {
+    int n = job->base_to - job->base_from, m = job->doc_count;
+    int *v = malloc(2 * (n + m + 3) * sizeof(int));
+    if(!v) {
+      perror("Malloc failled");
+      exit(EXIT_FAILURE);
+    }
+    DiffContext c = {
+      .a = job->base + job->base_from, .b = job->doc,
+      .a_offset = job->base_from, .b_offset = job->doc_from,
+      .vf = v, .vb = v + n + m + 3, .out = &job->result,
+    };
+    diff_range(&c, 0, n, 0, m);
+    free(v);
+  }
+  event_post(diff_job_done, job);
+  return NULL;
+}
+
+// ===============================
+// JOBS
+// ===============================
+
+void diff_job_free(DiffJob *job) {
+  free(job->path);
+  free(job->doc);
+  free(job->result.hunks);
+  free(job);
+}
+
+// Replaces the hunks the job recomputed, shifting the ones below it
+void diff_splice(DiffJob *job) {
+  DiffHunks merged = {0};
+  for(int i = 0; i < Diff.hunks.count; i++) {
+    DiffHunk *h = &Diff.hunks.hunks[i];
+    if(h->doc_start + h->doc_count < job->old_from) hunks_push(&merged, h->base_start, h->base_count, h->doc_start, h->doc_count);
+  }
+  for(int i = 0; i < job->result.count; i++) {
+    DiffHunk *h = &job->result.hunks[i];
+    hunks_push(&merged, h->base_start, h->base_count, h->doc_start, h->doc_count);
+  }
+  for(int i = 0; i < Diff.hunks.count; i++) {
+    DiffHunk *h = &Diff.hunks.hunks[i];
+    if(h->doc_start > job->old_to) {
+      hunks_push(&merged, h->base_start, h->base_count, h->doc_start + job->size_delta, h->doc_count);
+    }
+  }
+  free(Diff.hunks.hunks);
+  Diff.hunks = merged;
+}
+
+void diff_summary(char *out, size_t size) {
+  long added = 0, changed = 0, deleted = 0;
+  for(int i = 0; i < Diff.hunks.count; i++) {
+    DiffHunk *h = &Diff.hunks.hunks[i];
+    int common = h->base_count < h->doc_count ? h->base_count : h->doc_count;
+    changed += common;
+    added += h->doc_count - common;
+    deleted += h->base_count - common;
+  }
+  if(Diff.hunks.count == 0) snprintf(out, size, "No changes against the file on disk");
+  else snprintf(out, size, "%ld added, %ld changed, %ld deleted lines", added, changed, deleted);
+}
+
+void diff_job_done(void *data) {
+  DiffJob *job = data;
+  Diff.busy = 0;
+  Diff.running.active = 0;
+
+  if(!Diff.active || job->generation != Diff.generation) {
+    free(job->base == Diff.base ? NULL : job->base);
+    diff_job_free(job);
+    if(Diff.active) diff_start_job(Diff.reload);
+    return;
+  }
+
+  if(job->path) {
+    if(job->load_failed) {
+      diff_job_free(job);
+      Diff.active = 0;
+      diff_updated("\033[1;31mError:\033[0m Cannot read the file on disk");
+      return;
+    }
+    free(Diff.base);
+    Diff.base = job->base;
+    Diff.base_count = job->base_count;
+    Diff.have_base = 1;
+  }
+  if(job->run) diff_splice(job);
+  diff_job_free(job);
+
+  char summary[96];
+  diff_summary(summary, sizeof(summary));
+  diff_updated(Diff.announce ? summary : NULL);
+  Diff.announce = 0;
+  if(Diff.dirty.active) diff_schedule();
+}
+
+// Widens doc lines [from, to) of the last result over every hunk that
+// overlaps or touches it
+void grow_window(int *from, int *to) {
+  int grown = 1;
+  while(grown) {
+    grown = 0;
+    for(int i = 0; i < Diff.hunks.count; i++) {
+      DiffHunk *h = &Diff.hunks.hunks[i];
+      if(h->doc_start > *to || h->doc_start + h->doc_count < *from) continue;
+      if(h->doc_start < *from) {
+        *from = h->doc_start;
+        grown = 1;
+      }
+      if(h->doc_start + h->doc_count > *to) {
+        *to = h->doc_start + h->doc_count;
+        grown = 1;
+      }
+    }
+  }
+}
+
+// File line matching document line y of the last result, for y at the
+// edge of a grown window. Deletions right at y count when past is set.
+int base_line_for(int y, int past) {
+  int shift = 0;
+  for(int i = 0; i < Diff.hunks.count; i++) {
+    DiffHunk *h = &Diff.hunks.hunks[i];
+    if(h->doc_start > y || (h->doc_start == y && !past)) break;
+    shift += h->base_count - h->doc_count;
+  }
+  return y + shift;
+}
+
+// Starts a job for the dirty window, or for a fresh copy of the file
+void diff_start_job(int reload) {
+  if(Diff.busy) return;
+  int size = document_line_count();
+  DiffJob *job = calloc(1, sizeof(DiffJob));
+  if(!job) {
+    perror("Malloc failled");
+    exit(EXIT_FAILURE);
+  }
+  job->generation = Diff.generation;
+  job->base = Diff.base;
+  job->base_count = Diff.base_count;
+
+  if(reload || !Diff.have_base) {
+    job->path = strdup(Diff.path);
+    if(!job->path) {
+      perror("Malloc failled");
+      exit(EXIT_FAILURE);
+    }
+    job->base = NULL;
+    job->base_count = 0;
+  }
+  Diff.reload = 0;
+
+  if(!reload) {
+    int from = 0, to = size, delta = 0;
+    if(Diff.have_base) {
+      from = Diff.dirty.from;
+      to = Diff.dirty.to;
+      delta = Diff.dirty.delta;
+    }
+    int old_from = from, old_to = to - delta;
+    if(old_to < old_from) old_to = old_from;
+    grow_window(&old_from, &old_to);
+    from = old_from;
+    to = old_to + delta;
+
+    job->run = 1;
+    job->old_from = old_from;
+    job->old_to = old_to;
+    job->size_delta = delta;
+    job->doc_from = from;
+    job->doc_count = to - from;
+    job->base_from = Diff.have_base ? base_line_for(old_from, 0) : 0;
+    job->base_to = Diff.have_base ? base_line_for(old_to, 1) : -1;
+    job->doc = malloc((job->doc_count > 0 ? job->doc_count : 1) * sizeof(uint64_t));
+    if(!job->doc) {
+      perror("Malloc failled");
+      exit(EXIT_FAILURE);
+    }
+    for(int i = 0; i < job->doc_count; i++) {
+      int len;
+      const char *text = document_line_text(from + i, &len);
+      job->doc[i] = diff_line_hash(text, len);
+    }
+    Diff.running = (DiffWindow){ 1, from, to, delta };
+    Diff.dirty = (DiffWindow){0};
+  }
+  else {
+    // The document was the file when it was saved; edits since stay dirty
+    free(Diff.hunks.hunks);
+    Diff.hunks = (DiffHunks){0};
+  }
+  Diff.lent = job->path == NULL;
+
+  pthread_t thread;
+  if(pthread_create(&thread, NULL, diff_worker, job) != 0) {
+    diff_worker(job);
+  }
+  else {
+    pthread_detach(thread);
+  }
+  Diff.busy = 1;
+}
+
+void diff_timeout(void *data) {
+  (void)data;
+  Diff.timer = 0;
+  if(!Diff.busy) diff_start_job(Diff.reload);
+}
+
+void diff_schedule() {
+  if(!Diff.timer) Diff.timer = event_timer_add(DIFF_DELAY_MS, diff_timeout, NULL);
+}
+
+// Maps document line y back across a window of edits. Returns -1 for a
+// line inside it.
+int through_window(const DiffWindow *w, int y) {
+  if(!w->active || y < w->from) return y;
+  if(y < w->to) return -1;
+  return y - w->delta;
+}
+
+// Maps line y from before a window of edits to after it
+int into_window(const DiffWindow *w, int y) {
+  if(!w->active || y < w->from) return y;
+  if(y < w->to - w->delta) return w->from;
+  return y + w->delta;
+}
+
+// Document line of the last result's line y as the document is now
+int current_line(int y) {
+  return into_window(&Diff.dirty, into_window(&Diff.running, y));
+}
+
+// ===============================
+// DIFF API
+// ===============================
+
+// Starts comparing the document with path
+void diff_start(const char *path) {
+  diff_stop();
+  Diff.path = strdup(path);
+  if(!Diff.path) {
+    perror("Malloc failled");
+    exit(EXIT_FAILURE);
+  }
+  Diff.active = 1;
+  Diff.announce = 1;
+  diff_start_job(0);
+}
+
+void diff_stop() {
+  if(!Diff.active) return;
+  if(Diff.timer) event_timer_cancel(Diff.timer);
+  Diff.timer = 0;
+  Diff.active = 0;
+  Diff.generation++;
+  // A running job that reads the hashes frees them when it is done
+  if(!Diff.busy || !Diff.lent) free(Diff.base);
+  Diff.base = NULL;
+  Diff.base_count = 0;
+  Diff.have_base = 0;
+  free(Diff.hunks.hunks);
+  Diff.hunks = (DiffHunks){0};
+  Diff.dirty = (DiffWindow){0};
+  Diff.running = (DiffWindow){0};
+  free(Diff.path);
+  Diff.path = NULL;
+}
+
+int diff_active() {
+  return Diff.active;
+}
+
+// Lines [y, y + removed) were replaced by added lines
+void diff_note_edit(int y, int removed, int added) {
+  if(!Diff.active) return;
+  DiffWindow *w = &Diff.dirty;
+  int size = document_line_count();
+  if(!w->active) {
+    *w = (DiffWindow){ 1, y, y + added, 0 };
+  }
+  else {
+    if(w->to > y + removed) w->to += added - removed;
+    else w->to = y + added;
+    if(y < w->from) w->from = y;
+  }
+  w->delta += added - removed;
+  if(w->to > size) w->to = size;
+  if(w->from > w->to) w->from = w->to;
+  diff_schedule();
+}
+
+// The document was just written to the file, which becomes the new base
+void diff_file_saved() {
+  if(!Diff.active) return;
+  Diff.generation += Diff.busy;
+  Diff.reload = 1;
+  free(Diff.hunks.hunks);
+  Diff.hunks = (DiffHunks){0};
+  Diff.dirty = (DiffWindow){0};
+  if(!Diff.busy) diff_start_job(1);
+}
+
+// Gutter mark for document line y: + added, ~ changed, - lines deleted
+// below it, space for none
+char diff_gutter(int y) {
+  if(!Diff.active) return ' ';
+  y = through_window(&Diff.dirty, y);
+  if(y >= 0) y = through_window(&Diff.running, y);
+  if(y < 0) return '~';
+
+  // First hunk starting after y
+  int lo = 0, hi = Diff.hunks.count;
+  while(lo < hi) {
+    int mid = (lo + hi) / 2;
+    if(Diff.hunks.hunks[mid].doc_start <= y) lo = mid + 1;
+    else hi = mid;
+  }
+  if(lo > 0) {
+    DiffHunk *h = &Diff.hunks.hunks[lo - 1];
+    if(y < h->doc_start + h->doc_count) return h->base_count == 0 ? '+' : '~';
+    if(h->doc_count == 0 && h->doc_start == 0 && y == 0) return '-';
+  }
+  if(lo < Diff.hunks.count) {
+    DiffHunk *h = &Diff.hunks.hunks[lo];
+    if(h->doc_count == 0 && h->doc_start == y + 1) return '-';
+  }
+  return ' ';
+}
+
+// First line of the next change after y (dir > 0) or before it, -1 when
+// there is none
+int diff_next_hunk(int y, int dir) {
+  if(!Diff.active) return -1;
+  int best = -1;
+  for(int i = 0; i < Diff.hunks.count + 2; i++) {
+    int line;
+    if(i < Diff.hunks.count) {
+      // A deletion is marked on the line above it
+      DiffHunk *h = &Diff.hunks.hunks[i];
+      line = current_line(h->doc_count == 0 && h->doc_start > 0 ? h->doc_start - 1 : h->doc_start);
+    }
+    else if(i == Diff.hunks.count && Diff.running.active) line = into_window(&Diff.dirty, Diff.running.from);
+    else if(i == Diff.hunks.count + 1 && Diff.dirty.active) line = Diff.dirty.from;
+    else continue;
+    if(dir > 0 && line > y && (best < 0 || line < best)) best = line;
+    if(dir < 0 && line < y && line > best) best = line;
+  }
+  return best;
+}
@@ -1,72 +1,267 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
 
-#define DOTFILE_PATH "~/.atomrc"
-#define SETTING_COUNT 4
+#include "atom.h"
 
-enum KEYS { 
-  TAB_VAL
-};
+// Settings from ~/.atomrc, one "key = value" per line, # starts a comment.
+// The file is parsed in a single pass straight into a Settings struct:
+// each key is looked up in a table that gives the field's offset, type
+// and range, so adding a setting is one table row. Settings missing from
+// the file keep their defaults, bad lines are reported and skipped.
+//
+// The directory holding the file is watched with inotify, so saving it
+// (in place or by rename, as most editors do) reloads it on the next
+// iteration of the event loop.
 
-char *values[] = {
-  [TAB_VAL] = "2",
-};
+#define DOTFILE_NAME ".atomrc"
+#define DOTFILE_MAX_SIZE (64 << 10)
+#define DOTFILE_WATCH_MASK (IN_CLOSE_WRITE | IN_MOVED_TO)
+
+void event_watch_fd(int fd, short events, EventFdCallback callback, void *data);
+
+void apply_settings();
+void flash_command_status(const char *s);
+
+// ===============================
+// DATA STRUCTURES
+// ===============================
+
+typedef enum {
+  SETTING_INT,
+  SETTING_SIZE,
+  SETTING_KEY
+} SettingType;
 
-char *default_layout[] = {
-  "tab_value = 2",
-  "escape_key_1 = j",
-  "escape_key_2 = j",
-  "escape_timeout_ms = 300"
+typedef struct {
+  const char *name;
+  SettingType type;
+  size_t offset;
+  long long min;
+  long long max;
+} SettingSpec;
+
+const SettingSpec SettingSpecs[] = {
+  { "tab_width", SETTING_INT, offsetof(Settings, tab_width), 1, 16 },
+  { "escape_key_1", SETTING_KEY, offsetof(Settings, escape_key_1), 0, 0 },
+  { "escape_key_2", SETTING_KEY, offsetof(Settings, escape_key_2), 0, 0 },
+  { "escape_timeout_ms", SETTING_INT, offsetof(Settings, escape_timeout_ms), 0, 5000 },
+  { "mmap_threshold_mb", SETTING_SIZE, offsetof(Settings, mmap_threshold_mb), 1, 1LL << 30 },
+  { "pager_budget_mb", SETTING_SIZE, offsetof(Settings, pager_budget_mb), 1, 1LL << 20 },
+  { "frame_budget_ms", SETTING_INT, offsetof(Settings, frame_budget_ms), 1, 1000 },
+  { "worker_threads", SETTING_INT, offsetof(Settings, worker_threads), 0, 256 },
+  { "buffer_budget_mb", SETTING_SIZE, offsetof(Settings, buffer_budget_mb), 1, 1LL << 20 },
+  { "intern_lines", SETTING_INT, offsetof(Settings, intern_lines), 0, 1 },
 };
 
-int check_dotfile() {
-  FILE *dotfile = fopen(DOTFILE_PATH, "r");
+#define SETTING_COUNT (int)(sizeof(SettingSpecs) / sizeof(SettingSpecs[0]))
+
+#define DEFAULT_SETTINGS { \
+  .tab_width = 2, \
+  .escape_key_1 = 'j', \
+  .escape_key_2 = 'j', \
+  .escape_timeout_ms = 300, \
+  .mmap_threshold_mb = 4096, \
+  .pager_budget_mb = 64, \
+  .frame_budget_ms = 16, \
+  .worker_threads = 0, \
+  .buffer_budget_mb = 1024, \
+  .intern_lines = 0, \
+}
+
+const Settings DefaultSettings = DEFAULT_SETTINGS;
+
+// ===============================
+// GLOBAL
+// ===============================
+
+Settings Config = DEFAULT_SETTINGS;
 
-  if(dotfile) {
-    fclose(dotfile);
+char DotfileDir[PATH_MAX];
+int DotfileWatch = -1;
+
+// ===============================
+// PARSER
+// ===============================
+
+int is_blank(char c) {
+  return c == ' ' || c == '\t' || c == '\r';
+}
+
+const SettingSpec *find_setting(const char *name, int len) {
+  for(int i = 0; i < SETTING_COUNT; i++) {
+    if((int)strlen(SettingSpecs[i].name) == len && memcmp(SettingSpecs[i].name, name, len) == 0) {
+      return &SettingSpecs[i];
+    }
+  }
+  return NULL;
+}
+
+// Stores value into the field spec describes. Returns 0 if it does not fit.
+int set_setting(Settings *s, const SettingSpec *spec, const char *value, int len) {
+  char *field = (char *)s + spec->offset;
+
+  if(spec->type == SETTING_KEY) {
+    if(len != 1 || value[0] < 33 || value[0] > 126) return 0;
+    *field = value[0];
     return 1;
   }
-  
-  return 0;
+
+  long long v = 0;
+  if(len == 0 || len > 18) return 0;
+  for(int i = 0; i < len; i++) {
+    if(value[i] < '0' || value[i] > '9') return 0;
+    v = v * 10 + (value[i] - '0');
+  }
+  if(v < spec->min || v > spec->max) return 0;
+  if(spec->type == SETTING_INT) *(int *)field = v;
+  else *(long long *)field = v;
+  return 1;
 }
 
-void handle_dotfile() {
-  if(check_dotfile() == 1) {
-    FILE *dotfile = fopen(DOTFILE_PATH, "r");
+// Parses text over defaults into out. Returns the number of bad lines;
+// the first one is described in error.
+int parse_settings(const char *text, size_t len, Settings *out, char *error, size_t error_size) {
+  const char *p = text, *end = text + len;
+  int line = 0, bad = 0;
+  *out = DefaultSettings;
 
-    char buff[128];
+  while(p < end) {
+    const char *eol = memchr(p, '\n', end - p);
+    if(!eol) eol = end;
+    line++;
 
-    while(fgets(buff, 128, dotfile)) {
-      size_t size = strlen(buff);
-      int pos = 0;
-      
-      while(pos < size) {
-        while(pos < size && buff[pos] == ' ') pos++;
+    const char *c = memchr(p, '#', eol - p);
+    if(!c) c = eol;
+    while(p < c && is_blank(*p)) p++;
+    while(c > p && is_blank(c[-1])) c--;
 
-        int key_start = pos;
-        int key_length = 0;
+    if(p < c) {
+      const char *key = p;
+      while(p < c && !is_blank(*p) && *p != '=') p++;
+      int key_len = p - key;
+      while(p < c && is_blank(*p)) p++;
 
-        while(pos < size && buff[pos] != '=') {
-          pos++;
-        }
+      const SettingSpec *spec = NULL;
+      const char *problem = NULL;
+      if(p >= c || *p != '=') {
+        problem = "expected key = value";
+      }
+      else if(!(spec = find_setting(key, key_len))) {
+        problem = "unknown setting";
+      }
+      else {
+        p++;
+        while(p < c && is_blank(*p)) p++;
+        if(!set_setting(out, spec, p, c - p)) problem = "bad value";
+      }
+      if(problem) {
+        if(bad++ == 0) snprintf(error, error_size, "line %d: %s", line, problem);
       }
     }
+    p = eol + 1;
+  }
+  return bad;
+}
+
+// ===============================
+// LOADING
+// ===============================
+
+void dotfile_path(char *out, size_t size) {
+  snprintf(out, size, "%s/%s", DotfileDir, DOTFILE_NAME);
+}
+
+// Reads the dotfile into Config and hands it to the editor. Nothing
+// changes when the file cannot be read.
+void reload_dotfile(int announce) {
+  char path[PATH_MAX + sizeof(DOTFILE_NAME) + 1];
+  dotfile_path(path, sizeof(path));
 
-    fclose(dotfile);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if(fd < 0) return;
+  char *text = malloc(DOTFILE_MAX_SIZE);
+  if(!text) {
+    perror("Malloc failled");
+    exit(EXIT_FAILURE);
   }
-  else {
-    FILE *dotfile = fopen(DOTFILE_PATH, "w");
-    if(!dotfile) {
-      perror("Error opening file");
-      exit(EXIT_FAILURE);
+  size_t len = 0;
+  ssize_t n;
+  while(len < DOTFILE_MAX_SIZE && (n = read(fd, text + len, DOTFILE_MAX_SIZE - len)) != 0) {
+    if(n < 0) {
+      if(errno == EINTR) continue;
+      break;
     }
-  
-    for(int i = 0; i < SETTING_COUNT; i++) {
-      fputs(default_layout[i], dotfile);
-      fputc('\n', dotfile);
+    len += n;
+  }
+  close(fd);
+
+  char error[128], msg[192];
+  int bad = parse_settings(text, len, &Config, error, sizeof(error));
+  free(text);
+
+  if(bad) {
+    snprintf(msg, sizeof(msg), "\033[1;31mError:\033[0m " DOTFILE_NAME " %s", error);
+    flash_command_status(msg);
+  }
+  else if(announce) {
+    flash_command_status("Reloaded " DOTFILE_NAME);
+  }
+  apply_settings();
+}
+
+void on_dotfile_events(int fd, short revents, void *data) {
+  (void)revents;
+  (void)data;
+  char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  int changed = 0;
+
+  ssize_t len;
+  while((len = read(fd, events, sizeof(events))) > 0) {
+    for(char *p = events; p < events + len; ) {
+      struct inotify_event *ev = (struct inotify_event *)p;
+      if(ev->len > 0 && strcmp(ev->name, DOTFILE_NAME) == 0) changed = 1;
+      p += sizeof(struct inotify_event) + ev->len;
     }
-    fclose(dotfile);
   }
+  if(changed) reload_dotfile(1);
+}
+
+// ===============================
+// SETTINGS API
+// ===============================
+
+// Loads ~/.atomrc if there is one and starts watching for it; settings
+// stay at their defaults until it is created
+void load_settings() {
+  const char *home = getenv("HOME");
+  if(!home || !home[0]) return;
+  snprintf(DotfileDir, sizeof(DotfileDir), "%s", home);
+
+  reload_dotfile(0);
+
+  DotfileWatch = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if(DotfileWatch < 0) return;
+  if(inotify_add_watch(DotfileWatch, DotfileDir, DOTFILE_WATCH_MASK) < 0) {
+    close(DotfileWatch);
+    DotfileWatch = -1;
+    return;
+  }
+  event_watch_fd(DotfileWatch, POLLIN, on_dotfile_events, NULL);
+}
+
+// Workers for parallel jobs, worker_threads or one per CPU
+int settings_worker_threads() {
+  if(Config.worker_threads > 0) return Config.worker_threads;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  return cpus > 0 ? (int)cpus : 1;
 }
@@ -0,0 +1,355 @@
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+
+#include "atom.h"
+
+// The editor runs on a single poll() loop. Terminal input, inotify,
+// signals (through a signalfd), timers and results handed back by worker
+// threads all arrive here, so waiting on one source never stalls another.
+// Callbacks run on the loop thread; only event_post may be called from
+// other threads.
+
+#define EVENT_MAX_WATCHES 32
+#define EVENT_MAX_TIMERS 32
+#define EVENT_MAX_SIGNALS 8
+
+// ===============================
+// DATA STRUCTURES
+// ===============================
+
+typedef struct {
+  int fd;
+  short events;
+  EventFdCallback callback;
+  void *data;
+} EventWatch;
+
+typedef struct {
+  int id;
+  long long deadline;
+  EventCallback callback;
+  void *data;
+} EventTimer;
+
+typedef struct {
+  int signo;
+  EventCallback callback;
+} EventSignal;
+
+typedef struct EventCompletion {
+  struct EventCompletion *next;
+  EventCallback callback;
+  void *data;
+} EventCompletion;
+
+typedef struct {
+  EventWatch watches[EVENT_MAX_WATCHES];
+  int watch_count;
+
+  EventTimer timers[EVENT_MAX_TIMERS];
+  int timer_count;
+  int next_timer_id;
+
+  EventSignal signals[EVENT_MAX_SIGNALS];
+  int signal_count;
+  sigset_t signal_mask;
+  int signal_fd;
+
+  // Worker threads queue completions here and poke wake_fd
+  int wake_fd;
+  pthread_mutex_t completion_lock;
+  EventCompletion *completions;
+  EventCompletion *completions_tail;
+
+  // Runs whenever the loop is about to wait
+  EventCallback idle;
+
+  int running;
+} EventLoop;
+
+// ===============================
+// GLOBAL
+// ===============================
+
+EventLoop Loop = {
+  .next_timer_id = 1,
+  .signal_fd = -1,
+  .wake_fd = -1,
+  .completion_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+// ===============================
+// HELPERS
+// ===============================
+
+long long event_now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int find_watch(int fd) {
+  for(int i = 0; i < Loop.watch_count; i++) {
+    if(Loop.watches[i].fd == fd) return i;
+  }
+  return -1;
+}
+
+// ===============================
+// FILE DESCRIPTORS
+// ===============================
+
+// Calls callback whenever poll reports one of events on fd. Watching an
+// fd again replaces its callback.
+void event_watch_fd(int fd, short events, EventFdCallback callback, void *data) {
+  int i = find_watch(fd);
+  if(i < 0) {
+    if(Loop.watch_count >= EVENT_MAX_WATCHES) {
+      fprintf(stderr, "event loop: too many watched fds\n");
+      exit(EXIT_FAILURE);
+    }
+    i = Loop.watch_count++;
+  }
+  Loop.watches[i].fd = fd;
+  Loop.watches[i].events = events;
+  Loop.watches[i].callback = callback;
+  Loop.watches[i].data = data;
+}
+
+void event_modify_fd(int fd, short events) {
+  int i = find_watch(fd);
+  if(i >= 0) Loop.watches[i].events = events;
+}
+
+void event_unwatch_fd(int fd) {
+  int i = find_watch(fd);
+  if(i < 0) return;
+  Loop.watches[i] = Loop.watches[--Loop.watch_count];
+}
+
+// ===============================
+// TIMERS
+// ===============================
+
+// One shot timer, returns an id for event_timer_cancel (never 0)
+int event_timer_add(int delay_ms, EventCallback callback, void *data) {
+  if(Loop.timer_count >= EVENT_MAX_TIMERS) {
+    fprintf(stderr, "event loop: too many timers\n");
+    exit(EXIT_FAILURE);
+  }
+  EventTimer *t = &Loop.timers[Loop.timer_count++];
+  t->id = Loop.next_timer_id++;
+  t->deadline = event_now_ms() + delay_ms;
+  t->callback = callback;
+  t->data = data;
+  return t->id;
+}
+
+void event_timer_cancel(int id) {
+  for(int i = 0; i < Loop.timer_count; i++) {
+    if(Loop.timers[i].id == id) {
+      Loop.timers[i] = Loop.timers[--Loop.timer_count];
+      return;
+    }
+  }
+}
+
+int event_timer_pending(int id) {
+  for(int i = 0; i < Loop.timer_count; i++) {
+    if(Loop.timers[i].id == id) return 1;
+  }
+  return 0;
+}
+
+// Milliseconds until the earliest timer is due, -1 when there is none
+int next_timer_timeout() {
+  if(Loop.timer_count == 0) return -1;
+  long long first = Loop.timers[0].deadline;
+  for(int i = 1; i < Loop.timer_count; i++) {
+    if(Loop.timers[i].deadline < first) first = Loop.timers[i].deadline;
+  }
+  long long left = first - event_now_ms();
+  return left < 0 ? 0 : (int)left;
+}
+
+// Fires due timers in deadline order. Timers added by a callback wait for
+// the next iteration even if they are already due.
+void run_due_timers() {
+  long long now = event_now_ms();
+  int last_id = Loop.next_timer_id;
+
+  while(1) {
+    int due = -1;
+    for(int i = 0; i < Loop.timer_count; i++) {
+      EventTimer *t = &Loop.timers[i];
+      if(t->id >= last_id || t->deadline > now) continue;
+      if(due < 0 || t->deadline < Loop.timers[due].deadline) due = i;
+    }
+    if(due < 0) return;
+
+    EventTimer t = Loop.timers[due];
+    Loop.timers[due] = Loop.timers[--Loop.timer_count];
+    t.callback(t.data);
+  }
+}
+
+// ===============================
+// SIGNALS
+// ===============================
+
+// Blocks signo and delivers it through the loop instead of a handler
+void event_on_signal(int signo, EventCallback callback) {
+  if(Loop.signal_count >= EVENT_MAX_SIGNALS) return;
+  Loop.signals[Loop.signal_count].signo = signo;
+  Loop.signals[Loop.signal_count].callback = callback;
+  Loop.signal_count++;
+
+  if(Loop.signal_count == 1) sigemptyset(&Loop.signal_mask);
+  sigaddset(&Loop.signal_mask, signo);
+  sigprocmask(SIG_BLOCK, &Loop.signal_mask, NULL);
+
+  Loop.signal_fd = signalfd(Loop.signal_fd, &Loop.signal_mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  if(Loop.signal_fd < 0) {
+    perror("signalfd");
+    exit(EXIT_FAILURE);
+  }
+}
+
+// Child processes should not inherit the loop's blocked signals
+void event_restore_signals() {
+  if(Loop.signal_count > 0) sigprocmask(SIG_UNBLOCK, &Loop.signal_mask, NULL);
+}
+
+void dispatch_signals() {
+  struct signalfd_siginfo info;
+  while(read(Loop.signal_fd, &info, sizeof(info)) == sizeof(info)) {
+    for(int i = 0; i < Loop.signal_count; i++) {
+      if(Loop.signals[i].signo == (int)info.ssi_signo) Loop.signals[i].callback(NULL);
+    }
+  }
+}
+
+// ===============================
+// IDLE
+// ===============================
+
+// Calls callback each time every ready event has been handled and the
+// loop is about to block, so work done for a burst of events can be
+// finished once at its end
+void event_on_idle(EventCallback callback) {
+  Loop.idle = callback;
+}
+
+// ===============================
+// WORKER COMPLETIONS
+// ===============================
+
+// Queues callback to run on the loop thread. Safe from any thread.
+void event_post(EventCallback callback, void *data) {
+  EventCompletion *c = malloc(sizeof(EventCompletion));
+  if(!c) {
+    perror("Malloc failled");
+    exit(EXIT_FAILURE);
+  }
+  c->next = NULL;
+  c->callback = callback;
+  c->data = data;
+
+  pthread_mutex_lock(&Loop.completion_lock);
+  if(Loop.completions_tail) Loop.completions_tail->next = c;
+  else Loop.completions = c;
+  Loop.completions_tail = c;
+  pthread_mutex_unlock(&Loop.completion_lock);
+
+  uint64_t one = 1;
+  write(Loop.wake_fd, &one, sizeof(one));
+}
+
+void dispatch_completions() {
+  uint64_t count;
+  read(Loop.wake_fd, &count, sizeof(count));
+
+  pthread_mutex_lock(&Loop.completion_lock);
+  EventCompletion *c = Loop.completions;
+  Loop.completions = Loop.completions_tail = NULL;
+  pthread_mutex_unlock(&Loop.completion_lock);
+
+  while(c) {
+    EventCompletion *next = c->next;
+    c->callback(c->data);
+    free(c);
+    c = next;
+  }
+}
+
+// ===============================
+// LOOP
+// ===============================
+
+void event_loop_init() {
+  Loop.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if(Loop.wake_fd < 0) {
+    perror("eventfd");
+    exit(EXIT_FAILURE);
+  }
+}
+
+void event_loop_stop() {
+  Loop.running = 0;
+}
+
+void event_loop_run() {
+  struct pollfd fds[EVENT_MAX_WATCHES + 2];
+  Loop.running = 1;
+
+  while(Loop.running) {
+    int n = 0;
+    for(int i = 0; i < Loop.watch_count; i++) {
+      fds[n].fd = Loop.watches[i].fd;
+      fds[n].events = Loop.watches[i].events;
+      fds[n].revents = 0;
+      n++;
+    }
+    int signal_slot = -1, wake_slot = -1;
+    if(Loop.signal_fd >= 0) {
+      signal_slot = n;
+      fds[n++] = (struct pollfd){ .fd = Loop.signal_fd, .events = POLLIN };
+    }
+    if(Loop.wake_fd >= 0) {
+      wake_slot = n;
+      fds[n++] = (struct pollfd){ .fd = Loop.wake_fd, .events = POLLIN };
+    }
+
+    if(Loop.idle) Loop.idle(NULL);
+    int ready = poll(fds, n, next_timer_timeout());
+    if(ready < 0) {
+      if(errno == EINTR) continue;
+      perror("poll");
+      exit(EXIT_FAILURE);
+    }
+
+    run_due_timers();
+    if(signal_slot >= 0 && fds[signal_slot].revents) dispatch_signals();
+
+    for(int i = 0; i < n && Loop.running; i++) {
+      if(!fds[i].revents || i == signal_slot || i == wake_slot) continue;
+      // A callback may have dropped or replaced the watch
+      int w = find_watch(fds[i].fd);
+      if(w < 0 || !(fds[i].revents & (Loop.watches[w].events | POLLHUP | POLLERR))) continue;
+      EventWatch watch = Loop.watches[w];
+      watch.callback(watch.fd, fds[i].revents, watch.data);
+    }
+
+    if(wake_slot >= 0 && fds[wake_slot].revents) dispatch_completions();
+  }
+}
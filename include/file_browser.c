@@ -1,11 +1,18 @@
 #include <dirent.h>
+#include <limits.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
 #include <sys/stat.h>
 #include <stdio.h>
 #include <unistd.h>
 
-#define PATH_LEN 128
+#include "atom.h"
+
+#define PATH_LEN PATH_MAX
+#define DIR_CACHE_MAX 64
+#define DIR_WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
 
 // ===============================
 // DATA STRUCTURES
@@ -40,8 +47,26 @@ typedef struct {
   int selected;
   char current_path[PATH_LEN];
   SortMode sort_mode;
+  int active;
 } FileBrowser;
 
+// Sorted listing of one directory, kept up to date by an inotify watch
+typedef struct {
+  char path[PATH_LEN];
+  FileEntry *entries;
+  int count;
+  int capacity;
+  int wd;
+  unsigned long last_used;
+} CachedDir;
+
+typedef struct {
+  CachedDir dirs[DIR_CACHE_MAX];
+  int count;
+  int inotify_fd;
+  unsigned long tick;
+} DirCache;
+
 typedef struct {
   int width;
   int height;
@@ -51,21 +76,60 @@ typedef struct {
 extern Window Win;
 
 void end_browsing();
+void draw_browser();
 void cmd_quit(void);
 int clamp(int v, int lo, int hi);
-void start_buffer(char *filepath);
+int start_buffer(char *filepath);
+void event_watch_fd(int fd, short events, EventFdCallback callback, void *data);
+void event_unwatch_fd(int fd);
+void on_dir_events(int fd, short revents, void *data);
+
+void keymap_init(int mode, KeyFallback fallback, int timeout_ms, int counted);
+void keymap_bind_table(int mode, const KeyBinding *table, int count);
+void keymap_feed(int mode, char c);
 
 // ===============================
 // GLOBAL 
 // ===============================
 
 FileBrowser Browser = {0};
+DirCache Cache = { .inotify_fd = -1 };
 
 // ===============================
-// File Browser
+// Directory listings
 // ===============================
 
-FileEntry *load_all_entries(char *path, int *total_count) {
+void free_entries(FileEntry *entries, int count) {
+  for(int i = 0; i < count; i++) {
+    free(entries[i].name);
+    free(entries[i].full_path);
+  }
+  free(entries);
+}
+
+int fill_entry(FileEntry *entry, const char *path, const char *name) {
+  char full_path[PATH_LEN];
+  snprintf(full_path, sizeof(full_path), "%s/%s", path, name);
+
+  struct stat st;
+  entry->type = ENTRY_UNKNOWN;
+  entry->size = 0;
+  if(stat(full_path, &st) == 0) {
+    entry->type = S_ISDIR(st.st_mode) ? ENTRY_DIR : ENTRY_FILE;
+    entry->size = st.st_size;
+  }
+  entry->full_path = strdup(full_path);
+  entry->name = strdup(name);
+
+  if(!entry->full_path || !entry->name) {
+    free(entry->full_path);
+    free(entry->name);
+    return -1;
+  }
+  return 0;
+}
+
+FileEntry *load_all_entries(char *path, int *total_count, int *total_capacity) {
   DIR *dir = opendir(path);
   if(dir == NULL) {
     perror("opendir() error");
@@ -88,11 +152,7 @@ FileEntry *load_all_entries(char *path, int *total_count) {
       capacity *= 2; 
       FileEntry *tmp = realloc(entries, sizeof(FileEntry) * capacity);
       if(!tmp) {
-        for(int i = 0; i < count; i++) {
-          free(entries[i].name);
-          free(entries[i].full_path);
-        }
-        free(entries);
+        free_entries(entries, count);
         closedir(dir);
         return NULL;
       }
@@ -100,44 +160,219 @@ FileEntry *load_all_entries(char *path, int *total_count) {
       memset(&entries[count], 0, (capacity - count) * sizeof(FileEntry));
     }
 
-    char full_path[PATH_LEN];
-    snprintf(full_path, sizeof(full_path), "%s/%s", path, entry->d_name);
-
-    struct stat st;
-    if(stat(full_path, &st) == 0) {
-      entries[count].type = S_ISDIR(st.st_mode) ? ENTRY_DIR : ENTRY_FILE;
-      entries[count].size = st.st_size;
+    if(fill_entry(&entries[count], path, entry->d_name) == 0) {
+      count++;
     }
-    entries[count].full_path = strdup(full_path);
-
-    entries[count].name = strdup(entry->d_name);
-
-    count++;
   }
 
   closedir(dir);
   *total_count = count;
+  *total_capacity = capacity;
 
   return entries; 
 }
 
-void swap_entry(FileEntry *a, FileEntry *b) {
-  FileEntry c = *a;
-  *a = *b;
-  *b = c;
+// Directories first, then by name
+int compare_entries(const void *a, const void *b) {
+  const FileEntry *x = a;
+  const FileEntry *y = b;
+  if(x->type == ENTRY_DIR && y->type != ENTRY_DIR) return -1;
+  if(x->type != ENTRY_DIR && y->type == ENTRY_DIR) return 1;
+  return strcmp(x->name, y->name);
 }
 
 void sort_entries(FileEntry *entries, int size) {
-  for(int i = 0; i < size - 1; i++) {
-    for(int j = i + 1; j < size; j++) {
-      if(entries[i].type != ENTRY_DIR && entries[j].type == ENTRY_DIR) {
-        swap_entry(&entries[i], &entries[j]);
+  qsort(entries, size, sizeof(FileEntry), compare_entries);
+}
+
+// ===============================
+// Directory cache
+// ===============================
+
+int find_entry_by_name(CachedDir *dir, const char *name) {
+  for(int i = 0; i < dir->count; i++) {
+    if(strcmp(dir->entries[i].name, name) == 0) return i;
+  }
+  return -1;
+}
+
+// Adds one entry at its sorted position instead of rescanning the directory
+void insert_cached_entry(CachedDir *dir, const char *name) {
+  if(find_entry_by_name(dir, name) >= 0) return;
+
+  FileEntry entry;
+  if(fill_entry(&entry, dir->path, name) != 0) return;
+
+  if(dir->count >= dir->capacity) {
+    int capacity = dir->capacity > 0 ? dir->capacity * 2 : 32;
+    FileEntry *tmp = realloc(dir->entries, sizeof(FileEntry) * capacity);
+    if(!tmp) {
+      free(entry.name);
+      free(entry.full_path);
+      return;
+    }
+    dir->entries = tmp;
+    dir->capacity = capacity;
+  }
+
+  int lo = 0, hi = dir->count;
+  while(lo < hi) {
+    int mid = (lo + hi) / 2;
+    if(compare_entries(&dir->entries[mid], &entry) < 0) lo = mid + 1;
+    else hi = mid;
+  }
+
+  memmove(&dir->entries[lo + 1], &dir->entries[lo], (dir->count - lo) * sizeof(FileEntry));
+  dir->entries[lo] = entry;
+  dir->count++;
+}
+
+void remove_cached_entry(CachedDir *dir, const char *name) {
+  int i = find_entry_by_name(dir, name);
+  if(i < 0) return;
+
+  free(dir->entries[i].name);
+  free(dir->entries[i].full_path);
+  memmove(&dir->entries[i], &dir->entries[i + 1], (dir->count - i - 1) * sizeof(FileEntry));
+  dir->count--;
+}
+
+void unwatch_cached_dir(CachedDir *dir) {
+  if(dir->wd >= 0) {
+    inotify_rm_watch(Cache.inotify_fd, dir->wd);
+    dir->wd = -1;
+  }
+}
+
+void drop_cached_dir(CachedDir *dir) {
+  unwatch_cached_dir(dir);
+  free_entries(dir->entries, dir->count);
+  *dir = Cache.dirs[--Cache.count];
+}
+
+CachedDir *find_cached_dir(const char *path) {
+  for(int i = 0; i < Cache.count; i++) {
+    if(strcmp(Cache.dirs[i].path, path) == 0) return &Cache.dirs[i];
+  }
+  return NULL;
+}
+
+CachedDir *find_cached_dir_by_wd(int wd) {
+  for(int i = 0; i < Cache.count; i++) {
+    if(Cache.dirs[i].wd == wd) return &Cache.dirs[i];
+  }
+  return NULL;
+}
+
+void evict_cached_dir() {
+  CachedDir *oldest = NULL;
+  for(int i = 0; i < Cache.count; i++) {
+    if(Cache.dirs[i].entries == Browser.entries) continue;
+    if(!oldest || Cache.dirs[i].last_used < oldest->last_used) oldest = &Cache.dirs[i];
+  }
+  if(oldest) drop_cached_dir(oldest);
+}
+
+// Returns the sorted listing of path, scanning it only when it is not
+// cached or its watch was lost
+CachedDir *get_cached_dir(const char *path) {
+  if(Cache.inotify_fd < 0) {
+    Cache.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(Cache.inotify_fd >= 0) event_watch_fd(Cache.inotify_fd, POLLIN, on_dir_events, NULL);
+  }
+  Cache.tick++;
+
+  CachedDir *dir = find_cached_dir(path);
+  if(dir && dir->wd >= 0) {
+    dir->last_used = Cache.tick;
+    return dir;
+  }
+
+  if(!dir) {
+    if(Cache.count >= DIR_CACHE_MAX) evict_cached_dir();
+    if(Cache.count >= DIR_CACHE_MAX) return NULL;
+    dir = &Cache.dirs[Cache.count++];
+    memset(dir, 0, sizeof(*dir));
+    strcpy(dir->path, path);
+    dir->wd = -1;
+  }
+
+  // Watch before scanning so nothing created in between is missed
+  if(Cache.inotify_fd >= 0) {
+    dir->wd = inotify_add_watch(Cache.inotify_fd, path, DIR_WATCH_MASK);
+  }
+
+  int count = 0, capacity = 0;
+  FileEntry *entries = load_all_entries(dir->path, &count, &capacity);
+  if(!entries) {
+    if(dir->entries) return dir;
+    drop_cached_dir(dir);
+    return NULL;
+  }
+  sort_entries(entries, count);
+
+  free_entries(dir->entries, dir->count);
+  dir->entries = entries;
+  dir->count = count;
+  dir->capacity = capacity;
+  dir->last_used = Cache.tick;
+  return dir;
+}
+
+// Applies pending inotify events to the cached listings.
+// Returns 1 if the directory being browsed changed.
+int process_dir_events() {
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  int current_changed = 0;
+  ssize_t len;
+
+  while((len = read(Cache.inotify_fd, buf, sizeof(buf))) > 0) {
+    const struct inotify_event *ev;
+    for(char *p = buf; p < buf + len; p += sizeof(struct inotify_event) + ev->len) {
+      ev = (const struct inotify_event *)p;
+
+      if(ev->mask & IN_Q_OVERFLOW) {
+        for(int i = 0; i < Cache.count; i++) unwatch_cached_dir(&Cache.dirs[i]);
+        current_changed = 1;
         continue;
       }
+
+      CachedDir *dir = find_cached_dir_by_wd(ev->wd);
+      if(!dir) continue;
+
+      if(ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+        unwatch_cached_dir(dir);
+      }
+      else if(ev->len == 0) {
+        continue;
+      }
+      else if(ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+        insert_cached_entry(dir, ev->name);
+      }
+      else if(ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+        remove_cached_entry(dir, ev->name);
+      }
+
+      if(strcmp(dir->path, Browser.current_path) == 0) current_changed = 1;
     }
-  } 
+  }
+
+  return current_changed;
+}
+
+void free_dir_cache() {
+  while(Cache.count > 0) drop_cached_dir(&Cache.dirs[0]);
+  if(Cache.inotify_fd >= 0) {
+    event_unwatch_fd(Cache.inotify_fd);
+    close(Cache.inotify_fd);
+    Cache.inotify_fd = -1;
+  }
 }
 
+// ===============================
+// File Browser
+// ===============================
+
 void select_entry(int direction) {
   int max_size = Browser.count > Win.height ? Browser.count - 3 : Browser.count - 1;
   Browser.selected = clamp(Browser.selected + direction, 0, max_size);
@@ -145,30 +380,55 @@ void select_entry(int direction) {
   if(Browser.selected < Win.scroll_y) Win.scroll_y--;
 }
 
+// Points the browser at the cached listing of its current path
+void sync_browser_entries() {
+  CachedDir *dir = get_cached_dir(Browser.current_path);
+  Browser.entries = dir ? dir->entries : NULL;
+  Browser.count = dir ? dir->count : 0;
+  Browser.selected = clamp(Browser.selected, 0, Browser.count - 1);
+  if(Win.scroll_y > Browser.selected) Win.scroll_y = Browser.selected;
+}
+
 void init_file_browser(char *current_dir) {
-  char path[128];
+  char path[PATH_LEN];
   if(current_dir != NULL) {
-    strcpy(Browser.current_path, current_dir);
+    if(realpath(current_dir, path) == NULL) {
+      perror("realpath() error");
+      return;
+    }
   }
   else {
     if(getcwd(path, sizeof(path)) == NULL) {
       perror("getcwd() error");
       return;
     }
-    strcpy(Browser.current_path, path);
   }
+  strcpy(Browser.current_path, path);
 
-  Browser.entries = load_all_entries(Browser.current_path, &Browser.count);
   Browser.selected = 0;
   Browser.sort_mode = DEFAULT_SORT;
+  Browser.active = 1;
+  Win.scroll_y = 0;
+  sync_browser_entries();
 }
 
+// The listing itself is owned by the directory cache
 void free_file_browser() {
-  for(int i = 0; i < Browser.count; i++) {
-    free(Browser.entries[i].name);
-    free(Browser.entries[i].full_path);
+  Browser.entries = NULL;
+  Browser.count = 0;
+  Browser.active = 0;
+}
+
+// Cached listings stay fresh while a file is being edited; the screen is
+// only redrawn while browsing
+void on_dir_events(int fd, short revents, void *data) {
+  (void)fd;
+  (void)revents;
+  (void)data;
+  if(process_dir_events() && Browser.active) {
+    sync_browser_entries();
+    draw_browser();
   }
-  free(Browser.entries);
 }
 
 void draw_browser() {
@@ -176,6 +436,7 @@ void draw_browser() {
   dprintf(STDOUT_FILENO, "\033[%d;1H\033[2K", 1);
 
   int end_point = Browser.count <= Win.height ? Browser.count : Win.height + Win.scroll_y - 2;
+  if(end_point > Browser.count) end_point = Browser.count;
   if(strlen(Browser.current_path) > Win.width) {
     char *temp_name = malloc(sizeof(char)*(Win.width));
     if(!temp_name) {
@@ -244,17 +505,34 @@ void open_entry(FileEntry entry) {
   }
 }
 
+void browser_open_selected() {
+  if(Browser.count > 0) open_entry(Browser.entries[Browser.selected]);
+}
+
+void browser_next() {
+  select_entry(1);
+  draw_browser();
+}
+
+void browser_prev() {
+  select_entry(-1);
+  draw_browser();
+}
+
+const KeyBinding BrowserBindings[] = {
+  { "q", end_browsing },
+  { "\n", browser_open_selected },
+  { "j", browser_next },
+  { "k", browser_prev },
+};
+
+void init_browser_keys() {
+  keymap_init(KEYMAP_BROWSER, NULL, KEY_SEQUENCE_TIMEOUT_MS, 0);
+  keymap_bind_table(KEYMAP_BROWSER, BrowserBindings, sizeof(BrowserBindings) / sizeof(BrowserBindings[0]));
+}
+
 void handle_browser_input(char c) {
-  switch (c) {
-    case 'q': end_browsing(); break;
-    case KEY_ENTER: {
-      open_entry(Browser.entries[Browser.selected]); 
-      free_file_browser();
-      break;
-    }
-    case 'j': select_entry(1); draw_browser(); break;
-    case 'k': select_entry(-1); draw_browser(); break;
-  } 
+  keymap_feed(KEYMAP_BROWSER, c);
 }
 
 void start_browsing(int width, int height) {
@@ -262,11 +540,19 @@ void start_browsing(int width, int height) {
   Win.height = height;
   Win.scroll_y = 0;
   init_file_browser(NULL);
-  sort_entries(Browser.entries, Browser.count);
+  draw_browser();
+}
+
+// Keeps the selection on screen after the terminal changed size
+void resize_browser() {
+  int rows = Win.height - 2;
+  if(Browser.selected - Win.scroll_y >= rows) Win.scroll_y = Browser.selected - rows + 1;
+  if(Win.scroll_y < 0) Win.scroll_y = 0;
   draw_browser();
 }
 
 void end_browsing() {
   free_file_browser(); 
+  free_dir_cache();
   cmd_quit();
 }
@@ -0,0 +1,324 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#include "atom.h"
+
+// :{range}!cmd pipes lines through a shell command. The child's stdin,
+// stdout and stderr are pipes whose ends here are non-blocking and
+// watched by the event loop: lines are written straight from the document
+// whenever stdin has room, and output is cut into lines as it arrives, so
+// neither side can fill up and stall the other and keys are handled while
+// the command runs. The editor collects the output lines and swaps them in
+// for the range in one edit once the command exits with status 0.
+
+#define FILTER_CHUNK_SIZE (64 << 10)
+#define FILTER_MAX_IOV 512
+#define FILTER_MAX_READS 16
+#define FILTER_ERROR_SIZE 128
+
+void event_watch_fd(int fd, short events, EventFdCallback callback, void *data);
+void event_unwatch_fd(int fd);
+void event_on_signal(int signo, EventCallback callback);
+void event_restore_signals();
+
+const char *document_line_text(int y, int *len);
+void filter_output_line(const char *text, int len);
+void filter_finished(int status, const char *error);
+
+// ===============================
+// DATA STRUCTURES
+// ===============================
+
+typedef struct {
+  int active;
+  pid_t pid;
+  int exited;
+  int status;
+
+  int in_fd;
+  int out_fd;
+  int err_fd;
+
+  // Next byte to write: line, and offset into it, where offset == length
+  // means only its newline is left
+  int line;
+  int end_line;
+  int offset;
+
+  char *chunk;
+  // Output line still waiting for its newline
+  char *partial;
+  int partial_len;
+  int partial_capacity;
+
+  char error[FILTER_ERROR_SIZE];
+  int error_len;
+} Filter;
+
+// ===============================
+// GLOBAL
+// ===============================
+
+Filter Filt = { .in_fd = -1, .out_fd = -1, .err_fd = -1 };
+
+// ===============================
+// HELPERS
+// ===============================
+
+void close_filter_fd(int *fd) {
+  if(*fd < 0) return;
+  event_unwatch_fd(*fd);
+  close(*fd);
+  *fd = -1;
+}
+
+void filter_cleanup() {
+  close_filter_fd(&Filt.in_fd);
+  close_filter_fd(&Filt.out_fd);
+  close_filter_fd(&Filt.err_fd);
+  free(Filt.chunk);
+  Filt.chunk = NULL;
+  free(Filt.partial);
+  Filt.partial = NULL;
+  Filt.partial_len = 0;
+  Filt.partial_capacity = 0;
+  Filt.active = 0;
+}
+
+// Reports once the command has exited and both its outputs are drained
+void filter_maybe_finish() {
+  if(!Filt.active || !Filt.exited || Filt.out_fd >= 0 || Filt.err_fd >= 0) return;
+
+  if(Filt.partial_len > 0) filter_output_line(Filt.partial, Filt.partial_len);
+  int status = WIFEXITED(Filt.status) ? WEXITSTATUS(Filt.status) : 128 + WTERMSIG(Filt.status);
+  char error[FILTER_ERROR_SIZE];
+  int len = strcspn(Filt.error, "\n");
+  snprintf(error, sizeof(error), "%.*s", len, Filt.error);
+
+  filter_cleanup();
+  filter_finished(status, error);
+}
+
+void partial_append(const char *text, int len) {
+  if(Filt.partial_len + len > Filt.partial_capacity) {
+    int capacity = Filt.partial_capacity ? Filt.partial_capacity : 256;
+    while(capacity < Filt.partial_len + len) capacity *= 2;
+    char *tmp = realloc(Filt.partial, capacity);
+    if(!tmp) {
+      perror("Malloc failled");
+      exit(EXIT_FAILURE);
+    }
+    Filt.partial = tmp;
+    Filt.partial_capacity = capacity;
+  }
+  memcpy(Filt.partial + Filt.partial_len, text, len);
+  Filt.partial_len += len;
+}
+
+void split_output(const char *p, size_t len) {
+  const char *end = p + len;
+  const char *nl;
+  while((nl = memchr(p, '\n', end - p)) != NULL) {
+    if(Filt.partial_len > 0) {
+      partial_append(p, nl - p);
+      filter_output_line(Filt.partial, Filt.partial_len);
+      Filt.partial_len = 0;
+    }
+    else {
+      filter_output_line(p, nl - p);
+    }
+    p = nl + 1;
+  }
+  if(p < end) partial_append(p, end - p);
+}
+
+// ===============================
+// EVENT HANDLERS
+// ===============================
+
+// Writes as much of the range as the pipe takes, straight from the lines
+void on_filter_writable(int fd, short revents, void *data) {
+  (void)data;
+  if(revents & (POLLERR | POLLHUP)) {
+    // The command stopped reading, which is its business
+    close_filter_fd(&Filt.in_fd);
+    return;
+  }
+
+  while(Filt.line < Filt.end_line) {
+    struct iovec iov[FILTER_MAX_IOV];
+    int n = 0;
+    for(int y = Filt.line; y < Filt.end_line && n + 2 <= FILTER_MAX_IOV; y++) {
+      int len;
+      const char *text = document_line_text(y, &len);
+      int from = y == Filt.line ? Filt.offset : 0;
+      if(from < len) iov[n++] = (struct iovec){ .iov_base = (char *)text + from, .iov_len = len - from };
+      iov[n++] = (struct iovec){ .iov_base = "\n", .iov_len = 1 };
+    }
+
+    ssize_t written = writev(fd, iov, n);
+    if(written < 0) {
+      if(errno == EINTR) continue;
+      if(errno == EAGAIN) return;
+      close_filter_fd(&Filt.in_fd);
+      return;
+    }
+
+    // Advance past what went out
+    while(written > 0) {
+      int len;
+      document_line_text(Filt.line, &len);
+      size_t left = len - Filt.offset + 1;
+      if((size_t)written < left) {
+        Filt.offset += written;
+        break;
+      }
+      written -= left;
+      Filt.line++;
+      Filt.offset = 0;
+    }
+  }
+  close_filter_fd(&Filt.in_fd);
+}
+
+void on_filter_output(int fd, short revents, void *data) {
+  (void)revents;
+  (void)data;
+  for(int i = 0; i < FILTER_MAX_READS; i++) {
+    ssize_t n = read(fd, Filt.chunk, FILTER_CHUNK_SIZE);
+    if(n < 0) {
+      if(errno == EINTR) continue;
+      if(errno == EAGAIN) return;
+      n = 0;
+    }
+    if(n == 0) {
+      close_filter_fd(&Filt.out_fd);
+      filter_maybe_finish();
+      return;
+    }
+    split_output(Filt.chunk, n);
+  }
+}
+
+// Keeps the start of stderr for the status bar and drops the rest
+void on_filter_error(int fd, short revents, void *data) {
+  (void)revents;
+  (void)data;
+  char buf[4096];
+  ssize_t n;
+  while((n = read(fd, buf, sizeof(buf))) != 0) {
+    if(n < 0) {
+      if(errno == EINTR) continue;
+      if(errno == EAGAIN) return;
+      break;
+    }
+    int room = FILTER_ERROR_SIZE - 1 - Filt.error_len;
+    if(room > 0) {
+      if(n < room) room = n;
+      memcpy(Filt.error + Filt.error_len, buf, room);
+      Filt.error_len += room;
+    }
+  }
+  close_filter_fd(&Filt.err_fd);
+  filter_maybe_finish();
+}
+
+void on_child_exit(void *data) {
+  (void)data;
+  if(!Filt.active || Filt.exited) return;
+  if(waitpid(Filt.pid, &Filt.status, WNOHANG) != Filt.pid) return;
+  Filt.exited = 1;
+  filter_maybe_finish();
+}
+
+// ===============================
+// FILTER API
+// ===============================
+
+// Must run before any thread starts, or SIGCHLD can land on a thread that
+// does not block it and never reach the loop
+void init_filters() {
+  // A command that exits early must not take the editor with it
+  signal(SIGPIPE, SIG_IGN);
+  event_on_signal(SIGCHLD, on_child_exit);
+}
+
+// Runs command through sh with lines [from, from + count) as its input.
+// Returns 0 when the command could not be started.
+int filter_start(const char *command, int from, int count) {
+  if(Filt.active) return 0;
+
+  int in[2], out[2], err[2];
+  if(pipe2(in, O_CLOEXEC) < 0) return 0;
+  if(pipe2(out, O_CLOEXEC) < 0) {
+    close(in[0]);
+    close(in[1]);
+    return 0;
+  }
+  if(pipe2(err, O_CLOEXEC) < 0) {
+    close(in[0]);
+    close(in[1]);
+    close(out[0]);
+    close(out[1]);
+    return 0;
+  }
+
+  pid_t pid = fork();
+  if(pid == 0) {
+    dup2(in[0], STDIN_FILENO);
+    dup2(out[1], STDOUT_FILENO);
+    dup2(err[1], STDERR_FILENO);
+    signal(SIGPIPE, SIG_DFL);
+    event_restore_signals();
+    execl("/bin/sh", "sh", "-c", command, (char *)NULL);
+    _exit(127);
+  }
+  close(in[0]);
+  close(out[1]);
+  close(err[1]);
+  if(pid < 0) {
+    close(in[1]);
+    close(out[0]);
+    close(err[0]);
+    return 0;
+  }
+
+  Filt = (Filter){
+    .active = 1, .pid = pid,
+    .in_fd = in[1], .out_fd = out[0], .err_fd = err[0],
+    .line = from, .end_line = from + count,
+  };
+  Filt.chunk = malloc(FILTER_CHUNK_SIZE);
+  if(!Filt.chunk) {
+    perror("Malloc failled");
+    exit(EXIT_FAILURE);
+  }
+  fcntl(Filt.in_fd, F_SETFL, O_NONBLOCK);
+  fcntl(Filt.out_fd, F_SETFL, O_NONBLOCK);
+  fcntl(Filt.err_fd, F_SETFL, O_NONBLOCK);
+  event_watch_fd(Filt.in_fd, POLLOUT, on_filter_writable, NULL);
+  event_watch_fd(Filt.out_fd, POLLIN, on_filter_output, NULL);
+  event_watch_fd(Filt.err_fd, POLLIN, on_filter_error, NULL);
+  return 1;
+}
+
+int filter_active() {
+  return Filt.active;
+}
+
+// Kills the command; nothing is reported
+void filter_cancel() {
+  if(!Filt.active) return;
+  kill(Filt.pid, SIGKILL);
+  if(!Filt.exited) waitpid(Filt.pid, NULL, 0);
+  filter_cleanup();
+}
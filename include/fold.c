@@ -0,0 +1,722 @@
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Folds of a buffer live in two treaps over one pool of nodes. The first
+// holds every fold, ordered by first line with outer folds before inner
+// ones that start on the same line, and knows the furthest last line in
+// each subtree, which makes it an interval tree: the folds around a line
+// are found without visiting the ones that end above it. The second holds
+// the spans of hidden lines: the closed folds that no other closed fold
+// encloses. Spans never overlap and each subtree knows how many lines its
+// spans hide, so the screen row of a line and the line on a row are one
+// walk down it. Moving, scrolling and drawing cost O(log n) however many
+// folds there are and however many lines they hide.
+//
+// An edit moves every fold below it. Both trees are split around the
+// edited lines, the part below gets a lazy shift and only the folds that
+// start or end inside the edit are taken out, adjusted and put back.
+//
+// Folds cross no other fold: two folds are either nested or apart.
+
+#define FOLD_FIRST_NODES 64
+#define FOLD_TAB_WIDTH 8
+
+const char *document_line_text(int y, int *len);
+int document_line_count();
+
+// ===============================
+// DATA STRUCTURES
+// ===============================
+
+typedef struct {
+  int start;
+  int end;
+  int closed;
+  unsigned priority;
+  int child[2];
+  // Over the subtree: furthest end, and lines hidden when its nodes are
+  // spans
+  int max_end;
+  int hidden;
+  // Still to be added to the lines of the children
+  int shift;
+} FoldNode;
+
+typedef struct FoldSet {
+  // Node 0 is the empty tree
+  FoldNode *nodes;
+  int node_count;
+  int node_capacity;
+  int free_node;
+  unsigned seed;
+
+  int folds;
+  int spans;
+
+  // Nodes taken out of a tree while it is reshaped
+  int *pending;
+  int pending_count;
+  int pending_capacity;
+} FoldSet;
+
+// ===============================
+// TREAP
+// ===============================
+
+int fold_new_node(FoldSet *s, int start, int end, int closed) {
+  int i = s->free_node;
+  if(i) {
+    s->free_node = s->nodes[i].child[0];
+  }
+  else {
+    if(s->node_count == s->node_capacity) {
+      int capacity = s->node_capacity * 2;
+      FoldNode *tmp = realloc(s->nodes, capacity * sizeof(FoldNode));
+      if(!tmp) {
+        perror("Malloc failled");
+        exit(EXIT_FAILURE);
+      }
+      s->nodes = tmp;
+      s->node_capacity = capacity;
+    }
+    i = s->node_count++;
+  }
+  s->seed ^= s->seed << 13;
+  s->seed ^= s->seed >> 17;
+  s->seed ^= s->seed << 5;
+  s->nodes[i] = (FoldNode){
+    .start = start, .end = end, .closed = closed, .priority = s->seed,
+    .max_end = end, .hidden = end - start,
+  };
+  return i;
+}
+
+void fold_free_node(FoldSet *s, int i) {
+  s->nodes[i].child[0] = s->free_node;
+  s->free_node = i;
+}
+
+void fold_free_tree(FoldSet *s, int t) {
+  if(!t) return;
+  fold_free_tree(s, s->nodes[t].child[0]);
+  fold_free_tree(s, s->nodes[t].child[1]);
+  fold_free_node(s, t);
+}
+
+void fold_pending_add(FoldSet *s, int i) {
+  if(s->pending_count == s->pending_capacity) {
+    int capacity = s->pending_capacity ? s->pending_capacity * 2 : 64;
+    int *tmp = realloc(s->pending, capacity * sizeof(int));
+    if(!tmp) {
+      perror("Malloc failled");
+      exit(EXIT_FAILURE);
+    }
+    s->pending = tmp;
+    s->pending_capacity = capacity;
+  }
+  s->pending[s->pending_count++] = i;
+}
+
+void fold_tag(FoldSet *s, int t, int shift) {
+  if(!t || !shift) return;
+  FoldNode *n = &s->nodes[t];
+  n->start += shift;
+  n->end += shift;
+  n->max_end += shift;
+  n->shift += shift;
+}
+
+void fold_push(FoldSet *s, int t) {
+  FoldNode *n = &s->nodes[t];
+  if(!n->shift) return;
+  fold_tag(s, n->child[0], n->shift);
+  fold_tag(s, n->child[1], n->shift);
+  n->shift = 0;
+}
+
+void fold_pull(FoldSet *s, int t) {
+  FoldNode *n = &s->nodes[t];
+  const FoldNode *l = &s->nodes[n->child[0]], *r = &s->nodes[n->child[1]];
+  n->max_end = n->end;
+  if(l->max_end > n->max_end) n->max_end = l->max_end;
+  if(r->max_end > n->max_end) n->max_end = r->max_end;
+  n->hidden = n->end - n->start + l->hidden + r->hidden;
+}
+
+// Tree order: by first line, the longer fold first
+int fold_before(int start, int end, int other_start, int other_end) {
+  return start < other_start || (start == other_start && end > other_end);
+}
+
+// Nodes ordered before (start, end) go to *left, the others to *right
+void fold_split(FoldSet *s, int t, int start, int end, int *left, int *right) {
+  if(!t) {
+    *left = 0;
+    *right = 0;
+    return;
+  }
+  fold_push(s, t);
+  FoldNode *n = &s->nodes[t];
+  if(fold_before(n->start, n->end, start, end)) {
+    fold_split(s, n->child[1], start, end, &n->child[1], right);
+    *left = t;
+  }
+  else {
+    fold_split(s, n->child[0], start, end, left, &n->child[0]);
+    *right = t;
+  }
+  fold_pull(s, t);
+}
+
+// Joins two trees, every node of a ordered before those of b
+int fold_merge(FoldSet *s, int a, int b) {
+  if(!a) return b;
+  if(!b) return a;
+  if(s->nodes[a].priority > s->nodes[b].priority) {
+    fold_push(s, a);
+    int right = fold_merge(s, s->nodes[a].child[1], b);
+    s->nodes[a].child[1] = right;
+    fold_pull(s, a);
+    return a;
+  }
+  fold_push(s, b);
+  int left = fold_merge(s, a, s->nodes[b].child[0]);
+  s->nodes[b].child[0] = left;
+  fold_pull(s, b);
+  return b;
+}
+
+int fold_insert(FoldSet *s, int t, int i) {
+  FoldNode *n = &s->nodes[i];
+  n->child[0] = 0;
+  n->child[1] = 0;
+  n->shift = 0;
+  fold_pull(s, i);
+  int left, right;
+  fold_split(s, t, n->start, n->end, &left, &right);
+  return fold_merge(s, fold_merge(s, left, i), right);
+}
+
+int fold_lookup(FoldSet *s, int t, int start, int end) {
+  while(t) {
+    fold_push(s, t);
+    FoldNode *n = &s->nodes[t];
+    if(n->start == start && n->end == end) return t;
+    t = n->child[fold_before(n->start, n->end, start, end) ? 1 : 0];
+  }
+  return 0;
+}
+
+// Drops the node for [start, end] from t; returns the new root
+int fold_remove(FoldSet *s, int t, int start, int end) {
+  int left, middle, right;
+  fold_split(s, t, start, end, &left, &right);
+  fold_split(s, right, start, end - 1, &middle, &right);
+  fold_free_tree(s, middle);
+  return fold_merge(s, left, right);
+}
+
+// ===============================
+// QUERIES
+// ===============================
+
+// The last fold in tree order that holds lines [a, b], which is the
+// innermost one. Closed folds are passed over when open_only is set.
+int fold_find(FoldSet *s, int t, int a, int b, int open_only) {
+  if(!t || s->nodes[t].max_end < b) return 0;
+  fold_push(s, t);
+  FoldNode *n = &s->nodes[t];
+  if(n->start <= a) {
+    int found = fold_find(s, n->child[1], a, b, open_only);
+    if(found) return found;
+    if(n->end >= b && !(open_only && n->closed)) return t;
+  }
+  return fold_find(s, n->child[0], a, b, open_only);
+}
+
+// Whether a fold overlaps [a, b] without one of the two holding the other
+int fold_crosses(FoldSet *s, int t, int a, int b) {
+  if(!t || s->nodes[t].max_end < a) return 0;
+  fold_push(s, t);
+  FoldNode *n = &s->nodes[t];
+  if((n->start < a && n->end >= a && n->end < b) || (n->start > a && n->start <= b && n->end > b)) return 1;
+  if(fold_crosses(s, n->child[0], a, b)) return 1;
+  return n->start <= b && fold_crosses(s, n->child[1], a, b);
+}
+
+// Adds to pending the closed folds within [a, b] that no other closed fold
+// there holds, in order. *last_end is the end of the last one added.
+void fold_collect_closed(FoldSet *s, int t, int a, int b, int *last_end) {
+  if(!t || s->nodes[t].max_end < a) return;
+  fold_push(s, t);
+  FoldNode *n = &s->nodes[t];
+  fold_collect_closed(s, n->child[0], a, b, last_end);
+  if(n->start >= a && n->end <= b && n->closed && n->start > *last_end) {
+    fold_pending_add(s, t);
+    *last_end = n->end;
+  }
+  if(n->start <= b) fold_collect_closed(s, n->child[1], a, b, last_end);
+}
+
+void fold_set_closed(FoldSet *s, int t, int closed) {
+  if(!t) return;
+  s->nodes[t].closed = closed;
+  fold_set_closed(s, s->nodes[t].child[0], closed);
+  fold_set_closed(s, s->nodes[t].child[1], closed);
+}
+
+// The span that hides line y or starts on it, 0 when there is none
+int fold_span_at(FoldSet *s, int y) {
+  int t = s->spans, found = 0;
+  while(t) {
+    fold_push(s, t);
+    FoldNode *n = &s->nodes[t];
+    if(n->start <= y) {
+      found = t;
+      t = n->child[1];
+    }
+    else {
+      t = n->child[0];
+    }
+  }
+  return found && s->nodes[found].end >= y ? found : 0;
+}
+
+// ===============================
+// SPANS
+// ===============================
+
+// Closed folds within [a, b] that no closed fold holds become spans
+void fold_respan(FoldSet *s, int a, int b) {
+  int last_end = INT_MIN;
+  s->pending_count = 0;
+  fold_collect_closed(s, s->folds, a, b, &last_end);
+  for(int k = 0; k < s->pending_count; k++) {
+    const FoldNode *f = &s->nodes[s->pending[k]];
+    int span = fold_new_node(s, f->start, f->end, 1);
+    s->spans = fold_insert(s, s->spans, span);
+  }
+  s->pending_count = 0;
+}
+
+// Lines (start, end] are hidden, replacing the spans inside them
+void fold_hide(FoldSet *s, int start, int end) {
+  int left, middle, right;
+  fold_split(s, s->spans, start, INT_MAX, &left, &right);
+  fold_split(s, right, end + 1, INT_MAX, &middle, &right);
+  fold_free_tree(s, middle);
+  s->spans = fold_merge(s, left, right);
+  s->spans = fold_insert(s, s->spans, fold_new_node(s, start, end, 1));
+}
+
+// ===============================
+// EDITS
+// ===============================
+
+// Where a fold's first line goes when [y, y + removed) became added lines
+int fold_map_start(int v, int y, int removed, int added) {
+  if(v <= y) return v;
+  if(v < y + removed) return y + added;
+  return v + added - removed;
+}
+
+// Where its last line goes. One that was in the middle of the replaced
+// lines ends above them.
+int fold_map_end(int v, int y, int removed, int added) {
+  if(v < y) return v;
+  if(v < y + removed - 1) return y - 1;
+  if(v == y + removed - 1) return y + added - 1;
+  return v + added - removed;
+}
+
+// Takes the nodes of t that end on line y or below into pending
+int fold_extract(FoldSet *s, int t, int y) {
+  if(!t || s->nodes[t].max_end < y) return t;
+  fold_push(s, t);
+  FoldNode *n = &s->nodes[t];
+  n->child[0] = fold_extract(s, n->child[0], y);
+  n->child[1] = fold_extract(s, n->child[1], y);
+  if(n->end < y) {
+    fold_pull(s, t);
+    return t;
+  }
+  fold_pending_add(s, t);
+  return fold_merge(s, n->child[0], n->child[1]);
+}
+
+void fold_extract_all(FoldSet *s, int t) {
+  if(!t) return;
+  fold_push(s, t);
+  fold_extract_all(s, s->nodes[t].child[0]);
+  fold_pending_add(s, t);
+  fold_extract_all(s, s->nodes[t].child[1]);
+}
+
+int fold_edit_tree(FoldSet *s, int t, int y, int removed, int added) {
+  int left, middle, right;
+  fold_split(s, t, y, INT_MAX, &left, &right);
+  fold_split(s, right, y + removed, INT_MAX, &middle, &right);
+  fold_tag(s, right, added - removed);
+
+  s->pending_count = 0;
+  left = fold_extract(s, left, y);
+  fold_extract_all(s, middle);
+  t = fold_merge(s, left, right);
+
+  for(int k = 0; k < s->pending_count; k++) {
+    int i = s->pending[k];
+    FoldNode *n = &s->nodes[i];
+    int start = fold_map_start(n->start, y, removed, added);
+    int end = fold_map_end(n->end, y, removed, added);
+    // Nothing left to fold, or a copy of a fold already put back
+    int same = end > start ? fold_lookup(s, t, start, end) : 0;
+    if(end <= start || same) {
+      if(same) s->nodes[same].closed |= n->closed;
+      fold_free_node(s, i);
+      continue;
+    }
+    n->start = start;
+    n->end = end;
+    t = fold_insert(s, t, i);
+  }
+  s->pending_count = 0;
+  return t;
+}
+
+// ===============================
+// BLOCKS
+// ===============================
+
+// Follows the braces of a line outside strings, character constants and
+// comments. *comment carries a block comment over to the next line. With
+// stop set, returns 1 as soon as *depth falls back to zero.
+int fold_scan_braces(const char *t, int len, int *depth, int *comment, int stop) {
+  for(int i = 0; i < len; i++) {
+    char c = t[i];
+    if(*comment) {
+      if(c == '*' && i + 1 < len && t[i + 1] == '/') {
+        *comment = 0;
+        i++;
+      }
+      continue;
+    }
+    if(c == '/' && i + 1 < len && t[i + 1] == '/') break;
+    if(c == '/' && i + 1 < len && t[i + 1] == '*') {
+      *comment = 1;
+      i++;
+    }
+    else if(c == '"' || c == '\'') {
+      for(i++; i < len && t[i] != c; i++) {
+        if(t[i] == '\\') i++;
+      }
+    }
+    else if(c == '{') {
+      (*depth)++;
+    }
+    else if(c == '}' && *depth > 0) {
+      if(--*depth == 0 && stop) return 1;
+    }
+  }
+  return 0;
+}
+
+// Column of the first character of line y, -1 when it is blank
+int fold_indent(int y) {
+  int len;
+  const char *t = document_line_text(y, &len);
+  int column = 0;
+  for(int i = 0; i < len; i++) {
+    if(t[i] == ' ') column++;
+    else if(t[i] == '\t') column += FOLD_TAB_WIDTH - column % FOLD_TAB_WIDTH;
+    else return column;
+  }
+  return -1;
+}
+
+// ===============================
+// FOLD API
+// ===============================
+
+FoldSet *fold_set_create() {
+  FoldSet *s = calloc(1, sizeof(FoldSet));
+  if(s) s->nodes = malloc(FOLD_FIRST_NODES * sizeof(FoldNode));
+  if(!s || !s->nodes) {
+    perror("Malloc failled");
+    exit(EXIT_FAILURE);
+  }
+  s->node_capacity = FOLD_FIRST_NODES;
+  s->node_count = 1;
+  s->nodes[0] = (FoldNode){ .max_end = INT_MIN };
+  s->seed = 2463534242u;
+  return s;
+}
+
+void fold_set_destroy(FoldSet *s) {
+  if(!s) return;
+  free(s->nodes);
+  free(s->pending);
+  free(s);
+}
+
+// Lines [y, y + removed) were replaced by added lines. Folds below move
+// with them; a fold whose lines are all gone goes too.
+void fold_note_edit(FoldSet *s, int y, int removed, int added) {
+  if(!s || !s->folds || removed == added) return;
+  s->folds = fold_edit_tree(s, s->folds, y, removed, added);
+  s->spans = fold_edit_tree(s, s->spans, y, removed, added);
+}
+
+// First line of the closed fold that hides y, else y
+int fold_span_start(FoldSet *s, int y) {
+  if(!s || !s->spans) return y;
+  int span = fold_span_at(s, y);
+  return span ? s->nodes[span].start : y;
+}
+
+// Last line of the closed fold shown on y's row, else y
+int fold_span_end(FoldSet *s, int y) {
+  if(!s || !s->spans) return y;
+  int span = fold_span_at(s, y);
+  return span ? s->nodes[span].end : y;
+}
+
+// The row of line y counting only lines that show
+int fold_visible_index(FoldSet *s, int y) {
+  if(!s || !s->spans) return y;
+  y = fold_span_start(s, y);
+  int hidden = 0, t = s->spans;
+  while(t) {
+    fold_push(s, t);
+    FoldNode *n = &s->nodes[t];
+    if(n->start < y) {
+      hidden += s->nodes[n->child[0]].hidden + n->end - n->start;
+      t = n->child[1];
+    }
+    else {
+      t = n->child[0];
+    }
+  }
+  return y - hidden;
+}
+
+// The line shown on row v counting only lines that show
+int fold_line_at(FoldSet *s, int v) {
+  if(!s || !s->spans) return v;
+  int hidden = 0, t = s->spans;
+  while(t) {
+    fold_push(s, t);
+    FoldNode *n = &s->nodes[t];
+    int before = hidden + s->nodes[n->child[0]].hidden;
+    if(n->start - before < v) {
+      hidden = before + n->end - n->start;
+      t = n->child[1];
+    }
+    else {
+      t = n->child[0];
+    }
+  }
+  return v + hidden;
+}
+
+// Adds a closed fold over [start, end], or closes the one that is there.
+// Returns 0 when it would cross a fold.
+int fold_add(FoldSet *s, int start, int end) {
+  if(end <= start || fold_crosses(s, s->folds, start, end)) return 0;
+  int f = fold_lookup(s, s->folds, start, end);
+  if(f) s->nodes[f].closed = 1;
+  else s->folds = fold_insert(s, s->folds, fold_new_node(s, start, end, 1));
+  // A closed fold around it hides it already
+  int span = fold_span_at(s, start);
+  if(!span || s->nodes[span].end < end) fold_hide(s, start, end);
+  return 1;
+}
+
+// Opens the closed fold shown on line y; the closed folds inside it show
+// closed. Returns 0 when y is not on one.
+int fold_open(FoldSet *s, int y) {
+  int span = s && s->spans ? fold_span_at(s, y) : 0;
+  if(!span) return 0;
+  int start = s->nodes[span].start, end = s->nodes[span].end;
+  s->spans = fold_remove(s, s->spans, start, end);
+  int f = fold_lookup(s, s->folds, start, end);
+  if(f) s->nodes[f].closed = 0;
+  fold_respan(s, start, end);
+  return 1;
+}
+
+// Closes the innermost open fold around what line y shows. Returns 0
+// when there is none.
+int fold_close(FoldSet *s, int y) {
+  if(!s) return 0;
+  int f = fold_find(s, s->folds, fold_span_start(s, y), fold_span_end(s, y), 1);
+  if(!f) return 0;
+  s->nodes[f].closed = 1;
+  fold_hide(s, s->nodes[f].start, s->nodes[f].end);
+  return 1;
+}
+
+// Deletes the closed fold shown on line y, else the innermost fold around
+// y. The folds inside it stay.
+int fold_delete(FoldSet *s, int y) {
+  if(!s) return 0;
+  int span = s->spans ? fold_span_at(s, y) : 0;
+  int f = span ? fold_lookup(s, s->folds, s->nodes[span].start, s->nodes[span].end)
+               : fold_find(s, s->folds, y, y, 0);
+  if(!f) return 0;
+  int start = s->nodes[f].start, end = s->nodes[f].end;
+  s->folds = fold_remove(s, s->folds, start, end);
+  if(span) {
+    s->spans = fold_remove(s, s->spans, start, end);
+    fold_respan(s, start, end);
+  }
+  return 1;
+}
+
+void fold_open_all(FoldSet *s) {
+  if(!s) return;
+  fold_set_closed(s, s->folds, 0);
+  fold_free_tree(s, s->spans);
+  s->spans = 0;
+}
+
+void fold_close_all(FoldSet *s) {
+  if(!s) return;
+  fold_set_closed(s, s->folds, 1);
+  fold_free_tree(s, s->spans);
+  s->spans = 0;
+  fold_respan(s, INT_MIN, INT_MAX);
+}
+
+// Last of the lines below y indented deeper than it, y when there are
+// none
+int fold_indent_end(int y) {
+  int indent = fold_indent(y);
+  if(indent < 0) return y;
+  int lines = document_line_count();
+  int end = y;
+  for(int k = y + 1; k < lines; k++) {
+    int i = fold_indent(k);
+    if(i < 0) continue;
+    if(i <= indent) break;
+    end = k;
+  }
+  return end;
+}
+
+// Last line of the block that starts on line y: the line with the brace
+// that closes the one left open on y, or on the line after it when that
+// line starts with one. Lines without braces take the lines below that
+// are indented deeper. y when no block starts there.
+int fold_block_end(int y) {
+  int lines = document_line_count();
+  int len, depth = 0, comment = 0;
+  const char *t = document_line_text(y, &len);
+  fold_scan_braces(t, len, &depth, &comment, 0);
+  int from = y + 1;
+  if(depth == 0 && !comment && y + 1 < lines) {
+    t = document_line_text(y + 1, &len);
+    int i = 0;
+    while(i < len && (t[i] == ' ' || t[i] == '\t')) i++;
+    if(i < len && t[i] == '{') {
+      fold_scan_braces(t, len, &depth, &comment, 0);
+      from = y + 2;
+    }
+  }
+  if(depth > 0) {
+    for(int k = from; k < lines; k++) {
+      t = document_line_text(k, &len);
+      if(fold_scan_braces(t, len, &depth, &comment, 1)) return k;
+    }
+    return y;
+  }
+
+  return fold_indent_end(y);
+}
+
+// One pass over the document with a stack of open braces. close[y] is the
+// line that closes the first brace line y leaves open, y when nothing
+// does and -1 when it leaves none open; comment[y] is set when line y
+// ends inside a comment.
+void fold_scan_blocks(int lines, int *close, char *comment) {
+  int *stack = NULL, depth = 0, capacity = 0, in_comment = 0;
+  for(int y = 0; y < lines; y++) {
+    close[y] = -1;
+    int len;
+    const char *t = document_line_text(y, &len);
+    for(int i = 0; i < len; i++) {
+      char c = t[i];
+      if(in_comment) {
+        if(c == '*' && i + 1 < len && t[i + 1] == '/') {
+          in_comment = 0;
+          i++;
+        }
+        continue;
+      }
+      if(c == '/' && i + 1 < len && t[i + 1] == '/') break;
+      if(c == '/' && i + 1 < len && t[i + 1] == '*') {
+        in_comment = 1;
+        i++;
+      }
+      else if(c == '"' || c == '\'') {
+        for(i++; i < len && t[i] != c; i++) {
+          if(t[i] == '\\') i++;
+        }
+      }
+      else if(c == '{') {
+        if(depth == capacity) {
+          capacity = capacity ? capacity * 2 : 64;
+          int *tmp = realloc(stack, capacity * sizeof(int));
+          if(!tmp) {
+            perror("Malloc failled");
+            exit(EXIT_FAILURE);
+          }
+          stack = tmp;
+        }
+        stack[depth++] = y;
+      }
+      else if(c == '}' && depth > 0) {
+        int from = stack[--depth];
+        // The lowest brace left open on its line is closed
+        if(from < y && (depth == 0 || stack[depth - 1] != from)) close[from] = y;
+      }
+    }
+    if(depth > 0 && stack[depth - 1] == y) close[y] = y;
+    comment[y] = in_comment;
+  }
+  free(stack);
+}
+
+// Closed folds over every outermost block of the document. Returns how
+// many were added. Block ends are those of fold_block_end, found for
+// every line in one pass so unclosed braces cost no rescans.
+int fold_all_blocks(FoldSet *s) {
+  int lines = document_line_count();
+  if(lines == 0) return 0;
+  int *close = malloc(lines * sizeof(int));
+  char *comment = malloc(lines);
+  if(!close || !comment) {
+    perror("Malloc failled");
+    exit(EXIT_FAILURE);
+  }
+  fold_scan_blocks(lines, close, comment);
+
+  int added = 0;
+  for(int y = 0; y < lines; y++) {
+    int end = close[y];
+    if(end < 0 && !comment[y] && y + 1 < lines && close[y + 1] >= 0) {
+      int len, i = 0;
+      const char *t = document_line_text(y + 1, &len);
+      while(i < len && (t[i] == ' ' || t[i] == '\t')) i++;
+      if(i < len && t[i] == '{') end = close[y + 1] == y + 1 ? y : close[y + 1];
+    }
+    if(end < 0) end = fold_indent_end(y);
+    if(end <= y) continue;
+    if(fold_add(s, y, end)) added++;
+    y = end;
+  }
+  free(close);
+  free(comment);
+  return added;
+}
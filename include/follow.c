@@ -0,0 +1,318 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#include "atom.h"
+
+// Follow mode for growing files (atom -f, :follow). An inotify watch on
+// the file reports appends; only the new bytes are read and split into
+// lines at the end of the document. A second watch on the directory
+// notices when the name is replaced, which together with a shrinking size
+// covers log rotation by rename and by copytruncate. Nothing runs while
+// the file is idle.
+
+#define FOLLOW_CHUNK_SIZE (1 << 20)
+#define FOLLOW_MAX_READ (16 << 20)
+#define FOLLOW_FRAME_MS 16
+#define FOLLOW_FILE_MASK (IN_MODIFY | IN_MOVE_SELF | IN_DELETE_SELF)
+#define FOLLOW_DIR_MASK (IN_CREATE | IN_MOVED_TO)
+
+void event_watch_fd(int fd, short events, EventFdCallback callback, void *data);
+void event_unwatch_fd(int fd);
+int event_timer_add(int delay_ms, EventCallback callback, void *data);
+void event_timer_cancel(int id);
+
+void load_line(const char *text, int len);
+void extend_last_line(const char *text, int len);
+int reset_document();
+int document_line_count();
+int cursor_at_bottom();
+void document_grew(int old_size, int pinned);
+void set_command_status(const char* s);
+
+// ===============================
+// DATA STRUCTURES
+// ===============================
+
+typedef struct {
+  int active;
+  char path[PATH_MAX];
+  char name[NAME_MAX + 1];
+  int fd;
+  off_t offset;
+  int tail_open;
+
+  int inotify_fd;
+  int file_wd;
+  int dir_wd;
+
+  // Redraws are batched per frame while data streams in
+  int frame_ms;
+  int frame_timer;
+  int more_timer;
+  int frame_old_size;
+  int frame_pinned;
+  int frame_pending;
+
+  char *chunk;
+} Follow;
+
+// ===============================
+// GLOBAL
+// ===============================
+
+Follow Tail = { .frame_ms = FOLLOW_FRAME_MS, .fd = -1, .inotify_fd = -1, .file_wd = -1, .dir_wd = -1 };
+
+void read_appended();
+void follow_stop();
+
+// ===============================
+// HELPERS
+// ===============================
+
+void follow_flush_frame(void *data) {
+  (void)data;
+  Tail.frame_timer = 0;
+  if(!Tail.frame_pending) return;
+  Tail.frame_pending = 0;
+  document_grew(Tail.frame_old_size, Tail.frame_pinned);
+}
+
+// Remembers the viewport as it was before the first append of a frame
+void begin_frame() {
+  if(Tail.frame_pending) return;
+  Tail.frame_pending = 1;
+  Tail.frame_old_size = document_line_count();
+  Tail.frame_pinned = cursor_at_bottom();
+  if(!Tail.frame_timer) Tail.frame_timer = event_timer_add(Tail.frame_ms, follow_flush_frame, NULL);
+}
+
+void append_bytes(const char *p, size_t len) {
+  const char *end = p + len;
+
+  if(Tail.tail_open) {
+    const char *nl = memchr(p, '\n', end - p);
+    int seg = nl ? nl - p : end - p;
+    if(nl && seg > 0 && p[seg - 1] == '\r') seg--;
+    extend_last_line(p, seg);
+    if(!nl) return;
+    Tail.tail_open = 0;
+    p = nl + 1;
+  }
+
+  const char *nl;
+  while((nl = memchr(p, '\n', end - p)) != NULL) {
+    load_line(p, nl - p);
+    p = nl + 1;
+  }
+  if(p < end) {
+    load_line(p, end - p);
+    Tail.tail_open = 1;
+  }
+}
+
+// The file shrank or was replaced under unsaved edits. They are kept and following
+// stops rather than reloading over them.
+void follow_give_up(const char *why) {
+  char msg[128];
+  snprintf(msg, sizeof(msg), "\033[1;31mError:\033[0m File %s, stopped following to keep unsaved edits", why);
+  set_command_status(msg);
+  int old_size = Tail.frame_pending ? Tail.frame_old_size : document_line_count();
+  int pinned = Tail.frame_pending && Tail.frame_pinned;
+  follow_stop();
+  document_grew(old_size, pinned);
+}
+
+void continue_reading(void *data) {
+  (void)data;
+  Tail.more_timer = 0;
+  read_appended();
+}
+
+// Reads whatever was appended since the last call. A large backlog is
+// taken in slices so keys are still handled between them.
+void read_appended() {
+  if(Tail.fd < 0) return;
+
+  struct stat st;
+  if(fstat(Tail.fd, &st) == 0 && st.st_size < Tail.offset) {
+    // Truncated in place: start over from the top
+    begin_frame();
+    if(!reset_document()) {
+      follow_give_up("was truncated");
+      return;
+    }
+    Tail.offset = 0;
+    Tail.tail_open = 0;
+    Tail.frame_old_size = 0;
+    lseek(Tail.fd, 0, SEEK_SET);
+  }
+
+  size_t total = 0;
+  ssize_t n;
+  while(total < FOLLOW_MAX_READ && (n = read(Tail.fd, Tail.chunk, FOLLOW_CHUNK_SIZE)) > 0) {
+    begin_frame();
+    append_bytes(Tail.chunk, n);
+    Tail.offset += n;
+    total += n;
+  }
+
+  if(total >= FOLLOW_MAX_READ && !Tail.more_timer) {
+    Tail.more_timer = event_timer_add(0, continue_reading, NULL);
+  }
+}
+
+int open_followed_file() {
+  Tail.fd = open(Tail.path, O_RDONLY | O_CLOEXEC);
+  if(Tail.fd < 0) return 0;
+  lseek(Tail.fd, Tail.offset, SEEK_SET);
+  Tail.file_wd = inotify_add_watch(Tail.inotify_fd, Tail.path, FOLLOW_FILE_MASK);
+  return 1;
+}
+
+void close_followed_file() {
+  if(Tail.file_wd >= 0) inotify_rm_watch(Tail.inotify_fd, Tail.file_wd);
+  Tail.file_wd = -1;
+  if(Tail.fd >= 0) close(Tail.fd);
+  Tail.fd = -1;
+}
+
+// A new file took the name: show it from the start
+void reopen_followed_file() {
+  read_appended();
+  if(!Tail.active) return;
+  close_followed_file();
+
+  begin_frame();
+  if(!reset_document()) {
+    follow_give_up("was replaced");
+    return;
+  }
+  Tail.frame_old_size = 0;
+  Tail.offset = 0;
+  Tail.tail_open = 0;
+  if(open_followed_file()) read_appended();
+}
+
+void on_follow_events(int fd, short revents, void *data) {
+  (void)revents;
+  (void)data;
+  char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  int modified = 0, gone = 0, replaced = 0;
+
+  ssize_t len;
+  while((len = read(fd, events, sizeof(events))) > 0) {
+    for(char *p = events; p < events + len; ) {
+      struct inotify_event *ev = (struct inotify_event *)p;
+      if(ev->wd == Tail.file_wd) {
+        if(ev->mask & IN_MODIFY) modified = 1;
+        if(ev->mask & (IN_MOVE_SELF | IN_DELETE_SELF)) gone = 1;
+      }
+      else if(ev->wd == Tail.dir_wd && ev->len > 0 && strcmp(ev->name, Tail.name) == 0) {
+        replaced = 1;
+      }
+      p += sizeof(struct inotify_event) + ev->len;
+    }
+  }
+
+  if(replaced) {
+    reopen_followed_file();
+  }
+  else if(gone) {
+    // Keep what was written before the move and wait for a new file
+    read_appended();
+    close_followed_file();
+  }
+  else if(modified) {
+    read_appended();
+  }
+}
+
+// ===============================
+// FOLLOW API
+// ===============================
+
+// Starts following path, whose first loaded_bytes are already in the
+// document
+void follow_start(const char *path, off_t loaded_bytes) {
+  if(Tail.active) return;
+
+  char resolved[PATH_MAX];
+  if(!realpath(path, resolved)) {
+    set_command_status("\033[1;31mError:\033[0m cannot follow file");
+    return;
+  }
+  strcpy(Tail.path, resolved);
+  char *slash = strrchr(Tail.path, '/');
+  snprintf(Tail.name, sizeof(Tail.name), "%s", slash + 1);
+
+  Tail.chunk = malloc(FOLLOW_CHUNK_SIZE);
+  Tail.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if(!Tail.chunk || Tail.inotify_fd < 0) {
+    perror("follow");
+    exit(EXIT_FAILURE);
+  }
+
+  // The last loaded line is still open if the file did not end in a newline
+  Tail.offset = loaded_bytes;
+  Tail.tail_open = 0;
+  if(!open_followed_file()) {
+    set_command_status("\033[1;31mError:\033[0m cannot follow file");
+    close(Tail.inotify_fd);
+    free(Tail.chunk);
+    Tail.chunk = NULL;
+    Tail.inotify_fd = -1;
+    return;
+  }
+  char last;
+  if(loaded_bytes > 0 && pread(Tail.fd, &last, 1, loaded_bytes - 1) == 1 && last != '\n') {
+    Tail.tail_open = document_line_count() > 0;
+  }
+
+  *slash = '\0';
+  Tail.dir_wd = inotify_add_watch(Tail.inotify_fd, Tail.path, FOLLOW_DIR_MASK);
+  *slash = '/';
+
+  Tail.active = 1;
+  event_watch_fd(Tail.inotify_fd, POLLIN, on_follow_events, NULL);
+
+  // Catch up on anything written since the file was loaded
+  read_appended();
+}
+
+void follow_stop() {
+  if(!Tail.active) return;
+  if(Tail.frame_timer) event_timer_cancel(Tail.frame_timer);
+  if(Tail.more_timer) event_timer_cancel(Tail.more_timer);
+  Tail.frame_timer = Tail.more_timer = 0;
+  Tail.frame_pending = 0;
+
+  close_followed_file();
+  event_unwatch_fd(Tail.inotify_fd);
+  close(Tail.inotify_fd);
+  Tail.inotify_fd = -1;
+  Tail.dir_wd = -1;
+  free(Tail.chunk);
+  Tail.chunk = NULL;
+  Tail.active = 0;
+}
+
+void follow_set_frame_ms(int ms) {
+  Tail.frame_ms = ms;
+}
+
+int follow_active() {
+  return Tail.active;
+}
+
+// Bytes of the file read into the document, kept after following stops
+off_t follow_offset() {
+  return Tail.offset;
+}
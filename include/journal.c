@@ -0,0 +1,428 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "atom.h"
+
+// Crash recovery journal kept next to the edited file as .<name>.atomj.
+// Every edit appends a few bytes to an in-memory batch; a timer hands the
+// batch to a writer thread which appends it as one checksummed frame and
+// fsyncs. A keystroke therefore costs a memcpy, and a crash loses at most
+// JOURNAL_COMMIT_MS of typing. Saving truncates the journal, a clean exit
+// removes it.
+//
+// File layout: a JournalHeader, then frames of
+//   u32 payload length, u32 FNV-1a of the payload, payload
+// where the payload is a run of records
+//   op byte, varint y, varint x, [byte c for JOURNAL_INSERT_CHAR and
+//   JOURNAL_SORT_LINES], [varint length, text for JOURNAL_REPLACE_LINES]
+// (for JOURNAL_DELETE_LINES, JOURNAL_SORT_LINES and JOURNAL_REPLACE_LINES,
+// x is the number of lines; a sort's c holds its flags and a replacement's
+// text is the new lines, each ended by a newline)
+// A torn or corrupt frame ends the journal.
+
+#define JOURNAL_MAGIC "ATOMJNL1"
+#define JOURNAL_COMMIT_MS 1000
+#define JOURNAL_SUFFIX ".atomj"
+
+int event_timer_add(int delay_ms, EventCallback callback, void *data);
+void event_timer_cancel(int id);
+
+// ===============================
+// DATA STRUCTURES
+// ===============================
+
+// Identifies the file contents the records apply to
+typedef struct {
+  char magic[8];
+  uint64_t file_size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+} JournalHeader;
+
+typedef struct {
+  char *data;
+  size_t len;
+  size_t cap;
+} JournalBuffer;
+
+typedef struct Journal {
+  char path[PATH_MAX];
+  int fd;
+  int timer;
+
+  // Filled by the editor without locking
+  JournalBuffer pending;
+
+  // Shared with the writer thread
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  JournalBuffer queued;
+  JournalHeader reset_header;
+  int reset;
+  int quit;
+} Journal;
+
+// ===============================
+// HELPERS
+// ===============================
+
+void journal_path(const char *file_path, char *out, size_t size) {
+  const char *slash = strrchr(file_path, '/');
+  if(slash) {
+    snprintf(out, size, "%.*s/.%s%s", (int)(slash - file_path), file_path, slash + 1, JOURNAL_SUFFIX);
+  }
+  else {
+    snprintf(out, size, ".%s%s", file_path, JOURNAL_SUFFIX);
+  }
+}
+
+void journal_header_for(const char *file_path, JournalHeader *h) {
+  struct stat st;
+  memset(h, 0, sizeof(*h));
+  memcpy(h->magic, JOURNAL_MAGIC, sizeof(h->magic));
+  if(stat(file_path, &st) == 0) {
+    h->file_size = st.st_size;
+    h->mtime_sec = st.st_mtim.tv_sec;
+    h->mtime_nsec = st.st_mtim.tv_nsec;
+  }
+}
+
+uint32_t journal_checksum(const char *data, size_t len) {
+  uint32_t hash = 2166136261u;
+  for(size_t i = 0; i < len; i++) {
+    hash ^= (unsigned char)data[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+void buffer_append(JournalBuffer *b, const void *data, size_t len) {
+  if(b->len + len > b->cap) {
+    size_t cap = b->cap ? b->cap * 2 : 4096;
+    while(cap < b->len + len) cap *= 2;
+    char *tmp = realloc(b->data, cap);
+    if(!tmp) {
+      perror("Malloc failled");
+      exit(EXIT_FAILURE);
+    }
+    b->data = tmp;
+    b->cap = cap;
+  }
+  memcpy(b->data + b->len, data, len);
+  b->len += len;
+}
+
+int put_varint(unsigned char *out, uint32_t v) {
+  int n = 0;
+  while(v >= 0x80) {
+    out[n++] = (v & 0x7f) | 0x80;
+    v >>= 7;
+  }
+  out[n++] = v;
+  return n;
+}
+
+// Returns bytes consumed, 0 when the varint runs past end
+int get_varint(const unsigned char *p, const unsigned char *end, uint32_t *v) {
+  uint32_t result = 0;
+  for(int i = 0; i < 5 && p + i < end; i++) {
+    result |= (uint32_t)(p[i] & 0x7f) << (7 * i);
+    if(!(p[i] & 0x80)) {
+      *v = result;
+      return i + 1;
+    }
+  }
+  return 0;
+}
+
+int write_all(int fd, const void *data, size_t len) {
+  const char *p = data;
+  while(len > 0) {
+    ssize_t n = write(fd, p, len);
+    if(n < 0) {
+      if(errno == EINTR) continue;
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+// ===============================
+// WRITER THREAD
+// ===============================
+
+void *journal_writer(void *arg) {
+  Journal *j = arg;
+  JournalBuffer batch = {0};
+
+  while(1) {
+    pthread_mutex_lock(&j->lock);
+    while(!j->quit && !j->reset && j->queued.len == 0) {
+      pthread_cond_wait(&j->wake, &j->lock);
+    }
+    int quit = j->quit;
+    int reset = j->reset;
+    JournalHeader header = j->reset_header;
+    JournalBuffer swap = j->queued;
+    j->queued = batch;
+    j->queued.len = 0;
+    batch = swap;
+    j->reset = 0;
+    pthread_mutex_unlock(&j->lock);
+
+    int synced = !reset && batch.len == 0;
+    if(reset) {
+      ftruncate(j->fd, 0);
+      lseek(j->fd, 0, SEEK_SET);
+      write_all(j->fd, &header, sizeof(header));
+    }
+    if(batch.len > 0) {
+      uint32_t frame[2] = { (uint32_t)batch.len, journal_checksum(batch.data, batch.len) };
+      struct iovec iov[2] = {
+        { .iov_base = frame, .iov_len = sizeof(frame) },
+        { .iov_base = batch.data, .iov_len = batch.len },
+      };
+      if(writev(j->fd, iov, 2) != (ssize_t)(sizeof(frame) + batch.len)) {
+        // A short write leaves a torn frame that recovery stops at
+        perror("journal");
+      }
+      batch.len = 0;
+    }
+    if(!synced) fdatasync(j->fd);
+
+    if(quit) break;
+  }
+
+  free(batch.data);
+  return NULL;
+}
+
+// Hands the pending records to the writer
+void journal_commit(void *data) {
+  Journal *j = data;
+  j->timer = 0;
+  if(j->pending.len == 0) return;
+
+  pthread_mutex_lock(&j->lock);
+  buffer_append(&j->queued, j->pending.data, j->pending.len);
+  pthread_cond_signal(&j->wake);
+  pthread_mutex_unlock(&j->lock);
+  j->pending.len = 0;
+}
+
+// ===============================
+// JOURNAL API
+// ===============================
+
+// Starts an empty journal for file_path, replacing any old one
+Journal *journal_open(const char *file_path) {
+  Journal *j = calloc(1, sizeof(Journal));
+  if(!j) {
+    perror("Malloc failled");
+    exit(EXIT_FAILURE);
+  }
+  journal_path(file_path, j->path, sizeof(j->path));
+
+  j->fd = open(j->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if(j->fd < 0) {
+    // Read-only directory: edit without a journal
+    free(j);
+    return NULL;
+  }
+
+  JournalHeader header;
+  journal_header_for(file_path, &header);
+  write_all(j->fd, &header, sizeof(header));
+
+  pthread_mutex_init(&j->lock, NULL);
+  pthread_cond_init(&j->wake, NULL);
+  if(pthread_create(&j->thread, NULL, journal_writer, j) != 0) {
+    perror("pthread_create");
+    close(j->fd);
+    unlink(j->path);
+    free(j);
+    return NULL;
+  }
+  return j;
+}
+
+void journal_record(Journal *j, int op, int y, int x, char c) {
+  if(!j) return;
+
+  unsigned char record[12];
+  int n = 0;
+  record[n++] = op;
+  n += put_varint(record + n, y);
+  n += put_varint(record + n, x);
+  if(op == JOURNAL_INSERT_CHAR || op == JOURNAL_SORT_LINES) record[n++] = c;
+  buffer_append(&j->pending, record, n);
+
+  if(!j->timer) j->timer = event_timer_add(JOURNAL_COMMIT_MS, journal_commit, j);
+}
+
+// Starts a record carrying len bytes of text, which must follow through
+// journal_append_text
+void journal_record_text(Journal *j, int op, int y, int x, uint32_t len) {
+  if(!j) return;
+
+  unsigned char record[16];
+  int n = 0;
+  record[n++] = op;
+  n += put_varint(record + n, y);
+  n += put_varint(record + n, x);
+  n += put_varint(record + n, len);
+  buffer_append(&j->pending, record, n);
+
+  if(!j->timer) j->timer = event_timer_add(JOURNAL_COMMIT_MS, journal_commit, j);
+}
+
+void journal_append_text(Journal *j, const char *text, size_t len) {
+  if(!j) return;
+  buffer_append(&j->pending, text, len);
+}
+
+// The file on disk now matches the document, so earlier records are moot
+void journal_reset(Journal *j, const char *file_path) {
+  if(!j) return;
+  if(j->timer) event_timer_cancel(j->timer);
+  j->timer = 0;
+  j->pending.len = 0;
+
+  pthread_mutex_lock(&j->lock);
+  j->queued.len = 0;
+  journal_header_for(file_path, &j->reset_header);
+  j->reset = 1;
+  pthread_cond_signal(&j->wake);
+  pthread_mutex_unlock(&j->lock);
+}
+
+// Flushes and stops the writer; remove deletes the journal file
+void journal_close(Journal *j, int remove) {
+  if(!j) return;
+  if(j->timer) event_timer_cancel(j->timer);
+  journal_commit(j);
+
+  pthread_mutex_lock(&j->lock);
+  j->quit = 1;
+  pthread_cond_signal(&j->wake);
+  pthread_mutex_unlock(&j->lock);
+  pthread_join(j->thread, NULL);
+
+  close(j->fd);
+  if(remove) unlink(j->path);
+  pthread_mutex_destroy(&j->lock);
+  pthread_cond_destroy(&j->wake);
+  free(j->pending.data);
+  free(j->queued.data);
+  free(j);
+}
+
+// ===============================
+// RECOVERY
+// ===============================
+
+// Reads the records left behind for file_path. Returns 0 when there are
+// none; *stale is set when the file changed after the journal was started.
+int journal_load(const char *file_path, char **records, size_t *len, int *stale) {
+  char path[PATH_MAX];
+  journal_path(file_path, path, sizeof(path));
+  *records = NULL;
+  *len = 0;
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if(fd < 0) return 0;
+
+  struct stat st;
+  JournalHeader header, current;
+  if(fstat(fd, &st) != 0 || st.st_size <= (off_t)sizeof(header) ||
+     read(fd, &header, sizeof(header)) != sizeof(header) ||
+     memcmp(header.magic, JOURNAL_MAGIC, sizeof(header.magic)) != 0) {
+    close(fd);
+    return 0;
+  }
+  journal_header_for(file_path, &current);
+  *stale = header.file_size != current.file_size ||
+           header.mtime_sec != current.mtime_sec ||
+           header.mtime_nsec != current.mtime_nsec;
+
+  size_t body = st.st_size - sizeof(header);
+  char *raw = malloc(body);
+  char *out = malloc(body);
+  if(!raw || !out) {
+    perror("Malloc failled");
+    exit(EXIT_FAILURE);
+  }
+  ssize_t got = read(fd, raw, body);
+  close(fd);
+
+  // Keep frames up to the first torn or corrupt one
+  size_t pos = 0;
+  while(got > 0 && pos + 8 <= (size_t)got) {
+    uint32_t frame[2];
+    memcpy(frame, raw + pos, sizeof(frame));
+    if(frame[0] > (size_t)got - pos - 8) break;
+    if(journal_checksum(raw + pos + 8, frame[0]) != frame[1]) break;
+    memcpy(out + *len, raw + pos + 8, frame[0]);
+    *len += frame[0];
+    pos += 8 + frame[0];
+  }
+  free(raw);
+
+  if(*len == 0) {
+    free(out);
+    return 0;
+  }
+  *records = out;
+  return 1;
+}
+
+// Feeds every record to apply, in order. Returns the number applied.
+long journal_replay(const char *records, size_t len,
+                    void (*apply)(int op, int y, int x, char c, const char *text, size_t text_len)) {
+  const unsigned char *p = (const unsigned char *)records;
+  const unsigned char *end = p + len;
+  long count = 0;
+
+  while(p < end) {
+    int op = *p++;
+    uint32_t y, x;
+    int n = get_varint(p, end, &y);
+    if(!n) break;
+    p += n;
+    n = get_varint(p, end, &x);
+    if(!n) break;
+    p += n;
+
+    char c = 0;
+    const char *text = NULL;
+    uint32_t text_len = 0;
+    if(op == JOURNAL_INSERT_CHAR || op == JOURNAL_SORT_LINES) {
+      if(p >= end) break;
+      c = *p++;
+    }
+    else if(op == JOURNAL_REPLACE_LINES) {
+      n = get_varint(p, end, &text_len);
+      if(!n || text_len > (size_t)(end - p - n)) break;
+      text = (const char *)p + n;
+      p += n + text_len;
+    }
+    else if(op < JOURNAL_INSERT_CHAR || op > JOURNAL_DELETE_LINES) {
+      break;
+    }
+    apply(op, y, x, c, text, text_len);
+    count++;
+  }
+  return count;
+}
@@ -0,0 +1,351 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "atom.h"
+
+// Key sequences are resolved through one trie per mode. Every node is the
+// prefix of some binding and each key moves one edge down, so a sequence
+// resolves in as many steps as it has keys. When a node completes one
+// binding and begins longer ones (j and jj in insert mode) the dispatcher
+// waits up to the mode's timeout for the next key before settling on the
+// longest binding typed so far. Keys that start no binding go to the
+// mode's fallback, which is how insert mode types text.
+//
+// Bindings compiled in call actions. :nmap and :imap add remaps that take
+// precedence; their right hand side is fed back through dispatch_key with
+// remaps disabled, so a remap can never loop.
+
+#define KEYMAP_MAX_SEQUENCE 16
+#define KEYMAP_FANOUT 128
+
+int event_timer_add(int delay_ms, EventCallback callback, void *data);
+void event_timer_cancel(int id);
+
+void dispatch_key(char c);
+
+// ===============================
+// DATA STRUCTURES
+// ===============================
+
+typedef struct {
+  int next[KEYMAP_FANOUT];
+  int children;
+  KeyAction action;
+  char *remap;
+} KeyNode;
+
+typedef struct {
+  // Node 0 is the root
+  KeyNode *nodes;
+  int node_count;
+  int node_capacity;
+
+  KeyFallback fallback;
+  int timeout_ms;
+  int counted;
+
+  // The sequence typed so far and the longest binding within it
+  int node;
+  char pending[KEYMAP_MAX_SEQUENCE];
+  int pending_len;
+  int match_node;
+  int match_len;
+  int count;
+  int timer;
+
+  // Takes the next key whole, for bindings with an argument like q{reg}
+  KeyFallback awaiting;
+} Keymap;
+
+// ===============================
+// GLOBAL
+// ===============================
+
+Keymap Keymaps[KEYMAP_MODES];
+
+// Above zero while a remap is being replayed
+int KeymapReplaying = 0;
+
+// Count typed before the binding that is running, 0 when there was none
+int KeymapCount = 0;
+
+// ===============================
+// HELPERS
+// ===============================
+
+int keymap_new_node(Keymap *m) {
+  if(m->node_count == m->node_capacity) {
+    int capacity = m->node_capacity ? m->node_capacity * 2 : 16;
+    KeyNode *tmp = realloc(m->nodes, capacity * sizeof(KeyNode));
+    if(!tmp) {
+      perror("Malloc failled");
+      exit(EXIT_FAILURE);
+    }
+    m->nodes = tmp;
+    m->node_capacity = capacity;
+  }
+  memset(&m->nodes[m->node_count], 0, sizeof(KeyNode));
+  return m->node_count++;
+}
+
+// Node for keys, created along the way
+int keymap_insert(Keymap *m, const char *keys, int len) {
+  int node = 0;
+  for(int i = 0; i < len; i++) {
+    unsigned char k = keys[i];
+    int next = m->nodes[node].next[k];
+    if(!next) {
+      next = keymap_new_node(m);
+      m->nodes[node].next[k] = next;
+      m->nodes[node].children++;
+    }
+    node = next;
+  }
+  return node;
+}
+
+// Node for keys, 0 when no binding starts with them
+int keymap_find(Keymap *m, const char *keys, int len) {
+  int node = 0;
+  for(int i = 0; i < len; i++) {
+    unsigned char k = keys[i];
+    node = k < KEYMAP_FANOUT ? m->nodes[node].next[k] : 0;
+    if(!node) return 0;
+  }
+  return node;
+}
+
+int keymap_bound(KeyNode *n) {
+  return n->action || (n->remap && !KeymapReplaying);
+}
+
+void keymap_clear_pending(Keymap *m) {
+  if(m->timer) event_timer_cancel(m->timer);
+  m->timer = 0;
+  m->node = 0;
+  m->pending_len = 0;
+  m->match_node = 0;
+  m->match_len = 0;
+  m->count = 0;
+}
+
+void keymap_replay(const char *keys, int count) {
+  KeymapReplaying++;
+  if(count > 0) {
+    char digits[16];
+    int len = snprintf(digits, sizeof(digits), "%d", count);
+    for(int i = 0; i < len; i++) dispatch_key(digits[i]);
+  }
+  for(const char *k = keys; *k; k++) dispatch_key(*k);
+  KeymapReplaying--;
+}
+
+void keymap_run(KeyNode *n, int count) {
+  if(n->remap && !KeymapReplaying) {
+    // The replayed keys may remap this very node
+    char keys[256];
+    snprintf(keys, sizeof(keys), "%s", n->remap);
+    keymap_replay(keys, count);
+    return;
+  }
+  KeymapCount = count;
+  n->action();
+  KeymapCount = 0;
+}
+
+// Ends the pending sequence without waiting for more keys: the longest
+// binding in it runs and the keys after it are dispatched again. With no
+// binding the first key goes to the fallback instead.
+void keymap_settle(Keymap *m) {
+  char keys[KEYMAP_MAX_SEQUENCE];
+  int len = m->pending_len;
+  int used = m->match_len;
+  int count = m->count;
+  KeyNode *match = used > 0 ? &m->nodes[m->match_node] : NULL;
+  memcpy(keys, m->pending, len);
+  keymap_clear_pending(m);
+
+  if(match) {
+    keymap_run(match, count);
+  }
+  else {
+    used = 1;
+    if(m->fallback) m->fallback(keys[0]);
+  }
+  // The binding may have switched modes, so the rest goes through dispatch
+  for(int i = used; i < len; i++) dispatch_key(keys[i]);
+}
+
+void keymap_timeout(void *data) {
+  Keymap *m = data;
+  m->timer = 0;
+  keymap_settle(m);
+}
+
+// Turns <Esc>, <CR>, <Tab>, <BS>, <Space> and <lt> into key bytes.
+// Returns the length, -1 when the text is not a valid sequence.
+int keymap_parse_keys(const char *text, char *out, int max) {
+  static const struct { const char *name; char key; } names[] = {
+    { "<Esc>", 27 }, { "<CR>", 10 }, { "<Enter>", 10 }, { "<Tab>", 9 },
+    { "<BS>", 127 }, { "<Space>", ' ' }, { "<lt>", '<' },
+  };
+  int len = 0;
+  while(*text) {
+    char key = *text;
+    int skip = 1;
+    if(*text == '<') {
+      for(size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        size_t n = strlen(names[i].name);
+        if(strncasecmp(text, names[i].name, n) == 0) {
+          key = names[i].key;
+          skip = n;
+          break;
+        }
+      }
+    }
+    if(len >= max || key == 0 || (unsigned char)key >= KEYMAP_FANOUT) return -1;
+    out[len++] = key;
+    text += skip;
+  }
+  return len;
+}
+
+// ===============================
+// KEYMAP API
+// ===============================
+
+// counted modes take a count typed before the sequence
+void keymap_init(int mode, KeyFallback fallback, int timeout_ms, int counted) {
+  Keymap *m = &Keymaps[mode];
+  if(m->nodes) return;
+  keymap_new_node(m);
+  m->fallback = fallback;
+  m->timeout_ms = timeout_ms;
+  m->counted = counted;
+}
+
+void keymap_set_timeout(int mode, int timeout_ms) {
+  Keymaps[mode].timeout_ms = timeout_ms;
+}
+
+void keymap_bind(int mode, const char *keys, KeyAction action) {
+  Keymap *m = &Keymaps[mode];
+  int len = strlen(keys);
+  if(len == 0 || len > KEYMAP_MAX_SEQUENCE) return;
+  for(int i = 0; i < len; i++) {
+    if((unsigned char)keys[i] >= KEYMAP_FANOUT) return;
+  }
+  // Inserting may move the nodes
+  int node = keymap_insert(m, keys, len);
+  m->nodes[node].action = action;
+}
+
+void keymap_bind_table(int mode, const KeyBinding *table, int count) {
+  for(int i = 0; i < count; i++) keymap_bind(mode, table[i].keys, table[i].action);
+}
+
+// Maps lhs to the keys of rhs, both in <Esc> notation. Returns 0 when
+// either side is not a valid key sequence.
+int keymap_remap(int mode, const char *lhs, const char *rhs) {
+  Keymap *m = &Keymaps[mode];
+  char keys[KEYMAP_MAX_SEQUENCE], replay[256];
+  int len = keymap_parse_keys(lhs, keys, sizeof(keys));
+  int replay_len = keymap_parse_keys(rhs, replay, sizeof(replay) - 1);
+  if(len <= 0 || replay_len <= 0) return 0;
+  replay[replay_len] = '\0';
+
+  int node = keymap_insert(m, keys, len);
+  KeyNode *n = &m->nodes[node];
+  free(n->remap);
+  n->remap = strdup(replay);
+  if(!n->remap) {
+    perror("Malloc failled");
+    exit(EXIT_FAILURE);
+  }
+  return 1;
+}
+
+// Drops the remap on lhs, or the built in binding when there is none.
+// Returns 0 when lhs was not bound.
+int keymap_unmap(int mode, const char *lhs) {
+  Keymap *m = &Keymaps[mode];
+  char keys[KEYMAP_MAX_SEQUENCE];
+  int len = keymap_parse_keys(lhs, keys, sizeof(keys));
+  int node = len > 0 ? keymap_find(m, keys, len) : 0;
+  if(!node) return 0;
+
+  KeyNode *n = &m->nodes[node];
+  if(n->remap) {
+    free(n->remap);
+    n->remap = NULL;
+  }
+  else if(n->action) {
+    n->action = NULL;
+  }
+  else {
+    return 0;
+  }
+  keymap_clear_pending(m);
+  return 1;
+}
+
+void keymap_feed(int mode, char c) {
+  Keymap *m = &Keymaps[mode];
+  if(m->timer) event_timer_cancel(m->timer);
+  m->timer = 0;
+
+  if(m->awaiting) {
+    KeyFallback take = m->awaiting;
+    m->awaiting = NULL;
+    take(c);
+    return;
+  }
+
+  if(m->counted && m->pending_len == 0 && isdigit((unsigned char)c) && (c != '0' || m->count > 0)) {
+    m->count = m->count * 10 + (c - '0');
+    return;
+  }
+
+  unsigned char k = c;
+  int next = k < KEYMAP_FANOUT ? m->nodes[m->node].next[k] : 0;
+  if(!next) {
+    if(m->pending_len == 0) {
+      // Nothing starts with this key
+      m->count = 0;
+      if(m->fallback) m->fallback(c);
+      return;
+    }
+    keymap_settle(m);
+    dispatch_key(c);
+    return;
+  }
+
+  m->node = next;
+  m->pending[m->pending_len++] = c;
+  KeyNode *n = &m->nodes[next];
+  if(keymap_bound(n)) {
+    m->match_node = next;
+    m->match_len = m->pending_len;
+  }
+
+  if(n->children == 0) keymap_settle(m);
+  else m->timer = event_timer_add(m->timeout_ms, keymap_timeout, m);
+}
+
+// Hands the next key of mode to take instead of looking it up
+void keymap_await_key(int mode, KeyFallback take) {
+  Keymaps[mode].awaiting = take;
+}
+
+// Forgets a half typed sequence, for when the mode's document goes away
+void keymap_cancel(int mode) {
+  keymap_clear_pending(&Keymaps[mode]);
+  Keymaps[mode].awaiting = NULL;
+}
+
+int keymap_count() {
+  return KeymapCount;
+}
@@ -0,0 +1,193 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "atom.h"
+
+// Split windows tile the text area as a binary tree. A leaf is a pane and
+// an inner node cuts its rectangle in two, side by side or one above the
+// other. Node numbers never move, so a leaf's number names its pane for as
+// long as it is open. Rectangles are worked out again from the tree on
+// every change to it or to the terminal size; a pane never stores a size
+// of its own that could go stale.
+//
+// A pane's rectangle includes the row it shares with the pane below (its
+// status row) and the column it shares with the pane to its right (the
+// separator), when there is one.
+
+#define LAYOUT_MAX_NODES (2 * MAX_PANES - 1)
+
+// ===============================
+// DATA STRUCTURES
+// ===============================
+
+typedef struct {
+  int used;
+  int parent;
+  // -1 for a pane
+  int child[2];
+  // Children side by side rather than stacked
+  int vertical;
+  LayoutRect rect;
+} LayoutNode;
+
+typedef struct {
+  LayoutNode nodes[LAYOUT_MAX_NODES];
+  int root;
+  LayoutRect area;
+} Layout;
+
+// ===============================
+// GLOBAL
+// ===============================
+
+Layout Tiles = { .root = -1 };
+
+// ===============================
+// HELPERS
+// ===============================
+
+int layout_new_node(int parent) {
+  for(int i = 0; i < LAYOUT_MAX_NODES; i++) {
+    if(Tiles.nodes[i].used) continue;
+    Tiles.nodes[i] = (LayoutNode){ .used = 1, .parent = parent, .child = { -1, -1 } };
+    return i;
+  }
+  return -1;
+}
+
+int layout_is_pane(int node) {
+  return Tiles.nodes[node].child[0] < 0;
+}
+
+// Splits rect between the children of node, the first taking the odd
+// row or column
+void layout_place(int node, LayoutRect rect) {
+  LayoutNode *n = &Tiles.nodes[node];
+  n->rect = rect;
+  if(layout_is_pane(node)) return;
+
+  LayoutRect first = rect, second = rect;
+  if(n->vertical) {
+    first.width = (rect.width + 1) / 2;
+    second.left = rect.left + first.width;
+    second.width = rect.width - first.width;
+  }
+  else {
+    first.height = (rect.height + 1) / 2;
+    second.top = rect.top + first.height;
+    second.height = rect.height - first.height;
+  }
+  layout_place(n->child[0], first);
+  layout_place(n->child[1], second);
+}
+
+int layout_first_pane(int node) {
+  while(!layout_is_pane(node)) node = Tiles.nodes[node].child[0];
+  return node;
+}
+
+int layout_last_pane(int node) {
+  while(!layout_is_pane(node)) node = Tiles.nodes[node].child[1];
+  return node;
+}
+
+// ===============================
+// LAYOUT API
+// ===============================
+
+void layout_arrange(LayoutRect area) {
+  Tiles.area = area;
+  if(Tiles.root >= 0) layout_place(Tiles.root, area);
+}
+
+// One pane covering area; returns it
+int layout_init(LayoutRect area) {
+  for(int i = 0; i < LAYOUT_MAX_NODES; i++) Tiles.nodes[i].used = 0;
+  Tiles.root = layout_new_node(-1);
+  layout_arrange(area);
+  return Tiles.root;
+}
+
+// Halves pane; the new pane goes right of it or below it. Returns the new
+// pane, -1 when there is no room for one.
+int layout_split(int pane, int vertical) {
+  LayoutRect r = Tiles.nodes[pane].rect;
+  // Both halves need a text row or column besides the shared one
+  if((vertical ? r.width : r.height) < 4) return -1;
+
+  int parent = Tiles.nodes[pane].parent;
+  int inner = layout_new_node(parent);
+  if(inner < 0) return -1;
+  int added = layout_new_node(inner);
+  if(added < 0) {
+    Tiles.nodes[inner].used = 0;
+    return -1;
+  }
+
+  LayoutNode *n = &Tiles.nodes[inner];
+  n->vertical = vertical;
+  n->child[0] = pane;
+  n->child[1] = added;
+  if(parent < 0) Tiles.root = inner;
+  else {
+    LayoutNode *p = &Tiles.nodes[parent];
+    p->child[p->child[0] == pane ? 0 : 1] = inner;
+  }
+  Tiles.nodes[pane].parent = inner;
+  layout_place(inner, r);
+  return added;
+}
+
+// Gives the room of pane to its neighbour in the split. Returns the pane
+// that is next in line, -1 when pane is the last one.
+int layout_close(int pane) {
+  int parent = Tiles.nodes[pane].parent;
+  if(parent < 0) return -1;
+
+  LayoutNode *p = &Tiles.nodes[parent];
+  int sibling = p->child[p->child[0] == pane ? 1 : 0];
+  int grand = p->parent;
+  Tiles.nodes[sibling].parent = grand;
+  if(grand < 0) Tiles.root = sibling;
+  else {
+    LayoutNode *g = &Tiles.nodes[grand];
+    g->child[g->child[0] == parent ? 0 : 1] = sibling;
+  }
+  layout_place(sibling, p->rect);
+  p->used = 0;
+  Tiles.nodes[pane].used = 0;
+  return layout_first_pane(sibling);
+}
+
+// Closes every pane but pane
+void layout_only(int pane) {
+  for(int i = 0; i < LAYOUT_MAX_NODES; i++) Tiles.nodes[i].used = 0;
+  Tiles.nodes[pane] = (LayoutNode){ .used = 1, .parent = -1, .child = { -1, -1 } };
+  Tiles.root = pane;
+  layout_place(pane, Tiles.area);
+}
+
+// The pane after pane in reading order, or before it when dir < 0,
+// wrapping around
+int layout_next(int pane, int dir) {
+  int node = pane;
+  int side = dir > 0 ? 1 : 0;
+  while(Tiles.nodes[node].parent >= 0) {
+    int parent = Tiles.nodes[node].parent;
+    if(Tiles.nodes[parent].child[1 - side] == node) {
+      int other = Tiles.nodes[parent].child[side];
+      return dir > 0 ? layout_first_pane(other) : layout_last_pane(other);
+    }
+    node = parent;
+  }
+  return dir > 0 ? layout_first_pane(Tiles.root) : layout_last_pane(Tiles.root);
+}
+
+// Whether pane is a pane that is open
+int layout_valid(int pane) {
+  return pane >= 0 && pane < LAYOUT_MAX_NODES && Tiles.nodes[pane].used && layout_is_pane(pane);
+}
+
+LayoutRect layout_rect(int pane) {
+  return Tiles.nodes[pane].rect;
+}
@@ -0,0 +1,275 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+// Line text lives in large mmap'd slabs instead of one malloc per line.
+// Blocks come in power of two size classes with a free list per class, so
+// a line that grows is moved at most log2(size) times and freed blocks are
+// reused. Loading a file packs lines densely with a bump pointer. Lines
+// bigger than the largest class get their own mapping, which grows in
+// place through mremap instead of being copied. Dropping a whole
+// document unmaps a handful of slabs instead of freeing every line.
+
+#define ARENA_MIN_CLASS_SHIFT 4
+#define ARENA_MAX_CLASS_SHIFT 16
+#define ARENA_CLASS_COUNT (ARENA_MAX_CLASS_SHIFT - ARENA_MIN_CLASS_SHIFT + 1)
+#define ARENA_MIN_BLOCK (1 << ARENA_MIN_CLASS_SHIFT)
+#define ARENA_MAX_BLOCK (1 << ARENA_MAX_CLASS_SHIFT)
+#define ARENA_FIRST_SLAB (1 << 20)
+#define ARENA_MAX_SLAB (64 << 20)
+#define ARENA_ALIGN 8
+
+// ===============================
+// DATA STRUCTURES
+// ===============================
+
+typedef struct Slab {
+  struct Slab *next;
+  size_t size;
+} Slab;
+
+typedef struct LargeBlock {
+  struct LargeBlock *prev;
+  struct LargeBlock *next;
+  size_t size;
+  size_t pad;
+} LargeBlock;
+
+typedef struct FreeBlock {
+  struct FreeBlock *next;
+} FreeBlock;
+
+typedef struct LineArena {
+  Slab *slabs;
+  size_t next_slab_size;
+  char *bump;
+  size_t bump_left;
+  FreeBlock *free_lists[ARENA_CLASS_COUNT];
+  LargeBlock *large;
+  size_t mapped;
+  size_t in_use;
+} LineArena;
+
+// ===============================
+// HELPERS
+// ===============================
+
+void *arena_map(size_t size) {
+  void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(p == MAP_FAILED) {
+    perror("mmap");
+    exit(EXIT_FAILURE);
+  }
+  return p;
+}
+
+int arena_class_of(size_t size) {
+  int shift = ARENA_MIN_CLASS_SHIFT;
+  while(((size_t)1 << shift) < size) shift++;
+  return shift - ARENA_MIN_CLASS_SHIFT;
+}
+
+// Largest class that fits entirely inside size bytes, or -1
+int arena_class_within(size_t size) {
+  if(size < ARENA_MIN_BLOCK) return -1;
+  int shift = ARENA_MIN_CLASS_SHIFT;
+  while(shift < ARENA_MAX_CLASS_SHIFT && ((size_t)2 << shift) <= size) shift++;
+  return shift - ARENA_MIN_CLASS_SHIFT;
+}
+
+void arena_push_free(LineArena *a, char *p, int cls) {
+  FreeBlock *block = (FreeBlock *)p;
+  block->next = a->free_lists[cls];
+  a->free_lists[cls] = block;
+}
+
+// Hands the unused tail of the current slab to the free lists
+void arena_retire_bump(LineArena *a) {
+  while(a->bump_left >= ARENA_MIN_BLOCK) {
+    int cls = arena_class_within(a->bump_left);
+    size_t size = (size_t)1 << (cls + ARENA_MIN_CLASS_SHIFT);
+    arena_push_free(a, a->bump, cls);
+    a->bump += size;
+    a->bump_left -= size;
+  }
+  a->bump_left = 0;
+}
+
+char *arena_bump(LineArena *a, size_t size) {
+  if(size > a->bump_left) {
+    arena_retire_bump(a);
+
+    size_t slab_size = a->next_slab_size;
+    Slab *slab = arena_map(slab_size);
+    slab->next = a->slabs;
+    slab->size = slab_size;
+    a->slabs = slab;
+    a->mapped += slab_size;
+    a->bump = (char *)slab + sizeof(Slab);
+    a->bump_left = slab_size - sizeof(Slab);
+    if(a->next_slab_size < ARENA_MAX_SLAB) a->next_slab_size *= 2;
+  }
+
+  char *p = a->bump;
+  a->bump += size;
+  a->bump_left -= size;
+  return p;
+}
+
+char *arena_alloc_large(LineArena *a, size_t need, int *capacity) {
+  size_t size = (need + sizeof(LargeBlock) + 4095) & ~(size_t)4095;
+  LargeBlock *block = arena_map(size);
+  block->prev = NULL;
+  block->next = a->large;
+  block->size = size;
+  if(a->large) a->large->prev = block;
+  a->large = block;
+  a->mapped += size;
+
+  *capacity = (int)(size - sizeof(LargeBlock));
+  return (char *)(block + 1);
+}
+
+// Grows a block with a mapping of its own by remapping it, which moves
+// pages rather than copying the text, and leaves room for the edits after
+// this one
+char *arena_grow_large(LineArena *a, char *p, int capacity, size_t need, int *new_capacity) {
+  LargeBlock *block = (LargeBlock *)p - 1;
+  size_t old_size = block->size;
+  size_t size = (need + need / 8 + sizeof(LargeBlock) + 4095) & ~(size_t)4095;
+  block = mremap(block, old_size, size, MREMAP_MAYMOVE);
+  if(block == MAP_FAILED) {
+    perror("mremap");
+    exit(EXIT_FAILURE);
+  }
+  if(block->prev) block->prev->next = block;
+  else a->large = block;
+  if(block->next) block->next->prev = block;
+  block->size = size;
+  a->mapped += size - old_size;
+
+  *new_capacity = (int)(size - sizeof(LargeBlock));
+  a->in_use += *new_capacity - capacity;
+  return (char *)(block + 1);
+}
+
+// ===============================
+// ARENA API
+// ===============================
+
+LineArena *line_arena_create() {
+  LineArena *a = calloc(1, sizeof(LineArena));
+  if(!a) {
+    perror("Malloc failled");
+    exit(EXIT_FAILURE);
+  }
+  a->next_slab_size = ARENA_FIRST_SLAB;
+  return a;
+}
+
+// Block of at least need bytes from the matching size class
+char *line_arena_alloc(LineArena *a, size_t need, int *capacity) {
+  if(need > ARENA_MAX_BLOCK) {
+    char *p = arena_alloc_large(a, need, capacity);
+    a->in_use += *capacity;
+    return p;
+  }
+
+  int cls = arena_class_of(need);
+  size_t size = (size_t)1 << (cls + ARENA_MIN_CLASS_SHIFT);
+  char *p;
+  if(a->free_lists[cls]) {
+    p = (char *)a->free_lists[cls];
+    a->free_lists[cls] = a->free_lists[cls]->next;
+  }
+  else {
+    p = arena_bump(a, size);
+  }
+
+  *capacity = (int)size;
+  a->in_use += size;
+  return p;
+}
+
+// Densely packed block for text that is loaded once and rarely edited
+char *line_arena_alloc_packed(LineArena *a, size_t need, int *capacity) {
+  if(need > ARENA_MAX_BLOCK) return line_arena_alloc(a, need, capacity);
+
+  size_t size = (need + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+  if(size < ARENA_MIN_BLOCK) size = ARENA_MIN_BLOCK;
+
+  *capacity = (int)size;
+  a->in_use += size;
+  return arena_bump(a, size);
+}
+
+void line_arena_free(LineArena *a, char *p, int capacity) {
+  if(!p) return;
+  a->in_use -= capacity;
+
+  if(capacity > ARENA_MAX_BLOCK) {
+    LargeBlock *block = (LargeBlock *)p - 1;
+    if(block->prev) block->prev->next = block->next;
+    else a->large = block->next;
+    if(block->next) block->next->prev = block->prev;
+    a->mapped -= block->size;
+    munmap(block, block->size);
+    return;
+  }
+
+  // Packed blocks are rounded down to the class that fits inside them
+  int cls = arena_class_within(capacity);
+  if(cls >= 0) arena_push_free(a, p, cls);
+}
+
+// Moves used bytes of p to a block of at least need bytes unless it
+// already fits
+char *line_arena_grow(LineArena *a, char *p, int used, int capacity, size_t need, int *new_capacity) {
+  if(p && need <= (size_t)capacity) {
+    *new_capacity = capacity;
+    return p;
+  }
+  if(p && capacity > ARENA_MAX_BLOCK) return arena_grow_large(a, p, capacity, need, new_capacity);
+
+  char *q = line_arena_alloc(a, need, new_capacity);
+  if(p) {
+    memcpy(q, p, used);
+    line_arena_free(a, p, capacity);
+  }
+  return q;
+}
+
+// Drops every line at once
+void line_arena_reset(LineArena *a) {
+  while(a->slabs) {
+    Slab *next = a->slabs->next;
+    munmap(a->slabs, a->slabs->size);
+    a->slabs = next;
+  }
+  while(a->large) {
+    LargeBlock *next = a->large->next;
+    munmap(a->large, a->large->size);
+    a->large = next;
+  }
+
+  memset(a->free_lists, 0, sizeof(a->free_lists));
+  a->next_slab_size = ARENA_FIRST_SLAB;
+  a->bump = NULL;
+  a->bump_left = 0;
+  a->mapped = 0;
+  a->in_use = 0;
+}
+
+void line_arena_destroy(LineArena *a) {
+  if(!a) return;
+  line_arena_reset(a);
+  free(a);
+}
+
+void line_arena_usage(LineArena *a, size_t *in_use, size_t *mapped) {
+  *in_use = a ? a->in_use : 0;
+  *mapped = a ? a->mapped : 0;
+}
@@ -0,0 +1,198 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "atom.h"
+
+// Remembers where a file was left and what was learned about its line
+// layout, so reopening a huge file does not start from scratch. Entries
+// live in $XDG_CACHE_HOME/atom (or ~/.cache/atom), one per device and
+// inode, and are ignored once the file's size or mtime changes. An entry
+// is a fixed header followed by the sparse line index; it is mapped, not
+// read, when a file is opened.
+//
+// The editor and the pager each keep a position record of their own: the
+// editor its cursor and scroll, the pager its top offset and line. Saving
+// one keeps the other, and a record never written reads as missing.
+
+#define LINE_CACHE_MAGIC "ATOMLIX2"
+#define LINE_CACHE_POSITION 3
+
+// ===============================
+// DATA STRUCTURES
+// ===============================
+
+typedef struct {
+  char magic[8];
+  uint64_t dev;
+  uint64_t ino;
+  int64_t size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  // Bit k set once position[k] was saved
+  int64_t saved;
+  int64_t position[LINE_CACHE_KINDS][LINE_CACHE_POSITION];
+  int64_t stride;
+  int64_t total_lines;
+  int64_t count;
+} LineCacheHeader;
+
+typedef struct LineCache {
+  void *map;
+  size_t len;
+  LineCacheHeader *header;
+} LineCache;
+
+// ===============================
+// HELPERS
+// ===============================
+
+int line_cache_dir(char *out, size_t size) {
+  const char *xdg = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  char base[PATH_MAX];
+
+  if(xdg && xdg[0]) snprintf(base, sizeof(base), "%s", xdg);
+  else if(home && home[0]) snprintf(base, sizeof(base), "%s/.cache", home);
+  else return 0;
+
+  mkdir(base, 0700);
+  snprintf(out, size, "%s/atom", base);
+  mkdir(out, 0700);
+  return 1;
+}
+
+// Fills the header key for path and the cache file that belongs to it
+int line_cache_key(const char *path, LineCacheHeader *h, char *cache_path, size_t size) {
+  struct stat st;
+  char dir[PATH_MAX];
+  if(stat(path, &st) != 0 || !line_cache_dir(dir, sizeof(dir))) return 0;
+
+  memset(h, 0, sizeof(*h));
+  memcpy(h->magic, LINE_CACHE_MAGIC, sizeof(h->magic));
+  h->dev = st.st_dev;
+  h->ino = st.st_ino;
+  h->size = st.st_size;
+  h->mtime_sec = st.st_mtim.tv_sec;
+  h->mtime_nsec = st.st_mtim.tv_nsec;
+
+  snprintf(cache_path, size, "%s/%llx-%llx.idx", dir,
+           (unsigned long long)h->dev, (unsigned long long)h->ino);
+  return 1;
+}
+
+// ===============================
+// LINE CACHE API
+// ===============================
+
+// Maps the entry for path if it still describes the file
+LineCache *line_cache_open(const char *path) {
+  LineCacheHeader key;
+  char cache_path[PATH_MAX];
+  if(!line_cache_key(path, &key, cache_path, sizeof(cache_path))) return NULL;
+
+  int fd = open(cache_path, O_RDONLY | O_CLOEXEC);
+  if(fd < 0) return NULL;
+  struct stat st;
+  if(fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(LineCacheHeader)) {
+    close(fd);
+    return NULL;
+  }
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(map == MAP_FAILED) return NULL;
+
+  LineCacheHeader *h = map;
+  size_t expected = sizeof(LineCacheHeader) + (h->count > 0 ? h->count : 0) * sizeof(off_t);
+  if(memcmp(h->magic, key.magic, sizeof(h->magic)) != 0 ||
+     h->dev != key.dev || h->ino != key.ino || h->size != key.size ||
+     h->mtime_sec != key.mtime_sec || h->mtime_nsec != key.mtime_nsec ||
+     h->count < 0 || expected != (size_t)st.st_size) {
+    munmap(map, st.st_size);
+    return NULL;
+  }
+
+  LineCache *c = malloc(sizeof(LineCache));
+  if(!c) {
+    perror("Malloc failled");
+    exit(EXIT_FAILURE);
+  }
+  c->map = map;
+  c->len = st.st_size;
+  c->header = h;
+  return c;
+}
+
+// Returns 0 when no position of this kind was saved
+int line_cache_position(LineCache *c, int kind, long long position[LINE_CACHE_POSITION]) {
+  if(!(c->header->saved & (1 << kind))) return 0;
+  for(int i = 0; i < LINE_CACHE_POSITION; i++) position[i] = c->header->position[kind][i];
+  return 1;
+}
+
+// Sparse index: offsets of lines 0, stride, 2 * stride... total_lines is
+// -1 when the index does not reach the end of the file
+const off_t *line_cache_index(LineCache *c, long *count, long *stride, long *total_lines) {
+  *count = c->header->count;
+  *stride = c->header->stride;
+  *total_lines = c->header->total_lines;
+  return (const off_t *)(c->header + 1);
+}
+
+void line_cache_close(LineCache *c) {
+  if(!c) return;
+  munmap(c->map, c->len);
+  free(c);
+}
+
+// Replaces the entry for path, keeping the position of the other kind if
+// the entry still describes the file. Written to a temporary file first so
+// a reader never sees half an entry.
+void line_cache_save(const char *path, int kind, const long long position[LINE_CACHE_POSITION],
+                     const off_t *index, long count, long stride, long total_lines) {
+  LineCacheHeader h;
+  char cache_path[PATH_MAX], tmp_path[PATH_MAX + 8];
+  if(!line_cache_key(path, &h, cache_path, sizeof(cache_path))) return;
+
+  LineCache *old = line_cache_open(path);
+  if(old) {
+    h.saved = old->header->saved;
+    memcpy(h.position, old->header->position, sizeof(h.position));
+    line_cache_close(old);
+  }
+  h.saved |= 1 << kind;
+  for(int i = 0; i < LINE_CACHE_POSITION; i++) h.position[kind][i] = position[i];
+  h.stride = stride;
+  h.total_lines = total_lines;
+  h.count = index ? count : 0;
+
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", cache_path);
+  FILE *f = fopen(tmp_path, "w");
+  if(!f) return;
+  int ok = fwrite(&h, sizeof(h), 1, f) == 1;
+  if(ok && h.count > 0) ok = fwrite(index, sizeof(off_t), h.count, f) == (size_t)h.count;
+  if(fclose(f) != 0) ok = 0;
+
+  if(ok) rename(tmp_path, cache_path);
+  else unlink(tmp_path);
+}
+
+// Replaces only one position of the entry for path; a line index the
+// pager built for the same file is kept
+void line_cache_save_position(const char *path, int kind, const long long position[LINE_CACHE_POSITION]) {
+  LineCache *c = line_cache_open(path);
+  if(!c) {
+    line_cache_save(path, kind, position, NULL, 0, 0, -1);
+    return;
+  }
+  long count, stride, total_lines;
+  const off_t *index = line_cache_index(c, &count, &stride, &total_lines);
+  line_cache_save(path, kind, position, index, count, stride, total_lines);
+  line_cache_close(c);
+}
@@ -0,0 +1,163 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Interned line text for files full of repeated lines, like logs of
+// heartbeats and stack traces. Loading a line looks its text up in a hash
+// table and shares the copy already there, so every distinct line is
+// stored once in the arena. Entries count the lines pointing at them and
+// go back to the arena when the last one is edited or deleted.
+//
+// A shared line has capacity 0: it owns no block, so line_reserve copies
+// it out before it is written and freeing it only drops a reference.
+
+#define LINE_STORE_MAX_LINE 4096
+#define LINE_STORE_FIRST_BUCKETS 1024
+
+typedef struct LineArena LineArena;
+
+char *line_arena_alloc_packed(LineArena *a, size_t need, int *capacity);
+void line_arena_free(LineArena *a, char *p, int capacity);
+
+// ===============================
+// DATA STRUCTURES
+// ===============================
+
+typedef struct LineStore LineStore;
+
+// Header of an arena block; the text follows it
+typedef struct LineEntry {
+  struct LineEntry *next;
+  LineStore *store;
+  uint32_t hash;
+  int refs;
+  int size;
+  int capacity;
+} LineEntry;
+
+typedef struct LineStore {
+  LineArena *arena;
+  LineEntry **buckets;
+  size_t bucket_count;
+  long long unique;
+  long long lines;
+  // Bytes the lines sharing an entry would take with blocks of their own
+  long long saved;
+} LineStore;
+
+// ===============================
+// HELPERS
+// ===============================
+
+uint32_t line_store_hash(const char *p, int len) {
+  uint64_t h = 0x9e3779b97f4a7c15ULL ^ (uint64_t)len;
+  int i = 0;
+  for(; i + 8 <= len; i += 8) {
+    uint64_t w;
+    memcpy(&w, p + i, 8);
+    h = (h ^ w) * 0xff51afd7ed558ccdULL;
+    h ^= h >> 32;
+  }
+  uint64_t tail = 0;
+  for(int k = 0; i < len; i++, k += 8) tail |= (uint64_t)(unsigned char)p[i] << k;
+  h = (h ^ tail) * 0xc4ceb9fe1a85ec53ULL;
+  return (uint32_t)(h ^ (h >> 29));
+}
+
+void line_store_rehash(LineStore *s, size_t bucket_count) {
+  LineEntry **buckets = calloc(bucket_count, sizeof(LineEntry *));
+  if(!buckets) {
+    perror("Malloc failled");
+    exit(EXIT_FAILURE);
+  }
+  for(size_t b = 0; b < s->bucket_count; b++) {
+    LineEntry *e = s->buckets[b];
+    while(e) {
+      LineEntry *next = e->next;
+      size_t k = e->hash & (bucket_count - 1);
+      e->next = buckets[k];
+      buckets[k] = e;
+      e = next;
+    }
+  }
+  free(s->buckets);
+  s->buckets = buckets;
+  s->bucket_count = bucket_count;
+}
+
+// ===============================
+// LINE STORE API
+// ===============================
+
+LineStore *line_store_create(LineArena *a) {
+  LineStore *s = calloc(1, sizeof(LineStore));
+  if(!s) {
+    perror("Malloc failled");
+    exit(EXIT_FAILURE);
+  }
+  s->arena = a;
+  line_store_rehash(s, LINE_STORE_FIRST_BUCKETS);
+  return s;
+}
+
+// Entries live in the arena and go with it
+void line_store_destroy(LineStore *s) {
+  if(!s) return;
+  free(s->buckets);
+  free(s);
+}
+
+// Shared, NUL terminated copy of text with one more reference, or NULL
+// for lines too long to be worth looking up
+char *line_store_intern(LineStore *s, const char *text, int len) {
+  if(len > LINE_STORE_MAX_LINE) return NULL;
+  uint32_t hash = line_store_hash(text, len);
+  for(LineEntry *e = s->buckets[hash & (s->bucket_count - 1)]; e; e = e->next) {
+    if(e->hash == hash && e->size == len && memcmp(e + 1, text, len) == 0) {
+      e->refs++;
+      s->lines++;
+      s->saved += len + 1;
+      return (char *)(e + 1);
+    }
+  }
+
+  if(s->unique >= (long long)s->bucket_count) line_store_rehash(s, s->bucket_count * 2);
+  int capacity;
+  LineEntry *e = (LineEntry *)line_arena_alloc_packed(s->arena, sizeof(LineEntry) + len + 1, &capacity);
+  size_t k = hash & (s->bucket_count - 1);
+  *e = (LineEntry){ .next = s->buckets[k], .store = s, .hash = hash, .refs = 1, .size = len, .capacity = capacity };
+  s->buckets[k] = e;
+  char *p = (char *)(e + 1);
+  memcpy(p, text, len);
+  p[len] = '\0';
+  s->unique++;
+  s->lines++;
+  return p;
+}
+
+// Drops a reference taken by line_store_intern
+void line_store_release(char *text) {
+  LineEntry *e = (LineEntry *)text - 1;
+  LineStore *s = e->store;
+  s->lines--;
+  if(--e->refs > 0) {
+    s->saved -= e->size + 1;
+    return;
+  }
+
+  LineEntry **link = &s->buckets[e->hash & (s->bucket_count - 1)];
+  while(*link != e) link = &(*link)->next;
+  *link = e->next;
+  s->unique--;
+  line_arena_free(s->arena, (char *)e, e->capacity);
+}
+
+// Lines sharing the store, distinct texts among them, bytes saved by
+// sharing and bytes taken by the table
+void line_store_usage(LineStore *s, long long *lines, long long *unique, long long *saved, size_t *table) {
+  *lines = s ? s->lines : 0;
+  *unique = s ? s->unique : 0;
+  *saved = s ? s->saved : 0;
+  *table = s ? sizeof(LineStore) + s->bucket_count * sizeof(LineEntry *) : 0;
+}
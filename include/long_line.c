@@ -0,0 +1,143 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "atom.h"
+
+// Lines too long to lex from their start on every frame, like minified JS
+// or a JSON dump on one line. Drawing shows only the columns scrolled into
+// view, but the highlighter has to know whether they start inside a string
+// or a comment. Every LONG_LINE_STEP bytes the state the lexer is in is
+// kept, so finding it for any column lexes less than one step.
+//
+// Checkpoints are kept for a few lines at a time, least recently drawn
+// ones making room. Typing into a line keeps those before the change;
+// any other edit of it drops them.
+
+#define LONG_LINE_MIN 4096
+#define LONG_LINE_STEP 4096
+#define LONG_LINE_SLOTS 16
+
+int syntax_state_after(const char *line, int size, int from, int to, int state);
+
+// ===============================
+// DATA STRUCTURES
+// ===============================
+
+typedef struct {
+  int taken;
+  int buffer;
+  int line;
+  // State at k * LONG_LINE_STEP for k < count
+  unsigned char *states;
+  int count;
+  int capacity;
+  unsigned long used;
+} LongLine;
+
+// ===============================
+// GLOBAL
+// ===============================
+
+LongLine LongLines[LONG_LINE_SLOTS];
+
+unsigned long LongLineClock = 0;
+
+// The line whose next edit was announced by long_line_note_change, -1
+// when none was
+int LongLineSpared = -1;
+
+// ===============================
+// HELPERS
+// ===============================
+
+LongLine *long_line_find(int buffer, int y) {
+  for(int i = 0; i < LONG_LINE_SLOTS; i++) {
+    if(LongLines[i].taken && LongLines[i].buffer == buffer && LongLines[i].line == y) return &LongLines[i];
+  }
+  return NULL;
+}
+
+// A slot for line y, taking the least recently drawn one when none is free
+LongLine *long_line_take(int buffer, int y) {
+  LongLine *slot = &LongLines[0];
+  for(int i = 0; i < LONG_LINE_SLOTS; i++) {
+    LongLine *l = &LongLines[i];
+    if(!l->taken) {
+      slot = l;
+      break;
+    }
+    if(l->used < slot->used) slot = l;
+  }
+  slot->taken = 1;
+  slot->buffer = buffer;
+  slot->line = y;
+  slot->count = 0;
+  return slot;
+}
+
+void long_line_reserve(LongLine *l, int count) {
+  if(count <= l->capacity) return;
+  int capacity = l->capacity ? l->capacity : 64;
+  while(capacity < count) capacity *= 2;
+  unsigned char *tmp = realloc(l->states, capacity);
+  if(!tmp) {
+    perror("Malloc failled");
+    exit(EXIT_FAILURE);
+  }
+  l->states = tmp;
+  l->capacity = capacity;
+}
+
+// ===============================
+// LONG LINE API
+// ===============================
+
+// Highlighter state at column x of line y of buffer, whose text is size
+// bytes long
+int long_line_state(int buffer, int y, const char *text, int size, int x) {
+  if(x < LONG_LINE_MIN) return syntax_state_after(text, size, 0, x, SYNTAX_CODE);
+
+  LongLine *l = long_line_find(buffer, y);
+  if(!l) l = long_line_take(buffer, y);
+  l->used = ++LongLineClock;
+
+  int k = x / LONG_LINE_STEP;
+  long_line_reserve(l, k + 1);
+  if(l->count == 0) l->states[l->count++] = SYNTAX_CODE;
+  while(l->count <= k) {
+    int from = (l->count - 1) * LONG_LINE_STEP;
+    l->states[l->count] = syntax_state_after(text, size, from, from + LONG_LINE_STEP, l->states[l->count - 1]);
+    l->count++;
+  }
+  return syntax_state_after(text, size, k * LONG_LINE_STEP, x, l->states[k]);
+}
+
+// The next edit of line y of buffer leaves its first x bytes alone. The
+// checkpoints before x stay.
+void long_line_note_change(int buffer, int y, int x) {
+  LongLine *l = long_line_find(buffer, y);
+  if(!l) return;
+  // The state at a checkpoint also depends on the byte right after it
+  int keep = (x + LONG_LINE_STEP - 1) / LONG_LINE_STEP;
+  if(l->count > keep) l->count = keep;
+  LongLineSpared = y;
+}
+
+// Lines [y, y + removed) of buffer became added lines
+void long_line_note_edit(int buffer, int y, int removed, int added) {
+  int spared = LongLineSpared;
+  LongLineSpared = -1;
+  for(int i = 0; i < LONG_LINE_SLOTS; i++) {
+    LongLine *l = &LongLines[i];
+    if(!l->taken || l->buffer != buffer || l->line < y) continue;
+    if(l->line >= y + removed) l->line += added - removed;
+    else if(!(removed == 1 && added == 1 && l->line == spared)) l->taken = 0;
+  }
+}
+
+// Drops the checkpoints of buffer, or of every buffer when it is -1
+void long_line_forget(int buffer) {
+  for(int i = 0; i < LONG_LINE_SLOTS; i++) {
+    if(buffer < 0 || LongLines[i].buffer == buffer) LongLines[i].taken = 0;
+  }
+}
@@ -0,0 +1,147 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Macro registers for q{reg} ... q and @{reg}. Recording keeps the keys as
+// they arrive from the terminal, before any mapping, and replay feeds them
+// back through dispatch_key so they take exactly the path typed keys take.
+// Rendering is suspended for the whole replay and the screen is drawn
+// once at the end, so a long replay costs the edits it makes and not a
+// terminal frame per key.
+
+#define MACRO_REGISTERS 26
+#define MACRO_MAX_DEPTH 64
+
+void dispatch_key(char c);
+void suspend_rendering();
+void resume_rendering();
+void flash_command_status(const char *s);
+
+// ===============================
+// DATA STRUCTURES
+// ===============================
+
+typedef struct {
+  char *keys;
+  int len;
+  int capacity;
+} MacroRegister;
+
+typedef struct {
+  MacroRegister registers[MACRO_REGISTERS];
+
+  // Register being recorded into, 0 when not recording
+  char recording;
+  // Length of the recording before the key being handled now
+  int key_start;
+
+  char last_played;
+  int depth;
+  int aborted;
+} Macros;
+
+// ===============================
+// GLOBAL
+// ===============================
+
+Macros Macro = {0};
+
+// ===============================
+// HELPERS
+// ===============================
+
+MacroRegister *macro_register(char name) {
+  name = tolower((unsigned char)name);
+  if(name < 'a' || name > 'z') return NULL;
+  return &Macro.registers[name - 'a'];
+}
+
+void macro_append(MacroRegister *r, char c) {
+  if(r->len == r->capacity) {
+    int capacity = r->capacity ? r->capacity * 2 : 64;
+    char *tmp = realloc(r->keys, capacity);
+    if(!tmp) {
+      perror("Malloc failled");
+      exit(EXIT_FAILURE);
+    }
+    r->keys = tmp;
+    r->capacity = capacity;
+  }
+  r->keys[r->len++] = c;
+}
+
+// ===============================
+// MACRO API
+// ===============================
+
+// Every key read from the terminal passes through here before dispatch
+void macro_record_key(char c) {
+  if(!Macro.recording) return;
+  MacroRegister *r = macro_register(Macro.recording);
+  Macro.key_start = r->len;
+  macro_append(r, c);
+}
+
+// An uppercase register appends to the lowercase one, as in vim.
+// Returns 0 for a name that is not a register.
+int macro_start(char name) {
+  MacroRegister *r = macro_register(name);
+  if(!r) return 0;
+  if(!isupper((unsigned char)name)) r->len = 0;
+  Macro.recording = tolower((unsigned char)name);
+  Macro.key_start = r->len;
+  return 1;
+}
+
+// Called while the key that ends the recording is handled; that key is
+// not part of the macro
+void macro_stop() {
+  if(!Macro.recording) return;
+  macro_register(Macro.recording)->len = Macro.key_start;
+  Macro.recording = 0;
+}
+
+char macro_recording() {
+  return Macro.recording;
+}
+
+// Replays register name count times; @ repeats the last register played
+void macro_play(char name, int count) {
+  if(name == '@') name = Macro.last_played;
+  MacroRegister *r = macro_register(name);
+  if(!r) {
+    flash_command_status("\033[1;31mError:\033[0m Invalid register");
+    return;
+  }
+  if(Macro.depth >= MACRO_MAX_DEPTH) {
+    Macro.aborted = 1;
+    return;
+  }
+  Macro.last_played = tolower((unsigned char)name);
+
+  // The register may be re-recorded while it plays
+  int len = r->len;
+  char *keys = malloc(len ? len : 1);
+  if(!keys) {
+    perror("Malloc failled");
+    exit(EXIT_FAILURE);
+  }
+  memcpy(keys, r->keys, len);
+
+  if(Macro.depth == 0) {
+    Macro.aborted = 0;
+    suspend_rendering();
+  }
+  Macro.depth++;
+  for(int n = 0; n < count && !Macro.aborted; n++) {
+    for(int i = 0; i < len && !Macro.aborted; i++) dispatch_key(keys[i]);
+  }
+  Macro.depth--;
+  free(keys);
+
+  if(Macro.depth == 0) {
+    resume_rendering();
+    if(Macro.aborted) flash_command_status("\033[1;31mError:\033[0m Macro recursion too deep");
+  }
+}
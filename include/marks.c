@@ -0,0 +1,352 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Marks and the jump list of a buffer are positions kept in one treap
+// ordered by line. Lines are stored relative: a node's pending shift
+// applies to its whole subtree, so an edit splits the tree around the
+// lines it replaced, shifts everything below with one tag and only
+// adjusts the positions inside the edit itself. Reading a position adds
+// up the shifts on the path from the root through parent links, so a mark
+// or a jump is found in O(log n) without the tree being searched.
+//
+// A position on a deleted line dies: its mark reads as unset and the jump
+// list skips it. Positions on lines that were replaced by fewer lines move
+// up to the last of them.
+
+#define MARK_NAMES 27
+#define MARK_CONTEXT 26
+#define MARK_MAX_JUMPS 100
+#define MARK_FIRST_NODES 64
+
+// ===============================
+// DATA STRUCTURES
+// ===============================
+
+typedef struct {
+  int line;
+  int column;
+  int dead;
+  unsigned priority;
+  int child[2];
+  int parent;
+  // Still to be added to the lines of the children
+  int shift;
+} MarkNode;
+
+typedef struct MarkSet {
+  // Node 0 is the empty tree
+  MarkNode *nodes;
+  int node_count;
+  int node_capacity;
+  int free_node;
+  unsigned seed;
+  int root;
+
+  // a to z, then the position before the latest jump; 0 when unset
+  int named[MARK_NAMES];
+
+  // Oldest first. jump is the entry being visited, jump_count while none
+  // is.
+  int jumps[MARK_MAX_JUMPS];
+  int jump_count;
+  int jump;
+
+  int *pending;
+  int pending_count;
+  int pending_capacity;
+} MarkSet;
+
+// ===============================
+// TREAP
+// ===============================
+
+int mark_new_node(MarkSet *s, int line, int column) {
+  int i = s->free_node;
+  if(i) {
+    s->free_node = s->nodes[i].child[0];
+  }
+  else {
+    if(s->node_count == s->node_capacity) {
+      int capacity = s->node_capacity * 2;
+      MarkNode *tmp = realloc(s->nodes, capacity * sizeof(MarkNode));
+      if(!tmp) {
+        perror("Malloc failled");
+        exit(EXIT_FAILURE);
+      }
+      s->nodes = tmp;
+      s->node_capacity = capacity;
+    }
+    i = s->node_count++;
+  }
+  s->seed ^= s->seed << 13;
+  s->seed ^= s->seed >> 17;
+  s->seed ^= s->seed << 5;
+  s->nodes[i] = (MarkNode){ .line = line, .column = column, .priority = s->seed };
+  return i;
+}
+
+void mark_tag(MarkSet *s, int t, int shift) {
+  if(!t) return;
+  s->nodes[t].line += shift;
+  s->nodes[t].shift += shift;
+}
+
+void mark_push(MarkSet *s, int t) {
+  MarkNode *n = &s->nodes[t];
+  if(!n->shift) return;
+  mark_tag(s, n->child[0], n->shift);
+  mark_tag(s, n->child[1], n->shift);
+  n->shift = 0;
+}
+
+void mark_adopt(MarkSet *s, int t) {
+  for(int k = 0; k < 2; k++) {
+    int c = s->nodes[t].child[k];
+    if(c) s->nodes[c].parent = t;
+  }
+}
+
+// Nodes on lines before line go to *left, the others to *right
+void mark_split(MarkSet *s, int t, int line, int *left, int *right) {
+  if(!t) {
+    *left = 0;
+    *right = 0;
+    return;
+  }
+  mark_push(s, t);
+  MarkNode *n = &s->nodes[t];
+  if(n->line < line) {
+    mark_split(s, n->child[1], line, &n->child[1], right);
+    *left = t;
+  }
+  else {
+    mark_split(s, n->child[0], line, left, &n->child[0]);
+    *right = t;
+  }
+  mark_adopt(s, t);
+}
+
+int mark_merge(MarkSet *s, int a, int b) {
+  if(!a) return b;
+  if(!b) return a;
+  if(s->nodes[a].priority > s->nodes[b].priority) {
+    mark_push(s, a);
+    int right = mark_merge(s, s->nodes[a].child[1], b);
+    s->nodes[a].child[1] = right;
+    mark_adopt(s, a);
+    return a;
+  }
+  mark_push(s, b);
+  int left = mark_merge(s, a, s->nodes[b].child[0]);
+  s->nodes[b].child[0] = left;
+  mark_adopt(s, b);
+  return b;
+}
+
+void mark_set_root(MarkSet *s, int t) {
+  s->root = t;
+  if(t) s->nodes[t].parent = 0;
+}
+
+void mark_insert(MarkSet *s, int i) {
+  MarkNode *n = &s->nodes[i];
+  n->child[0] = 0;
+  n->child[1] = 0;
+  n->shift = 0;
+  int left, right;
+  mark_split(s, s->root, n->line, &left, &right);
+  mark_set_root(s, mark_merge(s, mark_merge(s, left, i), right));
+}
+
+// Pushes the shifts down the path from the root to node i
+void mark_settle(MarkSet *s, int i) {
+  int path[64], depth = 0;
+  for(int t = s->nodes[i].parent; t && depth < 64; t = s->nodes[t].parent) path[depth++] = t;
+  while(depth > 0) mark_push(s, path[--depth]);
+}
+
+// Takes live node i out of the tree
+void mark_unlink(MarkSet *s, int i) {
+  mark_settle(s, i);
+  mark_push(s, i);
+  MarkNode *n = &s->nodes[i];
+  int joined = mark_merge(s, n->child[0], n->child[1]);
+  int parent = n->parent;
+  if(!parent) {
+    mark_set_root(s, joined);
+    return;
+  }
+  MarkNode *p = &s->nodes[parent];
+  p->child[p->child[0] == i ? 0 : 1] = joined;
+  if(joined) s->nodes[joined].parent = parent;
+}
+
+void mark_release(MarkSet *s, int i) {
+  if(!i) return;
+  if(!s->nodes[i].dead) mark_unlink(s, i);
+  s->nodes[i].child[0] = s->free_node;
+  s->free_node = i;
+}
+
+// Line of node i: its own plus the shifts its ancestors still owe it
+int mark_line(MarkSet *s, int i) {
+  int line = s->nodes[i].line;
+  for(int t = s->nodes[i].parent; t; t = s->nodes[t].parent) line += s->nodes[t].shift;
+  return line;
+}
+
+void mark_collect(MarkSet *s, int t) {
+  if(!t) return;
+  mark_push(s, t);
+  mark_collect(s, s->nodes[t].child[0]);
+  if(s->pending_count == s->pending_capacity) {
+    int capacity = s->pending_capacity ? s->pending_capacity * 2 : 64;
+    int *tmp = realloc(s->pending, capacity * sizeof(int));
+    if(!tmp) {
+      perror("Malloc failled");
+      exit(EXIT_FAILURE);
+    }
+    s->pending = tmp;
+    s->pending_capacity = capacity;
+  }
+  s->pending[s->pending_count++] = t;
+  mark_collect(s, s->nodes[t].child[1]);
+}
+
+// ===============================
+// JUMP LIST
+// ===============================
+
+void mark_drop_jump(MarkSet *s, int k) {
+  mark_release(s, s->jumps[k]);
+  memmove(&s->jumps[k], &s->jumps[k + 1], (s->jump_count - k - 1) * sizeof(int));
+  s->jump_count--;
+}
+
+// Appends a position, dropping dead entries and any older one on line
+void mark_append_jump(MarkSet *s, int line, int column) {
+  for(int k = s->jump_count - 1; k >= 0; k--) {
+    int i = s->jumps[k];
+    if(s->nodes[i].dead || mark_line(s, i) == line) mark_drop_jump(s, k);
+  }
+  if(s->jump_count == MARK_MAX_JUMPS) mark_drop_jump(s, 0);
+  int i = mark_new_node(s, line, column);
+  mark_insert(s, i);
+  s->jumps[s->jump_count++] = i;
+  s->jump = s->jump_count;
+}
+
+// ===============================
+// MARKS API
+// ===============================
+
+MarkSet *mark_set_create() {
+  MarkSet *s = calloc(1, sizeof(MarkSet));
+  if(s) s->nodes = malloc(MARK_FIRST_NODES * sizeof(MarkNode));
+  if(!s || !s->nodes) {
+    perror("Malloc failled");
+    exit(EXIT_FAILURE);
+  }
+  s->node_capacity = MARK_FIRST_NODES;
+  s->node_count = 1;
+  s->nodes[0] = (MarkNode){0};
+  s->seed = 2463534242u;
+  return s;
+}
+
+void mark_set_destroy(MarkSet *s) {
+  if(!s) return;
+  free(s->nodes);
+  free(s->pending);
+  free(s);
+}
+
+// Lines [y, y + removed) were replaced by added lines
+void mark_note_edit(MarkSet *s, int y, int removed, int added) {
+  if(!s || !s->root || removed == added) return;
+  int left, middle, right;
+  mark_split(s, s->root, y, &left, &right);
+  mark_split(s, right, y + removed, &middle, &right);
+  mark_tag(s, right, added - removed);
+  mark_set_root(s, mark_merge(s, left, right));
+
+  s->pending_count = 0;
+  mark_collect(s, middle);
+  for(int k = 0; k < s->pending_count; k++) {
+    int i = s->pending[k];
+    MarkNode *n = &s->nodes[i];
+    if(n->line - y < added) {
+      mark_insert(s, i);
+    }
+    else if(added > 0) {
+      n->line = y + added - 1;
+      mark_insert(s, i);
+    }
+    else {
+      n->dead = 1;
+      n->parent = 0;
+    }
+  }
+  s->pending_count = 0;
+}
+
+// Sets mark name (a to z, or ' for the position before the last jump)
+void mark_set(MarkSet *s, char name, int line, int column) {
+  int k = name == '\'' ? MARK_CONTEXT : name - 'a';
+  if(k < 0 || k >= MARK_NAMES) return;
+  mark_release(s, s->named[k]);
+  s->named[k] = mark_new_node(s, line, column);
+  mark_insert(s, s->named[k]);
+}
+
+// Returns 0 when the mark is unset or its line was deleted
+int mark_get(MarkSet *s, char name, int *line, int *column) {
+  int k = name == '\'' || name == '`' ? MARK_CONTEXT : name - 'a';
+  if(!s || k < 0 || k >= MARK_NAMES || !s->named[k]) return 0;
+  int i = s->named[k];
+  if(s->nodes[i].dead) return 0;
+  *line = mark_line(s, i);
+  *column = s->nodes[i].column;
+  return 1;
+}
+
+// Called before a jump leaves line, column
+void mark_jump_from(MarkSet *s, int line, int column) {
+  mark_set(s, '\'', line, column);
+  mark_append_jump(s, line, column);
+}
+
+// The entry before the one being visited. Leaving the newest end of the
+// list keeps the current position there so it can be come back to.
+// Returns 0 at the oldest entry.
+int mark_jump_older(MarkSet *s, int line, int column, int *to_line, int *to_column) {
+  if(!s) return 0;
+  if(s->jump >= s->jump_count) {
+    mark_append_jump(s, line, column);
+    s->jump = s->jump_count - 1;
+  }
+  for(int k = s->jump - 1; k >= 0; k--) {
+    int i = s->jumps[k];
+    if(s->nodes[i].dead) continue;
+    s->jump = k;
+    *to_line = mark_line(s, i);
+    *to_column = s->nodes[i].column;
+    return 1;
+  }
+  return 0;
+}
+
+// The entry after the one being visited; 0 at the newest
+int mark_jump_newer(MarkSet *s, int *to_line, int *to_column) {
+  if(!s) return 0;
+  for(int k = s->jump + 1; k < s->jump_count; k++) {
+    int i = s->jumps[k];
+    if(s->nodes[i].dead) continue;
+    s->jump = k;
+    *to_line = mark_line(s, i);
+    *to_column = s->nodes[i].column;
+    return 1;
+  }
+  return 0;
+}
@@ -4,10 +4,16 @@
 #include <unistd.h>
 #include <sys/stat.h>
 
+#include "atom.h"
+
 int WIDTH, HEIGHT;
 
 void cmd_quit();
-void start_buffer(char *filepath);
+int start_buffer(char *filepath);
+
+void keymap_init(int mode, KeyFallback fallback, int timeout_ms, int counted);
+void keymap_bind_table(int mode, const KeyBinding *table, int count);
+void keymap_feed(int mode, char c);
 
 const char *welcome_lines[11] = {
   "\033[38;2;255;120;70m原子\033[0m\n",
@@ -95,40 +101,32 @@ void process_menu_command_mode(char *buffer) {
   }
 }
 
-void handle_menu_command_mode() {
-  char c;
-  char buffer[256];
-  int i = 0;
-
-  while(1) {
-    read(STDIN_FILENO, &c, sizeof(c)); 
-
-    if(!c) {
-      perror("Error reading character");
-      exit(EXIT_FAILURE);
-    }
-
-    switch (c) {
-      case '\r':
-      case '\n':  // Enter key
-        buffer[i] = '\0';
-        process_menu_command_mode(buffer);
-        i = 0;
-        break;
-      case 8:
-      case 127: // Backspace
-        if(i > 0) {
-          i--;
-          buffer[i] = '\0';
-          write(STDOUT_FILENO, "\b \b", 3);
-        }
-        break;
-      default:
-        buffer[i] = c;
-        i++;
+// Menu command line, fed one key at a time by the event loop
+char MenuCommand[256];
+int MenuCommandLen = 0;
+int MenuCommandActive = 0;
+
+void handle_menu_command_key(char c) {
+  switch (c) {
+    case '\r':
+    case '\n':  // Enter key
+      MenuCommand[MenuCommandLen] = '\0';
+      MenuCommandLen = 0;
+      process_menu_command_mode(MenuCommand);
+      break;
+    case 8:
+    case 127: // Backspace
+      if(MenuCommandLen > 0) {
+        MenuCommandLen--;
+        write(STDOUT_FILENO, "\b \b", 3);
+      }
+      break;
+    default:
+      if(MenuCommandLen < (int)sizeof(MenuCommand) - 1) {
+        MenuCommand[MenuCommandLen++] = c;
         write(STDOUT_FILENO, &c, sizeof(c));
-        break;
-    }
+      }
+      break;
   }
 }
 
@@ -136,16 +134,32 @@ void enter_menu_command_mode() {
   dprintf(STDOUT_FILENO, "\033[%d;1H", HEIGHT);
   write(STDOUT_FILENO, "\033[2K", 4);
   write(STDOUT_FILENO, ":", 1);
-  handle_menu_command_mode();
+  MenuCommandLen = 0;
+  MenuCommandActive = 1;
+}
+
+const KeyBinding MenuBindings[] = {
+  { ":", enter_menu_command_mode },
+  { "q", cmd_quit },
+};
+
+void init_menu_keys() {
+  keymap_init(KEYMAP_MENU, NULL, KEY_SEQUENCE_TIMEOUT_MS, 0);
+  keymap_bind_table(KEYMAP_MENU, MenuBindings, sizeof(MenuBindings) / sizeof(MenuBindings[0]));
 }
 
 void handle_menu_input(char c) {
-  switch(c) {
-    case ':':
-      enter_menu_command_mode();
-      break;
-    case 'q': cmd_quit(); break; 
+  if(MenuCommandActive) {
+    handle_menu_command_key(c);
+    return;
   }
+  keymap_feed(KEYMAP_MENU, c);
+}
+
+void resize_menu(int win_h, int win_w) {
+  WIDTH = win_w;
+  HEIGHT = win_h;
+  print_menu();
 }
 
 void start_menu(int win_h, int win_w) {
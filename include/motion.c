@@ -0,0 +1,363 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Cursor motions that look at the text: words, WORDs, characters,
+// brackets and paragraphs. Every byte is a blank, a word character
+// (letters, digits, _ and anything past ASCII, so UTF-8 letters stay in
+// their word) or punctuation. Boundaries are found sixteen bytes at a
+// time: a block is classified into one bit per byte with a few SSE2
+// compares, and the first or last bit of the wanted classes is the next
+// boundary. A count of words over a line of minified JSON costs a handful
+// of blocks per word instead of a call per byte.
+//
+// Positions are (line, column) pairs passed by pointer and moved in place.
+// The functions return 0 when there was nowhere to move.
+
+#define MOTION_BLANK 1
+#define MOTION_PUNCT 2
+#define MOTION_WORD 4
+#define MOTION_ANY (MOTION_BLANK | MOTION_PUNCT | MOTION_WORD)
+#define MOTION_BLOCK 16
+
+const char *document_line_text(int y, int *len);
+int document_line_count();
+
+// ===============================
+// CHARACTER CLASSES
+// ===============================
+
+int motion_class(unsigned char c) {
+  if(c == ' ' || c == '\t') return MOTION_BLANK;
+  if(c >= 0x80 || c == '_' || (c >= '0' && c <= '9') || ((c | 0x20) >= 'a' && (c | 0x20) <= 'z')) return MOTION_WORD;
+  return MOTION_PUNCT;
+}
+
+// Class of the byte at x; WORDs are every run of non-blanks
+int motion_class_at(const char *s, int x, int big) {
+  int c = motion_class(s[x]);
+  return big && c != MOTION_BLANK ? MOTION_PUNCT | MOTION_WORD : c;
+}
+
+#ifdef __SSE2__
+
+// One bit per byte of the 16 at s whose class is in classes
+unsigned motion_block(const char *s, int classes) {
+  __m128i b = _mm_loadu_si128((const __m128i *)s);
+  __m128i bias = _mm_set1_epi8((char)0x80);
+  __m128i blank = _mm_or_si128(_mm_cmpeq_epi8(b, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(b, _mm_set1_epi8('\t')));
+  // Unsigned ranges through a signed compare with the sign bit flipped
+  __m128i lower = _mm_or_si128(b, _mm_set1_epi8(0x20));
+  __m128i alpha = _mm_cmplt_epi8(_mm_xor_si128(_mm_sub_epi8(lower, _mm_set1_epi8('a')), bias),
+                                 _mm_set1_epi8((char)(26 ^ 0x80)));
+  __m128i digit = _mm_cmplt_epi8(_mm_xor_si128(_mm_sub_epi8(b, _mm_set1_epi8('0')), bias),
+                                 _mm_set1_epi8((char)(10 ^ 0x80)));
+  __m128i under = _mm_cmpeq_epi8(b, _mm_set1_epi8('_'));
+  unsigned blank_bits = _mm_movemask_epi8(blank);
+  // The sign bit is set on bytes past ASCII
+  unsigned word_bits = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(alpha, digit), under)) | _mm_movemask_epi8(b);
+
+  unsigned bits = 0;
+  if(classes & MOTION_BLANK) bits |= blank_bits;
+  if(classes & MOTION_WORD) bits |= word_bits;
+  if(classes & MOTION_PUNCT) bits |= ~(blank_bits | word_bits) & 0xFFFF;
+  return bits;
+}
+
+// One bit per byte of the 16 at s that is one of the n bytes in set
+unsigned motion_block_bytes(const char *s, const char *set, int n) {
+  __m128i b = _mm_loadu_si128((const __m128i *)s);
+  __m128i hit = _mm_setzero_si128();
+  for(int i = 0; i < n; i++) hit = _mm_or_si128(hit, _mm_cmpeq_epi8(b, _mm_set1_epi8(set[i])));
+  return _mm_movemask_epi8(hit);
+}
+
+#else
+
+// Without SSE2 a block is classified a byte at a time
+unsigned motion_block(const char *s, int classes) {
+  unsigned bits = 0;
+  for(int i = 0; i < MOTION_BLOCK; i++) {
+    if(motion_class(s[i]) & classes) bits |= 1u << i;
+  }
+  return bits;
+}
+
+unsigned motion_block_bytes(const char *s, const char *set, int n) {
+  unsigned bits = 0;
+  for(int i = 0; i < MOTION_BLOCK; i++) {
+    if(memchr(set, s[i], n)) bits |= 1u << i;
+  }
+  return bits;
+}
+
+#endif
+
+// ===============================
+// SCANNING
+// ===============================
+
+// First column at or after from whose byte is in classes, -1 when none
+int motion_scan_forward(const char *s, int len, int from, int classes) {
+  int i = from;
+  for(; i + MOTION_BLOCK <= len; i += MOTION_BLOCK) {
+    unsigned bits = motion_block(s + i, classes);
+    if(bits) return i + __builtin_ctz(bits);
+  }
+  for(; i < len; i++) {
+    if(motion_class(s[i]) & classes) return i;
+  }
+  return -1;
+}
+
+// Last column at or before from whose byte is in classes, -1 when none
+int motion_scan_backward(const char *s, int from, int classes) {
+  int end = from + 1;
+  for(; end >= MOTION_BLOCK; end -= MOTION_BLOCK) {
+    unsigned bits = motion_block(s + end - MOTION_BLOCK, classes);
+    if(bits) return end - MOTION_BLOCK + 31 - __builtin_clz(bits);
+  }
+  while(--end >= 0) {
+    if(motion_class(s[end]) & classes) return end;
+  }
+  return -1;
+}
+
+// Bits of the bytes in set within the block of up to 16 bytes at s
+unsigned motion_bytes_at(const char *s, int n, const char *set, int set_len) {
+  if(n == MOTION_BLOCK) return motion_block_bytes(s, set, set_len);
+  unsigned bits = 0;
+  for(int i = 0; i < n; i++) {
+    if(memchr(set, s[i], set_len)) bits |= 1u << i;
+  }
+  return bits;
+}
+
+// ===============================
+// MOTIONS API
+// ===============================
+
+// w and W: start of the next word, an empty line counting as one
+int motion_word(int *y, int *x, int count, int big) {
+  int lines = document_line_count();
+  int moved = 0;
+  while(count-- > 0) {
+    int len;
+    const char *s = document_line_text(*y, &len);
+    int p = *x;
+    if(p < len) {
+      int c = motion_class_at(s, p, big);
+      if(c != MOTION_BLANK) p = motion_scan_forward(s, len, p, MOTION_ANY & ~c);
+      if(p >= 0) p = motion_scan_forward(s, len, p, MOTION_PUNCT | MOTION_WORD);
+    }
+    else {
+      p = -1;
+    }
+    int line = *y;
+    while(p < 0 && line + 1 < lines) {
+      s = document_line_text(++line, &len);
+      p = len == 0 ? 0 : motion_scan_forward(s, len, 0, MOTION_PUNCT | MOTION_WORD);
+    }
+    if(p < 0) {
+      // Past the last word the cursor stops on the last character
+      document_line_text(line, &len);
+      p = len > 0 ? len - 1 : 0;
+      if(line == *y && p <= *x) return moved;
+    }
+    *y = line;
+    *x = p;
+    moved = 1;
+  }
+  return moved;
+}
+
+// e and E: end of the word, or of the next one when already at an end
+int motion_word_end(int *y, int *x, int count, int big) {
+  int lines = document_line_count();
+  int moved = 0;
+  while(count-- > 0) {
+    int line = *y, len;
+    const char *s = document_line_text(line, &len);
+    int p = motion_scan_forward(s, len, *x + 1, MOTION_PUNCT | MOTION_WORD);
+    while(p < 0 && line + 1 < lines) {
+      s = document_line_text(++line, &len);
+      p = motion_scan_forward(s, len, 0, MOTION_PUNCT | MOTION_WORD);
+    }
+    if(p < 0) return moved;
+    int c = motion_class_at(s, p, big);
+    int q = motion_scan_forward(s, len, p, MOTION_ANY & ~c);
+    *y = line;
+    *x = (q < 0 ? len : q) - 1;
+    moved = 1;
+  }
+  return moved;
+}
+
+// b and B: start of the word, or of the one before when already at a
+// start. An empty line counts as a word.
+int motion_word_back(int *y, int *x, int count, int big) {
+  int moved = 0;
+  while(count-- > 0) {
+    int line = *y, len;
+    const char *s = document_line_text(line, &len);
+    int p = *x - 1 < len ? *x - 1 : len - 1;
+    p = p >= 0 ? motion_scan_backward(s, p, MOTION_PUNCT | MOTION_WORD) : -1;
+    while(p < 0) {
+      if(line == 0) break;
+      s = document_line_text(--line, &len);
+      if(len == 0) break;
+      p = motion_scan_backward(s, len - 1, MOTION_PUNCT | MOTION_WORD);
+    }
+    if(p < 0) {
+      if(line == *y && *x == 0) return moved;
+      p = 0;
+    }
+    else {
+      int c = motion_class_at(s, p, big);
+      p = motion_scan_backward(s, p, MOTION_ANY & ~c) + 1;
+    }
+    *y = line;
+    *x = p;
+    moved = 1;
+  }
+  return moved;
+}
+
+// f, t, F and T on line y: the count-th c after x, or before it when dir
+// is negative. till stops one short of it.
+int motion_find_char(int y, int *x, char c, int count, int dir, int till) {
+  int len;
+  const char *s = document_line_text(y, &len);
+  int p = *x;
+  while(count-- > 0) {
+    const char *hit;
+    if(dir > 0) {
+      // t from just before a match looks past it
+      int from = p + 1 + (till && count == 0 && p + 1 < len && s[p + 1] == c);
+      hit = from < len ? memchr(s + from, c, len - from) : NULL;
+    }
+    else {
+      int end = p - (till && count == 0 && p > 0 && s[p - 1] == c);
+      hit = end > 0 ? memrchr(s, c, end) : NULL;
+    }
+    if(!hit) return 0;
+    p = hit - s;
+  }
+  if(till) p -= dir > 0 ? 1 : -1;
+  if(p == *x) return 0;
+  *x = p;
+  return 1;
+}
+
+// %: from the first bracket at or after x on line y to the one matching
+// it, across lines
+int motion_match_bracket(int *y, int *x) {
+  static const char brackets[] = "()[]{}";
+  int len;
+  const char *s = document_line_text(*y, &len);
+  int p = -1;
+  for(int i = *x; i < len && p < 0; i += MOTION_BLOCK) {
+    int n = len - i < MOTION_BLOCK ? len - i : MOTION_BLOCK;
+    unsigned bits = motion_bytes_at(s + i, n, brackets, 6);
+    if(bits) p = i + __builtin_ctz(bits);
+  }
+  if(p < 0) return 0;
+
+  int kind = strchr(brackets, s[p]) - brackets;
+  int dir = kind % 2 == 0 ? 1 : -1;
+  char pair[2] = { s[p], brackets[kind + dir] };
+  int lines = document_line_count();
+  int depth = 0;
+  for(int line = *y; line >= 0 && line < lines; line += dir) {
+    if(line != *y) {
+      s = document_line_text(line, &len);
+      p = dir > 0 ? 0 : len - 1;
+    }
+    // Blocks of the line from p towards its end in the direction of dir
+    while(dir > 0 ? p < len : p >= 0) {
+      int start = dir > 0 ? p : (p + 1 > MOTION_BLOCK ? p + 1 - MOTION_BLOCK : 0);
+      int n = dir > 0 ? (len - p < MOTION_BLOCK ? len - p : MOTION_BLOCK) : p + 1 - start;
+      unsigned bits = motion_bytes_at(s + start, n, pair, 2);
+      while(bits) {
+        int b = dir > 0 ? __builtin_ctz(bits) : 31 - __builtin_clz(bits);
+        bits &= ~(1u << b);
+        depth += s[start + b] == pair[0] ? 1 : -1;
+        if(depth == 0) {
+          *y = line;
+          *x = start + b;
+          return 1;
+        }
+      }
+      p = dir > 0 ? start + n : start - 1;
+    }
+  }
+  return 0;
+}
+
+// } and {: the count-th empty line after or before y that ends a
+// paragraph, or the last or first line when there is none
+int motion_paragraph(int *y, int *x, int count, int dir) {
+  int lines = document_line_count();
+  int line = *y, len;
+  while(count-- > 0) {
+    // An empty line only ends a paragraph once some text was passed
+    document_line_text(line, &len);
+    int text = len > 0;
+    while(line + dir >= 0 && line + dir < lines) {
+      line += dir;
+      document_line_text(line, &len);
+      if(len > 0) text = 1;
+      else if(text) break;
+    }
+  }
+  document_line_text(line, &len);
+  int column = dir > 0 && len > 0 && line == lines - 1 ? len - 1 : 0;
+  if(line == *y && column == *x) return 0;
+  *y = line;
+  *x = column;
+  return 1;
+}
+
+// The word under or after x on line y, for *. Returns 0 when there is none.
+int motion_word_under(int y, int x, int *start, int *end) {
+  int len;
+  const char *s = document_line_text(y, &len);
+  if(x >= len) return 0;
+  int p = motion_class(s[x]) == MOTION_WORD ? x : motion_scan_forward(s, len, x, MOTION_WORD);
+  if(p < 0) return 0;
+  *start = motion_scan_backward(s, p, MOTION_BLANK | MOTION_PUNCT) + 1;
+  int q = motion_scan_forward(s, len, p, MOTION_BLANK | MOTION_PUNCT);
+  *end = q < 0 ? len : q;
+  return 1;
+}
+
+// Next whole word occurrence of word after y, x, wrapping around the end
+int motion_find_word(int *y, int *x, const char *word, int word_len) {
+  int lines = document_line_count();
+  for(int k = 0; k <= lines; k++) {
+    int line = (*y + k) % lines, len;
+    const char *s = document_line_text(line, &len);
+    int from = k == 0 ? *x + 1 : 0;
+    int to = k == lines ? *x + word_len : len;
+    if(to > len) to = len;
+    while(from + word_len <= to) {
+      const char *hit = memmem(s + from, to - from, word, word_len);
+      if(!hit) break;
+      int p = hit - s;
+      int before = p > 0 && motion_class(s[p - 1]) == MOTION_WORD;
+      int after = p + word_len < len && motion_class(s[p + word_len]) == MOTION_WORD;
+      if(!before && !after) {
+        *y = line;
+        *x = p;
+        return 1;
+      }
+      from = p + 1;
+    }
+  }
+  return 0;
+}
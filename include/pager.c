@@ -0,0 +1,535 @@
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "atom.h"
+
+// Read-only pager for files that do not fit in memory (atom -R, and files
+// above mmap_threshold_mb, PAGER_AUTO_SIZE by default). The file is never loaded: a window of at most
+// three quarters of the memory budget is mapped around the position being
+// looked at, and a sparse index remembers the byte offset of every
+// stride-th line seen so far. When the index outgrows the rest of the
+// budget the stride doubles and every other checkpoint is dropped, so
+// memory stays capped whatever the file size.
+
+#define PAGER_DEFAULT_BUDGET (64 << 20)
+#define PAGER_MIN_BUDGET (1 << 20)
+#define PAGER_FIRST_STRIDE 1024
+#define PAGER_AUTO_SIZE (4LL << 30)
+
+#define KEY_ENTER 10
+#define KEY_ESC 27
+#define KEY_BACKSPACE 127
+
+typedef struct {
+  int width;
+  int height;
+  int scroll_y;
+} Window;
+
+extern Window Win;
+
+void term_write(const void *data, size_t len);
+void term_printf(const char *fmt, ...);
+void syntax_highlight_and_print(char *line, int size);
+void cmd_quit(void);
+
+typedef struct LineCache LineCache;
+LineCache *line_cache_open(const char *path);
+int line_cache_position(LineCache *c, int kind, long long position[3]);
+const off_t *line_cache_index(LineCache *c, long *count, long *stride, long *total_lines);
+void line_cache_close(LineCache *c);
+void line_cache_save(const char *path, int kind, const long long position[3],
+                     const off_t *index, long count, long stride, long total_lines);
+
+// ===============================
+// DATA STRUCTURES
+// ===============================
+
+typedef struct {
+  int active;
+  char *path;
+  int fd;
+  off_t size;
+  size_t budget;
+  off_t threshold;
+  long page;
+
+  // Mapped window [map_start, map_start + map_len)
+  char *map;
+  off_t map_start;
+  size_t map_len;
+  size_t window;
+
+  // checkpoints[i] is the offset of line i * stride
+  off_t *checkpoints;
+  long checkpoint_count;
+  long checkpoint_cap;
+  long stride;
+  int indexed_to_end;
+  long total_lines;
+
+  // Top of the screen; top_line is -1 after a jump that skipped lines
+  off_t top_offset;
+  long top_line;
+
+  int count;
+  int prompt;
+  char query[256];
+  int query_len;
+  char message[128];
+} Pager;
+
+// ===============================
+// GLOBAL
+// ===============================
+
+Pager Pg = { .fd = -1 };
+
+// ===============================
+// WINDOW MAPPING
+// ===============================
+
+void pager_unmap() {
+  if(Pg.map) munmap(Pg.map, Pg.map_len);
+  Pg.map = NULL;
+  Pg.map_len = 0;
+}
+
+// Maps the window so it contains offset. Forward scans place offset at
+// the start of the window, backward ones at the end, and the screen gets
+// some room on both sides.
+enum { MAP_AROUND, MAP_FORWARD, MAP_BACKWARD };
+
+void pager_map(off_t offset, int direction) {
+  if(Pg.map && offset >= Pg.map_start && offset < Pg.map_start + (off_t)Pg.map_len) return;
+
+  off_t start;
+  switch (direction) {
+    case MAP_FORWARD: start = offset; break;
+    case MAP_BACKWARD: start = offset - (off_t)Pg.window + Pg.page; break;
+    default: start = offset - (off_t)Pg.window / 4; break;
+  }
+  if(start < 0) start = 0;
+  start -= start % Pg.page;
+
+  size_t len = Pg.window;
+  if(start + (off_t)len > Pg.size) len = Pg.size - start;
+
+  pager_unmap();
+  if(len == 0) return;
+  Pg.map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, Pg.fd, start);
+  if(Pg.map == MAP_FAILED) {
+    perror("mmap");
+    exit(EXIT_FAILURE);
+  }
+  Pg.map_start = start;
+  Pg.map_len = len;
+  madvise(Pg.map, len, direction == MAP_AROUND ? MADV_RANDOM : MADV_SEQUENTIAL);
+}
+
+// Bytes from offset to the end of the window
+const char *bytes_at(off_t offset, size_t *avail, int direction) {
+  pager_map(offset, direction);
+  *avail = Pg.map_len - (offset - Pg.map_start);
+  return Pg.map + (offset - Pg.map_start);
+}
+
+// ===============================
+// SPARSE LINE INDEX
+// ===============================
+
+void note_line(long line, off_t offset) {
+  if(line % Pg.stride != 0 || line / Pg.stride != Pg.checkpoint_count) return;
+
+  if(Pg.checkpoint_count == Pg.checkpoint_cap) {
+    // Out of budget: keep every other checkpoint
+    long kept = 0;
+    for(long i = 0; i < Pg.checkpoint_count; i += 2) Pg.checkpoints[kept++] = Pg.checkpoints[i];
+    Pg.checkpoint_count = kept;
+    Pg.stride *= 2;
+    if(line % Pg.stride != 0 || line / Pg.stride != Pg.checkpoint_count) return;
+  }
+  Pg.checkpoints[Pg.checkpoint_count++] = offset;
+}
+
+// Last known line at or before line (for a line) or offset (for a byte)
+void nearest_checkpoint(long line, off_t offset, long *cp_line, off_t *cp_offset) {
+  long lo = 0, hi = Pg.checkpoint_count - 1;
+  while(lo < hi) {
+    long mid = (lo + hi + 1) / 2;
+    int before = line >= 0 ? mid * Pg.stride <= line : Pg.checkpoints[mid] <= offset;
+    if(before) lo = mid;
+    else hi = mid - 1;
+  }
+  *cp_line = lo * Pg.stride;
+  *cp_offset = Pg.checkpoints[lo];
+}
+
+// Start of the line after the one containing offset, or the file size
+off_t next_line_start(off_t offset) {
+  while(offset < Pg.size) {
+    size_t avail;
+    const char *p = bytes_at(offset, &avail, MAP_FORWARD);
+    const char *nl = memchr(p, '\n', avail);
+    if(nl) return offset + (nl - p) + 1;
+    offset += avail;
+  }
+  return Pg.size;
+}
+
+// Start of the line containing offset
+off_t line_start_of(off_t offset) {
+  while(offset > 0) {
+    pager_map(offset - 1, MAP_BACKWARD);
+    const char *base = Pg.map;
+    size_t len = offset - Pg.map_start;
+    const char *nl = memrchr(base, '\n', len);
+    if(nl) return Pg.map_start + (nl - base) + 1;
+    offset = Pg.map_start;
+  }
+  return 0;
+}
+
+// Walks forward from a known line, indexing as it goes, and stops at
+// target_line or at the line containing target_offset
+void walk_lines(long *line, off_t *offset, long target_line, off_t target_offset) {
+  while(*offset < Pg.size) {
+    if(target_line >= 0 && *line >= target_line) return;
+    off_t next = next_line_start(*offset);
+    if(target_offset >= 0 && next > target_offset) return;
+    if(next >= Pg.size) {
+      Pg.total_lines = *line + 1;
+      Pg.indexed_to_end = 1;
+      return;
+    }
+    (*line)++;
+    *offset = next;
+    note_line(*line, *offset);
+  }
+}
+
+// Line number of the line starting at offset, or -1 when finding it
+// would mean reading beyond the indexed part of the file
+long line_number_at(off_t offset) {
+  long line;
+  off_t at;
+  nearest_checkpoint(-1, offset, &line, &at);
+  long last_line = (Pg.checkpoint_count - 1) * Pg.stride;
+  if(line == last_line && offset - at > (off_t)Pg.window && !Pg.indexed_to_end) return -1;
+  walk_lines(&line, &at, -1, offset);
+  return line;
+}
+
+// ===============================
+// DRAWING
+// ===============================
+
+int pager_rows() {
+  return Win.height - 2;
+}
+
+void draw_pager_status() {
+  term_printf("\033[%d;1H\033[2K\033[7m", Win.height - 1);
+  int percent = Pg.size > 0 ? (int)(Pg.top_offset * 100 / Pg.size) : 100;
+  char line[32];
+  if(Pg.top_line >= 0) snprintf(line, sizeof(line), "%ld", Pg.top_line + 1);
+  else snprintf(line, sizeof(line), "?");
+  char total[32] = "";
+  if(Pg.indexed_to_end) snprintf(total, sizeof(total), "/%ld", Pg.total_lines);
+  int name_width = Win.width > 60 ? Win.width - 50 : 10;
+  term_printf("%.*s [RO] line %s%s %d%%", name_width, Pg.path, line, total, percent);
+  term_write("\033[0m", 4);
+
+  term_printf("\033[%d;1H\033[2K", Win.height);
+  if(Pg.prompt) term_printf("/%.*s", Win.width - 2, Pg.query);
+  else term_printf("%.*s", Win.width - 1, Pg.message);
+}
+
+void draw_pager() {
+  term_write("\033[?25l\033[?7l", 11);
+  off_t offset = Pg.top_offset;
+
+  for(int row = 0; row < pager_rows(); row++) {
+    term_printf("\033[%d;1H\033[2K", row + 1);
+    if(offset >= Pg.size) {
+      term_write("~", 1);
+      continue;
+    }
+
+    size_t avail;
+    const char *p = bytes_at(offset, &avail, MAP_AROUND);
+    const char *nl = memchr(p, '\n', avail);
+    if(!nl && avail < Pg.window && offset + (off_t)avail < Pg.size) {
+      // The line runs past the window: remap so it starts the window
+      pager_unmap();
+      p = bytes_at(offset, &avail, MAP_FORWARD);
+      nl = memchr(p, '\n', avail);
+    }
+    size_t len = nl ? (size_t)(nl - p) : avail;
+    if(len > 0 && p[len - 1] == '\r') len--;
+    if(len > (size_t)Win.width) len = Win.width;
+    syntax_highlight_and_print((char *)p, len);
+
+    offset = nl ? offset + (nl - p) + 1 : next_line_start(offset);
+  }
+
+  draw_pager_status();
+  if(Pg.prompt) term_printf("\033[%d;%dH\033[?25h", Win.height, Pg.query_len + 2);
+  term_write("\033[?7h", 5);
+}
+
+// ===============================
+// NAVIGATION
+// ===============================
+
+void scroll_down(long count) {
+  for(long i = 0; i < count; i++) {
+    off_t next = next_line_start(Pg.top_offset);
+    if(next >= Pg.size) break;
+    Pg.top_offset = next;
+    if(Pg.top_line >= 0) note_line(++Pg.top_line, next);
+  }
+}
+
+void scroll_up(long count) {
+  for(long i = 0; i < count && Pg.top_offset > 0; i++) {
+    Pg.top_offset = line_start_of(Pg.top_offset - 1);
+    if(Pg.top_line > 0) Pg.top_line--;
+  }
+  if(Pg.top_offset == 0) Pg.top_line = 0;
+}
+
+void goto_line(long target) {
+  long line;
+  off_t offset;
+  nearest_checkpoint(target, -1, &line, &offset);
+  walk_lines(&line, &offset, target, -1);
+  Pg.top_offset = offset;
+  Pg.top_line = line;
+}
+
+// Last screenful of the file
+void goto_end() {
+  Pg.top_offset = Pg.size > 0 ? line_start_of(Pg.size - 1) : 0;
+  Pg.top_line = -1;
+  scroll_up(pager_rows() - 1);
+  Pg.top_line = line_number_at(Pg.top_offset);
+}
+
+void goto_percent(long percent) {
+  if(percent > 100) percent = 100;
+  off_t target = Pg.size * percent / 100;
+  Pg.top_offset = target > 0 ? line_start_of(target) : 0;
+  Pg.top_line = line_number_at(Pg.top_offset);
+}
+
+// Finds the query after the top line. Matches are found with memmem over
+// the window; the overlap keeps matches that straddle two windows.
+void search_forward() {
+  if(Pg.query_len == 0) return;
+  off_t from = next_line_start(Pg.top_offset);
+  size_t overlap = Pg.query_len - 1;
+
+  while(from < Pg.size) {
+    size_t avail;
+    const char *p = bytes_at(from, &avail, MAP_FORWARD);
+    const char *hit = memmem(p, avail, Pg.query, Pg.query_len);
+    if(hit) {
+      off_t at = line_start_of(from + (hit - p));
+      long line = Pg.top_line;
+      if(line >= 0) {
+        off_t offset = Pg.top_offset;
+        walk_lines(&line, &offset, -1, at);
+      }
+      Pg.top_offset = at;
+      Pg.top_line = line;
+      Pg.message[0] = '\0';
+      return;
+    }
+    if(from + (off_t)avail >= Pg.size) break;
+    from += avail > overlap ? avail - overlap : avail;
+  }
+  snprintf(Pg.message, sizeof(Pg.message), "Pattern not found: %.*s", Pg.query_len, Pg.query);
+}
+
+void handle_pager_prompt(char c) {
+  switch (c) {
+    case KEY_ENTER:
+      Pg.prompt = 0;
+      Pg.query[Pg.query_len] = '\0';
+      search_forward();
+      break;
+    case KEY_ESC:
+      Pg.prompt = 0;
+      break;
+    case KEY_BACKSPACE:
+      if(Pg.query_len == 0) Pg.prompt = 0;
+      else Pg.query[--Pg.query_len] = '\0';
+      break;
+    default:
+      if(Pg.query_len < (int)sizeof(Pg.query) - 1) {
+        Pg.query[Pg.query_len++] = c;
+        Pg.query[Pg.query_len] = '\0';
+      }
+      // Only the prompt row changes while typing
+      draw_pager_status();
+      term_printf("\033[%d;%dH", Win.height, Pg.query_len + 2);
+      return;
+  }
+  draw_pager();
+}
+
+// ===============================
+// PAGER API
+// ===============================
+
+void handle_pager_input(char c) {
+  if(Pg.prompt) {
+    handle_pager_prompt(c);
+    return;
+  }
+
+  if(isdigit((unsigned char)c)) {
+    Pg.count = Pg.count * 10 + (c - '0');
+    return;
+  }
+  long count = Pg.count > 0 ? Pg.count : 1;
+  int had_count = Pg.count > 0;
+  Pg.count = 0;
+  Pg.message[0] = '\0';
+
+  switch (c) {
+    case 'j': scroll_down(count); break;
+    case 'k': scroll_up(count); break;
+    case ' ':
+    case 'f': scroll_down(count * pager_rows()); break;
+    case 'b': scroll_up(count * pager_rows()); break;
+    case 'g': goto_line(0); break;
+    case 'G':
+      if(had_count) goto_line(count - 1);
+      else goto_end();
+      break;
+    case '%': goto_percent(had_count ? count : 0); break;
+    case '/':
+      Pg.prompt = 1;
+      Pg.query_len = 0;
+      Pg.query[0] = '\0';
+      draw_pager_status();
+      term_printf("\033[%d;2H\033[?25h", Win.height);
+      return;
+    case 'n': search_forward(); break;
+    case 'q': cmd_quit(); return;
+    default: return;
+  }
+  draw_pager();
+}
+
+// Takes over the index and position saved when this file was last paged,
+// thinning the index if the budget is smaller now
+void restore_cached_index(LineCache *cache) {
+  long count, stride, total_lines;
+  const off_t *index = line_cache_index(cache, &count, &stride, &total_lines);
+
+  if(count > 0 && stride > 0) {
+    long step = 1;
+    while((count + step - 1) / step > Pg.checkpoint_cap) step *= 2;
+    Pg.checkpoint_count = 0;
+    for(long i = 0; i < count; i += step) Pg.checkpoints[Pg.checkpoint_count++] = index[i];
+    Pg.stride = stride * step;
+  }
+  if(total_lines >= 0) {
+    Pg.indexed_to_end = 1;
+    Pg.total_lines = total_lines;
+  }
+
+  long long position[3];
+  if(line_cache_position(cache, LINE_CACHE_PAGER, position) && position[0] > 0 && position[0] < Pg.size) {
+    Pg.top_offset = position[0];
+    Pg.top_line = position[1];
+  }
+}
+
+void pager_set_budget(size_t bytes) {
+  Pg.budget = bytes < PAGER_MIN_BUDGET ? PAGER_MIN_BUDGET : bytes;
+}
+
+// Files from this size on open in the pager
+void pager_set_threshold(off_t bytes) {
+  Pg.threshold = bytes;
+}
+
+// Opens path read-only. Returns 0 when it cannot be paged.
+int start_pager(const char *path) {
+  if(Pg.budget == 0) Pg.budget = PAGER_DEFAULT_BUDGET;
+
+  Pg.fd = open(path, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if(Pg.fd < 0 || fstat(Pg.fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    if(Pg.fd >= 0) close(Pg.fd);
+    Pg.fd = -1;
+    return 0;
+  }
+  Pg.path = strdup(path);
+  Pg.size = st.st_size;
+  Pg.page = sysconf(_SC_PAGESIZE);
+
+  // Three quarters of the budget for the window, the rest for the index
+  Pg.window = Pg.budget / 4 * 3;
+  Pg.window -= Pg.window % Pg.page;
+  Pg.checkpoint_cap = (Pg.budget - Pg.window) / sizeof(off_t);
+  Pg.checkpoints = malloc(Pg.checkpoint_cap * sizeof(off_t));
+  if(!Pg.path || !Pg.checkpoints) {
+    perror("Malloc failled");
+    exit(EXIT_FAILURE);
+  }
+  Pg.stride = PAGER_FIRST_STRIDE;
+  Pg.checkpoints[0] = 0;
+  Pg.checkpoint_count = 1;
+  Pg.indexed_to_end = Pg.size == 0;
+  Pg.total_lines = 0;
+
+  Pg.top_offset = 0;
+  Pg.top_line = 0;
+
+  LineCache *cache = line_cache_open(path);
+  if(cache) {
+    restore_cached_index(cache);
+    line_cache_close(cache);
+  }
+
+  Pg.active = 1;
+  term_write("\033[2J", 4);
+  draw_pager();
+  return 1;
+}
+
+void pager_resize() {
+  draw_pager();
+}
+
+void close_pager() {
+  if(!Pg.active) return;
+  long long position[3] = { Pg.top_offset, Pg.top_line, 0 };
+  line_cache_save(Pg.path, LINE_CACHE_PAGER, position, Pg.checkpoints, Pg.checkpoint_count,
+                  Pg.stride, Pg.indexed_to_end ? Pg.total_lines : -1);
+  pager_unmap();
+  close(Pg.fd);
+  Pg.fd = -1;
+  free(Pg.checkpoints);
+  Pg.checkpoints = NULL;
+  free(Pg.path);
+  Pg.path = NULL;
+  Pg.active = 0;
+}
+
+int should_page(const char *path) {
+  struct stat st;
+  return stat(path, &st) == 0 && S_ISREG(st.st_mode) && st.st_size >= (Pg.threshold ? Pg.threshold : PAGER_AUTO_SIZE);
+}
@@ -0,0 +1,239 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "atom.h"
+
+// Parallel stable sort for :sort. The caller passes one SortItem per line
+// pointing at the line's text; nothing is copied. Each item carries a 64
+// bit key: eight bytes of the line, big endian, or the line's number for
+// numeric sorts, complemented for reverse sorts so the order is always
+// ascending. The items are cut into one chunk per worker and each worker
+// radix sorts its chunk on the keys; runs that tie are keyed again on the
+// next eight bytes and sorted the same way, so a line's text is read once
+// per eight bytes of prefix it shares rather than once per comparison.
+// Pairs of sorted chunks are then merged in parallel rounds. Radix passes
+// keep equal keys in order, which keeps the sort stable.
+// SORT_KEEP_ORDER only keys the items, for :uniq.
+
+#define SORT_MIN_CHUNK 65536
+#define SORT_RADIX_MIN 256
+
+// ===============================
+// DATA STRUCTURES
+// ===============================
+
+typedef struct {
+  SortItem *items;
+  SortItem *scratch;
+  int from;
+  int mid;
+  int to;
+  int flags;
+} SortJob;
+
+// ===============================
+// KEYS AND ORDER
+// ===============================
+
+// First number in the line, vim style; lines without one sort first
+uint64_t numeric_key(const char *text, int len) {
+  for(int i = 0; i < len; i++) {
+    if(text[i] < '0' || text[i] > '9') continue;
+    int negative = i > 0 && text[i - 1] == '-';
+    uint64_t v = 0;
+    while(i < len && text[i] >= '0' && text[i] <= '9' && v < (UINT64_MAX >> 5)) {
+      v = v * 10 + (text[i] - '0');
+      i++;
+    }
+    // Offset so negative numbers order below positive ones and 0 is free
+    uint64_t bias = 1ULL << 62;
+    if(v >= bias) v = bias - 1;
+    return negative ? bias - v : bias + v;
+  }
+  return 0;
+}
+
+uint64_t prefix_key(const char *text, int len) {
+  uint64_t key = 0;
+  for(int i = 0; i < 8; i++) {
+    key = (key << 8) | (i < len ? (unsigned char)text[i] : 0);
+  }
+  return key;
+}
+
+// Key of the eight bytes at offset, in sort order
+uint64_t item_key(const SortItem *item, int offset, int flags) {
+  uint64_t key = flags & SORT_NUMERIC
+    ? numeric_key(item->text, item->len)
+    : prefix_key(item->text + offset, item->len - offset);
+  return flags & SORT_REVERSE ? ~key : key;
+}
+
+// Compares lines only, ignoring where they came from. Keys must be the
+// ones for offset 0.
+int sort_compare_lines(const SortItem *a, const SortItem *b, int flags) {
+  if(a->key != b->key) return a->key < b->key ? -1 : 1;
+  if(flags & SORT_NUMERIC) return 0;
+  int min = a->len < b->len ? a->len : b->len;
+  int order = min > 8 ? memcmp(a->text + 8, b->text + 8, min - 8) : 0;
+  if(order == 0) order = (a->len > b->len) - (a->len < b->len);
+  return flags & SORT_REVERSE ? -order : order;
+}
+
+int sort_compare(const SortItem *a, const SortItem *b, int flags) {
+  int order = sort_compare_lines(a, b, flags);
+  if(order) return order;
+  return (a->index > b->index) - (a->index < b->index);
+}
+
+// ===============================
+// WORKERS
+// ===============================
+
+// Stable sort of items by key alone. Byte positions where every key
+// agrees are skipped.
+void radix_sort(SortItem *items, SortItem *scratch, int n) {
+  if(n < SORT_RADIX_MIN) {
+    for(int i = 1; i < n; i++) {
+      SortItem t = items[i];
+      int j = i;
+      for(; j > 0 && items[j - 1].key > t.key; j--) items[j] = items[j - 1];
+      items[j] = t;
+    }
+    return;
+  }
+
+  static __thread int counts[8][256];
+  memset(counts, 0, sizeof(counts));
+  for(int i = 0; i < n; i++) {
+    uint64_t key = items[i].key;
+    for(int b = 0; b < 8; b++) counts[b][(key >> (8 * b)) & 255]++;
+  }
+
+  SortItem *in = items, *out = scratch;
+  for(int b = 0; b < 8; b++) {
+    int shift = 8 * b;
+    if(counts[b][(in[0].key >> shift) & 255] == n) continue;
+    int offsets[256];
+    for(int d = 0, sum = 0; d < 256; d++) {
+      offsets[d] = sum;
+      sum += counts[b][d];
+    }
+    for(int i = 0; i < n; i++) out[offsets[(in[i].key >> shift) & 255]++] = in[i];
+    SortItem *t = in;
+    in = out;
+    out = t;
+  }
+  if(in != items) memcpy(items, in, n * sizeof(SortItem));
+}
+
+// Sorts items whose lines agree before offset, keyed at offset
+void sort_refine(SortItem *items, SortItem *scratch, int n, int offset, int flags) {
+  radix_sort(items, scratch, n);
+  if(flags & SORT_NUMERIC) return;
+
+  for(int i = 0, j; i < n; i = j) {
+    int longer = items[i].len > offset + 8;
+    for(j = i + 1; j < n && items[j].key == items[i].key; j++) {
+      if(items[j].len > offset + 8) longer = 1;
+    }
+    if(j - i < 2 || !longer) continue;
+
+    // The run shares this key; put it back once the tie is broken
+    uint64_t shared = items[i].key;
+    for(int k = i; k < j; k++) items[k].key = item_key(&items[k], offset + 8, flags);
+    sort_refine(items + i, scratch + i, j - i, offset + 8, flags);
+    for(int k = i; k < j; k++) items[k].key = shared;
+  }
+}
+
+void *sort_chunk(void *arg) {
+  SortJob *job = arg;
+  SortItem *items = job->items + job->from;
+  int n = job->to - job->from;
+  for(int i = 0; i < n; i++) items[i].key = item_key(&items[i], 0, job->flags);
+  if(!(job->flags & SORT_KEEP_ORDER)) sort_refine(items, job->scratch + job->from, n, 0, job->flags);
+  return NULL;
+}
+
+// Merges [from, mid) and [mid, to) of items into the same range of scratch
+void *merge_chunks(void *arg) {
+  SortJob *job = arg;
+  SortItem *in = job->items, *out = job->scratch;
+  int i = job->from, j = job->mid, k = job->from;
+  while(i < job->mid && j < job->to) {
+    out[k++] = sort_compare(&in[j], &in[i], job->flags) < 0 ? in[j++] : in[i++];
+  }
+  while(i < job->mid) out[k++] = in[i++];
+  while(j < job->to) out[k++] = in[j++];
+  return NULL;
+}
+
+void run_jobs(void *(*work)(void *), SortJob *jobs, int count) {
+  pthread_t threads[count];
+  int started[count];
+  for(int i = 1; i < count; i++) {
+    started[i] = pthread_create(&threads[i], NULL, work, &jobs[i]) == 0;
+    if(!started[i]) work(&jobs[i]);
+  }
+  if(count > 0) work(&jobs[0]);
+  for(int i = 1; i < count; i++) {
+    if(started[i]) pthread_join(threads[i], NULL);
+  }
+}
+
+// ===============================
+// SORT API
+// ===============================
+
+// Sorts items by line with up to threads workers, stable
+void sort_items(SortItem *items, int count, int flags, int threads) {
+  if(count < 2) return;
+  int chunks = threads > 0 ? threads : 1;
+  while(chunks > 1 && count / chunks < SORT_MIN_CHUNK) chunks--;
+
+  SortItem *scratch = malloc(count * sizeof(SortItem));
+  if(!scratch) {
+    perror("Malloc failled");
+    exit(EXIT_FAILURE);
+  }
+
+  int bounds[chunks + 1];
+  SortJob jobs[chunks];
+  for(int c = 0; c <= chunks; c++) bounds[c] = (long long)count * c / chunks;
+  for(int c = 0; c < chunks; c++) {
+    jobs[c] = (SortJob){ .items = items, .scratch = scratch, .from = bounds[c], .to = bounds[c + 1],
+                         .flags = flags };
+  }
+  run_jobs(sort_chunk, jobs, chunks);
+  if(chunks == 1 || (flags & SORT_KEEP_ORDER)) {
+    free(scratch);
+    return;
+  }
+
+  // Each round merges neighbouring runs, halving how many there are
+  SortItem *in = items, *out = scratch;
+  for(int width = 1; width < chunks; width *= 2) {
+    int n = 0;
+    for(int c = 0; c < chunks; c += 2 * width) {
+      int mid = c + width < chunks ? c + width : chunks;
+      int end = c + 2 * width < chunks ? c + 2 * width : chunks;
+      jobs[n++] = (SortJob){ .items = in, .scratch = out, .from = bounds[c], .mid = bounds[mid],
+                             .to = bounds[end], .flags = flags };
+    }
+    run_jobs(merge_chunks, jobs, n);
+    SortItem *t = in;
+    in = out;
+    out = t;
+  }
+  if(in != items) memcpy(items, in, count * sizeof(SortItem));
+  free(scratch);
+}
+
+// Whether two sorted neighbours count as the same line for :sort u
+int sort_items_equal(const SortItem *a, const SortItem *b, int flags) {
+  return sort_compare_lines(a, b, flags) == 0;
+}
@@ -0,0 +1,164 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define LATENCY_SAMPLES 256
+
+long long document_memory(long long *mapped);
+int document_dedup(long long *lines, long long *unique, long long *saved);
+
+// ===============================
+// DATA STRUCTURES
+// ===============================
+
+// Cheap always-on counters for the editor frame loop. Totals only ever
+// grow; the frame fields hold the values of the last completed frame.
+// Frames are written out together once a batch of input is handled, so
+// a frame's bytes and write calls are those of the last flush.
+typedef struct {
+  unsigned long long bytes_written;
+  unsigned long long write_calls;
+  unsigned long long lines_highlighted;
+  unsigned long long frames;
+
+  long long frame_start_ns;
+  unsigned long long frame_start_lines;
+  // Totals at the last flush
+  unsigned long long flushed_bytes;
+  unsigned long long flushed_calls;
+
+  long long frame_ns;
+  unsigned long long frame_bytes;
+  unsigned long long frame_calls;
+  unsigned long long frame_lines;
+
+  long long key_ns;
+  long long latency_ns[LATENCY_SAMPLES];
+  int latency_count;
+  int latency_next;
+
+  int overlay;
+} EditorStats;
+
+// ===============================
+// GLOBAL
+// ===============================
+
+EditorStats Stats = {0};
+
+// ===============================
+// COUNTERS
+// ===============================
+
+long long stats_now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void stats_count_write(size_t bytes) {
+  Stats.bytes_written += bytes;
+  Stats.write_calls++;
+}
+
+void stats_count_highlight() {
+  Stats.lines_highlighted++;
+}
+
+// Remembers when the first key since the last frame arrived
+void stats_key_received() {
+  if(Stats.key_ns == 0) Stats.key_ns = stats_now_ns();
+}
+
+void stats_frame_begin() {
+  Stats.frame_start_ns = stats_now_ns();
+  Stats.frame_start_lines = Stats.lines_highlighted;
+}
+
+void stats_frame_end() {
+  Stats.frames++;
+  Stats.frame_ns = stats_now_ns() - Stats.frame_start_ns;
+  Stats.frame_lines = Stats.lines_highlighted - Stats.frame_start_lines;
+}
+
+// The collected frames reached the terminal; keys typed since the last
+// flush count as painted now
+void stats_output_flushed() {
+  long long now = stats_now_ns();
+  Stats.frame_bytes = Stats.bytes_written - Stats.flushed_bytes;
+  Stats.frame_calls = Stats.write_calls - Stats.flushed_calls;
+  Stats.flushed_bytes = Stats.bytes_written;
+  Stats.flushed_calls = Stats.write_calls;
+
+  if(Stats.key_ns != 0) {
+    Stats.latency_ns[Stats.latency_next] = now - Stats.key_ns;
+    Stats.latency_next = (Stats.latency_next + 1) % LATENCY_SAMPLES;
+    if(Stats.latency_count < LATENCY_SAMPLES) Stats.latency_count++;
+    Stats.key_ns = 0;
+  }
+}
+
+// ===============================
+// REPORTING
+// ===============================
+
+int compare_latency(const void *a, const void *b) {
+  long long x = *(const long long *)a, y = *(const long long *)b;
+  return (x > y) - (x < y);
+}
+
+// Key-to-paint latency percentiles in milliseconds over the recent samples
+void stats_latency_percentiles(double *p50, double *p90, double *p99) {
+  long long sorted[LATENCY_SAMPLES];
+  int n = Stats.latency_count;
+  *p50 = *p90 = *p99 = 0;
+  if(n == 0) return;
+
+  memcpy(sorted, Stats.latency_ns, n * sizeof(long long));
+  qsort(sorted, n, sizeof(long long), compare_latency);
+  *p50 = sorted[(n - 1) * 50 / 100] / 1e6;
+  *p90 = sorted[(n - 1) * 90 / 100] / 1e6;
+  *p99 = sorted[(n - 1) * 99 / 100] / 1e6;
+}
+
+void format_bytes(char *out, size_t size, double bytes) {
+  const char *units[] = { "B", "KB", "MB", "GB", "TB" };
+  int unit = 0;
+  while(bytes >= 1024 && unit < 4) {
+    bytes /= 1024;
+    unit++;
+  }
+  snprintf(out, size, unit == 0 ? "%.0f%s" : "%.1f%s", bytes, units[unit]);
+}
+
+// One line summary of the last frame, used by :stats and the overlay row
+void stats_format(char *out, size_t size) {
+  double p50, p90, p99;
+  long long mapped;
+  char frame_bytes[16], doc_bytes[16], doc_mapped[16];
+  stats_latency_percentiles(&p50, &p90, &p99);
+  format_bytes(frame_bytes, sizeof(frame_bytes), Stats.frame_bytes);
+  format_bytes(doc_bytes, sizeof(doc_bytes), document_memory(&mapped));
+  format_bytes(doc_mapped, sizeof(doc_mapped), mapped);
+
+  snprintf(out, size, "frame %.2fms %s %llu writes | hl %llu | doc %s/%s | key p50 %.2f p90 %.2f p99 %.2fms",
+           Stats.frame_ns / 1e6, frame_bytes, Stats.frame_calls, Stats.frame_lines,
+           doc_bytes, doc_mapped, p50, p90, p99);
+
+  long long lines, unique, saved;
+  size_t len = strlen(out);
+  if(document_dedup(&lines, &unique, &saved) && len < size) {
+    char saved_bytes[16];
+    format_bytes(saved_bytes, sizeof(saved_bytes), saved);
+    snprintf(out + len, size - len, " | dedup %lld/%lld lines -%s", unique, lines, saved_bytes);
+  }
+}
+
+void stats_set_overlay(int on) {
+  Stats.overlay = on;
+}
+
+int stats_overlay_visible() {
+  return Stats.overlay;
+}
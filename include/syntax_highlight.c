@@ -3,6 +3,11 @@
 #include <ctype.h>
 #include <unistd.h>
 
+#include "atom.h"
+
+void term_write(const void *data, size_t len);
+void stats_count_highlight();
+
 typedef enum {
   TOKEN_RESET,
   TOKEN_KEYWORD,
@@ -108,12 +113,12 @@ void print_colored_token(char *token, size_t size, int type) {
   const char *color = ansi_colors[type];
   
   if(color != NULL) {
-    write(STDOUT_FILENO, color, strlen(color));
-    write(STDOUT_FILENO, token, size);
-    write(STDOUT_FILENO, ansi_colors[TOKEN_RESET], strlen(ansi_colors[TOKEN_RESET]));
+    term_write(color, strlen(color));
+    term_write(token, size);
+    term_write(ansi_colors[TOKEN_RESET], strlen(ansi_colors[TOKEN_RESET]));
   } 
   else {
-    write(STDOUT_FILENO, token, size);
+    term_write(token, size);
   }
 }
 
@@ -121,10 +126,12 @@ void syntax_highlight_and_print(char *line, int size) {
   int pos = 0;
   int after_include = 0;
 
+  stats_count_highlight();
+
   while(pos < size) {
     // Handle whitespaces
     while (pos < size && isspace((unsigned char)line[pos])) {
-      write(STDOUT_FILENO, &line[pos], 1);
+      term_write(&line[pos], 1);
       pos++;
     }
 
@@ -185,10 +192,51 @@ void syntax_highlight_and_print(char *line, int size) {
       continue;
     }
     // Handle OPERATORS and PUNCTUATION
-    write(STDOUT_FILENO, ansi_colors[TOKEN_RESET], strlen(ansi_colors[TOKEN_RESET]));
-    write(STDOUT_FILENO, &line[pos], 1);
+    term_write(ansi_colors[TOKEN_RESET], strlen(ansi_colors[TOKEN_RESET]));
+    term_write(&line[pos], 1);
     pos++;
   }
 
-  write(STDOUT_FILENO, ansi_colors[TOKEN_RESET], strlen(ansi_colors[TOKEN_RESET]));
+  term_write(ansi_colors[TOKEN_RESET], strlen(ansi_colors[TOKEN_RESET]));
+}
+
+// State at to of a line that is in state at from. Only quotes and // move
+// it: words and numbers never hold them and a / always starts a token.
+// A / just before to looks at the byte after it.
+int syntax_state_after(const char *line, int size, int from, int to, int state) {
+  int pos = from;
+  while(pos < to && state != SYNTAX_COMMENT) {
+    if(state == SYNTAX_STRING) {
+      const char *end = memchr(line + pos, '"', to - pos);
+      if(!end) break;
+      state = SYNTAX_CODE;
+      pos = end - line + 1;
+      continue;
+    }
+    for(; pos < to; pos++) {
+      if(line[pos] == '"') {
+        state = SYNTAX_STRING;
+        pos++;
+        break;
+      }
+      if(line[pos] == '/' && pos + 1 < size && line[pos + 1] == '/') return SYNTAX_COMMENT;
+    }
+  }
+  return state;
+}
+
+// syntax_highlight_and_print for text that starts in state, as the visible
+// part of a line scrolled sideways does
+void syntax_highlight_slice(char *line, int size, int state) {
+  int pos = 0;
+  if(state == SYNTAX_COMMENT) {
+    pos = size;
+    print_colored_token(line, size, TOKEN_COMMENT);
+  }
+  else if(state == SYNTAX_STRING) {
+    const char *end = memchr(line, '"', size);
+    pos = end ? end - line + 1 : size;
+    print_colored_token(line, pos, TOKEN_STRING);
+  }
+  syntax_highlight_and_print(line + pos, size - pos);
 }
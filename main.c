@@ -1,15 +1,24 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <string.h>
 #include <termios.h>
 #include <wctype.h>
 #include <ctype.h>
+#include <limits.h>
+#include <regex.h>
 #include <sys/ioctl.h>
-#include <sys/select.h>
 #include <sys/stat.h>
 
+#include "include/atom.h"
+
 // ===============================
 // CONSTANTS AND KEY DEFINITIONS
 // ===============================
@@ -19,7 +28,8 @@ typedef enum {
   MODE_INSERT,
   MODE_COMMAND,
   MODE_MENU,
-  MODE_BROWSER
+  MODE_BROWSER,
+  MODE_PAGER
 } EditorMode;
 
 enum Key {
@@ -29,10 +39,11 @@ enum Key {
   KEY_TAB = 9,
 };
 
-#define TAB_VAL 2
-#define ESCAPE_KEY_1 'j'
-#define ESCAPE_KEY_2 'j'
-#define ESCAPE_TIMEOUT_MS 300
+#define OPEN_CHUNK_SIZE (1 << 20)
+#define RESIZE_DEBOUNCE_MS 50
+#define STATUS_TIMEOUT_MS 4000
+#define LINE_CACHE_MIN_BYTES (1 << 20)
+#define FRAME_MAX_BYTES (1 << 18)
  
 // ===============================
 // ANSI ESCAPE CODES
@@ -68,14 +79,16 @@ const char *ansi_codes[] = {
 // DATA STRUCTURES
 // ===============================
 
-typedef struct {
-  int count;
-  char command[128];
-  char action[128]; 
-} Prefix;
+typedef struct LineArena LineArena;
+typedef struct Journal Journal;
+typedef struct LineCache LineCache;
+typedef struct FoldSet FoldSet;
+typedef struct MarkSet MarkSet;
+typedef struct LineStore LineStore;
 
 typedef struct {
   int size;
+  int capacity;
   char *line;
   int is_dirty;
 } Line;
@@ -86,26 +99,90 @@ typedef struct {
   int desired_x;
 } Cursor;
 
+// Lines [start, start + count)
+typedef struct {
+  int start;
+  int count;
+} LineRun;
+
+// Lines taken by d and y, put back by p. Deleted lines are moved in, not
+// copied.
+typedef struct {
+  Line *lines;
+  int count;
+  int capacity;
+  // Holds the text of the lines; the active buffer's except while
+  // buffers are switched
+  LineArena *arena;
+} YankRegister;
+
 typedef struct {
   int width;
   int height;
   int scroll_y;
+  // First column shown; lines are cut at both edges, never wrapped
+  int scroll_x;
 } Window;
 
+// A split window onto a buffer. The active pane's buffer, cursor and
+// scroll position are CurrentBuffer, Buff and Win; the others keep theirs
+// here.
+typedef struct {
+  int buffer;
+  Cursor cursor;
+  int scroll_y;
+  int scroll_x;
+  // Rows [dirty_from, dirty_to) of the pane repaint on the next draw
+  int dirty_from;
+  int dirty_to;
+} Pane;
+
+// Output waiting for the next term_flush
+typedef struct {
+  char *data;
+  size_t len;
+  size_t capacity;
+} FrameBuffer;
+
 typedef struct {
   EditorMode mode;
-  Prefix prefix;
   Line *document;
   int document_size;
   int document_capacity;
   Cursor cursor;
   char *file_name;
-  char pending_escape_char;
-  int has_pending_escape;
+  off_t file_bytes;
   char *status_msg;
   int status_len;
+  LineArena *arena;
+  // NULL unless lines were loaded with intern_lines on
+  LineStore *store;
+  Journal *journal;
+  // Edited since it was opened or saved
+  int modified;
+  // NULL until the first fold is made
+  FoldSet *folds;
+  // NULL until the first mark or jump
+  MarkSet *marks;
 } Buffer;
 
+// An open file. The active one is in Buff and the others keep their
+// document, cursor and journal here. Clean ones may be unloaded to stay
+// within buffer_budget_mb and are read in again when switched to.
+typedef struct {
+  Buffer buffer;
+  int scroll_y;
+  int scroll_x;
+  int loaded;
+  // Journal started and last position restored
+  int visited;
+  // Follow mode and :diff, which only run in the active buffer, were on
+  // when it was parked and start again when it is switched back to
+  int following;
+  int diffing;
+  unsigned long last_used;
+} BufferSlot;
+
 // ===============================
 // GLOBAL VARIABLES
 // ===============================
@@ -114,6 +191,46 @@ struct termios OriginalTermios;
 Buffer Buff;
 Window Win;
 
+// Pending event loop timers, 0 when idle. A resize is applied once
+// SIGWINCH stops arriving for RESIZE_DEBOUNCE_MS.
+int ResizeTimer = 0;
+int StatusTimer = 0;
+
+// Nothing reaches the terminal while this is above zero
+int RenderSuspend = 0;
+
+FrameBuffer Frame = {0};
+
+YankRegister Yank = {0};
+
+// Every open buffer, CurrentBuffer is the one in Buff (-1 while none is).
+// The yank register's lines live in the arena of the buffer active when
+// they were taken and move along on every switch.
+BufferSlot *Buffers = NULL;
+int BufferCount = 0;
+int BufferCapacity = 0;
+int CurrentBuffer = -1;
+unsigned long BufferClock = 0;
+
+// Split windows, indexed by their node in the layout tree. ActivePane is
+// -1 until a buffer is first shown.
+Pane Panes[2 * MAX_PANES - 1];
+int ActivePane = -1;
+int PaneCount = 0;
+// Status rows and separators between panes repaint on the next draw
+int PaneFramesDirty = 0;
+
+// Deletes of one :g are journaled as several runs and removed together
+// when replayed
+LineRun *ReplayRuns = NULL;
+int ReplayRunCount = 0;
+int ReplayRunCapacity = 0;
+
+// Output of a running :! filter and the lines it replaces
+YankRegister FilterOutput = {0};
+int FilterFrom = 0;
+int FilterCount = 0;
+
 // ===============================
 // FUNCTION PROTOTYPES
 // ===============================
@@ -124,9 +241,32 @@ int wait_for_input_with_timeout(int timeout_ms);
 void disable_raw_mode(void);
 void enable_raw_mode(void);
 void ensure_document_capacity(void);
-void init_editor(void);
+void reserve_document(int lines);
+void yank_clear(int release);
+void move_yank(LineArena *to);
+int document_locked(void);
+void key_cancel_filter(void);
+void discard_filter_output(void);
+void init_document(void);
 void free_editor(void);
-void open_editor(char *filen);
+void park_buffer(void);
+int switch_to_buffer(int i);
+int activate_buffer(int i);
+void clamp_view(void);
+Buffer *slot_buffer(int i);
+void enforce_buffer_budget(void);
+void invalidate_panes(void);
+void invalidate_other_panes(int y, int removed, int added);
+int buffer_in_pane(int i);
+void cmd_split(int vertical, char *file);
+void cmd_close_pane(void);
+void cmd_only_pane(void);
+void key_next_pane(void);
+void key_prev_pane(void);
+int start_buffer(char *filepath);
+const char *prepare_file(const char *path);
+void flash_open_error(const char *path, const char *why);
+int open_editor(char *filen);
 void create_window(void);
 void draw_editor(void);
 
@@ -152,8 +292,13 @@ void process_command_input(char *command);
 
 void cmd_save_file(void);
 void cmd_quit(void);
+int quit_refused(void);
+void cmd_map(int mode, char *args);
+void cmd_buffer(char *command);
+void cmd_list_buffers(void);
+void remember_position(void);
 
-void editor_key_press(void);
+void dispatch_key(char c);
 
 // External
 void start_menu(int win_h, int win_w);
@@ -161,15 +306,249 @@ void handle_menu_input(char c);
 void start_browsing(int width, int height);
 void handle_browser_input(char c);
 void free_file_browser();
+void free_dir_cache();
+void resize_browser();
+void resize_menu(int win_h, int win_w);
 void syntax_highlight_and_print(char *line, int size);
-void handle_dotfile(); 
+void syntax_highlight_slice(char *line, int size, int state);
+void stats_count_write(size_t bytes);
+void stats_output_flushed();
+void stats_key_received();
+void stats_frame_begin();
+void stats_frame_end();
+void stats_format(char *out, size_t size);
+void stats_set_overlay(int on);
+int stats_overlay_visible();
+extern Settings Config;
+void load_settings();
+int settings_worker_threads();
+LineArena *line_arena_create();
+void line_arena_destroy(LineArena *a);
+void line_arena_reset(LineArena *a);
+char *line_arena_alloc_packed(LineArena *a, size_t need, int *capacity);
+char *line_arena_grow(LineArena *a, char *p, int used, int capacity, size_t need, int *new_capacity);
+void line_arena_free(LineArena *a, char *p, int capacity);
+void line_arena_usage(LineArena *a, size_t *in_use, size_t *mapped);
+LineStore *line_store_create(LineArena *a);
+void line_store_destroy(LineStore *s);
+char *line_store_intern(LineStore *s, const char *text, int len);
+void line_store_release(char *text);
+void line_store_usage(LineStore *s, long long *lines, long long *unique, long long *saved, size_t *table);
+void event_loop_init();
+void event_loop_run();
+void event_watch_fd(int fd, short events, EventFdCallback callback, void *data);
+void event_on_signal(int signo, EventCallback callback);
+void event_on_idle(EventCallback callback);
+int event_timer_add(int delay_ms, EventCallback callback, void *data);
+void event_timer_cancel(int id);
+Journal *journal_open(const char *file_path);
+void journal_record(Journal *j, int op, int y, int x, char c);
+void journal_reset(Journal *j, const char *file_path);
+void journal_close(Journal *j, int remove);
+int journal_load(const char *file_path, char **records, size_t *len, int *stale);
+void journal_record_text(Journal *j, int op, int y, int x, uint32_t len);
+void journal_append_text(Journal *j, const char *text, size_t len);
+long journal_replay(const char *records, size_t len,
+                    void (*apply)(int op, int y, int x, char c, const char *text, size_t text_len));
+void follow_start(const char *path, off_t loaded_bytes);
+void follow_stop();
+int follow_active();
+off_t follow_offset();
+void follow_set_frame_ms(int ms);
+int start_pager(const char *path);
+void handle_pager_input(char c);
+void pager_resize();
+void pager_set_budget(size_t bytes);
+void pager_set_threshold(off_t bytes);
+void close_pager();
+int should_page(const char *path);
+LineCache *line_cache_open(const char *path);
+int line_cache_position(LineCache *c, int kind, long long position[3]);
+void line_cache_close(LineCache *c);
+void line_cache_save(const char *path, int kind, const long long position[3],
+                     const off_t *index, long count, long stride, long total_lines);
+void line_cache_save_position(const char *path, int kind, const long long position[3]);
+void keymap_init(int mode, KeyFallback fallback, int timeout_ms, int counted);
+void keymap_bind(int mode, const char *keys, KeyAction action);
+void keymap_bind_table(int mode, const KeyBinding *table, int count);
+void keymap_set_timeout(int mode, int timeout_ms);
+int keymap_remap(int mode, const char *lhs, const char *rhs);
+int keymap_unmap(int mode, const char *lhs);
+void keymap_feed(int mode, char c);
+void keymap_cancel(int mode);
+void keymap_await_key(int mode, KeyFallback take);
+int keymap_count();
+void init_browser_keys();
+void macro_record_key(char c);
+int macro_start(char name);
+void macro_stop();
+char macro_recording();
+void macro_play(char name, int count);
+void init_menu_keys();
+void sort_items(SortItem *items, int count, int flags, int threads);
+int sort_items_equal(const SortItem *a, const SortItem *b, int flags);
+void init_filters();
+int filter_start(const char *command, int from, int count);
+int filter_active();
+void filter_cancel();
+void diff_start(const char *path);
+void diff_stop();
+int diff_active();
+void diff_note_edit(int y, int removed, int added);
+void diff_file_saved();
+char diff_gutter(int y);
+int diff_next_hunk(int y, int dir);
+int layout_init(LayoutRect area);
+void layout_arrange(LayoutRect area);
+int layout_split(int pane, int vertical);
+int layout_close(int pane);
+void layout_only(int pane);
+int layout_next(int pane, int dir);
+int layout_valid(int pane);
+LayoutRect layout_rect(int pane);
+FoldSet *fold_set_create();
+void fold_set_destroy(FoldSet *s);
+void fold_note_edit(FoldSet *s, int y, int removed, int added);
+int fold_span_start(FoldSet *s, int y);
+int fold_span_end(FoldSet *s, int y);
+int fold_visible_index(FoldSet *s, int y);
+int fold_line_at(FoldSet *s, int v);
+int fold_add(FoldSet *s, int start, int end);
+int fold_open(FoldSet *s, int y);
+int fold_close(FoldSet *s, int y);
+int fold_delete(FoldSet *s, int y);
+void fold_open_all(FoldSet *s);
+void fold_close_all(FoldSet *s);
+int fold_block_end(int y);
+int fold_all_blocks(FoldSet *s);
+MarkSet *mark_set_create();
+void mark_set_destroy(MarkSet *s);
+void mark_note_edit(MarkSet *s, int y, int removed, int added);
+void mark_set(MarkSet *s, char name, int line, int column);
+int mark_get(MarkSet *s, char name, int *line, int *column);
+void mark_jump_from(MarkSet *s, int line, int column);
+int mark_jump_older(MarkSet *s, int line, int column, int *to_line, int *to_column);
+int mark_jump_newer(MarkSet *s, int *to_line, int *to_column);
+int motion_word(int *y, int *x, int count, int big);
+int motion_word_end(int *y, int *x, int count, int big);
+int motion_word_back(int *y, int *x, int count, int big);
+int motion_find_char(int y, int *x, char c, int count, int dir, int till);
+int motion_match_bracket(int *y, int *x);
+int motion_paragraph(int *y, int *x, int count, int dir);
+int motion_word_under(int y, int x, int *start, int *end);
+int motion_find_word(int *y, int *x, const char *word, int word_len);
+int long_line_state(int buffer, int y, const char *text, int size, int x);
+void long_line_note_change(int buffer, int y, int x);
+void long_line_note_edit(int buffer, int y, int removed, int added);
+void long_line_forget(int buffer);
 
 // ----------
 // HELPERS
 // ----------
 
+void write_terminal(const char *data, size_t len) {
+  while(len > 0) {
+    ssize_t n = write(STDOUT_FILENO, data, len);
+    if(n < 0) {
+      if(errno == EINTR) continue;
+      return;
+    }
+    stats_count_write(n);
+    data += n;
+    len -= n;
+  }
+}
+
+// Writes out everything drawn since the last flush
+void term_flush() {
+  if(Frame.len == 0) return;
+  write_terminal(Frame.data, Frame.len);
+  Frame.len = 0;
+  stats_output_flushed();
+}
+
+// All terminal output goes through here. It is collected and written by
+// term_flush once the event loop has handled every pending key, so a
+// burst of input reaches the terminal as one frame however many times it
+// redraws.
+void term_write(const void *data, size_t len) {
+  if(RenderSuspend > 0) return;
+  if(Frame.len + len > FRAME_MAX_BYTES) term_flush();
+  if(len > FRAME_MAX_BYTES) {
+    write_terminal(data, len);
+    return;
+  }
+  if(Frame.len + len > Frame.capacity) {
+    size_t capacity = Frame.capacity ? Frame.capacity : 4096;
+    while(capacity < Frame.len + len) capacity *= 2;
+    char *tmp = realloc(Frame.data, capacity);
+    if(!tmp) {
+      perror("Malloc failled");
+      exit(EXIT_FAILURE);
+    }
+    Frame.data = tmp;
+    Frame.capacity = capacity;
+  }
+  memcpy(Frame.data + Frame.len, data, len);
+  Frame.len += len;
+}
+
+void on_loop_idle(void *data) {
+  (void)data;
+  term_flush();
+}
+
+void term_printf(const char *fmt, ...) {
+  char buf[512];
+  va_list args;
+
+  va_start(args, fmt);
+  int len = vsnprintf(buf, sizeof(buf), fmt, args);
+  va_end(args);
+  if(len < 0) return;
+
+  if((size_t)len < sizeof(buf)) {
+    term_write(buf, len);
+    return;
+  }
+
+  char *big = malloc(len + 1);
+  if(!big) return;
+  va_start(args, fmt);
+  vsnprintf(big, len + 1, fmt, args);
+  va_end(args);
+  term_write(big, len);
+  free(big);
+}
+
 void ansi_emit(enum AnsiCode code) {
-  write(STDOUT_FILENO, ansi_codes[code], strlen(ansi_codes[code]));
+  term_write(ansi_codes[code], strlen(ansi_codes[code]));
+  // Whoever clears the screen repaints the active pane; the rest follow
+  if(code == ANSI_CLEAR) invalidate_panes();
+}
+
+// Screen rows and columns shared out between the panes
+LayoutRect text_area() {
+  return (LayoutRect){ 0, 0, Win.height - 2 - (stats_overlay_visible() ? 1 : 0), Win.width };
+}
+
+// Where pane p shows text: its rectangle less the status row it shares
+// with a pane below and the separator it shares with a pane to its right
+LayoutRect pane_text(int p) {
+  LayoutRect area = text_area();
+  LayoutRect r = layout_rect(p);
+  if(r.top + r.height < area.top + area.height) r.height--;
+  if(r.left + r.width < area.left + area.width) r.width--;
+  return r;
+}
+
+LayoutRect active_text() {
+  return ActivePane < 0 ? text_area() : pane_text(ActivePane);
+}
+
+// Rows available for document text
+int text_rows() {
+  return active_text().height;
 }
 
 int clamp(int v, int lo, int hi) {
@@ -179,9 +558,31 @@ int clamp(int v, int lo, int hi) {
   return v;
 }
 
+// Rows count the lines that show: a closed fold takes one row, its first
+// line's. The row of line y of b, and the line on a row.
+int line_row(const Buffer *b, int y) {
+  return fold_visible_index(b->folds, y);
+}
+
+int row_line(const Buffer *b, int row) {
+  return fold_line_at(b->folds, row);
+}
+
+// Rows from the top of the active view down to the cursor
+int cursor_row() {
+  return line_row(&Buff, Buff.cursor.y) - line_row(&Buff, Win.scroll_y);
+}
+
+// The top line that puts line y on the last of rows rows
+int scroll_above(int y, int rows) {
+  int top = line_row(&Buff, y) - rows + 1;
+  return row_line(&Buff, top < 0 ? 0 : top);
+}
+
 // Functions to work with terminal text modes
 void disable_raw_mode() {
   ansi_emit(ANSI_CURSOR_SHOW);
+  term_flush();
   tcsetattr(STDIN_FILENO, TCSAFLUSH, &OriginalTermios);
 }
 
@@ -193,26 +594,11 @@ void enable_raw_mode() {
   tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
 }
 
-int wait_for_input_with_timeout(int timeout_ms) {
-  fd_set readfds;
-  struct timeval timeout;
-
-  // Clear the set
-  FD_ZERO(&readfds);
-
-  // Add stdin (STDIN_FILENO) to the set
-  FD_SET(STDIN_FILENO, &readfds);
-
-  // Set timeout
-  timeout.tv_sec = timeout_ms / 1000;           // seconds
-  timeout.tv_usec = (timeout_ms % 1000) * 1000; // microseconds
-
-  int result = select(STDIN_FILENO + 1, &readfds, NULL, NULL, &timeout);
-
-  return result;
-}
-
 void set_command_status(const char* s) {
+  if(StatusTimer) {
+    event_timer_cancel(StatusTimer);
+    StatusTimer = 0;
+  }
   free(Buff.status_msg);
   Buff.status_msg = NULL;
   Buff.status_len = 0;
@@ -233,80 +619,58 @@ void set_command_status(const char* s) {
 }
 
 void clear_command_status(void) {
-  free(Buff.status_msg);
-  Buff.status_msg = NULL;
-  Buff.status_len = 0;
-  return;
+  set_command_status(NULL);
 }
 
-void mark_all_lines_dirty() {
-  for(int i = 0; i < Buff.document_size; i++) {
-    Buff.document[i].is_dirty = 1;
-  }
+void expire_command_status(void *data) {
+  (void)data;
+  StatusTimer = 0;
+  clear_command_status();
+  if(Buff.mode == MODE_VIEW) draw_editor();
 }
 
-int is_operator(char c) {
-  switch (c) {
-    case 'd':
-      return 1;
-      break;
-    case 'c':
-      return 1;
-      break;
-    case 'y':
-      return 1;
-      break;
-  }
-  
-  return 0;
+// Status message that clears itself after STATUS_TIMEOUT_MS
+void flash_command_status(const char *s) {
+  set_command_status(s);
+  StatusTimer = event_timer_add(STATUS_TIMEOUT_MS, expire_command_status, NULL);
 }
 
-int is_motion(char c) {
-  switch (c) {
-    case 'j':
-      return 1;
-      break;
-    case 'k':
-      return 1;
-      break;
-    case 'h':
-      return 1;
-      break;
-    case 'l':
-      return 1;
-      break;
-    case 'w':
-      return 1;
-      break;
+// Repaints the lines shown on screen rows [from, to) on the next draw.
+// Lines outside the viewport are invalidated when they scroll into view.
+void invalidate_rows(int from, int to) {
+  if(from >= to) return;
+  int i = row_line(&Buff, line_row(&Buff, Win.scroll_y) + from);
+  for(int row = from; row < to && i < Buff.document_size; row++) {
+    Buff.document[i].is_dirty = 1;
+    i = fold_span_end(Buff.folds, i) + 1;
   }
-
-  return 0;
 }
 
-void reset_prefix() {
-  Buff.prefix.count = 0;
-  Buff.prefix.command[0] = '\0';
-  Buff.prefix.action[0] = '\0';
-  draw_editor();
+void mark_visible_lines_dirty() {
+  invalidate_rows(0, text_rows());
 }
 
-void execute_motion(int count, char c) {
-  switch (c) {
-    case 'h': move_cursor_horizontaly(-count); break;
-    case 'l': move_cursor_horizontaly(count); break;
-    case 'j': move_cursor_verticaly(count); break;
-    case 'k': move_cursor_verticaly(-count); break; 
-  }  
+// Batches of edits (journal replay) run without drawing, then the
+// viewport is repainted once
+void suspend_rendering() {
+  RenderSuspend++;
 }
 
-void execute_operator(int count, char c) {
-  switch (c) {
-    case 'd': for(int i = 0; i < count; i++) delete_line(); break;
+void resume_rendering() {
+  if(--RenderSuspend > 0 || !Buff.document) return;
+  int rows = text_rows();
+  int row = cursor_row();
+  if(row < 0 || row >= rows) {
+    int top = line_row(&Buff, Buff.cursor.y) - rows / 2;
+    Win.scroll_y = row_line(&Buff, top < 0 ? 0 : top);
   }
+  ansi_emit(ANSI_CLEAR);
+  mark_visible_lines_dirty();
+  draw_editor();
 }
 
 void draw_status_bar() {
-  dprintf(STDOUT_FILENO, "\033[%d;1H", Win.height - 1);
+  term_printf("\033[%d;1H\033[2K", Win.height - 1);
   float percent = Buff.document_size > 0 ? (((float)Buff.cursor.y+1) / Buff.document_size) * 100 : 0;
   if(strlen(Buff.file_name) > Win.width) {
     char *t_name = malloc(Win.width - 20);
@@ -315,33 +679,35 @@ void draw_status_bar() {
       exit(EXIT_FAILURE);
     }
     memcpy(t_name, Buff.file_name + (strlen(Buff.file_name) - Win.width), Win.width - 20);
-    dprintf(STDOUT_FILENO, "%s %d %d %d%%", t_name, Buff.cursor.y, Buff.cursor.x, (int)percent);
+    term_printf("%s %d %d %d%%", t_name, Buff.cursor.y, Buff.cursor.x, (int)percent);
     free(t_name);
   }
   else {
-    dprintf(STDOUT_FILENO, "%s %d %d %d%%", Buff.file_name, Buff.cursor.y, Buff.cursor.x, (int)percent);   
+    term_printf("%s %d %d %d%%", Buff.file_name, Buff.cursor.y, Buff.cursor.x, (int)percent);   
   }
+  if(BufferCount > 1) term_printf(" [%d/%d]", CurrentBuffer + 1, BufferCount);
+  if(follow_active()) term_write(" [follow]", 9);
+  if(macro_recording()) term_printf(" [recording @%c]", macro_recording());
 }
 // ===============================
 // BUFFER MANAGEMENT
 // ===============================
 
-void init_editor() {
+// An empty document in Buff with its own arena
+void init_document() {
   Buff.cursor.x = 0;
   Buff.cursor.y = 0;
   Buff.cursor.desired_x = 0;
-  Buff.mode = MODE_VIEW;
-  Buff.prefix.command[0] = '\0';
-  Buff.prefix.action[0] = '\0';
-  Buff.prefix.count = 0;
   Buff.document_capacity = 512;
   Buff.document_size = 0;
   Buff.file_name = NULL;
   Buff.document = malloc(sizeof(Line) * Buff.document_capacity);
-  Buff.pending_escape_char = 0;
-  Buff.has_pending_escape = 0;
-  Buff.status_msg = NULL;
-  Buff.status_len = 0;
+  Buff.arena = line_arena_create();
+  Buff.store = NULL;
+  Buff.journal = NULL;
+  Buff.modified = 0;
+  Buff.folds = NULL;
+  Buff.marks = NULL;
   if(!Buff.document) {
     perror("Malloc failled");
     exit(EXIT_FAILURE);
@@ -350,22 +716,74 @@ void init_editor() {
   for(int i = 0; i < Buff.document_capacity; i++) {
     Buff.document[i].line = NULL;
     Buff.document[i].size = 0;
+    Buff.document[i].capacity = 0;
     Buff.document[i].is_dirty = 0;
   }
 }
 
+void free_buffer(Buffer *b, int remove_journal) {
+  journal_close(b->journal, remove_journal);
+  b->journal = NULL;
+  line_arena_destroy(b->arena);
+  b->arena = NULL;
+  line_store_destroy(b->store);
+  b->store = NULL;
+  free(b->document);
+  b->document = NULL;
+  free(b->file_name);
+  b->file_name = NULL;
+  fold_set_destroy(b->folds);
+  b->folds = NULL;
+  mark_set_destroy(b->marks);
+  b->marks = NULL;
+}
+
+// Line text is owned by the arena, so this is a few munmaps per buffer
 void free_editor() {
-  for(int i = 0; i < Buff.document_size; i++) {
-    if(Buff.document[i].line != NULL) {
-      free(Buff.document[i].line);
-    }
-  }
+  keymap_cancel(KEYMAP_VIEW);
+  keymap_cancel(KEYMAP_INSERT);
+  close_pager();
+  follow_stop();
+  filter_cancel();
+  diff_stop();
+  // Unsaved edits stay recoverable
+  journal_close(Buff.journal, !Buff.modified);
+  Buff.journal = NULL;
+  yank_clear(0);
+  FilterOutput.count = 0;
+  line_arena_destroy(Buff.arena);
+  Buff.arena = NULL;
+  line_store_destroy(Buff.store);
+  Buff.store = NULL;
   free(Buff.document);
+  Buff.document = NULL;
+  free(Buff.file_name);
+  Buff.file_name = NULL;
+  fold_set_destroy(Buff.folds);
+  Buff.folds = NULL;
+  mark_set_destroy(Buff.marks);
+  Buff.marks = NULL;
+  Buff.document_size = 0;
+  Buff.document_capacity = 0;
+
+  for(int i = 0; i < BufferCount; i++) {
+    if(i != CurrentBuffer) free_buffer(&Buffers[i].buffer, !Buffers[i].buffer.modified);
+  }
+  free(Buffers);
+  Buffers = NULL;
+  BufferCount = 0;
+  BufferCapacity = 0;
+  CurrentBuffer = -1;
 }
 
 void ensure_document_capacity() {
-  if(Buff.document_size >= Buff.document_capacity) {
-    Buff.document_capacity *= 2;
+  reserve_document(Buff.document_size + 1);
+}
+
+// Room for at least lines lines
+void reserve_document(int lines) {
+  if(lines > Buff.document_capacity) {
+    while(Buff.document_capacity < lines) Buff.document_capacity *= 2;
     Line *tmp = realloc(Buff.document, sizeof(Line) * Buff.document_capacity);
     if (!tmp) {
       perror("realloc");
@@ -375,170 +793,588 @@ void ensure_document_capacity() {
     for(int i = Buff.document_size; i < Buff.document_capacity; i++) {
       Buff.document[i].line = NULL;
       Buff.document[i].size = 0;
+      Buff.document[i].capacity = 0;
       Buff.document[i].is_dirty = 1;
     }
   }
 }
 
-void open_editor(char *filen) {
-  struct stat st;
-  if (stat(filen, &st) != 0) {
-    FILE *new_f = fopen(filen, "w");
-    fclose(new_f);
+long long document_memory(long long *mapped) {
+  size_t in_use, arena_mapped, table;
+  long long lines, unique, saved;
+  line_arena_usage(Buff.arena, &in_use, &arena_mapped);
+  line_store_usage(Buff.store, &lines, &unique, &saved, &table);
+  long long array = (long long)sizeof(Line) * Buff.document_capacity + table;
+  *mapped = arena_mapped + array;
+  return in_use + array;
+}
+
+// Lines of the document sharing interned text and the distinct texts
+// among them; 0 when lines are not interned
+int document_dedup(long long *lines, long long *unique, long long *saved) {
+  size_t table;
+  line_store_usage(Buff.store, lines, unique, saved, &table);
+  return Buff.store != NULL;
+}
+
+// Interned text is shared with other lines and owns no block
+int line_shared(const Line *l) {
+  return l->capacity == 0 && l->line;
+}
+
+// Makes room for size bytes plus the terminator, growing in place when
+// the block already has space. Shared text is copied out first.
+void line_reserve(Line *l, int size) {
+  char *shared = line_shared(l) ? l->line : NULL;
+  l->line = line_arena_grow(Buff.arena, l->line, l->size, l->capacity, size + 1, &l->capacity);
+  if(shared) {
+    l->line[l->size] = '\0';
+    line_store_release(shared);
   }
-  else if (S_ISDIR(st.st_mode)) {
-    dprintf(STDERR_FILENO, "\033[1;31mError:\033[0m '%s' is a directory.\n", filen);
-    disable_raw_mode();
+}
+
+// Gives a line its own copy of its text before it is written in place
+void line_unshare(Line *l) {
+  if(line_shared(l)) line_reserve(l, l->size);
+}
+
+void line_release(Line *l) {
+  if(line_shared(l)) line_store_release(l->line);
+  else line_arena_free(Buff.arena, l->line, l->capacity);
+  l->line = NULL;
+  l->size = 0;
+  l->capacity = 0;
+}
+
+// Drops the text of every line of Buff at once. A yank register in the
+// same arena is set aside and copied back.
+void reset_lines() {
+  LineArena *keep = NULL;
+  if(Yank.count > 0 && Yank.arena == Buff.arena) {
+    keep = line_arena_create();
+    move_yank(keep);
+  }
+  line_arena_reset(Buff.arena);
+  line_store_destroy(Buff.store);
+  Buff.store = NULL;
+  if(keep) {
+    move_yank(Buff.arena);
+    line_arena_destroy(keep);
+  }
+}
+
+void load_line(const char *text, int len) {
+  ensure_document_capacity();
+
+  if(len > 0 && text[len - 1] == '\r') len--;
+
+  Line *l = &Buff.document[Buff.document_size];
+  char *shared = NULL;
+  if(Config.intern_lines) {
+    if(!Buff.store) Buff.store = line_store_create(Buff.arena);
+    shared = line_store_intern(Buff.store, text, len);
+  }
+  if(shared) {
+    l->line = shared;
+    l->capacity = 0;
+  }
+  else {
+    l->line = line_arena_alloc_packed(Buff.arena, len + 1, &l->capacity);
+    memcpy(l->line, text, len);
+    l->line[len] = '\0';
+  }
+  l->size = len;
+  l->is_dirty = 1;
+  Buff.document_size++;
+  diff_note_edit(Buff.document_size - 1, 0, 1);
+  invalidate_other_panes(Buff.document_size - 1, 0, 1);
+}
+
+// Creates path when it does not exist. Returns NULL when it can be read
+// into a buffer, otherwise why not.
+const char *prepare_file(const char *path) {
+  struct stat st;
+  if(stat(path, &st) == 0 && S_ISDIR(st.st_mode)) return strerror(EISDIR);
+  int fd = open(path, O_RDONLY | O_CREAT | O_CLOEXEC, 0666);
+  if(fd < 0) return strerror(errno);
+  close(fd);
+  return NULL;
+}
+
+void flash_open_error(const char *path, const char *why) {
+  char msg[PATH_MAX + 64];
+  snprintf(msg, sizeof(msg), "\033[1;31mError:\033[0m Cannot open '%s': %s", path, why);
+  flash_command_status(msg);
+}
+
+// Reads filen into the active buffer. Returns 0 and leaves the document
+// alone when the file cannot be opened.
+int open_editor(char *filen) {
+  if(prepare_file(filen)) return 0;
+  int fd = open(filen, O_RDONLY | O_CLOEXEC);
+  if(fd < 0) return 0;
+
+  reset_lines();
+  Buff.document_size = 0; 
+  Buff.file_bytes = 0;
+
+  // Read in large chunks and split on newlines; a line longer than the
+  // buffer makes it grow
+  size_t buffer_cap = OPEN_CHUNK_SIZE;
+  size_t used = 0;
+  char *buffer = malloc(buffer_cap);
+  if(!buffer) {
+    perror("Malloc failled");
     exit(EXIT_FAILURE);
   }
 
-  for (int i = 0; i < Buff.document_size; i++) {
-    if(Buff.document[i].line != NULL) {
-      free(Buff.document[i].line);
-      Buff.document[i].line = NULL;
+  ssize_t n;
+  while((n = read(fd, buffer + used, buffer_cap - used)) > 0) {
+    used += n;
+    Buff.file_bytes += n;
+
+    char *start = buffer;
+    char *end = buffer + used;
+    char *nl;
+    while((nl = memchr(start, '\n', end - start)) != NULL) {
+      load_line(start, nl - start);
+      start = nl + 1;
+    }
+
+    used = end - start;
+    memmove(buffer, start, used);
+    if(used == buffer_cap) {
+      buffer_cap *= 2;
+      char *tmp = realloc(buffer, buffer_cap);
+      if(!tmp) {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+      }
+      buffer = tmp;
     }
-    Buff.document[i].size = 0;
-    Buff.document[i].is_dirty = 0;
   }
-  Buff.document_size = 0; 
+  if(used > 0) load_line(buffer, used);
 
-  FILE *file = fopen(filen, "r");
+  free(buffer);
 
-  if (!file) {
-    perror("Error opening file");
+  // Callers may pass a stack buffer that is gone once the loop resumes
+  char *name = strdup(filen);
+  if(!name) {
+    perror("Malloc failled");
     exit(EXIT_FAILURE);
   }
+  free(Buff.file_name);
+  Buff.file_name = name;
+  close(fd);
+  return 1;
+}
 
-  char *buffer = NULL;
-  size_t buffer_len;
-  ssize_t line_len;
-  Buff.document_size = 0;
+// ===============================
+// FOLLOW MODE HOOKS
+// ===============================
 
-  while((line_len = getline(&buffer, &buffer_len, file)) != -1) {  
-    ensure_document_capacity();
+void extend_last_line(const char *text, int len) {
+  Line *l = &Buff.document[Buff.document_size - 1];
+  long_line_note_change(CurrentBuffer, Buff.document_size - 1, l->size);
+  long_line_note_edit(CurrentBuffer, Buff.document_size - 1, 1, 1);
+  line_reserve(l, l->size + len);
+  memcpy(l->line + l->size, text, len);
+  l->size += len;
+  l->line[l->size] = '\0';
+  l->is_dirty = 1;
+  diff_note_edit(Buff.document_size - 1, 1, 1);
+  invalidate_other_panes(Buff.document_size - 1, 1, 1);
+}
 
-    if(line_len > 0 && buffer[line_len - 1] == '\n') {
-      line_len--;
-      buffer[line_len] = '\0';
-    }
-    if (line_len > 0 && buffer[line_len - 1] == '\r') {
-      line_len--;
-      buffer[line_len] = '\0';
-    }
+// The file was truncated or replaced; its lines are read in again.
+// Returns 0 and keeps the document and its journal when it has unsaved
+// edits.
+int reset_document() {
+  if(Buff.modified) return 0;
+  // A running filter reads these lines and would replace a range of them
+  if(filter_active()) {
+    filter_cancel();
+    discard_filter_output();
+    flash_command_status("Filter cancelled, the file was reloaded");
+  }
+  diff_stop();
+  invalidate_other_panes(0, Buff.document_size, 0);
+  long_line_forget(CurrentBuffer);
+  fold_set_destroy(Buff.folds);
+  Buff.folds = NULL;
+  mark_set_destroy(Buff.marks);
+  Buff.marks = NULL;
+  reset_lines();
+  Buff.document_size = 0;
+  Buff.cursor.x = 0;
+  Buff.cursor.y = 0;
+  Buff.cursor.desired_x = 0;
+  Win.scroll_y = 0;
+  Win.scroll_x = 0;
+  journal_reset(Buff.journal, Buff.file_name);
+  return 1;
+}
 
-    Buff.document[Buff.document_size].size = line_len;
-    Buff.document[Buff.document_size].line = malloc(line_len +1);
+int document_line_count() {
+  return Buff.document_size;
+}
 
-    if(!Buff.document[Buff.document_size].line) {
-      perror("Malloc buffer line failled");
-      fclose(file);
-      return;
-    }
+int cursor_at_bottom() {
+  return Buff.cursor.y >= Buff.document_size - 1;
+}
 
-    memcpy(Buff.document[Buff.document_size].line, buffer, line_len);
-    Buff.document_size++;
-    Buff.document[Buff.document_size].is_dirty = 1;
-  }
+// Repaints after lines were appended, moving the cursor along with the
+// end of the document when it was on the last line
+void document_grew(int old_size, int pinned) {
+  int old_scroll = Win.scroll_y;
+  int rows = text_rows();
+  int last = Buff.document_size > 0 ? Buff.document_size - 1 : 0;
 
-  free(buffer);
+  if(pinned) {
+    Buff.cursor.y = fold_span_start(Buff.folds, last);
+    Buff.cursor.x = 0;
+    Buff.cursor.desired_x = 0;
+    if(cursor_row() >= rows) Win.scroll_y = scroll_above(Buff.cursor.y, rows);
+  }
 
-  Buff.file_name = filen;
-  fclose(file);
+  if(old_size == 0 || Win.scroll_y != old_scroll) {
+    ansi_emit(ANSI_CLEAR);
+    mark_visible_lines_dirty();
+  }
+  else {
+    int from = line_row(&Buff, old_size - 1) - line_row(&Buff, Win.scroll_y);
+    invalidate_rows(clamp(from, 0, rows), rows);
+  }
+  draw_editor();
 }
 
 // ===============================
 // WINDOW AND RENDERING
 // ===============================
 
+// Fits the panes to the text area after it changed size
+void arrange_panes() {
+  if(ActivePane >= 0) layout_arrange(text_area());
+}
+
 void create_window() {
   struct winsize w;
   ioctl(STDOUT_FILENO, TIOCGWINSZ, &w); 
   Win.height = w.ws_row;
   Win.width = w.ws_col;
   Win.scroll_y = 0;
+  Win.scroll_x = 0;
+}
+
+// Repaints only what a size change touched: every visible row when the
+// width or the scroll position changes, otherwise just the rows gained
+void relayout_editor(int old_width, int old_height) {
+  arrange_panes();
+  int rows = text_rows();
+  int old_rows = rows - (Win.height - old_height);
+  int old_scroll = Win.scroll_y;
+
+  if(cursor_row() >= rows) {
+    Win.scroll_y = scroll_above(Buff.cursor.y, rows);
+  }
+
+  if(Win.width != old_width || Win.scroll_y != old_scroll || PaneCount > 1) {
+    ansi_emit(ANSI_CLEAR);
+    mark_visible_lines_dirty();
+  }
+  else if(rows > old_rows) {
+    for(int row = old_rows; row < rows; row++) {
+      term_printf("\033[%d;1H\033[2K", row + 1);
+    }
+    invalidate_rows(old_rows, rows);
+  }
+
+  draw_editor();
+}
+
+void apply_resize() {
+  struct winsize w;
+  if(ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) != 0) return;
+  if(w.ws_row == Win.height && w.ws_col == Win.width) return;
+
+  int old_width = Win.width;
+  int old_height = Win.height;
+  Win.height = w.ws_row;
+  Win.width = w.ws_col;
+
+  switch (Buff.mode) {
+    case MODE_BROWSER:
+      term_flush();
+      resize_browser();
+      break;
+    case MODE_MENU:
+      term_flush();
+      resize_menu(Win.height, Win.width);
+      break;
+    case MODE_PAGER:
+      pager_resize();
+      break;
+    default:
+      relayout_editor(old_width, old_height);
+      break;
+  }
+}
+
+void on_resize_timer(void *data) {
+  (void)data;
+  ResizeTimer = 0;
+  apply_resize();
+}
+
+// Bursts of SIGWINCH while a window is dragged collapse into one relayout
+void on_resize_signal(void *data) {
+  (void)data;
+  if(ResizeTimer) event_timer_cancel(ResizeTimer);
+  ResizeTimer = event_timer_add(RESIZE_DEBOUNCE_MS, on_resize_timer, NULL);
+}
+
+void draw_overlay() {
+  char line[256];
+  stats_format(line, sizeof(line));
+  term_printf("\033[%d;1H\033[2K\033[7m%.*s\033[0m", Win.height - 2, Win.width, line);
+}
+
+// Columns taken by the :diff marks left of the text
+int gutter_width() {
+  return diff_active() ? 2 : 0;
+}
+
+void draw_gutter(int y) {
+  char mark = diff_gutter(y);
+  const char *color = mark == '+' ? "32" : mark == '-' ? "31" : "33";
+  if(mark == ' ') term_write("  ", 2);
+  else term_printf("\033[%sm%c\033[0m ", color, mark);
+}
+
+void pad_columns(int n) {
+  static const char spaces[] = "                                ";
+  while(n > 0) {
+    int k = n < (int)sizeof(spaces) - 1 ? n : (int)sizeof(spaces) - 1;
+    term_write(spaces, k);
+    n -= k;
+  }
+}
+
+// The row a closed fold shows as: how many lines it hides and the text
+// of its first one, in at most width columns. Returns the columns used.
+int draw_fold_header(const Line *l, int lines, int width) {
+  int skip = 0;
+  while(skip < l->size && (l->line[skip] == ' ' || l->line[skip] == '\t')) skip++;
+  char head[32];
+  int len = snprintf(head, sizeof(head), "+--%3d lines: ", lines);
+  len = clamp(len, 0, width);
+  int size = clamp(l->size - skip, 0, width - len);
+  term_printf("\033[36m%.*s%.*s\033[0m", len, head, size, l->line + skip);
+  return len + size;
+}
+
+// Line y of b, the buffer in slot buffer, on row of a pane showing text
+// there from column scroll_x. Only the columns that fit are written, so a
+// line of hundreds of megabytes draws as fast as a short one. A pane
+// narrower than the screen is blanked up to its edge, since clearing the
+// row would wipe the pane beside it.
+void draw_pane_line(LayoutRect text, int row, const Buffer *b, int buffer, int y, int gutter, int scroll_x) {
+  int full = text.left == 0 && text.width == Win.width;
+  if(full) term_printf("\033[%d;1H\033[2K", text.top + row + 1);
+  else term_printf("\033[%d;%dH", text.top + row + 1, text.left + 1);
+
+  int used = 0;
+  if(y < b->document_size) {
+    if(gutter) {
+      draw_gutter(y);
+      used = gutter;
+    }
+    int end = fold_span_end(b->folds, y);
+    if(end > y) {
+      used += draw_fold_header(&b->document[y], end - y + 1, text.width - used);
+    }
+    else {
+      const Line *l = &b->document[y];
+      int from = clamp(scroll_x, 0, l->size);
+      int size = clamp(l->size - from, 0, text.width - used);
+      int state = from > 0 ? long_line_state(buffer, y, l->line, l->size, from) : 0;
+      syntax_highlight_slice(l->line + from, size, state);
+      used += size;
+    }
+  }
+  if(!full) pad_columns(text.width - used);
+}
+
+// Repaints the dirty rows of a pane that is not the active one
+void draw_pane(int p) {
+  Pane *pane = &Panes[p];
+  LayoutRect text = pane_text(p);
+  const Buffer *b = slot_buffer(pane->buffer);
+  int gutter = pane->buffer == CurrentBuffer ? gutter_width() : 0;
+  int to = pane->dirty_to < text.height ? pane->dirty_to : text.height;
+  int y = row_line(b, line_row(b, pane->scroll_y) + pane->dirty_from);
+  for(int row = pane->dirty_from; row < to; row++) {
+    draw_pane_line(text, row, b, pane->buffer, y, gutter, pane->scroll_x);
+    if(y < b->document_size) y = fold_span_end(b->folds, y) + 1;
+  }
+  pane->dirty_from = 0;
+  pane->dirty_to = 0;
+}
+
+// The separator right of each pane that has a neighbour there and the
+// status row under each pane that has one below. The status rows are
+// short and show the active pane, so they are drawn every frame.
+void draw_pane_frames() {
+  for(int p = 0; p < 2 * MAX_PANES - 1; p++) {
+    if(!layout_valid(p)) continue;
+    LayoutRect r = layout_rect(p);
+    LayoutRect text = pane_text(p);
+    if(PaneFramesDirty && text.width < r.width) {
+      for(int row = 0; row < r.height; row++) {
+        term_printf("\033[%d;%dH|", r.top + row + 1, text.left + text.width + 1);
+      }
+    }
+    if(text.height < r.height) {
+      const Buffer *b = slot_buffer(p == ActivePane ? CurrentBuffer : Panes[p].buffer);
+      char name[256];
+      int len = snprintf(name, sizeof(name), " %s%s", b->file_name, b->modified ? " [+]" : "");
+      len = clamp(len, 0, r.width < (int)sizeof(name) - 1 ? r.width : (int)sizeof(name) - 1);
+      term_printf("\033[%d;%dH\033[%sm%.*s", r.top + text.height + 1, r.left + 1,
+                  p == ActivePane ? "1;7" : "7", len, name);
+      pad_columns(r.width - len);
+      term_write("\033[0m", 4);
+    }
+  }
+  PaneFramesDirty = 0;
+}
+
+void place_cursor() {
+  LayoutRect text = active_text();
+  int screen_y = text.top + cursor_row() + 1;
+  term_printf("\033[%d;%dH", screen_y, text.left + Buff.cursor.x - Win.scroll_x + gutter_width() + 1);
+}
+
+// Scrolls sideways to show the cursor's column: just enough going right,
+// so typing at the end of a long line moves one column at a time, and
+// half a screen going left
+void follow_cursor_column() {
+  int width = active_text().width - gutter_width();
+  int scroll = Win.scroll_x;
+  if(Buff.cursor.x < scroll) scroll = clamp(Buff.cursor.x - width / 2, 0, Buff.cursor.x);
+  if(width > 0 && Buff.cursor.x - scroll >= width) scroll = Buff.cursor.x - width + 1;
+  if(scroll == Win.scroll_x) return;
+  Win.scroll_x = scroll;
+  mark_visible_lines_dirty();
 }
 
 void draw_editor() {
+  if(RenderSuspend > 0) return;
+  stats_frame_begin();
   ansi_emit(ANSI_CURSOR_HIDE);
 
   // Render
-  int max_lines = Win.height - 2;
-  int start_line = Win.scroll_y;
-  int end_line = Win.scroll_y + max_lines;
+  follow_cursor_column();
+  LayoutRect text = active_text();
 
-  // Render visible lines
-  for(int i = start_line; i < end_line && i < Buff.document_size; i++) {
+  // Render visible lines, a closed fold as its first
+  int i = fold_span_start(Buff.folds, Win.scroll_y);
+  for(int row = 0; row < text.height && i < Buff.document_size; row++) {
     if(Buff.document[i].is_dirty) {
-      dprintf(STDOUT_FILENO, "\033[%d;1H\033[2K", i - Win.scroll_y + 1);
-      syntax_highlight_and_print(Buff.document[i].line, Buff.document[i].size);
+      draw_pane_line(text, row, &Buff, CurrentBuffer, i, gutter_width(), Win.scroll_x);
       Buff.document[i].is_dirty = 0;
     }
+    i = fold_span_end(Buff.folds, i) + 1;
+  }
+
+  if(PaneCount > 1) {
+    for(int p = 0; p < 2 * MAX_PANES - 1; p++) {
+      if(p != ActivePane && layout_valid(p)) draw_pane(p);
+    }
+    draw_pane_frames();
   }
 
   // Writing command message
   if(Buff.status_len > 0) {
-    dprintf(STDOUT_FILENO, "\033[%d;1H", Win.height);
-    dprintf(STDOUT_FILENO, "%s", Buff.status_msg);
+    term_printf("\033[%d;1H\033[2K", Win.height);
+    term_printf("%.*s", Win.width - 1, Buff.status_msg);
   }
   else {
-    dprintf(STDOUT_FILENO, "\033[%d;1H", Win.height);
+    term_printf("\033[%d;1H", Win.height);
     ansi_emit(ANSI_CLEAR_LINE);
   }
 
   draw_status_bar();
+  if(stats_overlay_visible()) draw_overlay();
 
   // Showing cursor
-  int screen_y = Buff.cursor.y - Win.scroll_y + 1;
-  dprintf(STDOUT_FILENO, "\033[%d;%dH", screen_y, Buff.cursor.x + 1);
-  write(STDOUT_FILENO, "\033[?7h", 5);
+  place_cursor();
+  term_write("\033[?7h", 5);
   ansi_emit(ANSI_CURSOR_SHOW);
+  stats_frame_end();
 }
 
 // ===============================
 // TEXT EDITING OPERATIONS
 // ===============================
 
+// Every edit reports the lines it replaced: [y, y + removed) became
+// added lines
+void document_edited(int y, int removed, int added) {
+  Buff.modified = 1;
+  long_line_note_edit(CurrentBuffer, y, removed, added);
+  fold_note_edit(Buff.folds, y, removed, added);
+  mark_note_edit(Buff.marks, y, removed, added);
+  diff_note_edit(y, removed, added);
+  invalidate_other_panes(y, removed, added);
+}
+
 // Inserting and deletign functions
 void append_char(char c) {
+  journal_record(Buff.journal, JOURNAL_INSERT_CHAR, Buff.cursor.y, Buff.cursor.x, c);
   if(Buff.document_size == 0) {
     ensure_document_capacity();
-    Buff.document[0].size = 1;
-    Buff.document[0].line = malloc(1);
-    if (!Buff.document[0].line) { perror("malloc"); exit(EXIT_FAILURE); }
+    Buff.document[0].line = NULL;
+    Buff.document[0].capacity = 0;
+    line_reserve(&Buff.document[0], 0);
+    Buff.document[0].size = 0;
     Buff.document[0].line[0] = '\0';
     Buff.document[0].is_dirty = 1;
     Buff.document_size = 1;
     Buff.cursor.x = 0;
     Buff.cursor.y = 0;
+    document_edited(0, 0, 1);
   }
 
-  int original_size = Buff.document[Buff.cursor.y].size;
+  Line *line = &Buff.document[Buff.cursor.y];
+  int original_size = line->size;
   int insert_pos = Buff.cursor.x;
 
-  Buff.document[Buff.cursor.y].size++;
-  Buff.document[Buff.cursor.y].line = realloc(Buff.document[Buff.cursor.y].line, Buff.document[Buff.cursor.y].size + 1);
-  if (!Buff.document[Buff.cursor.y].line) { perror("realloc"); exit(EXIT_FAILURE); }
-  Buff.document[Buff.cursor.y].is_dirty = 1;
+  line_reserve(line, original_size + 1);
+  line->size++;
+  line->is_dirty = 1;
 
-  for(int i = original_size; i >= insert_pos; i--) {
-    Buff.document[Buff.cursor.y].line[i + 1] = Buff.document[Buff.cursor.y].line[i];
-  }
+  memmove(&line->line[insert_pos + 1], &line->line[insert_pos], original_size - insert_pos + 1);
   
-  Buff.document[Buff.cursor.y].line[insert_pos] = c;
+  line->line[insert_pos] = c;
+  long_line_note_change(CurrentBuffer, Buff.cursor.y, insert_pos);
+  document_edited(Buff.cursor.y, 1, 1);
   move_cursor_horizontaly(1);
 }
 
 void append_line() {
+  journal_record(Buff.journal, JOURNAL_SPLIT_LINE, Buff.cursor.y, Buff.cursor.x, 0);
   if (Buff.document_size == 0) {
     ensure_document_capacity();
+    Buff.document[0].line = NULL;
+    Buff.document[0].capacity = 0;
+    line_reserve(&Buff.document[0], 0);
     Buff.document[0].size = 0;
-    Buff.document[0].line = malloc(1);
-    if (!Buff.document[0].line) { perror("malloc"); exit(EXIT_FAILURE); }
     Buff.document[0].line[0] = '\0';
     Buff.document[0].is_dirty = 1;
     Buff.document_size = 1;
     Buff.cursor.x = 0;
     Buff.cursor.y = 0;
+    document_edited(0, 0, 1);
     draw_editor();
     return;
   }
@@ -559,9 +1395,11 @@ void append_line() {
   int remaining_size = content_size - split_pos;
   if (remaining_size < 0) remaining_size = 0;
   
+  Buff.document[current_line + 1].line = NULL;
+  Buff.document[current_line + 1].size = 0;
+  Buff.document[current_line + 1].capacity = 0;
+  line_reserve(&Buff.document[current_line + 1], remaining_size);
   Buff.document[current_line + 1].size = remaining_size;
-  Buff.document[current_line + 1].line = malloc(remaining_size + 1);
-  if(!Buff.document[current_line + 1].line) { perror("malloc"); exit(EXIT_FAILURE); }
 
   if (remaining_size > 0) {
     memcpy(Buff.document[current_line + 1].line,
@@ -572,21 +1410,22 @@ void append_line() {
   Buff.document[current_line + 1].is_dirty = 1;
 
   Buff.document[current_line].size = split_pos;
-  Buff.document[current_line].line = realloc(Buff.document[current_line].line, split_pos + 1);
-  if(!Buff.document[current_line].line) { perror("realloc"); exit(EXIT_FAILURE); };
+  line_unshare(&Buff.document[current_line]);
   Buff.document[current_line].line[split_pos] = '\0';
   Buff.document[current_line].is_dirty = 1;  
 
   Buff.document_size++;
+  document_edited(current_line, 1, 2);
   move_cursor_verticaly(1);
   Buff.cursor.x = 0;
   Buff.cursor.desired_x = 0;
 
-  mark_all_lines_dirty();
+  mark_visible_lines_dirty();
   draw_editor();
 }
 
 void delete_char() {
+  journal_record(Buff.journal, JOURNAL_DELETE_CHAR, Buff.cursor.y, Buff.cursor.x, 0);
   int original_size = Buff.document[Buff.cursor.y].size;
   int delete_pos = Buff.cursor.x - 1;
    if(delete_pos < 0) {
@@ -598,10 +1437,8 @@ void delete_char() {
         int previous_content_size = previous_size;
 
   
+        line_reserve(&Buff.document[current_pos - 1], previous_content_size + current_size);
         Buff.document[current_pos - 1].size = previous_content_size + current_size;
-  
-        Buff.document[current_pos - 1].line = realloc(Buff.document[current_pos - 1].line, previous_content_size + current_size + 1);
-        if(!Buff.document[current_pos - 1].line) { perror("realloc"); exit(EXIT_FAILURE); };
         Buff.document[current_pos - 1].is_dirty = 1;
   
         memcpy(
@@ -612,7 +1449,7 @@ void delete_char() {
   
         Buff.document[current_pos - 1].line[previous_content_size + current_size] = '\0';
   
-        free(Buff.document[current_pos].line);
+        line_release(&Buff.document[current_pos]);
   
         for(int i = current_pos; i < Buff.document_size - 1; i++) {
           Buff.document[i] = Buff.document[i + 1];
@@ -620,6 +1457,7 @@ void delete_char() {
         }
   
         Buff.document_size--;
+        document_edited(current_pos - 1, 2, 1);
         move_cursor_verticaly(-1);
         Buff.cursor.x = previous_content_size;
         Buff.cursor.desired_x = previous_content_size;
@@ -628,18 +1466,18 @@ void delete_char() {
     }
 
     ansi_emit(ANSI_CLEAR);
-    mark_all_lines_dirty();
+    mark_visible_lines_dirty();
     draw_editor();
     return;
   } 
 
-  for(int i = delete_pos; i < original_size; i++) {
-    Buff.document[Buff.cursor.y].line[i] = Buff.document[Buff.cursor.y].line[i+1];
-  }
+  // Shrinking keeps the block so retyping grows in place
+  line_unshare(&Buff.document[Buff.cursor.y]);
+  memmove(&Buff.document[Buff.cursor.y].line[delete_pos], &Buff.document[Buff.cursor.y].line[delete_pos + 1], original_size - delete_pos);
   Buff.document[Buff.cursor.y].size--;
-  Buff.document[Buff.cursor.y].line = realloc(Buff.document[Buff.cursor.y].line, Buff.document[Buff.cursor.y].size + 1);
-  if(!Buff.document[Buff.cursor.y].line) { perror("realloc"); exit(EXIT_FAILURE); };
   Buff.document[Buff.cursor.y].is_dirty = 1;
+  long_line_note_change(CurrentBuffer, Buff.cursor.y, delete_pos);
+  document_edited(Buff.cursor.y, 1, 1);
 
   move_cursor_horizontaly(-1);
   draw_editor();
@@ -650,19 +1488,19 @@ void delete_line() {
     draw_editor();
     return;
   }
+  journal_record(Buff.journal, JOURNAL_DELETE_LINE, Buff.cursor.y, Buff.cursor.x, 0);
   
   int current_line = Buff.cursor.y; 
 
-  free(Buff.document[current_line].line);
-  Buff.document[current_line].size = 0;
-  Buff.document[current_line].line = NULL;
+  line_release(&Buff.document[current_line]);
   Buff.document[current_line].is_dirty = 1;
 
-  for(int i = current_line; i < Buff.document_size; i++) {
+  for(int i = current_line; i < Buff.document_size - 1; i++) {
     Buff.document[i] = Buff.document[i+1];
   }
 
   Buff.document_size--;
+  document_edited(current_line, 1, 0);
   Buff.cursor.x = 0;
   Buff.cursor.desired_x = 0;
   if(Buff.cursor.y >= Buff.document_size) {
@@ -671,11 +1509,160 @@ void delete_line() {
   if(Buff.cursor.y <= 1) {
     move_cursor_horizontaly(-Buff.document_size);
   }
-  mark_all_lines_dirty();
+  mark_visible_lines_dirty();
+  ansi_emit(ANSI_CLEAR);
+  draw_editor();
+}
+
+// ===============================
+// LINE RANGES
+// ===============================
+
+// Forgets what the register held. Its lines live in the arena, so when
+// the arena is about to go away they are dropped without freeing.
+void yank_clear(int release) {
+  if(release) {
+    for(int i = 0; i < Yank.count; i++) line_release(&Yank.lines[i]);
+  }
+  Yank.count = 0;
+}
+
+// Room for count lines in r, growing it at least twofold
+void register_reserve(YankRegister *r, int count) {
+  if(count <= r->capacity) return;
+  int capacity = r->capacity * 2 > count ? r->capacity * 2 : count;
+  Line *tmp = realloc(r->lines, capacity * sizeof(Line));
+  if(!tmp) {
+    perror("Malloc failled");
+    exit(EXIT_FAILURE);
+  }
+  r->lines = tmp;
+  r->capacity = capacity;
+}
+
+void yank_reserve(int count) {
+  register_reserve(&Yank, count);
+  Yank.arena = Buff.arena;
+}
+
+// Copies lines [from, from + count) into the register
+void yank_lines(int from, int count) {
+  yank_clear(1);
+  yank_reserve(count);
+  for(int i = 0; i < count; i++) {
+    Line *src = &Buff.document[from + i];
+    Line *dst = &Yank.lines[i];
+    dst->line = line_arena_alloc_packed(Buff.arena, src->size + 1, &dst->capacity);
+    memcpy(dst->line, src->line, src->size);
+    dst->line[src->size] = '\0';
+    dst->size = src->size;
+    dst->is_dirty = 1;
+  }
+  Yank.count = count;
+}
+
+// Removes the lines of runs (ascending, not overlapping) in one pass: each
+// kept block between two runs is moved once. Removed lines go into the
+// yank register when yank is set.
+void remove_line_runs(const LineRun *runs, int n, int yank) {
+  if(n == 0) return;
+  // Bottom up, so each run's line numbers still hold
+  for(int k = n - 1; k >= 0; k--) document_edited(runs[k].start, runs[k].count, 0);
+  if(yank) {
+    int removed = 0;
+    for(int k = 0; k < n; k++) removed += runs[k].count;
+    yank_clear(1);
+    yank_reserve(removed);
+  }
+
+  int w = runs[0].start;
+  for(int k = 0; k < n; k++) {
+    Line *dead = &Buff.document[runs[k].start];
+    for(int i = 0; i < runs[k].count; i++) {
+      if(yank) Yank.lines[Yank.count++] = dead[i];
+      else line_release(&dead[i]);
+    }
+    int keep_from = runs[k].start + runs[k].count;
+    int keep_to = k + 1 < n ? runs[k + 1].start : Buff.document_size;
+    memmove(&Buff.document[w], &Buff.document[keep_from], (keep_to - keep_from) * sizeof(Line));
+    w += keep_to - keep_from;
+  }
+
+  for(int i = w; i < Buff.document_size; i++) {
+    Buff.document[i].line = NULL;
+    Buff.document[i].size = 0;
+    Buff.document[i].capacity = 0;
+    Buff.document[i].is_dirty = 1;
+  }
+  Buff.document_size = w;
+}
+
+// Puts the cursor at the start of line y after an edit that moved many
+// lines, and repaints once
+void finish_bulk_edit(int y) {
+  Buff.cursor.y = Buff.document_size > 0 ? clamp(y, 0, Buff.document_size - 1) : 0;
+  Buff.cursor.x = 0;
+  Buff.cursor.desired_x = 0;
+  if(Win.scroll_y > Buff.cursor.y) Win.scroll_y = Buff.cursor.y;
+  mark_visible_lines_dirty();
   ansi_emit(ANSI_CLEAR);
+  move_cursor_verticaly(0);
   draw_editor();
 }
 
+// Journals the runs bottom up, so every record's line numbers still hold
+// when it is replayed, then removes them
+void delete_line_runs(const LineRun *runs, int n, int yank) {
+  if(n == 0) return;
+  for(int k = n - 1; k >= 0; k--) {
+    journal_record(Buff.journal, JOURNAL_DELETE_LINES, runs[k].start, runs[k].count, 0);
+  }
+  remove_line_runs(runs, n, yank);
+  finish_bulk_edit(runs[0].start);
+}
+
+void delete_lines(int from, int count, int yank) {
+  LineRun run = { from, count };
+  delete_line_runs(&run, 1, yank);
+}
+
+// Inserts a copy of the register at line at
+void put_lines(int at) {
+  if(Yank.count == 0) return;
+  int count = Yank.count;
+
+  // Journaled as one record replacing no lines with the register's text
+  if(Buff.journal) {
+    size_t len = 0;
+    for(int i = 0; i < count; i++) len += Yank.lines[i].size + 1;
+    journal_record_text(Buff.journal, JOURNAL_REPLACE_LINES, at, 0, len);
+    for(int i = 0; i < count; i++) {
+      journal_append_text(Buff.journal, Yank.lines[i].line, Yank.lines[i].size);
+      journal_append_text(Buff.journal, "\n", 1);
+    }
+  }
+
+  reserve_document(Buff.document_size + count);
+  memmove(&Buff.document[at + count], &Buff.document[at], (Buff.document_size - at) * sizeof(Line));
+  for(int i = 0; i < count; i++) {
+    Line *src = &Yank.lines[i];
+    Line *dst = &Buff.document[at + i];
+    dst->line = line_arena_alloc_packed(Buff.arena, src->size + 1, &dst->capacity);
+    memcpy(dst->line, src->line, src->size);
+    dst->line[src->size] = '\0';
+    dst->size = src->size;
+    dst->is_dirty = 1;
+  }
+  Buff.document_size += count;
+  document_edited(at, 0, count);
+
+  Buff.cursor.y = at;
+  Buff.cursor.x = 0;
+  Buff.cursor.desired_x = 0;
+  mark_visible_lines_dirty();
+  move_cursor_verticaly(0);
+}
+
 // ===============================
 // CURSOR MOVEMENT
 // ===============================
@@ -690,24 +1677,27 @@ void move_cursor_horizontaly(int direction) {
   draw_editor();
 }
 
+// Moves by rows, so a closed fold is one step
 void move_cursor_verticaly(int direction) {
   if(Buff.document_size <= 0) return;  
   
-  int doc_y = clamp(Buff.cursor.y + direction, 0, Buff.document_size - 1);
+  long long row = (long long)line_row(&Buff, Buff.cursor.y) + direction;
+  int last_row = line_row(&Buff, Buff.document_size - 1);
+  int doc_y = row_line(&Buff, row < 0 ? 0 : row > last_row ? last_row : row);
   int doc_x = clamp(Buff.cursor.desired_x, 0, Buff.document[doc_y].size - 1);
   Buff.cursor.y = doc_y;
   Buff.cursor.x = doc_x;
 
-  int max_visible_lines = Win.height - 2;
+  int max_visible_lines = text_rows();
   
-  if (Buff.cursor.y >= Win.scroll_y + max_visible_lines) {
-    mark_all_lines_dirty();
-    Win.scroll_y = Buff.cursor.y - max_visible_lines + 1;
+  if (cursor_row() >= max_visible_lines) {
+    Win.scroll_y = scroll_above(Buff.cursor.y, max_visible_lines);
+    mark_visible_lines_dirty();
   }
   
-  if (Buff.cursor.y < Win.scroll_y) {
-    mark_all_lines_dirty();
+  if (cursor_row() < 0) {
     Win.scroll_y = Buff.cursor.y;
+    mark_visible_lines_dirty();
   }
   draw_editor();
 }
@@ -725,68 +1715,425 @@ void enter_viewing_mode() {
   draw_editor();
 }
 
-void handle_viewing_input(char c) {
-  if(isdigit(c)) {
-    if(c == '0' && Buff.prefix.count == 0) {
-      move_cursor_horizontaly(-Win.width);
-      return;
+// Count typed before the key, at least 1
+int key_count() {
+  int count = keymap_count();
+  return count > 0 ? count : 1;
+}
+
+void key_left() { move_cursor_horizontaly(-key_count()); }
+void key_right() { move_cursor_horizontaly(key_count()); }
+void key_down() { move_cursor_verticaly(key_count()); }
+void key_up() { move_cursor_verticaly(-key_count()); }
+void key_line_start() { move_cursor_horizontaly(-Win.width); }
+
+// ]c and [c, count times
+void jump_to_change(int dir) {
+  if(!diff_active()) return;
+  int y = Buff.cursor.y;
+  for(int i = key_count(); i > 0; i--) {
+    int next = diff_next_hunk(y, dir);
+    if(next < 0) break;
+    y = next;
+  }
+  if(y == Buff.cursor.y) {
+    flash_command_status("No more changes");
+    draw_editor();
+    return;
+  }
+  Buff.cursor.y = y;
+  move_cursor_verticaly(0);
+}
+
+void key_next_change() { jump_to_change(1); }
+void key_prev_change() { jump_to_change(-1); }
+
+// Lines on the count rows from the cursor's down, every line of a closed
+// fold among them
+int counted_lines() {
+  int last_row = line_row(&Buff, Buff.document_size - 1);
+  int row = clamp(line_row(&Buff, Buff.cursor.y) + key_count() - 1, 0, last_row);
+  return fold_span_end(Buff.folds, row_line(&Buff, row)) - Buff.cursor.y + 1;
+}
+
+void key_delete_lines() {
+  if(Buff.document_size == 0 || document_locked()) return;
+  delete_lines(Buff.cursor.y, counted_lines(), 1);
+}
+
+void key_yank_lines() {
+  if(Buff.document_size == 0) return;
+  yank_lines(Buff.cursor.y, counted_lines());
+}
+
+void key_put_below() {
+  if(document_locked()) return;
+  int at = Buff.document_size > 0 ? fold_span_end(Buff.folds, Buff.cursor.y) + 1 : 0;
+  for(int i = key_count(); i > 0; i--) put_lines(at);
+}
+
+void key_put_above() {
+  if(document_locked()) return;
+  for(int i = key_count(); i > 0; i--) put_lines(Buff.cursor.y);
+}
+
+void key_append() {
+  move_cursor_horizontaly(1);
+  enter_inserting_mode();
+}
+
+void key_insert_at_indent() {
+  for(int i = 0; i < Buff.document[Buff.cursor.y].size; i++) {
+    if(Buff.document[Buff.cursor.y].line[i] != ' ') {
+      move_cursor_horizontaly(i - Buff.cursor.x);
+      enter_inserting_mode();
+      break;
     }
-    Buff.prefix.count = Buff.prefix.count * 10 + (c - '0');
+  }
+  move_cursor_horizontaly(0);
+}
+
+void key_append_at_end() {
+  move_cursor_horizontaly(Buff.document[Buff.cursor.y].size);
+  enter_inserting_mode();
+}
+
+// q{reg} and @{reg} take the register as the next key
+int MacroPlayCount = 1;
+
+void take_record_register(char c) {
+  if(macro_start(c)) draw_editor();
+}
+
+void take_play_register(char c) {
+  macro_play(c, MacroPlayCount);
+}
+
+void key_record_macro() {
+  if(macro_recording()) {
+    macro_stop();
     draw_editor();
     return;
   }
-  if(c == KEY_ESC) {
-    reset_prefix();
+  keymap_await_key(KEYMAP_VIEW, take_record_register);
+}
+
+void key_play_macro() {
+  MacroPlayCount = key_count();
+  keymap_await_key(KEYMAP_VIEW, take_play_register);
+}
+
+// --- FOLDS ---
+
+FoldSet *buffer_folds() {
+  if(!Buff.folds) Buff.folds = fold_set_create();
+  return Buff.folds;
+}
+
+// Folds opened or closed: the cursor stays on the row it was on and every
+// pane repaints
+void folds_changed() {
+  Buff.cursor.y = fold_span_start(Buff.folds, Buff.cursor.y);
+  Win.scroll_y = fold_span_start(Buff.folds, Win.scroll_y);
+  ansi_emit(ANSI_CLEAR);
+  mark_visible_lines_dirty();
+  move_cursor_verticaly(0);
+}
+
+void fold_failed(const char *message) {
+  flash_command_status(message);
+  draw_editor();
+}
+
+// Closed fold over lines [from, to]
+void make_fold(int from, int to) {
+  if(to <= from) {
+    fold_failed("\033[1;31mError:\033[0m A fold needs two lines or more");
     return;
   }
-  if(is_operator(c)) {
-    if(Buff.prefix.command[0] == '\0') {
-      Buff.prefix.command[0] = c;
-      Buff.prefix.command[1] = '\0';
-      draw_editor();
-      return;
-    }
-    else if(Buff.prefix.command[0] == c) {
-      int count = (Buff.prefix.count > 0) ? Buff.prefix.count : 1;
-      execute_operator(count, c);
-      reset_prefix();
-      return;
-    }
+  if(!fold_add(buffer_folds(), from, to)) {
+    fold_failed("\033[1;31mError:\033[0m Folds cannot cross");
+    return;
   }
-  if(is_motion(c)) {
-    if(Buff.prefix.command[0] == '\0') {
-      int count = (Buff.prefix.count > 0) ? Buff.prefix.count : 1;
-      execute_motion(count, c);
-      reset_prefix();
-    }
-    
-    reset_prefix();
+  folds_changed();
+}
+
+// zf folds count rows, or without a count the block the cursor is on
+void key_fold_create() {
+  if(Buff.document_size == 0) return;
+  int y = Buff.cursor.y;
+  int end = keymap_count() > 0 ? y + counted_lines() - 1 : fold_block_end(y);
+  if(end <= y) {
+    fold_failed("No block to fold");
     return;
   }
-    
-  switch (c) {
-    case ' ': move_cursor_horizontaly(1); break;
-    case ':': enter_command_mode(); break;
-    case 'i': enter_inserting_mode(); break;
-    case 'a': move_cursor_horizontaly(1); enter_inserting_mode(); break;
-    case 'I':
-      for(int i = 0; i < Buff.document[Buff.cursor.y].size; i++) {
-        if(Buff.document[Buff.cursor.y].line[i] != ' ') {
-          move_cursor_horizontaly(i - Buff.cursor.x);
-          enter_inserting_mode();
-          break;
-        }
-      }
-      move_cursor_horizontaly(0);
-      break;
-    case 'A': move_cursor_horizontaly(Buff.document[Buff.cursor.y].size); enter_inserting_mode(); break;
-    case 'G': move_cursor_verticaly(Buff.document_size); break;
+  make_fold(y, end);
+}
+
+void key_fold_open() {
+  if(fold_open(Buff.folds, Buff.cursor.y)) folds_changed();
+  else fold_failed("\033[1;31mError:\033[0m No fold found");
+}
+
+void key_fold_close() {
+  if(fold_close(Buff.folds, Buff.cursor.y)) folds_changed();
+  else fold_failed("\033[1;31mError:\033[0m No fold found");
+}
+
+void key_fold_delete() {
+  if(fold_delete(Buff.folds, Buff.cursor.y)) folds_changed();
+  else fold_failed("\033[1;31mError:\033[0m No fold found");
+}
+
+void key_fold_open_all() {
+  fold_open_all(Buff.folds);
+  folds_changed();
+}
+
+void key_fold_close_all() {
+  fold_close_all(Buff.folds);
+  folds_changed();
+}
+
+void key_fold_eliminate() {
+  fold_set_destroy(Buff.folds);
+  Buff.folds = NULL;
+  folds_changed();
+}
+
+// Text is typed into open lines only
+void open_folds_at_cursor() {
+  if(fold_span_end(Buff.folds, Buff.cursor.y) == Buff.cursor.y) return;
+  while(fold_open(Buff.folds, Buff.cursor.y));
+  folds_changed();
+}
+
+// --- MARKS ---
+
+MarkSet *buffer_marks() {
+  if(!Buff.marks) Buff.marks = mark_set_create();
+  return Buff.marks;
+}
+
+// Puts the cursor on line y at column x, or at the first non-blank when x
+// is negative, opening the folds around it
+void go_to_position(int y, int x) {
+  if(Buff.document_size <= 0) return;
+  Buff.cursor.y = clamp(y, 0, Buff.document_size - 1);
+  if(x < 0) {
+    Line *l = &Buff.document[Buff.cursor.y];
+    for(x = 0; x < l->size - 1 && (l->line[x] == ' ' || l->line[x] == '\t'); x++);
+  }
+  Buff.cursor.desired_x = x;
+  open_folds_at_cursor();
+  move_cursor_verticaly(0);
+}
+
+// A jump leaves the position it starts from in the jump list and the '
+// mark
+void jump_to(int y, int x) {
+  if(Buff.document_size <= 0) return;
+  mark_jump_from(buffer_marks(), Buff.cursor.y, Buff.cursor.x);
+  go_to_position(y, x);
+}
+
+// G and gg go to line count when there is one
+void key_last_line() {
+  int count = keymap_count();
+  jump_to(count > 0 ? count - 1 : Buff.document_size - 1, Buff.cursor.desired_x);
+}
+
+void key_first_line() {
+  int count = keymap_count();
+  jump_to(count > 0 ? count - 1 : 0, Buff.cursor.desired_x);
+}
+
+// m{a-z} sets a mark, '{a-z} jumps to its line and `{a-z} to its column.
+// '' and `` go back to where the last jump started.
+void take_mark_name(char c) {
+  if(c >= 'a' && c <= 'z') mark_set(buffer_marks(), c, Buff.cursor.y, Buff.cursor.x);
+}
+
+void go_to_mark(char c, int exact) {
+  int y, x;
+  if(!mark_get(Buff.marks, c, &y, &x)) {
+    flash_command_status("Mark not set");
+    draw_editor();
+    return;
+  }
+  jump_to(y, exact ? x : -1);
+}
+
+void take_mark_line(char c) { go_to_mark(c, 0); }
+void take_mark_exact(char c) { go_to_mark(c, 1); }
+
+void key_set_mark() { keymap_await_key(KEYMAP_VIEW, take_mark_name); }
+void key_mark_line() { keymap_await_key(KEYMAP_VIEW, take_mark_line); }
+void key_mark_exact() { keymap_await_key(KEYMAP_VIEW, take_mark_exact); }
+
+// Ctrl-O and Ctrl-I (Tab) walk the jump list, count entries at a time
+void key_jump_older() {
+  int y, x, moved = 0;
+  for(int i = key_count(); i > 0; i--) {
+    if(!mark_jump_older(buffer_marks(), Buff.cursor.y, Buff.cursor.x, &y, &x)) break;
+    moved = 1;
+  }
+  if(moved) go_to_position(y, x);
+}
+
+void key_jump_newer() {
+  int y, x, moved = 0;
+  for(int i = key_count(); i > 0; i--) {
+    if(!mark_jump_newer(Buff.marks, &y, &x)) break;
+    moved = 1;
+  }
+  if(moved) go_to_position(y, x);
+}
+
+// --- MOTIONS ---
+
+void word_motion(int (*motion)(int *y, int *x, int count, int big), int big) {
+  if(Buff.document_size <= 0) return;
+  int y = Buff.cursor.y, x = Buff.cursor.x;
+  if(motion(&y, &x, key_count(), big)) go_to_position(y, x);
+}
+
+void key_word() { word_motion(motion_word, 0); }
+void key_big_word() { word_motion(motion_word, 1); }
+void key_word_end() { word_motion(motion_word_end, 0); }
+void key_big_word_end() { word_motion(motion_word_end, 1); }
+void key_word_back() { word_motion(motion_word_back, 0); }
+void key_big_word_back() { word_motion(motion_word_back, 1); }
+
+// f, t, F and T take the character as the next key
+int FindCount = 1;
+int FindDir = 1;
+int FindTill = 0;
+
+void take_find_char(char c) {
+  if(Buff.document_size <= 0) return;
+  int x = Buff.cursor.x;
+  if(motion_find_char(Buff.cursor.y, &x, c, FindCount, FindDir, FindTill)) go_to_position(Buff.cursor.y, x);
+}
+
+void find_char(int dir, int till) {
+  FindCount = key_count();
+  FindDir = dir;
+  FindTill = till;
+  keymap_await_key(KEYMAP_VIEW, take_find_char);
+}
+
+void key_find_forward() { find_char(1, 0); }
+void key_till_forward() { find_char(1, 1); }
+void key_find_backward() { find_char(-1, 0); }
+void key_till_backward() { find_char(-1, 1); }
+
+// % goes to the matching bracket, or count percent into the file
+void key_match_bracket() {
+  if(Buff.document_size <= 0) return;
+  int count = keymap_count();
+  if(count > 0) {
+    if(count <= 100) jump_to((count * Buff.document_size + 99) / 100 - 1, -1);
+    return;
+  }
+  int y = Buff.cursor.y, x = Buff.cursor.x;
+  if(motion_match_bracket(&y, &x)) jump_to(y, x);
+}
+
+void paragraph_motion(int dir) {
+  if(Buff.document_size <= 0) return;
+  int y = Buff.cursor.y, x = Buff.cursor.x;
+  if(motion_paragraph(&y, &x, key_count(), dir)) jump_to(y, x);
+}
+
+void key_next_paragraph() { paragraph_motion(1); }
+void key_prev_paragraph() { paragraph_motion(-1); }
+
+// * goes to the next whole word match of the word under the cursor
+void key_star() {
+  if(Buff.document_size <= 0) return;
+  int start, end;
+  if(!motion_word_under(Buff.cursor.y, Buff.cursor.x, &start, &end)) {
+    flash_command_status("No string under cursor");
+    draw_editor();
+    return;
+  }
+  int len = end - start;
+  char *word = malloc(len);
+  if(!word) {
+    perror("Malloc failled");
+    exit(EXIT_FAILURE);
   }
+  memcpy(word, Buff.document[Buff.cursor.y].line + start, len);
+  int y = Buff.cursor.y, x = start;
+  for(int i = key_count(); i > 0; i--) motion_find_word(&y, &x, word, len);
+  free(word);
+  jump_to(y, x);
+}
+
+const KeyBinding ViewBindings[] = {
+  { "h", key_left },
+  { "j", key_down },
+  { "k", key_up },
+  { "l", key_right },
+  { " ", key_right },
+  { "0", key_line_start },
+  { "G", key_last_line },
+  { "gg", key_first_line },
+  { "m", key_set_mark },
+  { "'", key_mark_line },
+  { "`", key_mark_exact },
+  { "\017", key_jump_older },
+  { "\t", key_jump_newer },
+  { "w", key_word },
+  { "W", key_big_word },
+  { "e", key_word_end },
+  { "E", key_big_word_end },
+  { "b", key_word_back },
+  { "B", key_big_word_back },
+  { "f", key_find_forward },
+  { "t", key_till_forward },
+  { "F", key_find_backward },
+  { "T", key_till_backward },
+  { "%", key_match_bracket },
+  { "}", key_next_paragraph },
+  { "{", key_prev_paragraph },
+  { "*", key_star },
+  { "dd", key_delete_lines },
+  { "yy", key_yank_lines },
+  { "p", key_put_below },
+  { "P", key_put_above },
+  { ":", enter_command_mode },
+  { "i", enter_inserting_mode },
+  { "a", key_append },
+  { "I", key_insert_at_indent },
+  { "A", key_append_at_end },
+  { "q", key_record_macro },
+  { "@", key_play_macro },
+  { "\003", key_cancel_filter },
+  { "]c", key_next_change },
+  { "[c", key_prev_change },
+  { "\027w", key_next_pane },
+  { "\027\027", key_next_pane },
+  { "\027W", key_prev_pane },
+  { "zf", key_fold_create },
+  { "zo", key_fold_open },
+  { "zc", key_fold_close },
+  { "zd", key_fold_delete },
+  { "zE", key_fold_eliminate },
+  { "zR", key_fold_open_all },
+  { "zM", key_fold_close_all },
+};
+
+void handle_viewing_input(char c) {
+  keymap_feed(KEYMAP_VIEW, c);
 }
 
 // --- INSERTING MODE ---
 
 void enter_inserting_mode() {
+  if(document_locked()) return;
+  open_folds_at_cursor();
   Buff.mode = MODE_INSERT;
   ansi_emit(ANSI_CURSOR_BAR);
   clear_command_status();
@@ -794,76 +2141,41 @@ void enter_inserting_mode() {
   draw_editor();
 }
 
-void handle_inserting_input(char c) {
-  if(Buff.has_pending_escape) {
-    if(c == ESCAPE_KEY_2) {
-      exit_inserting_mode();
-    }
-    else {
-      if (c == KEY_BACKSPACE) {
-        delete_char();
-      } 
-      else if (c == KEY_ENTER) {
-        append_line();
-      } 
-      else if (c >= 32 && c <= 126) {
-        append_char(c);
-      } 
-    }
+void key_backspace() {
+  delete_char();
+  draw_editor();
+}
 
-    Buff.has_pending_escape = 0; 
-    Buff.pending_escape_char = 0;
-    draw_editor();
-    return;
-  }
+void key_newline() {
+  append_line();
+  draw_editor();
+}
 
-  if(c == ESCAPE_KEY_1) {
-    int result = wait_for_input_with_timeout(ESCAPE_TIMEOUT_MS);
+void key_tab() {
+  for(int i = 0; i < Config.tab_width; i++) append_char(' ');
+  draw_editor();
+}
 
-    if(result > 0) {
-      Buff.pending_escape_char = c;
-      Buff.has_pending_escape = 1;
-      return;
-    }
-    else if(result == 0) {
-      append_char(c); 
-      draw_editor();
-      Buff.has_pending_escape = 0;
-      return;
-    }
-    else {
-      append_char(c);
-      draw_editor();
-      Buff.has_pending_escape = 0;
-      return;
-    }
-  }
+// The two key escape (jj by default) is bound from the settings
+const KeyBinding InsertBindings[] = {
+  { "\033", exit_inserting_mode },
+  { "\177", key_backspace },
+  { "\n", key_newline },
+  { "\t", key_tab },
+};
 
-  switch (c) {
-    case KEY_ESC: 
-      exit_inserting_mode(); 
-      break;
-    case KEY_BACKSPACE:
-      delete_char();
-      draw_editor();
-      break;
-    case KEY_ENTER:
-      append_line();
-      draw_editor();
-      break;
-    case KEY_TAB:
-      for(int i = 0; i < TAB_VAL; i++) append_char(' ');
-      draw_editor();
-      break;
-    default:
-      if (c >= 32 && c <= 126) {
-        append_char(c);
-        draw_editor();
-      }
-      break;
+// Anything that is not a binding is typed
+void insert_key(char c) {
+  if(c >= 32 && c <= 126) {
+    append_char(c);
+    draw_editor();
   }
 }
 
+void handle_inserting_input(char c) {
+  keymap_feed(KEYMAP_INSERT, c);
+}
+
 void exit_inserting_mode() {
   clear_command_status();
   enter_viewing_mode();
@@ -876,9 +2188,9 @@ void enter_command_mode() {
   clear_command_status();
   Buff.mode = MODE_COMMAND;
   ansi_emit(ANSI_CUROSR_UNDERLINE);
-  dprintf(STDOUT_FILENO, "\033[%d;1H", Win.height);
-  write(STDOUT_FILENO, "\033[2K", 4);
-  write(STDOUT_FILENO, ":", 1);
+  term_printf("\033[%d;1H", Win.height);
+  term_write("\033[2K", 4);
+  term_write(":", 1);
 }
 
 void handle_command_input(char c) {
@@ -908,46 +2220,495 @@ void handle_command_input(char c) {
       if(cmd_pos < 128) {
         command_buffer[cmd_pos] = c;
         cmd_pos++;
-        dprintf(STDOUT_FILENO, "%c", c);
+        term_printf("%c", c);
       }
       break;
   }
 }
 
-void process_command_input(char *command) {
-  if(strcmp(command, "q") == 0) {
-    cmd_quit();
-  } 
-  else if(strcmp(command, "w") == 0) {
-    cmd_save_file();
-    exit_command_mode();
-  } 
-  else if(strcmp(command, "wq") == 0) {
-    cmd_save_file();
-    cmd_quit();
+// Reorders lines [from, from + count) by moving their handles; no line
+// text is copied. With SORT_UNIQUE only the first of equal neighbours
+// stays, and with SORT_KEEP_ORDER that is all that happens. Journaled as
+// one record, since the same sort over the same lines gives the same
+// order. Returns how many lines were dropped.
+int sort_lines(int from, int count, int flags) {
+  journal_record(Buff.journal, JOURNAL_SORT_LINES, from, count, flags);
+
+  SortItem *items = malloc(count * sizeof(SortItem));
+  Line *sorted = malloc(count * sizeof(Line));
+  if(!items || !sorted) {
+    perror("Malloc failled");
+    exit(EXIT_FAILURE);
   }
-  else if(strcmp(command, "E") == 0) {
-    free_editor(); 
-    Buff.mode = MODE_BROWSER;
-    start_browsing(Win.width, Win.height);
+  Line *lines = &Buff.document[from];
+  for(int i = 0; i < count; i++) {
+    items[i].text = lines[i].line;
+    items[i].len = lines[i].size;
+    items[i].index = i;
   }
-  else {
-    set_command_status("\033[1;31mError:\033[0m Command not found");
-    exit_command_mode();
+  sort_items(items, count, flags, settings_worker_threads());
+
+  // Equal lines are neighbours now, and comparing with the previous item
+  // is comparing with the last line kept
+  int kept = 0;
+  for(int i = 0; i < count; i++) {
+    Line *l = &lines[items[i].index];
+    if((flags & SORT_UNIQUE) && kept > 0 && sort_items_equal(&items[i], &items[i - 1], flags)) {
+      line_release(l);
+      continue;
+    }
+    sorted[kept] = *l;
+    sorted[kept].is_dirty = 1;
+    kept++;
+  }
+  memcpy(lines, sorted, kept * sizeof(Line));
+  free(sorted);
+  free(items);
+
+  int removed = count - kept;
+  if(removed > 0) {
+    memmove(&lines[kept], &lines[count], (Buff.document_size - from - count) * sizeof(Line));
+    for(int i = Buff.document_size - removed; i < Buff.document_size; i++) {
+      Buff.document[i].line = NULL;
+      Buff.document[i].size = 0;
+      Buff.document[i].capacity = 0;
+      Buff.document[i].is_dirty = 1;
+    }
+    Buff.document_size -= removed;
   }
+  document_edited(from, count, kept);
+  finish_bulk_edit(from);
+  return removed;
 }
 
-void exit_command_mode() {
-  dprintf(STDOUT_FILENO, "\033[%d;1H\033[2K", Win.height);
-  int screen_y = Buff.cursor.y - Win.scroll_y + 1;
-  dprintf(STDOUT_FILENO, "\033[%d;%dH", screen_y, Buff.cursor.x + 1);
-  draw_editor();
-  enter_viewing_mode();
-}
+// Puts n lines in place of [from, from + count), taking them over.
+// Journaled as one record holding the new text.
+void replace_lines(int from, int count, const Line *lines, int n) {
+  if(Buff.journal) {
+    size_t len = 0;
+    for(int i = 0; i < n; i++) len += lines[i].size + 1;
+    journal_record_text(Buff.journal, JOURNAL_REPLACE_LINES, from, count, len);
+    for(int i = 0; i < n; i++) {
+      journal_append_text(Buff.journal, lines[i].line, lines[i].size);
+      journal_append_text(Buff.journal, "\n", 1);
+    }
+  }
 
-// ===============================
-// COMMAND IMPLEMENTATIONS
-// ===============================
+  for(int i = from; i < from + count; i++) line_release(&Buff.document[i]);
+  int old_size = Buff.document_size;
+  reserve_document(old_size - count + n);
+  memmove(&Buff.document[from + n], &Buff.document[from + count], (old_size - from - count) * sizeof(Line));
+  memcpy(&Buff.document[from], lines, n * sizeof(Line));
+  Buff.document_size = old_size - count + n;
+  for(int i = from; i < from + n; i++) Buff.document[i].is_dirty = 1;
+  for(int i = Buff.document_size; i < old_size; i++) {
+    Buff.document[i].line = NULL;
+    Buff.document[i].size = 0;
+    Buff.document[i].capacity = 0;
+    Buff.document[i].is_dirty = 1;
+  }
+  document_edited(from, count, n);
+  finish_bulk_edit(from);
+}
+
+// ===============================
+// RANGE COMMANDS
+// ===============================
+
+// A :g pattern. Patterns without regex characters are matched with memmem.
+typedef struct {
+  const char *text;
+  size_t len;
+  int is_regex;
+  regex_t regex;
+} LinePattern;
+
+int pattern_compile(LinePattern *pat, const char *text) {
+  pat->text = text;
+  pat->len = strlen(text);
+  pat->is_regex = strpbrk(text, ".[]*^$\\") != NULL;
+  if(pat->is_regex) return regcomp(&pat->regex, text, REG_NOSUB) == 0;
+  return pat->len > 0;
+}
+
+int pattern_matches(LinePattern *pat, const Line *l) {
+  if(!pat->is_regex) return memmem(l->line, l->size, pat->text, pat->len) != NULL;
+  regmatch_t span = { .rm_so = 0, .rm_eo = l->size };
+  return regexec(&pat->regex, l->line, 1, &span, REG_STARTEND) == 0;
+}
+
+void pattern_free(LinePattern *pat) {
+  if(pat->is_regex) regfree(&pat->regex);
+}
+
+// One address: N, . or $, each optionally followed by +N or -N. Returns
+// 0 when p does not start with one.
+int parse_address(char **p, int *line) {
+  char *s = *p;
+  int base;
+  if(isdigit((unsigned char)*s)) base = strtol(s, &s, 10) - 1;
+  else if(*s == '.') { base = Buff.cursor.y; s++; }
+  else if(*s == '$') { base = Buff.document_size - 1; s++; }
+  else if(*s == '+' || *s == '-') base = Buff.cursor.y;
+  else return 0;
+
+  while(*s == '+' || *s == '-') {
+    int sign = *s++ == '+' ? 1 : -1;
+    base += sign * (isdigit((unsigned char)*s) ? strtol(s, &s, 10) : 1);
+  }
+  *line = base;
+  *p = s;
+  return 1;
+}
+
+// [range] as %, addr or addr,addr. Returns how many addresses were
+// given, -1 for a range that does not parse.
+int parse_range(char **p, int *from, int *to) {
+  if(**p == '%') {
+    (*p)++;
+    *from = 0;
+    *to = Buff.document_size - 1;
+    return 2;
+  }
+  if(!parse_address(p, from)) return 0;
+  *to = *from;
+  if(**p != ',') return 1;
+  (*p)++;
+  return parse_address(p, to) ? 2 : -1;
+}
+
+// :[range]g/pat/d and :[range]v/pat/d. One scan collects the lines to
+// remove as runs and one pass over the document removes them all.
+void cmd_global(char *args, int from, int to, int invert) {
+  char delim = *args++;
+  char *end = strchr(args, delim);
+  if(!end || strcmp(end + 1, "d") != 0) {
+    flash_command_status("\033[1;31mError:\033[0m Usage: g/pattern/d");
+    return;
+  }
+  *end = '\0';
+
+  LinePattern pat;
+  if(!pattern_compile(&pat, args)) {
+    flash_command_status("\033[1;31mError:\033[0m Bad pattern");
+    return;
+  }
+
+  LineRun *runs = NULL;
+  int count = 0, capacity = 0, removed = 0;
+  for(int i = from; i <= to; i++) {
+    if(pattern_matches(&pat, &Buff.document[i]) == invert) continue;
+    removed++;
+    if(count > 0 && runs[count - 1].start + runs[count - 1].count == i) {
+      runs[count - 1].count++;
+      continue;
+    }
+    if(count == capacity) {
+      capacity = capacity ? capacity * 2 : 256;
+      LineRun *tmp = realloc(runs, capacity * sizeof(LineRun));
+      if(!tmp) {
+        perror("Malloc failled");
+        exit(EXIT_FAILURE);
+      }
+      runs = tmp;
+    }
+    runs[count].start = i;
+    runs[count].count = 1;
+    count++;
+  }
+  pattern_free(&pat);
+
+  delete_line_runs(runs, count, 0);
+  free(runs);
+
+  char msg[64];
+  snprintf(msg, sizeof(msg), "%d fewer lines", removed);
+  flash_command_status(msg);
+}
+
+// --- FILTERS ---
+
+// Edits wait until a running filter has replaced its range
+int document_locked() {
+  if(!filter_active()) return 0;
+  flash_command_status("\033[1;31mError:\033[0m Filter running, Ctrl-C cancels");
+  if(Buff.mode == MODE_VIEW) draw_editor();
+  return 1;
+}
+
+const char *document_line_text(int y, int *len) {
+  *len = Buff.document[y].size;
+  return Buff.document[y].line;
+}
+
+void filter_output_line(const char *text, int len) {
+  if(len > 0 && text[len - 1] == '\r') len--;
+  register_reserve(&FilterOutput, FilterOutput.count + 1);
+  Line *l = &FilterOutput.lines[FilterOutput.count++];
+  l->line = line_arena_alloc_packed(Buff.arena, len + 1, &l->capacity);
+  memcpy(l->line, text, len);
+  l->line[len] = '\0';
+  l->size = len;
+  l->is_dirty = 1;
+}
+
+void discard_filter_output() {
+  for(int i = 0; i < FilterOutput.count; i++) line_release(&FilterOutput.lines[i]);
+  FilterOutput.count = 0;
+}
+
+void filter_finished(int status, const char *error) {
+  char msg[192];
+  if(status == 0) {
+    if(FilterOutput.count == FilterCount) snprintf(msg, sizeof(msg), "%d lines filtered", FilterCount);
+    else snprintf(msg, sizeof(msg), "%d lines filtered into %d", FilterCount, FilterOutput.count);
+    replace_lines(FilterFrom, FilterCount, FilterOutput.lines, FilterOutput.count);
+    FilterOutput.count = 0;
+  }
+  else {
+    discard_filter_output();
+    snprintf(msg, sizeof(msg), "\033[1;31mError:\033[0m Filter exited with %d%s%s",
+             status, error[0] ? ": " : "", error);
+  }
+  flash_command_status(msg);
+  if(Buff.mode == MODE_VIEW) draw_editor();
+}
+
+// --- DIFF ---
+
+// The change gutter has new marks; summary is set when :diff asked for it
+void diff_updated(const char *summary) {
+  if(!diff_active()) ansi_emit(ANSI_CLEAR);
+  mark_visible_lines_dirty();
+  if(summary) flash_command_status(summary);
+  if(Buff.mode == MODE_VIEW || Buff.mode == MODE_INSERT) draw_editor();
+}
+
+// :{range}!command. The range stays as it is until the command is done.
+void cmd_filter(const char *command, int from, int count) {
+  if(!*command) {
+    flash_command_status("\033[1;31mError:\033[0m Usage: {range}!command");
+    return;
+  }
+  if(!filter_start(command, from, count)) {
+    flash_command_status("\033[1;31mError:\033[0m Could not start filter");
+    return;
+  }
+  FilterFrom = from;
+  FilterCount = count;
+  set_command_status("Filtering... Ctrl-C cancels");
+}
+
+void key_cancel_filter() {
+  if(!filter_active()) return;
+  filter_cancel();
+  discard_filter_output();
+  flash_command_status("Filter cancelled");
+  draw_editor();
+}
+
+// --- RANGES ---
+
+// Flags for :sort[!] [n][r][u] and :uniq, -1 when p is neither
+int parse_sort_command(const char *p) {
+  if(strcmp(p, "uniq") == 0) return SORT_UNIQUE | SORT_KEEP_ORDER;
+  if(strncmp(p, "sort", 4) != 0) return -1;
+  p += 4;
+  int flags = 0;
+  if(*p == '!') {
+    flags |= SORT_REVERSE;
+    p++;
+  }
+  for(; *p; p++) {
+    if(*p == 'n') flags |= SORT_NUMERIC;
+    else if(*p == 'r') flags |= SORT_REVERSE;
+    else if(*p == 'u') flags |= SORT_UNIQUE;
+    else if(*p != ' ') return -1;
+  }
+  return flags;
+}
+
+// Commands that start with a range, or :g, :v, :sort and :uniq, which
+// default to the whole buffer. :{range}!cmd needs the range. Returns 0 when command is none of them.
+int run_range_command(char *command) {
+  char *p = command;
+  int from = 0, to = Buff.document_size - 1;
+  int given = parse_range(&p, &from, &to);
+  int global = (p[0] == 'g' || p[0] == 'v') && (p[1] == '/' || (p[0] == 'g' && p[1] == '!' && p[2] == '/'));
+  int sort_flags = parse_sort_command(p);
+  if(given == 0 && !global && sort_flags < 0) return 0;
+
+  if(given == 0) {
+    from = 0;
+    to = Buff.document_size - 1;
+  }
+  if(from > to) {
+    int t = from;
+    from = to;
+    to = t;
+  }
+  if(given < 0 || from < 0 || to >= Buff.document_size) {
+    flash_command_status("\033[1;31mError:\033[0m Invalid range");
+    exit_command_mode();
+    return 1;
+  }
+  int edits = global || sort_flags >= 0 || *p == '!' || strcmp(p, "d") == 0;
+  if(edits && document_locked()) {
+    exit_command_mode();
+    return 1;
+  }
+
+  char msg[64];
+  int count = to - from + 1;
+  if(global) {
+    int invert = p[0] == 'v' || p[1] == '!';
+    cmd_global(p + (p[1] == '!' ? 2 : 1), from, to, invert);
+  }
+  else if(sort_flags >= 0) {
+    int removed = sort_lines(from, count, sort_flags);
+    if(sort_flags & SORT_KEEP_ORDER) snprintf(msg, sizeof(msg), "%d fewer lines", removed);
+    else if(removed > 0) snprintf(msg, sizeof(msg), "%d lines sorted, %d fewer lines", count, removed);
+    else snprintf(msg, sizeof(msg), "%d lines sorted", count);
+    flash_command_status(msg);
+  }
+  else if(*p == '!') {
+    cmd_filter(p + 1, from, count);
+  }
+  else if(*p == '\0') {
+    jump_to(to, Buff.cursor.desired_x);
+  }
+  else if(strcmp(p, "d") == 0) {
+    delete_lines(from, count, 1);
+    snprintf(msg, sizeof(msg), "%d fewer lines", count);
+    flash_command_status(msg);
+  }
+  else if(strcmp(p, "y") == 0) {
+    yank_lines(from, count);
+    snprintf(msg, sizeof(msg), "%d lines yanked", count);
+    flash_command_status(msg);
+  }
+  else if(strcmp(p, "fold") == 0) {
+    make_fold(from, to);
+  }
+  else {
+    flash_command_status("\033[1;31mError:\033[0m Command not found");
+  }
+  exit_command_mode();
+  return 1;
+}
+
+void process_command_input(char *command) {
+  if(run_range_command(command)) return;
+
+  if(strcmp(command, "q") == 0) {
+    if(PaneCount > 1) cmd_close_pane();
+    else if(!quit_refused()) cmd_quit();
+  } 
+  else if(strcmp(command, "q!") == 0) {
+    if(PaneCount > 1) cmd_close_pane();
+    else cmd_quit();
+  }
+  else if(strcmp(command, "w") == 0) {
+    cmd_save_file();
+    exit_command_mode();
+  } 
+  else if(strcmp(command, "wq") == 0) {
+    cmd_save_file();
+    if(PaneCount > 1) cmd_close_pane();
+    else if(!quit_refused()) cmd_quit();
+  }
+  else if(strncmp(command, "split", 5) == 0 && (!command[5] || command[5] == ' ')) {
+    cmd_split(0, command[5] ? command + 6 : NULL);
+  }
+  else if(strncmp(command, "vsplit", 6) == 0 && (!command[6] || command[6] == ' ')) {
+    cmd_split(1, command[6] ? command + 7 : NULL);
+  }
+  else if(strcmp(command, "close") == 0) {
+    cmd_close_pane();
+  }
+  else if(strcmp(command, "only") == 0) {
+    cmd_only_pane();
+  }
+  else if(strcmp(command, "stats") == 0) {
+    char line[256];
+    stats_format(line, sizeof(line));
+    flash_command_status(line);
+    exit_command_mode();
+  }
+  else if(strcmp(command, "stats on") == 0 || strcmp(command, "stats off") == 0) {
+    stats_set_overlay(command[7] == 'n');
+    arrange_panes();
+    ansi_emit(ANSI_CLEAR);
+    mark_visible_lines_dirty();
+    exit_command_mode();
+  }
+  else if(strcmp(command, "follow") == 0) {
+    follow_start(Buff.file_name, Buff.file_bytes);
+    move_cursor_verticaly(Buff.document_size);
+    exit_command_mode();
+  }
+  else if(strcmp(command, "diff") == 0 || strcmp(command, "diff off") == 0) {
+    if(command[4]) diff_stop();
+    else diff_start(Buff.file_name);
+    ansi_emit(ANSI_CLEAR);
+    mark_visible_lines_dirty();
+    exit_command_mode();
+  }
+  else if(strcmp(command, "fold") == 0) {
+    char msg[64];
+    snprintf(msg, sizeof(msg), "%d folds", fold_all_blocks(buffer_folds()));
+    folds_changed();
+    flash_command_status(msg);
+    exit_command_mode();
+  }
+  else if(strcmp(command, "follow off") == 0) {
+    follow_stop();
+    exit_command_mode();
+  }
+  else if(strncmp(command, "nmap ", 5) == 0 || strncmp(command, "imap ", 5) == 0) {
+    cmd_map(command[0] == 'n' ? KEYMAP_VIEW : KEYMAP_INSERT, command + 5);
+    exit_command_mode();
+  }
+  else if(strncmp(command, "nunmap ", 7) == 0 || strncmp(command, "iunmap ", 7) == 0) {
+    if(!keymap_unmap(command[0] == 'n' ? KEYMAP_VIEW : KEYMAP_INSERT, command + 7)) {
+      flash_command_status("\033[1;31mError:\033[0m No such mapping");
+    }
+    exit_command_mode();
+  }
+  else if(strcmp(command, "ls") == 0) {
+    cmd_list_buffers();
+    exit_command_mode();
+  }
+  else if(strcmp(command, "bn") == 0 || strcmp(command, "bp") == 0 ||
+          (command[0] == 'b' && command[1] == ' ') || (command[0] == 'e' && command[1] == ' ')) {
+    cmd_buffer(command);
+  }
+  else if(strcmp(command, "E") == 0) {
+    if(document_locked()) {
+      exit_command_mode();
+      return;
+    }
+    park_buffer();
+    Buff.mode = MODE_BROWSER;
+    term_flush();
+    start_browsing(Win.width, Win.height);
+  }
+  else {
+    flash_command_status("\033[1;31mError:\033[0m Command not found");
+    exit_command_mode();
+  }
+}
+
+void exit_command_mode() {
+  term_printf("\033[%d;1H\033[2K", Win.height);
+  place_cursor();
+  draw_editor();
+  enter_viewing_mode();
+}
+
+// ===============================
+// COMMAND IMPLEMENTATIONS
+// ===============================
 //
 void cmd_save_file(void) {
   if (!Buff.file_name) {
@@ -963,21 +2724,83 @@ void cmd_save_file(void) {
   }
   
   for (int i = 0; i < Buff.document_size; i++) {
-    fputs(Buff.document[i].line, file);
+    fwrite(Buff.document[i].line, 1, Buff.document[i].size, file);
     fputc('\n', file);
   }
   
   fclose(file);
+  journal_reset(Buff.journal, Buff.file_name);
+  Buff.modified = 0;
+  diff_file_saved();
+  flash_command_status("File saved");
+  exit_command_mode();
+}
+
+// :e {file}, :b {n}, :bn and :bp
+void cmd_buffer(char *command) {
+  if(document_locked()) {
+    exit_command_mode();
+    return;
+  }
+  char *arg = command + 1;
+  while(*arg == ' ') arg++;
+  int target = -1;
+  if(command[0] == 'e') {
+    if(!*arg) flash_command_status("\033[1;31mError:\033[0m Usage: e {file}");
+    else term_printf("\033[%d;1H\033[2K", Win.height);
+    if(!*arg || !start_buffer(arg)) exit_command_mode();
+    return;
+  }
+  if(strcmp(command, "bn") == 0) target = (CurrentBuffer + 1) % BufferCount;
+  else if(strcmp(command, "bp") == 0) target = (CurrentBuffer + BufferCount - 1) % BufferCount;
+  else target = atoi(arg) - 1;
+  if(target < 0 || target >= BufferCount) {
+    flash_command_status("\033[1;31mError:\033[0m No such buffer");
+    exit_command_mode();
+    return;
+  }
+  term_printf("\033[%d;1H\033[2K", Win.height);
+  Buff.mode = MODE_VIEW;
+  if(!switch_to_buffer(target)) exit_command_mode();
+}
+
+// {lhs} {rhs}, where rhs runs to the end of the line
+void cmd_map(int mode, char *args) {
+  while(*args == ' ') args++;
+  char *rhs = strchr(args, ' ');
+  if(rhs) {
+    *rhs++ = '\0';
+    while(*rhs == ' ') rhs++;
+  }
+  if(!rhs || !*rhs || !keymap_remap(mode, args, rhs)) {
+    flash_command_status("\033[1;31mError:\033[0m Usage: map {lhs} {rhs}");
+  }
+}
+
+// :q and :wq refuse while a buffer has unsaved edits; :q! does not
+int quit_refused() {
+  char msg[96];
+  if(Buff.modified) {
+    snprintf(msg, sizeof(msg), "\033[1;31mError:\033[0m No write since last change (:q! quits anyway)");
+  }
+  else {
+    int i = 0;
+    while(i < BufferCount && (i == CurrentBuffer || !Buffers[i].buffer.modified)) i++;
+    if(i == BufferCount) return 0;
+    snprintf(msg, sizeof(msg), "\033[1;31mError:\033[0m No write since last change in buffer %d", i + 1);
+  }
+  flash_command_status(msg);
   exit_command_mode();
-  set_command_status("File saved");
+  return 1;
 }
 
 void cmd_quit(void) {
+  remember_position();
   free_editor();
   disable_raw_mode();
   ansi_emit(ANSI_CLEAR);
   ansi_emit(ANSI_CURSOR_HOME);
-  write(STDOUT_FILENO, "\033[0m", 4);
+  term_write("\033[0m", 4);
   exit(EXIT_SUCCESS);
 }
 
@@ -985,44 +2808,710 @@ void cmd_quit(void) {
 // MAIN EVENT LOOP
 // ===============================
 
-void editor_key_press() {
+// The terminal is gone: flush the journal and leave it for next time
+void on_hangup(void *data) {
+  (void)data;
+  journal_close(Buff.journal, 0);
+  Buff.journal = NULL;
+  for(int i = 0; i < BufferCount; i++) {
+    if(i != CurrentBuffer) journal_close(Buffers[i].buffer.journal, 0);
+  }
+  exit(EXIT_FAILURE);
+}
+
+// Binds escape_key_1 then escape_key_2 to leave insert mode, in place of the
+// pair bound before. The first key is held back until the second arrives
+// or escape_timeout_ms shows it was plain text.
+void bind_insert_escape() {
+  static char escape[3];
+  char next[3] = { Config.escape_key_1, Config.escape_key_2, '\0' };
+  if(strcmp(escape, next) == 0) return;
+  if(escape[0]) keymap_bind(KEYMAP_INSERT, escape, NULL);
+  keymap_bind(KEYMAP_INSERT, next, exit_inserting_mode);
+  memcpy(escape, next, sizeof(escape));
+}
+
+// Compiles the bindings of every mode, once at startup
+void init_keymaps() {
+  keymap_init(KEYMAP_VIEW, NULL, KEY_SEQUENCE_TIMEOUT_MS, 1);
+  keymap_bind_table(KEYMAP_VIEW, ViewBindings, sizeof(ViewBindings) / sizeof(ViewBindings[0]));
+  keymap_init(KEYMAP_INSERT, insert_key, Config.escape_timeout_ms, 0);
+  keymap_bind_table(KEYMAP_INSERT, InsertBindings, sizeof(InsertBindings) / sizeof(InsertBindings[0]));
+  bind_insert_escape();
+  init_browser_keys();
+  init_menu_keys();
+}
+
+// ATOM_PAGER_BUDGET, in MB, wins over pager_budget_mb
+void apply_pager_budget() {
+  char *budget = getenv("ATOM_PAGER_BUDGET");
+  pager_set_budget((budget ? strtoull(budget, NULL, 10) : (unsigned long long)Config.pager_budget_mb) << 20);
+}
+
+// Called whenever ~/.atomrc was read
+void apply_settings() {
+  bind_insert_escape();
+  keymap_set_timeout(KEYMAP_INSERT, Config.escape_timeout_ms);
+  apply_pager_budget();
+  pager_set_threshold(Config.mmap_threshold_mb << 20);
+  follow_set_frame_ms(Config.frame_budget_ms);
+  enforce_buffer_budget();
+  if(Buff.document && (Buff.mode == MODE_VIEW || Buff.mode == MODE_INSERT)) draw_editor();
+}
+
+void dispatch_key(char c) {
+  stats_key_received();
+  if (c == 0) {
+    cmd_quit();
+    return;
+  } 
+
+  switch (Buff.mode) {
+    case MODE_VIEW:
+      handle_viewing_input(c);
+      break;
+    case MODE_INSERT:
+      handle_inserting_input(c);
+      break;
+    case MODE_COMMAND:
+      handle_command_input(c);
+      break;
+    // The browser and the menu write to the terminal directly, after
+    // anything still collected
+    case MODE_BROWSER:
+      term_flush();
+      handle_browser_input(c);
+      break;
+    case MODE_MENU:
+      term_flush();
+      handle_menu_input(c);
+      break;
+    case MODE_PAGER:
+      handle_pager_input(c);
+      break;
+  }
+}
+
+void on_stdin_ready(int fd, short revents, void *data) {
+  (void)revents;
+  (void)data;
+  char keys[256];
+  ssize_t n = read(fd, keys, sizeof(keys));
+  if(n < 0) {
+    if(errno == EINTR || errno == EAGAIN) return;
+    cmd_quit();
+  }
+  if(n == 0) cmd_quit();
+
+  // Keys are handled at the new size
+  if(ResizeTimer) {
+    event_timer_cancel(ResizeTimer);
+    ResizeTimer = 0;
+    apply_resize();
+  }
+
+  for(ssize_t i = 0; i < n; i++) {
+    macro_record_key(keys[i]);
+    dispatch_key(keys[i]);
+  }
+}
+
+// ===============================
+// CRASH RECOVERY
+// ===============================
+
+// Blocking yes/no question on the message row
+int confirm_prompt(const char *question) {
+  term_printf("\033[%d;1H\033[2K%.*s", Win.height, Win.width - 1, question);
+  term_flush();
   char c;
-  while(1) {
-    read(STDIN_FILENO, &c, sizeof(c)); 
-    if (c == 0) {
-      cmd_quit();
-      return;
-    } 
-
-    switch (Buff.mode) {
-      case MODE_VIEW:
-        handle_viewing_input(c);
-        break;
-      case MODE_INSERT:
-        handle_inserting_input(c);
-        break;
-      case MODE_COMMAND:
-        handle_command_input(c);
-        break;
-      case MODE_BROWSER:
-        handle_browser_input(c);
-        break;
-      case MODE_MENU:
-        handle_menu_input(c);
-        break;
+  while(read(STDIN_FILENO, &c, 1) == 1) {
+    if(c == 'y' || c == 'Y') return 1;
+    if(c == 'n' || c == 'N' || c == KEY_ESC) return 0;
+  }
+  return 0;
+}
+
+// Removes the collected runs, which arrived bottom up
+void flush_replayed_runs() {
+  if(ReplayRunCount == 0) return;
+  for(int i = 0, j = ReplayRunCount - 1; i < j; i++, j--) {
+    LineRun t = ReplayRuns[i];
+    ReplayRuns[i] = ReplayRuns[j];
+    ReplayRuns[j] = t;
+  }
+  delete_line_runs(ReplayRuns, ReplayRunCount, 0);
+  ReplayRunCount = 0;
+}
+
+void replay_line_run(int y, int count) {
+  if(y >= Buff.document_size || count <= 0) return;
+  count = clamp(count, 1, Buff.document_size - y);
+  if(ReplayRunCount == ReplayRunCapacity) {
+    ReplayRunCapacity = ReplayRunCapacity ? ReplayRunCapacity * 2 : 64;
+    LineRun *tmp = realloc(ReplayRuns, ReplayRunCapacity * sizeof(LineRun));
+    if(!tmp) {
+      perror("Malloc failled");
+      exit(EXIT_FAILURE);
+    }
+    ReplayRuns = tmp;
+  }
+  ReplayRuns[ReplayRunCount].start = y;
+  ReplayRuns[ReplayRunCount].count = count;
+  ReplayRunCount++;
+}
+
+void apply_journal_record(int op, int y, int x, char c, const char *text, size_t text_len) {
+  // Consecutive bottom up runs are one :g and are removed in one pass
+  int continues = op == JOURNAL_DELETE_LINES && ReplayRunCount > 0 &&
+                  y + x <= ReplayRuns[ReplayRunCount - 1].start;
+  if(!continues) flush_replayed_runs();
+  if(op == JOURNAL_DELETE_LINES) {
+    replay_line_run(y, x);
+    return;
+  }
+  if(op == JOURNAL_SORT_LINES) {
+    if(y < Buff.document_size && x > 1) sort_lines(y, clamp(x, 1, Buff.document_size - y), c);
+    return;
+  }
+  if(op == JOURNAL_REPLACE_LINES) {
+    if(y > Buff.document_size) return;
+    for(const char *p = text, *end = text + text_len, *nl; p < end; p = nl + 1) {
+      nl = memchr(p, '\n', end - p);
+      if(!nl) nl = end;
+      filter_output_line(p, nl - p);
+    }
+    replace_lines(y, clamp(x, 0, Buff.document_size - y), FilterOutput.lines, FilterOutput.count);
+    FilterOutput.count = 0;
+    return;
+  }
+
+  if(Buff.document_size > 0) {
+    Buff.cursor.y = clamp(y, 0, Buff.document_size - 1);
+    Buff.cursor.x = clamp(x, 0, Buff.document[Buff.cursor.y].size);
+  }
+  else {
+    Buff.cursor.y = 0;
+    Buff.cursor.x = 0;
+  }
+  Buff.cursor.desired_x = Buff.cursor.x;
+
+  switch (op) {
+    case JOURNAL_INSERT_CHAR: append_char(c); break;
+    case JOURNAL_DELETE_CHAR: delete_char(); break;
+    case JOURNAL_SPLIT_LINE: append_line(); break;
+    case JOURNAL_DELETE_LINE: delete_line(); break;
+  }
+}
+
+// Offers to replay edits a crashed session left in the journal, then
+// starts a fresh journal. Replayed edits are journaled again.
+int start_journal(char *filepath) {
+  char *records;
+  size_t len;
+  int stale = 0;
+  int recover = 0;
+
+  int found = journal_load(filepath, &records, &len, &stale);
+  if(found) {
+    recover = confirm_prompt(stale
+      ? "Unsaved changes found, but the file changed since. Recover anyway? (y/n)"
+      : "Unsaved changes found from a previous session. Recover them? (y/n)");
+  }
+
+  Buff.journal = journal_open(filepath);
+  if(!found) return 0;
+
+  if(recover) {
+    suspend_rendering();
+    long count = journal_replay(records, len, apply_journal_record);
+    flush_replayed_runs();
+    Buff.cursor.x = clamp(Buff.cursor.x, 0, Buff.document_size > 0 ? Buff.document[Buff.cursor.y].size : 0);
+    char msg[64];
+    snprintf(msg, sizeof(msg), "Recovered %ld edits", count);
+    flash_command_status(msg);
+    resume_rendering();
+  }
+  free(records);
+  return recover;
+}
+
+// ===============================
+// LAST POSITION
+// ===============================
+
+// Large files reopen where they were left
+void remember_position(void) {
+  if(Buff.mode == MODE_PAGER || !Buff.file_name || Buff.file_bytes < LINE_CACHE_MIN_BYTES) return;
+  long long position[3] = { Buff.cursor.y, Buff.cursor.x, Win.scroll_y };
+  line_cache_save_position(Buff.file_name, LINE_CACHE_EDITOR, position);
+}
+
+void restore_position() {
+  if(Buff.file_bytes < LINE_CACHE_MIN_BYTES || Buff.document_size == 0) return;
+  LineCache *cache = line_cache_open(Buff.file_name);
+  if(!cache) return;
+  long long position[3];
+  int saved = line_cache_position(cache, LINE_CACHE_EDITOR, position);
+  line_cache_close(cache);
+  if(!saved) return;
+
+  Buff.cursor.y = clamp(position[0], 0, Buff.document_size - 1);
+  Buff.cursor.x = clamp(position[1], 0, Buff.document[Buff.cursor.y].size);
+  Buff.cursor.desired_x = Buff.cursor.x;
+  Win.scroll_y = clamp(position[2], 0, Buff.cursor.y);
+  if(cursor_row() >= text_rows()) Win.scroll_y = scroll_above(Buff.cursor.y, text_rows());
+}
+
+// Read-only view that never loads the whole file
+void start_read_only(char *filepath) {
+  Buff.mode = MODE_PAGER;
+  if(!start_pager(filepath)) {
+    disable_raw_mode();
+    dprintf(STDERR_FILENO, "\033[1;31mError:\033[0m cannot page '%s'.\n", filepath);
+    exit(EXIT_FAILURE);
+  }
+}
+
+// ===============================
+// BUFFER LIST
+// ===============================
+
+// The document half of a buffer; the mode and status message belong to
+// the screen and stay in Buff
+void move_document(Buffer *to, const Buffer *from) {
+  to->document = from->document;
+  to->document_size = from->document_size;
+  to->document_capacity = from->document_capacity;
+  to->cursor = from->cursor;
+  to->file_name = from->file_name;
+  to->file_bytes = from->file_bytes;
+  to->arena = from->arena;
+  to->store = from->store;
+  to->journal = from->journal;
+  to->modified = from->modified;
+  to->folds = from->folds;
+  to->marks = from->marks;
+}
+
+Buffer *slot_buffer(int i) {
+  return i == CurrentBuffer ? &Buff : &Buffers[i].buffer;
+}
+
+// Bytes held by a loaded buffer: mapped line text and the line array
+size_t buffer_memory(const Buffer *b) {
+  size_t in_use, mapped, table;
+  long long lines, unique, saved;
+  line_arena_usage(b->arena, &in_use, &mapped);
+  line_store_usage(b->store, &lines, &unique, &saved, &table);
+  return mapped + table + (size_t)b->document_capacity * sizeof(Line);
+}
+
+int find_buffer(const char *path) {
+  char want[PATH_MAX], have[PATH_MAX];
+  if(!realpath(path, want)) snprintf(want, sizeof(want), "%s", path);
+  for(int i = 0; i < BufferCount; i++) {
+    const char *name = slot_buffer(i)->file_name;
+    if(!realpath(name, have)) snprintf(have, sizeof(have), "%s", name);
+    if(strcmp(want, have) == 0) return i;
+  }
+  return -1;
+}
+
+// Adds path to the list without reading it
+int add_buffer(const char *path) {
+  if(BufferCount == BufferCapacity) {
+    int capacity = BufferCapacity ? BufferCapacity * 2 : 8;
+    BufferSlot *tmp = realloc(Buffers, capacity * sizeof(BufferSlot));
+    if(!tmp) {
+      perror("Malloc failled");
+      exit(EXIT_FAILURE);
     }
+    Buffers = tmp;
+    BufferCapacity = capacity;
+  }
+  BufferSlot *s = &Buffers[BufferCount];
+  memset(s, 0, sizeof(BufferSlot));
+  s->buffer.file_name = strdup(path);
+  if(!s->buffer.file_name) {
+    perror("Malloc failled");
+    exit(EXIT_FAILURE);
   }
+  return BufferCount++;
+}
+
+// Moves the active buffer into its slot and leaves Buff without a document
+void park_buffer() {
+  if(CurrentBuffer < 0) return;
+  keymap_cancel(KEYMAP_VIEW);
+  keymap_cancel(KEYMAP_INSERT);
+  BufferSlot *s = &Buffers[CurrentBuffer];
+  s->following = follow_active();
+  s->diffing = diff_active();
+  follow_stop();
+  diff_stop();
+  // Following again picks up after what was read
+  if(s->following) Buff.file_bytes = follow_offset();
+  remember_position();
+
+  move_document(&s->buffer, &Buff);
+  s->scroll_y = Win.scroll_y;
+  s->scroll_x = Win.scroll_x;
+  s->last_used = ++BufferClock;
+  move_document(&Buff, &(Buffer){0});
+  CurrentBuffer = -1;
 }
 
-void start_buffer(char *filepath) {
+// Drops the document of a clean parked buffer; its file is read again
+// when it is switched to
+void unload_buffer(int i) {
+  Buffer *b = &Buffers[i].buffer;
+  line_arena_destroy(b->arena);
+  b->arena = NULL;
+  line_store_destroy(b->store);
+  b->store = NULL;
+  free(b->document);
+  b->document = NULL;
+  b->document_size = 0;
+  b->document_capacity = 0;
+  // The file is read afresh, so folds and marks over it may no longer fit
+  long_line_forget(i);
+  fold_set_destroy(b->folds);
+  b->folds = NULL;
+  mark_set_destroy(b->marks);
+  b->marks = NULL;
+  Buffers[i].loaded = 0;
+}
+
+// Unloads clean buffers, least recently used first, until the loaded ones
+// fit in buffer_budget_mb. Edited buffers and the ones on screen always
+// stay.
+void enforce_buffer_budget() {
+  if(CurrentBuffer < 0) return;
+  size_t budget = (size_t)Config.buffer_budget_mb << 20;
+  size_t total = 0;
+  for(int i = 0; i < BufferCount; i++) {
+    if(Buffers[i].loaded) total += buffer_memory(slot_buffer(i));
+  }
+  while(total > budget) {
+    int victim = -1;
+    for(int i = 0; i < BufferCount; i++) {
+      BufferSlot *s = &Buffers[i];
+      if(i == CurrentBuffer || !s->loaded || s->buffer.modified || buffer_in_pane(i)) continue;
+      if(victim < 0 || s->last_used < Buffers[victim].last_used) victim = i;
+    }
+    if(victim < 0) break;
+    total -= buffer_memory(&Buffers[victim].buffer);
+    unload_buffer(victim);
+  }
+}
+
+// Copies the yank register into arena to
+void move_yank(LineArena *to) {
+  LineArena *from = Yank.arena;
+  if(!from || from == to) return;
+  for(int i = 0; i < Yank.count; i++) {
+    Line *l = &Yank.lines[i];
+    int capacity;
+    char *text = line_arena_alloc_packed(to, l->size + 1, &capacity);
+    memcpy(text, l->line, l->size + 1);
+    if(line_shared(l)) line_store_release(l->line);
+    else line_arena_free(from, l->line, l->capacity);
+    l->line = text;
+    l->capacity = capacity;
+  }
+  Yank.arena = to;
+}
+
+// Copies the yank register into the active buffer's arena
+void carry_yank() {
+  move_yank(Buff.arena);
+}
+
+// Keeps the cursor on a line and in view
+void clamp_view() {
+  if(Buff.document_size > 0) {
+    Buff.cursor.y = fold_span_start(Buff.folds, clamp(Buff.cursor.y, 0, Buff.document_size - 1));
+    Buff.cursor.x = clamp(Buff.cursor.x, 0, Buff.document[Buff.cursor.y].size);
+  }
+  else {
+    Buff.cursor = (Cursor){0};
+  }
+  Win.scroll_y = fold_span_start(Buff.folds, clamp(Win.scroll_y, 0, Buff.cursor.y));
+  if(cursor_row() >= text_rows()) Win.scroll_y = scroll_above(Buff.cursor.y, text_rows());
+}
+
+// Makes buffer i the active one, reading it in when it is not loaded,
+// without drawing. Returns 0, with the reason in the status line, when its
+// file cannot be read; the active buffer stays.
+int activate_buffer(int i) {
+  BufferSlot *s = &Buffers[i];
+  const char *why = s->loaded ? NULL : prepare_file(s->buffer.file_name);
+  if(why) {
+    flash_open_error(s->buffer.file_name, why);
+    return 0;
+  }
+  if(ActivePane < 0) {
+    ActivePane = layout_init(text_area());
+    PaneCount = 1;
+  }
+  park_buffer();
+
+  int reloaded = !s->loaded;
+  if(s->loaded) {
+    move_document(&Buff, &s->buffer);
+  }
+  else {
+    char *name = s->buffer.file_name;
+    init_document();
+    // Only if the file went away since it was checked: the buffer opens
+    // empty
+    if(open_editor(name)) free(name);
+    else Buff.file_name = name;
+    Buff.journal = s->buffer.journal;
+    Buff.cursor = s->buffer.cursor;
+    s->loaded = 1;
+  }
+  move_document(&s->buffer, &(Buffer){0});
+  CurrentBuffer = i;
+  Panes[ActivePane].buffer = i;
+  Win.scroll_y = s->scroll_y;
+  Win.scroll_x = s->scroll_x;
+  carry_yank();
+
+  if(!s->visited) {
+    s->visited = 1;
+    if(!start_journal(Buff.file_name)) restore_position();
+  }
+  else if(reloaded) {
+    // The file may have changed while it was unloaded
+    journal_reset(Buff.journal, Buff.file_name);
+  }
+  clamp_view();
+  if(s->following) follow_start(Buff.file_name, Buff.file_bytes);
+  if(s->diffing) diff_start(Buff.file_name);
+  s->following = 0;
+  s->diffing = 0;
+  enforce_buffer_budget();
+  return 1;
+}
+
+int switch_to_buffer(int i) {
+  if(i == CurrentBuffer) {
+    draw_editor();
+    return 1;
+  }
+  if(!activate_buffer(i)) return 0;
   ansi_emit(ANSI_CLEAR);
-  //handle_dotfile();
-  init_editor();
-  open_editor(filepath);
+  mark_visible_lines_dirty();
+  draw_editor();
+  return 1;
+}
+
+// Opens filepath as a buffer, or switches to it when it is open already.
+// Returns 0, with the reason in the status line, when it cannot. Without a
+// buffer to stay in, as when atom starts, that ends the editor.
+int start_buffer(char *filepath) {
+  const char *why = NULL;
+  int i = find_buffer(filepath);
+  // The pager cannot hand back to a buffer list, so once there is one,
+  // large files are only paged from the command line
+  if(i < 0 && should_page(filepath)) {
+    if(BufferCount == 0) {
+      start_read_only(filepath);
+      return 1;
+    }
+    why = "Too large to edit, use atom -R";
+  }
+  else if(i < 0) {
+    why = prepare_file(filepath);
+  }
+  if(why && BufferCount == 0) {
+    disable_raw_mode();
+    dprintf(STDERR_FILENO, "\033[1;31mError:\033[0m Cannot open '%s': %s.\n", filepath, why);
+    exit(EXIT_FAILURE);
+  }
+  if(why) {
+    flash_open_error(filepath, why);
+    return 0;
+  }
+  if(i < 0) i = add_buffer(filepath);
   Buff.mode = MODE_VIEW;
-  mark_all_lines_dirty();
+  return switch_to_buffer(i);
+}
+
+// :ls, one entry per buffer: [n name] for the active one, + when edited
+// and ~ when unloaded
+void cmd_list_buffers() {
+  char line[1024];
+  int len = 0;
+  for(int i = 0; i < BufferCount && len < (int)sizeof(line) - 1; i++) {
+    Buffer *b = slot_buffer(i);
+    const char *mark = b->modified ? "+" : Buffers[i].loaded ? "" : "~";
+    const char *fmt = i == CurrentBuffer ? "%s[%d %s%s]" : "%s%d %s%s";
+    len += snprintf(line + len, sizeof(line) - len, fmt, i ? "  " : "", i + 1, b->file_name, mark);
+  }
+  flash_command_status(line);
+}
+
+// ===============================
+// SPLIT WINDOWS
+// ===============================
+
+void pane_invalidate(int p, int from, int to) {
+  Pane *pane = &Panes[p];
+  if(from >= to) return;
+  if(pane->dirty_from == pane->dirty_to) {
+    pane->dirty_from = from;
+    pane->dirty_to = to;
+    return;
+  }
+  if(from < pane->dirty_from) pane->dirty_from = from;
+  if(to > pane->dirty_to) pane->dirty_to = to;
+}
+
+// The screen was cleared: every pane repaints whole
+void invalidate_panes() {
+  if(PaneCount < 2) return;
+  for(int p = 0; p < 2 * MAX_PANES - 1; p++) {
+    if(p != ActivePane && layout_valid(p)) pane_invalidate(p, 0, pane_text(p).height);
+  }
+  PaneFramesDirty = 1;
+}
+
+// An edit replaced lines [y, y + removed) of the active buffer with added
+// lines. Other panes onto the buffer repaint the rows showing them, and
+// every row below when the lines after them moved.
+void invalidate_other_panes(int y, int removed, int added) {
+  if(PaneCount < 2) return;
+  for(int p = 0; p < 2 * MAX_PANES - 1; p++) {
+    if(p == ActivePane || !layout_valid(p) || Panes[p].buffer != CurrentBuffer) continue;
+    int rows = pane_text(p).height;
+    int top = line_row(&Buff, Panes[p].scroll_y);
+    int from = line_row(&Buff, y) - top;
+    int to = removed == added ? line_row(&Buff, y + added - 1) - top + 1 : rows;
+    pane_invalidate(p, clamp(from, 0, rows), clamp(to, 0, rows));
+  }
+}
+
+// Whether buffer i shows in a pane besides the active one
+int buffer_in_pane(int i) {
+  for(int p = 0; p < 2 * MAX_PANES - 1; p++) {
+    if(p != ActivePane && layout_valid(p) && Panes[p].buffer == i) return 1;
+  }
+  return 0;
+}
+
+// Stores the active pane's view in its slot
+void keep_pane_view() {
+  Pane *pane = &Panes[ActivePane];
+  pane->buffer = CurrentBuffer;
+  pane->cursor = Buff.cursor;
+  pane->scroll_y = Win.scroll_y;
+  pane->scroll_x = Win.scroll_x;
+}
+
+// Makes p the active pane, its buffer the active buffer, without drawing.
+// The view of the pane it replaces must have been kept.
+void enter_pane(int p) {
+  ActivePane = p;
+  Pane *pane = &Panes[p];
+  if(pane->buffer != CurrentBuffer) activate_buffer(pane->buffer);
+  Buff.cursor = pane->cursor;
+  Win.scroll_y = pane->scroll_y;
+  Win.scroll_x = pane->scroll_x;
+  clamp_view();
+  // Rows it missed while inactive now go by the lines' own flags
+  if(Win.scroll_y != pane->scroll_y) mark_visible_lines_dirty();
+  else invalidate_rows(pane->dirty_from, pane->dirty_to);
+  pane->dirty_from = 0;
+  pane->dirty_to = 0;
+}
+
+void focus_pane(int p) {
+  if(p == ActivePane || !layout_valid(p)) return;
+  // A running filter replaces its range in the buffer it was started in
+  if(Panes[p].buffer != CurrentBuffer && document_locked()) return;
+  int old = ActivePane;
+  int had_gutter = gutter_width();
+  keep_pane_view();
+  enter_pane(p);
+  // Leaving its buffer ended :diff there
+  if(had_gutter && Panes[old].buffer != CurrentBuffer) pane_invalidate(old, 0, pane_text(old).height);
   draw_editor();
-  editor_key_press();
+}
+
+void key_next_pane() { focus_pane(layout_next(ActivePane, 1)); }
+void key_prev_pane() { focus_pane(layout_next(ActivePane, -1)); }
+
+// Clears the command line and repaints every pane after the layout changed
+void redraw_panes() {
+  term_printf("\033[%d;1H\033[2K", Win.height);
+  Buff.mode = MODE_VIEW;
+  ansi_emit(ANSI_CLEAR);
+  mark_visible_lines_dirty();
+  draw_editor();
+}
+
+// :split and :vsplit [file]. The new pane opens below or right of the
+// active one, onto file or the same buffer, and becomes the active one.
+void cmd_split(int vertical, char *file) {
+  while(file && *file == ' ') file++;
+  if(file && !*file) file = NULL;
+  if(file && document_locked()) {
+    exit_command_mode();
+    return;
+  }
+  int i = file ? find_buffer(file) : -1;
+  const char *why = NULL;
+  if(file && i < 0 && should_page(file)) why = "Too large to edit, use atom -R";
+  else if(file && (i < 0 || !Buffers[i].loaded)) why = prepare_file(file);
+  if(why) {
+    flash_open_error(file, why);
+    exit_command_mode();
+    return;
+  }
+
+  int p = layout_split(ActivePane, vertical);
+  if(p < 0) {
+    flash_command_status("\033[1;31mError:\033[0m Not enough room");
+    exit_command_mode();
+    return;
+  }
+  PaneCount++;
+  keep_pane_view();
+  Panes[p] = Panes[ActivePane];
+  Panes[p].dirty_from = 0;
+  Panes[p].dirty_to = 0;
+  enter_pane(p);
+  if(file) {
+    if(i < 0) i = add_buffer(file);
+    if(i != CurrentBuffer) activate_buffer(i);
+  }
+  redraw_panes();
+}
+
+// :close, and :q while there are other panes
+void cmd_close_pane() {
+  if(PaneCount < 2) {
+    flash_command_status("\033[1;31mError:\033[0m Cannot close the last pane");
+    exit_command_mode();
+    return;
+  }
+  if(document_locked()) {
+    exit_command_mode();
+    return;
+  }
+  int p = layout_close(ActivePane);
+  PaneCount--;
+  enter_pane(p);
+  redraw_panes();
+}
+
+void cmd_only_pane() {
+  layout_only(ActivePane);
+  PaneCount = 1;
+  redraw_panes();
 }
 
 int main(int arg, char **file) {
@@ -1031,22 +3520,55 @@ int main(int arg, char **file) {
   create_window();
   enable_raw_mode();
 
+  event_loop_init();
+  event_on_idle(on_loop_idle);
+  event_on_signal(SIGWINCH, on_resize_signal);
+  event_on_signal(SIGHUP, on_hangup);
+  event_on_signal(SIGTERM, on_hangup);
+  init_filters();
+  event_watch_fd(STDIN_FILENO, POLLIN, on_stdin_ready, NULL);
+  init_keymaps();
+  load_settings();
+  apply_pager_budget();
+
   if (arg < 2) {
     ansi_emit(ANSI_CLEAR);
     Buff.mode = MODE_MENU;
+    term_flush();
     start_menu(Win.height, Win.width); 
-    editor_key_press();
+    event_loop_run();
     disable_raw_mode();
     exit(EXIT_SUCCESS);
   }
   if(strcmp(file[1], ".") == 0) {
     Buff.mode = MODE_BROWSER;
+    term_flush();
     start_browsing(Win.width, Win.height);
-    editor_key_press();
+    event_loop_run();
     free_file_browser();
+    free_dir_cache();
+  }
+  else if(strcmp(file[1], "-R") == 0 && arg > 2) {
+    start_read_only(file[2]);
+    event_loop_run();
+  }
+  else if(strcmp(file[1], "-f") == 0 && arg > 2) {
+    start_buffer(file[2]);
+    follow_start(Buff.file_name, Buff.file_bytes);
+    move_cursor_verticaly(Buff.document_size);
+    event_loop_run();
+    free_editor();
   }
   else {
     start_buffer(file[1]);
+    // A large first file is paged, and the pager has no buffer list
+    if(Buff.mode != MODE_PAGER) {
+      for(int i = 2; i < arg; i++) {
+        if(find_buffer(file[i]) < 0) add_buffer(file[i]);
+      }
+      draw_editor();
+    }
+    event_loop_run();
     free_editor();
   }
 